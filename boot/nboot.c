@@ -330,7 +330,16 @@ EFI_STATUS EFIAPI efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable
     vprint_dec(SystemTable, bi->mmap_entries);
     vprint_ascii(SystemTable, "\r\n");
 
-    // --- ACPI, SMBIOS, etc can be added here if desired ---
+    // --- ACPI: the kernel reads the SRAT (NUMA layout) through the RSDP ---
+    for (UINTN i = 0; i < SystemTable->NumberOfTableEntries; ++i) {
+        EFI_CONFIGURATION_TABLE *t = &SystemTable->ConfigurationTable[i];
+        if (!memcmp(&t->VendorGuid, &gEfiAcpi20TableGuid, sizeof(EFI_GUID))) {
+            bi->acpi_rsdp = (uint64_t)(uintptr_t)t->VendorTable;
+            break;
+        }
+        if (!bi->acpi_rsdp && !memcmp(&t->VendorGuid, &gEfiAcpi10TableGuid, sizeof(EFI_GUID)))
+            bi->acpi_rsdp = (uint64_t)(uintptr_t)t->VendorTable;
+    }
 
     // --- Print status ---
     vprint_ascii(SystemTable, "[nboot] Bootinfo at ");
@@ -0,0 +1,57 @@
+// Physical memory report shared by the kernel and SYS_MEMINFO callers.
+#pragma once
+#include <stdint.h>
+
+#define MEMINFO_MAX_ZONES  8
+#define MEMINFO_ORDERS     17      // PMM_BUDDY_ORDERS
+
+typedef struct {
+    uint64_t base;                          // physical start of the zone
+    uint64_t frames;                        // frames spanned, holes included
+    uint64_t free_frames;
+    uint32_t node;
+    uint32_t max_order;
+    uint64_t free_blocks[MEMINFO_ORDERS];   // free blocks of each order
+    // Unusable free space index per order, in permille: the share of free
+    // memory sitting in blocks too small to satisfy a request of that order.
+    // 0 means every free page could serve it; 1000 means none could.
+    uint16_t unusable[MEMINFO_ORDERS];
+    // Zone lock statistics; zero unless built with BUDDY_LOCK_STATS.
+    uint64_t lock_acquires;
+    uint64_t lock_hold_cycles;
+    uint64_t lock_max_hold;
+} meminfo_zone_t;
+
+// Compressed swap (kernel/VM/zswap.c).  The compression ratio is
+// stored_pages * 4096 / compressed_bytes; the pool's own overhead shows in
+// pool_pages against stored_pages.
+typedef struct {
+    uint64_t stored_pages;      // pages held compressed
+    uint64_t same_filled;       // of which zero-filled, kept as no data
+    uint64_t compressed_bytes;  // their compressed size
+    uint64_t pool_pages;        // frames holding the compressed data
+    uint64_t stores;            // pages compressed so far
+    uint64_t rejected;          // pages that did not compress enough
+    uint64_t loads;             // faults that decompressed a page
+    uint64_t load_cycles;       // TSC cycles those faults spent decompressing
+} meminfo_zswap_t;
+
+// Same-page merging (kernel/VM/ksm.c).  Each merged frame stands in for
+// the `sharing` mappings of it, so `saved` = sharing - merged_pages.
+typedef struct {
+    uint64_t merged_pages;      // frames shared read-only after a merge
+    uint64_t sharing;           // page table mappings of them
+    uint64_t saved;             // frames freed by merging, net
+    uint64_t scanned;           // pages examined so far
+    uint64_t full_scans;        // passes over every space
+} meminfo_ksm_t;
+
+typedef struct meminfo {
+    uint32_t       zone_count;
+    uint64_t       total_pages;             // usable RAM
+    uint64_t       free_pages;
+    uint64_t       reclaimable_pages;       // reported by shrinkers
+    meminfo_zone_t zones[MEMINFO_MAX_ZONES];
+    meminfo_zswap_t zswap;
+    meminfo_ksm_t   ksm;
+} meminfo_t;
@@ -0,0 +1,25 @@
+// Memory mapping constants shared by the kernel and mmap/munmap/mprotect
+// callers.  Values follow POSIX/Linux so ported code can pass them through.
+#pragma once
+
+#define PROT_NONE   0x0
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define PROT_EXEC   0x4
+
+#define MAP_SHARED     0x01
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+#define MAP_ANON       MAP_ANONYMOUS
+
+#define MAP_FAILED  ((void *)-1)
+
+// madvise advice
+#define MADV_NORMAL          0
+#define MADV_RANDOM          1
+#define MADV_SEQUENTIAL      2
+#define MADV_WILLNEED        3
+#define MADV_DONTNEED        4
+#define MADV_POPULATE_READ   22
+#define MADV_POPULATE_WRITE  23
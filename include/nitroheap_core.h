@@ -4,38 +4,78 @@
 #include <stdint.h>
 
 #define NH_CACHELINE 64
-#define NH_MAX_SIZE_CLASSES 72       // power-of-two + hand-picked gaps
-#define NH_MAG_RING_SIZE    256      // per-CPU magazine ring for tiny/small
+#define NH_MAX_SIZE_CLASSES 48       // power-of-two + hand-picked gaps
+#define NH_MAG_ROUNDS_MAX   126      // objects one magazine can hold
 #define NH_PARTITION_NAME   32
+#define NH_MAX_CPUS         32
+#define NH_MAX_PARTITIONS   16
+
+// Size class flags
+#define NH_SC_TINY    (1u << 0)      // <= 512 bytes
+#define NH_SC_SMALL   (1u << 1)      // <= 8 KiB
+#define NH_SC_MEDIUM  (1u << 2)      // up to the largest class
 
 // Forward decls
 struct nh_slab;
-struct nh_extent;
+struct nh_cpu_heap;
 
-// Size class descriptor (read-mostly)
+// Size class descriptor (read-mostly, derived from the class table at init)
 typedef struct nh_sizeclass {
   uint32_t size;            // user size
-  uint16_t slot_size;       // internal size w/ header, color padding
+  uint32_t slot_size;       // internal size w/ header, alignment padding
+  uint32_t first_offset;    // first user slot, relative to the slab base
   uint16_t slots_per_slab;
   uint16_t class_id;
-  uint16_t flags;           // TINY/SMALL/MEDIUM/LARGE
+  uint16_t slab_order;      // buddy order of one slab
+  uint16_t flags;           // TINY/SMALL/MEDIUM
 } nh_sizeclass;
 
-// Per-CPU magazine for a size class
+// Magazine: a stack of cached free objects of one size class.  A CPU owns
+// at most two per class (loaded and previous); the rest sit in the class
+// depot, either full or empty.  1 KiB each.
 typedef struct nh_magazine {
-  _Atomic(uint32_t) head;               // ring head (index)
-  _Atomic(uint32_t) tail;               // ring tail (index)
-  void*             ring[NH_MAG_RING_SIZE]; // cached free objects
-  uint32_t          class_id;
-  uint32_t          cpu_id;
-  _Atomic(uint32_t) remote_backlog;     // approximate count of remote frees
-  char              pad[NH_CACHELINE - ((sizeof(_Atomic(uint32_t))*3 + sizeof(void*)*NH_MAG_RING_SIZE + 8) % NH_CACHELINE)];
+  struct nh_magazine* next;              // depot stack link
+  uint32_t            rounds;            // objects held
+  uint32_t            size;              // capacity, fixed while loaded
+  void*               objs[NH_MAG_ROUNDS_MAX];
 } nh_magazine;
 
-// Partition-global pools (per size class)
+// Magazine depot (Bonwick): full and empty magazine stacks for one size
+// class behind a short spinlock.  CPUs trade whole magazines with it, so a
+// producer's frees reach a consumer's allocations one magazine at a time.
+// Contention on the lock grows `mag_size`, the capacity given to magazines
+// as they are loaded, up to `mag_max`.  `min_full`/`min_empty` are the
+// lowest stack depths seen since the last reclaim pass: magazines below
+// that depth sat unused for a whole interval and are reaped.
+typedef struct nh_depot {
+  volatile int        lock;
+  nh_magazine*        full;
+  nh_magazine*        empty;
+  uint32_t            nr_full;
+  uint32_t            nr_empty;
+  uint32_t            mag_size;
+  uint32_t            mag_max;
+  uint32_t            ops;               // acquisitions in this window
+  uint32_t            contended;         // of which found the lock held
+  uint32_t            min_full;
+  uint32_t            min_empty;
+} __attribute__((aligned(NH_CACHELINE))) nh_depot;
+
+// Partition-global pools (per size class).  The depot and the slab lists
+// have separate locks; the depot lock is never held across a slab call.
+// `reserve` is a floor on `nr_free`, the free slots across the pool's
+// slabs, below which empty slabs are never released (NH_LOW_LATENCY).
 typedef struct nh_class_pool {
-  _Atomic(struct nh_slab*) partial_list;   // lock-free list of partially used slabs
-  _Atomic(struct nh_slab*) empty_list;     // empty slabs to refill magazines
+  nh_depot                 depot;
+  volatile int             lock;
+  struct nh_slab*          partial_list;   // partially used slabs
+  struct nh_slab*          empty_list;     // empty slabs to refill magazines
+  struct nh_slab*          draining_list;  // sparse slabs left to empty out
+  uint32_t                 nr_slabs;
+  uint32_t                 nr_empty;
+  uint32_t                 nr_draining;
+  uint32_t                 nr_free;
+  uint32_t                 reserve;
   _Atomic(uint64_t)        pressure_score; // contention/fragmentation heuristic
 } nh_class_pool;
 
@@ -48,33 +88,44 @@ typedef struct nh_traits {
   uint8_t  _reserved;
 } nh_traits;
 
-// Partition object (kernel visible)
+// Partition object (kernel visible).  Objects never move between
+// partitions: a slab, and every slot in it, belongs to exactly one.
 typedef struct nh_partition {
   char                 name[NH_PARTITION_NAME];
   uint16_t             id;
   uint16_t             numa_node;
   nh_traits            traits;
   nh_class_pool        pools[NH_MAX_SIZE_CLASSES];
-  _Atomic(uint64_t)    bytes_inuse;
-  _Atomic(uint64_t)    bytes_committed;
-  _Atomic(uint64_t)    allocs;
-  _Atomic(uint64_t)    frees;
-  // remote-free inbox per CPU per class (pointer stacks), elided for brevity
+  struct nh_cpu_heap*  cpu_heaps[NH_MAX_CPUS];   // created on first use
+  _Atomic(uint64_t)    bytes_committed;          // slab memory held
 } nh_partition;
 
-// Slab header (metadata out-of-line: this struct lives in shadow/metadata pages)
+// Slab header, at the base of the buddy block it describes.  Free slots are
+// chained through their first word on `freelist`; the slab's live count is
+// slots_per_slab - free_count.  A draining slab hands out no slots while
+// other slabs of its class have any, so it empties and can be reclaimed.
 typedef struct nh_slab {
   nh_partition*        part;
-  nh_sizeclass*        cls;
-  _Atomic(uint32_t)    free_count;
-  _Atomic(uint32_t)    bitmap_words;     // or pointer to bitmap
-  void*                user_base;        // first user slot address (data page)
+  const nh_sizeclass*  cls;
+  void*                freelist;         // in-slab list of free slots
+  uint32_t             free_count;       // slots on `freelist`
+  uint32_t             list;             // which pool list holds the slab
+  void*                user_base;        // first user slot address
   struct nh_slab*      next;
+  struct nh_slab*      prev;
 } nh_slab;
 
-// Per-CPU heap state
+// A CPU's magazines for one size class.  Only the owning CPU touches them,
+// with interrupts disabled.  Allocation pops `loaded`; when it runs dry a
+// full `prev` is swapped in before the depot is asked, so a burst of frees
+// followed by a burst of allocations stays on the CPU.
+typedef struct nh_cpu_cache {
+  nh_magazine*  loaded;
+  nh_magazine*  prev;
+} nh_cpu_cache;
+
+// Per-CPU heap state for one partition
 typedef struct nh_cpu_heap {
   uint32_t      cpu_id;
-  nh_magazine   mags[NH_MAX_SIZE_CLASSES];
-  // Epoch timing, harvest cursors, etc.
+  nh_cpu_cache  caches[NH_MAX_SIZE_CLASSES];
 } nh_cpu_heap;
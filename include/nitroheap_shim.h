@@ -20,7 +20,8 @@ void* rallocx(void* p, size_t size, nh_flags_t flags);
 // MOVABLE objects (optional)
 typedef uint64_t nh_handle_t;
 nh_handle_t halloc(size_t size, nh_flags_t flags);
-void*       hptr(nh_handle_t h);                 // temporary direct pointer (epoch-scoped)
+void*       hptr(nh_handle_t h);                 // direct pointer, pinned in place until hunpin
+int         hunpin(nh_handle_t h);
 int         hfree(nh_handle_t h);
 
 #ifdef __cplusplus
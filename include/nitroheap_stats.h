@@ -1,6 +1,8 @@
 #pragma once
 #include <stdint.h>
 
+#define NH_STATS_ALL_CPUS 0xFFFF
+
 typedef struct {
   uint16_t part_id;
   char     name[32];
@@ -12,6 +14,7 @@ typedef struct {
   uint64_t remote_free_backlog;  // pending cross-CPU returns
   uint32_t guard_sample_rate;
   uint32_t reuse_epoch_ticks;
+  uint64_t stale_unpins;         // hunpin without a pin held (movable partition)
 } nh_part_stats_summary;
 
 typedef struct {
@@ -29,3 +32,16 @@ typedef struct {
   // Followed by n_cpus entries of nh_part_stats_cpu (packed)
   // Followed by N size-class histograms (optional extension)
 } nh_part_stats_blob;
+
+// One size class across every partition, summed over all CPUs or for one.
+typedef struct {
+  uint32_t class_id;
+  uint32_t size;                 // object size
+  uint32_t mag_size;             // rounds magazines are loaded with
+  uint32_t _reserved;
+  uint64_t fast_hits;            // allocations served by the loaded magazine
+  uint64_t refills;              // magazines loaded from the depot or slabs
+  uint64_t drains;               // full magazines handed back to the depot
+  uint64_t quarantined;          // frees waiting out their reuse epoch
+  uint64_t bytes_inuse;
+} nh_class_stats;
@@ -15,6 +15,11 @@ typedef enum {
   NH_HEAPCTL_ATTACH_PROCESS,      // bind process/thread to partition
   NH_HEAPCTL_DETACH_PROCESS,
   NH_HEAPCTL_DEBUG_SNAPSHOT,      // copies shadow metadata safely
+  NH_HEAPCTL_GET_CLASS_STATS,     // per-size-class counters
+  NH_HEAPCTL_GET_TUNABLES,
+  NH_HEAPCTL_SET_TUNABLES,
+  NH_HEAPCTL_PROF_SET,            // start, retune or stop heap sampling
+  NH_HEAPCTL_PROF_DUMP,           // live samples as pprof heap text
 } nh_heapctl_op;
 
 typedef struct {
@@ -51,6 +56,40 @@ typedef struct {
   size_t   user_buf_len;
 } nh_heapctl_get_stats_args;
 
+typedef struct {
+  uint16_t cpu;              // NH_STATS_ALL_CPUS for the sum over every CPU
+  void*    user_buf;         // nh_class_stats[], one per size class
+  size_t   user_buf_len;
+} nh_heapctl_get_class_stats_args;
+
+// Heap-wide tunables.  SET_TUNABLES leaves fields given as 0 unchanged.
+typedef struct {
+  uint32_t mag_bytes;        // object bytes a newly loaded magazine holds
+  uint32_t mag_rounds;       // ... capped at this many objects
+  uint32_t quarantine_limit; // local frees queued between harvests
+  uint32_t reclaim_high;     // empty-slab pages that wake the reclaimer
+  uint32_t reclaim_low;      // ... and that it works down to
+} nh_heap_tunables;
+
+typedef struct {
+  void*    user_buf;         // nh_heap_tunables
+  size_t   user_buf_len;
+} nh_heapctl_get_tunables_args;
+
+#define NH_PROF_RATE_MAX (1ull << 40)
+
+typedef struct {
+  uint64_t sample_bytes;     // mean bytes between samples; 0 stops and clears
+} nh_heapctl_prof_set_args;
+
+typedef struct {
+  void*    user_buf;         // NUL-terminated report text
+  size_t   user_buf_len;
+} nh_heapctl_prof_dump_args;
+
+// Returns 0 on success and -1 on error; GET_CLASS_STATS returns the number
+// of classes copied out and PROF_DUMP the full length of the report, which
+// is truncated to fit the buffer.
 int sys_heapctl(nh_heapctl_op op, const void* args, size_t args_len);
 
 // Hot path syscalls (can be routed via vDSO in usermode for per-CPU fastpath)
@@ -67,8 +106,10 @@ int sys_nh_realloc(const nh_realloc_req* in, nh_alloc_resp* out);
 typedef struct { size_t size; nh_flags_t flags; } nh_halloc_req;
 typedef struct { uint64_t handle; } nh_halloc_resp;
 typedef struct { uint64_t handle; } nh_hptr_req;
+typedef struct { uint64_t handle; } nh_hunpin_req;
 typedef struct { uint64_t handle; } nh_hfree_req;
 
 int sys_nh_halloc(const nh_halloc_req* in, nh_halloc_resp* out);
-int sys_nh_hptr(const nh_hptr_req* in, nh_alloc_resp* out);
+int sys_nh_hptr(const nh_hptr_req* in, nh_alloc_resp* out);     // pins until hunpin
+int sys_nh_hunpin(const nh_hunpin_req* in);
 int sys_nh_hfree(const nh_hfree_req* in);
@@ -12,6 +12,8 @@
 #include <kernel/api.h>
 #include "VM/vmm.h"
 #include "../VM/paging_adv.h"
+#include "../VM/mmap.h"
+#include "../VM/zeropool.h"
 #include "regx_key.h"
 
 extern int kprintf(const char *fmt, ...);
@@ -150,7 +152,7 @@ void threads_early_init(void){
     main_thread.priority=MIN_PRIORITY; main_thread.next=&main_thread;
     uint64_t rsp; __asm__ volatile("mov %%rsp,%0":"=r"(rsp));
     main_thread.rsp=rsp;
-    main_thread.pml4 = paging_kernel_pml4();
+    main_thread.vm = paging_kernel_space();
     current_cpu[0]=tail_cpu[0]=&main_thread;
 }
 
@@ -161,7 +163,9 @@ static void add_to_zombie_list(thread_t *t){ uint64_t rf=irq_save_disable(); t->
 /*
  * Reclaim zombie threads and return their descriptors to the pool.
  * Stacks are wiped to prevent stale data from influencing future tasks
- * or leaking sensitive information between threads.
+ * or leaking sensitive information between threads.  The wipe uses
+ * non-temporal stores: this runs on the switch path and a dead stack is
+ * not worth pulling into the cache.
  */
 static void thread_reap(void){
     uint64_t rf=irq_save_disable();
@@ -172,7 +176,8 @@ static void thread_reap(void){
     for (thread_t *t = list; t; ) {
         thread_t *n = t->next;
         if (t->stack)
-            memset(t->stack, 0, STACK_SIZE);
+            zero_range_nt(t->stack, STACK_SIZE);
+        paging_space_put(t->vm);
         memset(t, 0, sizeof(thread_t));
         t = n;
     }
@@ -245,9 +250,9 @@ void schedule(void){
     }
 
     next->state=THREAD_RUNNING; next->started=1; current_cpu[cpu]=next;
-    /* With all threads sharing a single address space, avoid CR3
-       switches which were pointing at incomplete page tables and
-       triggering triple faults. */
+    /* Kernel stacks and text sit in the shared half of every space, so
+       the new tables can go in before the stack switch. */
+    paging_space_switch(next->vm);
     context_switch(&prev->rsp,next->rsp);
     if(prev->state==THREAD_EXITED) add_to_zombie_list(prev);
     thread_reap();
@@ -259,6 +264,7 @@ uint64_t schedule_from_isr(uint64_t *old_rsp){
     thread_t *next=pick_next(cpu);
     if(!next){ current_cpu[cpu]=prev; prev->state=THREAD_RUNNING; return (uint64_t)old_rsp; }
     next->state=THREAD_RUNNING; next->started=1; current_cpu[cpu]=next;
+    paging_space_switch(next->vm);
     kprintf("[sched_isr] switch to tid=%d func=%p rsp=%p\n", next->id, (void*)next->func, (void*)next->rsp);
     return next->rsp;
 }
@@ -311,7 +317,8 @@ static void bad_agent_entry(const AgentAPI *api, uint32_t self_tid) {
 uintptr_t thread_debug_get_entry_trampoline(void) { return (uintptr_t)thread_entry; }
 #endif
 
-thread_t *thread_create_with_priority(void(*func)(void), int priority){
+/* Create a thread in address space `vm`, or in a new one when NULL. */
+static thread_t *thread_spawn(void(*func)(void), int priority, struct vm_space *vm){
     if(priority<MIN_PRIORITY) priority=MIN_PRIORITY;
     if(priority>MAX_PRIORITY) priority=MAX_PRIORITY;
     thread_t *t=NULL; int idx=-1;
@@ -343,16 +350,17 @@ thread_t *thread_create_with_priority(void(*func)(void), int priority){
 
     t->rsp=(uint64_t)sp;
     t->func=func;
-    /* Until per-task address spaces are fully supported, run all threads
-       on the kernel's bootstrap page table.  Using fresh, partially
-       populated PML4s left new threads without valid mappings, causing
-       early page faults and watchdog resets before init could launch. */
-    t->pml4 = paging_kernel_pml4();
+    /* Each thread gets its own lower half; before paging_init(), or when
+       memory is short, it shares the kernel's space instead. */
+    t->vm = vm ? vm : paging_space_create();
+    if(!t->vm) t->vm = paging_kernel_space();
     t->id=__atomic_fetch_add(&next_id,1,__ATOMIC_RELAXED);
     t->state=THREAD_READY;
     t->started=0;
     t->priority=priority;
     t->next=NULL;
+    t->wake_tick=0;
+    t->text_lo=t->text_hi=0;
 
     kprintf("[thread] spawn id=%d entry=%p stack=%p-%p prio=%d\n",
             t->id, func, t->stack, t->stack+STACK_SIZE, priority);
@@ -361,6 +369,35 @@ thread_t *thread_create_with_priority(void(*func)(void), int priority){
     return t;
 }
 
+thread_t *thread_create_with_priority(void(*func)(void), int priority){ return thread_spawn(func,priority,NULL); }
+
+thread_t *task_fork(thread_t *parent, void(*func)(void), int priority){
+    if(!parent||parent->magic!=THREAD_MAGIC) return NULL;
+    struct vm_space *vm=vm_fork(parent->vm);
+    if(!vm) return NULL;
+    thread_t *t=thread_spawn(func,priority,vm);
+    if(!t) paging_space_put(vm);
+    return t;
+}
+
+thread_t *task_spawn(thread_t *parent, void(*entry)(void), int priority){
+    if(!parent||parent->magic!=THREAD_MAGIC) return NULL;
+    uint64_t e=(uint64_t)(uintptr_t)entry;
+    if(e<parent->text_lo||e>=parent->text_hi) return NULL;
+    if(priority>parent->priority) priority=parent->priority;
+    thread_t *t=task_fork(parent,entry,priority);
+    if(t){ t->text_lo=parent->text_lo; t->text_hi=parent->text_hi; }
+    return t;
+}
+
+int thread_set_text(int id, uint64_t lo, uint64_t hi){
+    for(int i=0;i<(int)MAX_KERNEL_THREADS;i++){
+        thread_t *t=&thread_pool[i];
+        if(t->magic==THREAD_MAGIC && t->id==id){ t->text_lo=lo; t->text_hi=hi; return 0; }
+    }
+    return -1;
+}
+
 thread_t *thread_create(void(*func)(void)){ return thread_create_with_priority(func,(MAX_PRIORITY+MIN_PRIORITY)/2); }
 
 // Bridge for the agent loader: spawn a thread for the loaded agent image.
@@ -388,6 +425,63 @@ void thread_unblock(thread_t *t){
     if(pre) schedule();
 }
 
+// The waiter publishes BLOCKED before it looks at `pending` and the waker
+// sets `pending` before it looks at the state, so one of them sees the
+// other: either the waiter does not sleep or the waker makes it READY.
+void thread_wait(thread_wait_t *w){
+    thread_t *self=thread_current();
+    uint64_t rf=irq_save_disable();
+    __atomic_store_n(&w->waiter,self,__ATOMIC_SEQ_CST);
+    for(;;){
+        __atomic_store_n(&self->state,THREAD_BLOCKED,__ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&w->pending,0,__ATOMIC_SEQ_CST)) break;
+        schedule();
+    }
+    self->state=THREAD_RUNNING;
+    irq_restore(rf);
+}
+
+void thread_wake(thread_wait_t *w){
+    __atomic_store_n(&w->pending,1,__ATOMIC_SEQ_CST);
+    thread_t *t=__atomic_load_n(&w->waiter,__ATOMIC_SEQ_CST);
+    thread_state_t s=THREAD_BLOCKED;
+    if(t) __atomic_compare_exchange_n(&t->state,&s,THREAD_READY,0,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED);
+}
+
+// Same handshake as thread_wait(): the sleeper publishes BLOCKED before
+// it reads the tick count, the tick advances the count before it reads
+// the state.
+static volatile uint64_t sched_ticks;
+
+void thread_sleep(uint64_t ticks){
+    thread_t *self=thread_current();
+    uint64_t rf=irq_save_disable();
+    uint64_t until=__atomic_load_n(&sched_ticks,__ATOMIC_SEQ_CST)+(ticks?ticks:1);
+    __atomic_store_n(&self->wake_tick,until,__ATOMIC_SEQ_CST);
+    for(;;){
+        __atomic_store_n(&self->state,THREAD_BLOCKED,__ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&sched_ticks,__ATOMIC_SEQ_CST)>=until) break;
+        schedule();
+    }
+    __atomic_store_n(&self->wake_tick,0,__ATOMIC_SEQ_CST);
+    self->state=THREAD_RUNNING;
+    irq_restore(rf);
+}
+
+static void wake_if_due(thread_t *t, uint64_t now){
+    uint64_t until=__atomic_load_n(&t->wake_tick,__ATOMIC_SEQ_CST);
+    thread_state_t s=THREAD_BLOCKED;
+    if(until && until<=now)
+        __atomic_compare_exchange_n(&t->state,&s,THREAD_READY,0,__ATOMIC_SEQ_CST,__ATOMIC_RELAXED);
+}
+
+void thread_timer_tick(void){
+    uint64_t now=__atomic_add_fetch(&sched_ticks,1,__ATOMIC_SEQ_CST);
+    wake_if_due(&main_thread,now);
+    for(int i=0;i<(int)MAX_KERNEL_THREADS;i++)
+        if(thread_pool[i].magic==THREAD_MAGIC) wake_if_due(&thread_pool[i],now);
+}
+
 int  thread_is_alive(thread_t *t){ return t && t->magic==THREAD_MAGIC && t->state!=THREAD_EXITED; }
 
 void thread_kill(thread_t *t){
@@ -37,13 +37,16 @@ typedef struct THREAD_ALIGNED(64) thread {
     uint64_t       rsp;       // Stack pointer for context switching
     void         (*func)(void); // Entry function
     char          *stack;     // Kernel stack base (from static pool)
-    uint64_t      *pml4;      // Page table root for this thread
+    struct vm_space *vm;      // Address space (kernel half shared)
     int            id;        // Thread ID (unique)
     thread_state_t state;     // Current state
     int            started;   // Has thread begun execution
     int            priority;  // Priority (0 = lowest, 255 = highest)
     struct thread *next;      // Run queue link (circular per-CPU)
     uint32_t       magic;     // Magic for corruption detection
+    uint64_t       wake_tick; // thread_sleep deadline, 0 when not sleeping
+    uint64_t       text_lo;   // executable range of the agent image it
+    uint64_t       text_hi;   // runs; empty for kernel threads
 } thread_t;
 
 // Per-CPU currently running thread (head of that CPU's circular run-queue)
@@ -82,6 +85,29 @@ thread_t *thread_create(void (*func)(void));
  */
 thread_t *thread_create_with_priority(void (*func)(void), int priority);
 
+/**
+ * Create a thread running `func` in a copy-on-write copy of `parent`'s
+ * address space: its mappings, and whatever the parent built in them,
+ * are there from the start without copying a page until one side writes.
+ * NULL when out of memory or threads.
+ */
+thread_t *task_fork(thread_t *parent, void (*func)(void), int priority);
+
+/**
+ * task_fork() on behalf of `parent` itself (SYS_SPAWN): `entry` must lie
+ * in the text of the parent's agent image, and the child gets no more
+ * than the parent's priority.  The child runs the same image.  NULL if
+ * the entry is refused or on failure.
+ */
+thread_t *task_spawn(thread_t *parent, void (*entry)(void), int priority);
+
+/**
+ * Record the executable range [lo, hi) of the image thread `id` runs;
+ * the agent loader calls it for each agent it starts.  -1 if no such
+ * thread.
+ */
+int thread_set_text(int id, uint64_t lo, uint64_t hi);
+
 /**
  * Mark thread as blocked and reschedule.
  */
@@ -93,6 +119,39 @@ void thread_block(thread_t *t);
  */
 void thread_unblock(thread_t *t);
 
+/**
+ * Wakeup for a background worker that sleeps until there is work: the
+ * worker calls thread_wait(), anyone calls thread_wake().  A wake that
+ * comes before the wait is not lost.
+ */
+typedef struct {
+    volatile int       pending;
+    thread_t *volatile waiter;
+} thread_wait_t;
+
+/**
+ * Block the calling thread until thread_wake(w) has been called since it
+ * last returned.  One waiter per thread_wait_t.
+ */
+void thread_wait(thread_wait_t *w);
+
+/**
+ * Make the waiter of `w` ready.  Never reschedules, so it may be called
+ * with locks held and interrupts off; the waiter runs at the next switch.
+ */
+void thread_wake(thread_wait_t *w);
+
+/**
+ * Block the calling thread for at least `ticks` timer ticks (one or more).
+ */
+void thread_sleep(uint64_t ticks);
+
+/**
+ * Timer interrupt hook: count a tick and make ready every sleeper whose
+ * deadline has passed.  Like thread_wake(), never reschedules.
+ */
+void thread_timer_tick(void);
+
 /**
  * Return nonzero if the thread has not exited and is valid.
  */
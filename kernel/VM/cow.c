@@ -4,47 +4,39 @@
 #include "../../nosm/drivers/IO/serial.h"
 #include "../../user/libc/libc.h"
 #include "cow.h"
+#include "zeropool.h"
+#include "page.h"
+#include "mmap.h"
+#include "shrinker.h"
 
 // ----------- Static State -----------
-static uint16_t *refcounts = NULL;
-static uint8_t  *cow_flags = NULL;
-static uint64_t frames = 0;
+// Reference counts and the COW bit live in the page frame database.
+static uint64_t fault_count = 0;
+static uint64_t fault_cycles = 0;
+
+static inline uint64_t fault_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
 
 // ----------- Core API -----------
 
-void cow_init(uint64_t total_frames) {
-    frames = total_frames;
-    refcounts = calloc(frames, sizeof(uint16_t));
-    cow_flags = calloc(frames, sizeof(uint8_t));
-    if (!refcounts || !cow_flags) {
-        serial_puts("[cow] allocation failure\n");
-        for(;;) __asm__("hlt");
-    }
-}
-
 void cow_inc_ref(uint64_t phys) {
-    if (!refcounts) return;
-    uint64_t frame = phys / PAGE_SIZE;
-    if (frame < frames) {
-        if (refcounts[frame] == 0xFFFF)
-            serial_puts("[cow] refcount overflow!\n");
-        else
-            refcounts[frame]++;
-    }
+    page_t *pg = phys_to_page(phys);
+    if (pg)
+        page_ref_inc(pg);
 }
 
 void cow_dec_ref(uint64_t phys) {
-    if (!refcounts) return;
-    uint64_t frame = phys / PAGE_SIZE;
-    if (frame < frames && refcounts[frame] > 0)
-        refcounts[frame]--;
+    page_t *pg = phys_to_page(phys);
+    if (pg)
+        page_ref_dec_and_test(pg);
 }
 
-uint16_t cow_refcount(uint64_t phys) {
-    if (!refcounts) return 0;
-    uint64_t frame = phys / PAGE_SIZE;
-    if (frame < frames) return refcounts[frame];
-    return 0;
+uint32_t cow_refcount(uint64_t phys) {
+    page_t *pg = phys_to_page(phys);
+    return pg ? page_ref_count(pg) : 0;
 }
 
 // Calculate buddy order for a page count.
@@ -73,81 +65,151 @@ void free_pages(void *addr, uint32_t pages) {
 
 // --- COW marking/flag helpers ---
 
-// Get the frame index for a VA, optionally returning the physical address.
-static int cow_flag_index(uint64_t virt, uint64_t *phys_out) {
+// Get the frame descriptor for a VA, optionally returning the physical address.
+static page_t *cow_page(uint64_t virt, uint64_t *phys_out) {
     uint64_t phys = paging_virt_to_phys_adv(virt);
-    if (!phys) return -1;
+    if (!phys) return NULL;
     if (phys_out) *phys_out = phys;
-    return phys / PAGE_SIZE;
+    return phys_to_page(phys);
 }
 
 void cow_mark(uint64_t virt) {
     uint64_t phys;
-    int idx = cow_flag_index(virt, &phys);
-    if (idx < 0) return;
-    cow_flags[idx] = 1;
+    page_t *pg = cow_page(virt, &phys);
+    if (!pg) return;
+    page_set_flag(pg, PG_COW);
     paging_unmap_adv(virt);
     paging_map_adv(virt, phys, PAGE_PRESENT | PAGE_USER, 0, current_cpu_node());
 }
 
 void cow_unmark(uint64_t virt) {
     uint64_t phys;
-    int idx = cow_flag_index(virt, &phys);
-    if (idx < 0) return;
-    cow_flags[idx] = 0;
+    page_t *pg = cow_page(virt, &phys);
+    if (!pg) return;
+    page_clear_flag(pg, PG_COW);
     paging_unmap_adv(virt);
     paging_map_adv(virt, phys, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER, 0, current_cpu_node());
 }
 
 int cow_is_marked(uint64_t virt) {
-    int idx = cow_flag_index(virt, NULL);
-    if (idx < 0) return 0;
-    return cow_flags[idx] ? 1 : 0;
+    page_t *pg = cow_page(virt, NULL);
+    return pg && page_test_flag(pg, PG_COW);
 }
 
 // Free frame only if refcount is zero.
 int cow_free_frame(uint64_t phys) {
-    uint64_t frame = phys / PAGE_SIZE;
-    if (frame < frames && refcounts[frame] == 0) {
+    page_t *pg = phys_to_page(phys);
+    if (pg && page_ref_count(pg) == 0) {
         buddy_free((void*)phys, 0, current_cpu_node());
         return 1;
     }
     return 0;
 }
 
-// ----------- Page Fault Handler (COW + Demand Paging) -----------
-void paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id) {
-    (void)cpu_id; // NUMA-aware policies can use this later
-    uint64_t virt = addr & ~(PAGE_SIZE - 1);
-    uint64_t phys = paging_virt_to_phys_adv(virt);
+int cow_put_frame(uint64_t phys) {
+    page_t *pg = phys_to_page(phys);
+    if (!pg || !page_ref_dec_and_test(pg))
+        return 0;
+    page_clear_flag(pg, PG_COW);
+    buddy_free((void*)phys, 0, numa_addr_node(phys));
+    return 1;
+}
 
-    if (!phys) {
-        // Demand paging: allocate and map zeroed page
-        void *page = buddy_alloc(0, current_cpu_node(), 0);
-        if (page) {
-            paging_map_adv(virt, (uint64_t)page, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER, 0, current_cpu_node());
-            memset((void*)virt, 0, PAGE_SIZE);
-            cow_inc_ref((uint64_t)page);
-            return;
-        }
-        serial_puts("[cow] buddy_alloc failed in pfault\n");
-    } else if ((err & 2) && cow_is_marked(virt)) { // Write fault, COW page
-        if (cow_refcount(phys) > 1) {
-            void *newp = buddy_alloc(0, current_cpu_node(), 0);
-            if (!newp) {
-                serial_puts("[cow] buddy_alloc failed in COW\n");
-                for(;;) __asm__("hlt");
-            }
-            memcpy(newp, (void*)phys, PAGE_SIZE);
-            cow_dec_ref(phys);
-            cow_inc_ref((uint64_t)newp);
-            paging_map_adv(virt, (uint64_t)newp, PAGE_PRESENT | PAGE_WRITABLE | PAGE_USER, 0, current_cpu_node());
-        } else {
-            cow_unmark(virt); // Only one ref, just remove COW and restore writable
+// ----------- Page Fault Handler (COW + Demand Paging) -----------
+// Error code bits pushed by the CPU for #PF.
+#define PF_PRESENT 0x01
+#define PF_WRITE   0x02
+#define PF_USER    0x04
+#define PF_FETCH   0x10
+
+// fault_locked: the access is fine but memory ran out resolving it.
+#define FAULT_OOM  -2
+// Pages reclaimed before a fault while memory is short, or after one that
+// ran out: a fault-around window.
+#define FAULT_RECLAIM  256
+
+// Write to a page shared copy-on-write: copy it unless this mapping is
+// the last one left.
+static int fault_cow(vm_space_t *vs, vma_t *v, uint64_t virt, uint64_t phys) {
+    uint64_t flags = vm_prot_flags(vs, v->prot);
+    if (cow_refcount(phys) > 1) {
+        void *newp = buddy_alloc(0, current_cpu_node(), 0);
+        if (!newp) {
+            serial_puts("[cow] buddy_alloc failed in COW\n");
+            return FAULT_OOM;
         }
-        return;
+        memcpy(newp, (void*)phys, PAGE_SIZE);
+        vm_frame_claim((uint64_t)newp, 0);
+        paging_map_adv(virt, (uint64_t)newp, flags, 0, current_cpu_node());
+        // The other sharers may have copied too since the count was read.
+        vm_frame_release(phys, 0);
+    } else {
+        page_t *pg = phys_to_page(phys);
+        if (pg)
+            page_clear_flag(pg, PG_COW);
+        paging_map_adv(virt, phys, flags, 0, current_cpu_node());
     }
+    return 0;
+}
+
+// Decide a fault at `virt` under the mmap lock.  Only addresses inside a
+// VMA that allows the access are resolved; pages zswap compressed come
+// back through vm_fault_around.
+static int fault_locked(vm_space_t *vs, uint64_t err, uint64_t virt) {
+    vma_t *v = vma_find(&vs->vmas, virt);
+    if (!v || !(v->prot & (VMA_READ | VMA_WRITE | VMA_EXEC)))
+        return -1;
+    if ((err & PF_WRITE) && !(v->prot & VMA_WRITE))
+        return -1;
+    if ((err & PF_FETCH) && !(v->prot & VMA_EXEC))
+        return -1;
+
+    uint64_t phys, pte;
+    if (!paging_lookup_adv(virt, &phys, &pte))
+        return vm_fault_around(v, virt) < 0 ? FAULT_OOM : 0;
+    phys &= ~(PAGE_SIZE - 1);
+    if ((err & PF_WRITE) && cow_is_marked(virt))
+        return fault_cow(vs, v, virt, phys);
+    // The kernel touching a user page outside stac/clac (SMAP).
+    if (!(err & PF_USER) && (pte & PAGE_USER))
+        return -1;
+    // Another CPU resolved it first, or the TLB held a stale entry.
+    if ((err & PF_WRITE) && !(pte & PAGE_WRITABLE))
+        return -1;
+    if ((err & PF_FETCH) && (pte & PAGE_NO_EXEC))
+        return -1;
+    if ((err & PF_USER) && !(pte & PAGE_USER))
+        return -1;
+    return 0;
+}
+
+int paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id) {
+    (void)cpu_id; // NUMA-aware policies can use this later
+    uint64_t t0 = fault_rdtsc();
+    vm_space_t *vs = paging_current_space();
+    // Reclaim may compress this space's pages, which it cannot while the
+    // fault holds the lock, so it runs first.
+    if (reclaim_under_pressure())
+        shrink_memory(FAULT_RECLAIM);
+    uint64_t rf = vm_mm_lock(vs);
+    int ret = fault_locked(vs, err, addr & ~(PAGE_SIZE - 1));
+    vm_mm_unlock(vs, rf);
+    if (ret == FAULT_OOM) {
+        shrink_memory(FAULT_RECLAIM);
+        rf = vm_mm_lock(vs);
+        ret = fault_locked(vs, err, addr & ~(PAGE_SIZE - 1));
+        vm_mm_unlock(vs, rf);
+        if (ret == FAULT_OOM)
+            ret = -1;
+    }
+    if (ret == 0) {
+        __atomic_fetch_add(&fault_count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&fault_cycles, fault_rdtsc() - t0, __ATOMIC_RELAXED);
+    }
+    return ret;
+}
 
-    serial_puts("[cow] unhandled pfault: addr=0x");
-    for(;;) __asm__("hlt");
+void paging_fault_stats(uint64_t *faults, uint64_t *cycles) {
+    if (faults) *faults = __atomic_load_n(&fault_count, __ATOMIC_RELAXED);
+    if (cycles) *cycles = __atomic_load_n(&fault_cycles, __ATOMIC_RELAXED);
 }
@@ -11,13 +11,8 @@ extern "C" {
 #endif
 
 /**
- * Initialize the COW system with the total number of page frames.
- * Must be called before any COW/demand paging logic is used.
- */
-void cow_init(uint64_t total_frames);
-
-/**
- * Increment reference count for the given physical frame.
+ * Increment reference count for the given physical frame.  Counts and the
+ * COW bit are kept in the page frame database (page.h) set up by pmm_init.
  */
 void cow_inc_ref(uint64_t phys);
 
@@ -29,7 +24,7 @@ void cow_dec_ref(uint64_t phys);
 /**
  * Get reference count for a physical frame.
  */
-uint16_t cow_refcount(uint64_t phys);
+uint32_t cow_refcount(uint64_t phys);
 
 /**
  * Mark a virtual address as COW (read-only, with COW flag set).
@@ -57,10 +52,25 @@ void free_pages(void *addr, uint32_t pages);
 int cow_free_frame(uint64_t phys);
 
 /**
- * Handle a page fault with the given error code and faulting address.
- * Uses the advanced paging subsystem to allocate or copy pages as needed.
+ * Drop a reference and free the frame if it was the last one, deciding
+ * both in one atomic step so two sharers letting go at once free it once.
+ * Returns 1 if it was freed.
+ */
+int cow_put_frame(uint64_t phys);
+
+/**
+ * Handle a page fault with the given error code and faulting address in
+ * the current space: map the page on first touch or copy a COW page, if
+ * the address lies in a VMA that allows the access.  Returns 0 when
+ * resolved, -1 for an access violation.
+ */
+int paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id);
+
+/**
+ * Number of faults resolved by paging_handle_fault and the TSC cycles spent
+ * resolving them, for latency measurements.
  */
-void paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id);
+void paging_fault_stats(uint64_t *faults, uint64_t *cycles);
 
 #ifdef __cplusplus
 }
@@ -6,6 +6,8 @@ extern "C" {
 
 void kheap_parse_bootarg(const char* cmdline);
 void kheap_init(void);
+/** Start the heap's background threads, once threads can be created. */
+void kheap_start(void);
 void* kmalloc(size_t sz, size_t align);
 void  kfree(void* p);
 void* krealloc(void* p, size_t newsz, size_t align);
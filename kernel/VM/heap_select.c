@@ -25,6 +25,11 @@ void kheap_init(void) {
         legacy_kheap_init();
 }
 
+void kheap_start(void) {
+    if (use_nitro)
+        nitro_reclaimd_start();
+}
+
 void* kmalloc(size_t sz, size_t align) {
     if (use_nitro)
         return nitro_kmalloc(sz, align);
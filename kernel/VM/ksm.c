@@ -0,0 +1,340 @@
+#include "ksm.h"
+#include "mmap.h"
+#include "paging_adv.h"
+#include "page.h"
+#include "cow.h"
+#include "heap.h"
+#include "tlb.h"
+#include "../Task/thread.h"
+#include "../../include/cpuid.h"
+#include "../../user/libc/libc.h"
+
+#define KSM_BUCKETS   1024      // chains per table, indexed by checksum
+#define KSM_SCAN_MAX  1024      // pages examined per hold of a space's lock
+
+// A merged frame (stable table) or a page waiting for a twin (unstable
+// table).  Candidates hold a reference on their space until the pass ends.
+typedef struct ksm_node {
+    struct ksm_node *next;
+    uint32_t    sum;
+    uint64_t    phys;           // the frame; 0 once a candidate was tried
+    vm_space_t *vs;             // candidates: where the page is mapped
+    uint64_t    va;
+} ksm_node_t;
+
+// The scanner owns both tables, the clock hand and the checksums it
+// leaves in user frames' page_t.private.  stable_lock also keeps
+// ksm_get_stats off the stable table while the scanner changes it.
+static volatile int scan_lock;
+static volatile int stable_lock;
+static ksm_node_t *stable[KSM_BUCKETS], *unstable[KSM_BUCKETS];
+static uint64_t scan_id, scan_va;
+static uint64_t stat_scanned, stat_full_scans;
+
+static int have_crc32;
+static uint32_t crc_table[256];
+
+static uint64_t stable_lock_irq(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    while (__sync_lock_test_and_set(&stable_lock, 1))
+        __asm__ volatile("pause");
+    return rf;
+}
+
+static void stable_unlock_irq(uint64_t rf) {
+    __sync_lock_release(&stable_lock);
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+// ----------- Checksum -----------
+// CRC-32C of the page: the SSE4.2 instruction eats 8 bytes a step, the
+// table fallback one, with the same result.
+
+static uint32_t page_sum(const void *page) {
+    uint64_t c = 0xFFFFFFFFu;
+    if (have_crc32) {
+        const uint64_t *w = page;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(*w); ++i)
+            __asm__("crc32q %1, %0" : "+r"(c) : "rm"(w[i]));
+    } else {
+        const uint8_t *b = page;
+        for (size_t i = 0; i < PAGE_SIZE; ++i)
+            c = crc_table[(c ^ b[i]) & 0xFF] ^ (c >> 8);
+    }
+    return (uint32_t)c;
+}
+
+// What page_t.private holds for a frame last seen with checksum `sum`.
+static inline void *sum_tag(uint32_t sum) {
+    return (void *)(uintptr_t)((uint64_t)sum | 1ULL << 32);
+}
+
+void ksm_init(void) {
+    uint32_t a, b, c, d;
+    cpuid(1, 0, &a, &b, &c, &d);
+    have_crc32 = (c >> 20) & 1;
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t v = i;
+        for (int k = 0; k < 8; ++k)
+            v = v & 1 ? (v >> 1) ^ 0x82F63B78u : v >> 1;
+        crc_table[i] = v;
+    }
+}
+
+// ----------- Merging -----------
+
+// A page merging may take: anonymous, 4 KiB, mapped only here, and not
+// shared copy-on-write or merged already.
+static page_t *candidate(uint64_t phys, uint64_t size) {
+    page_t *pg = phys_to_page(phys);
+    if (size != PAGE_SIZE || !pg || pg->owner != PAGE_OWNER_USER || page_ref_count(pg) != 1 ||
+        pg->mapcount != 1 || page_test_flag(pg, PG_COW | PG_KSM))
+        return NULL;
+    return pg;
+}
+
+static inline int same_page(uint64_t a, uint64_t b) {
+    return !memcmp((const void *)(uintptr_t)a, (const void *)(uintptr_t)b, PAGE_SIZE);
+}
+
+// Map merged frame `k` read-only at `va` in `vs`, inside `v`, where
+// paging_page_take left `old`, and let go of the frame that was there.
+static void map_merged(vm_space_t *vs, vma_t *v, uint64_t va, uint64_t old, uint64_t phys,
+                       uint64_t k) {
+    cow_inc_ref(k);
+    page_mapcount_inc(phys_to_page(k));
+    paging_swap_set(vs, va, old & ~PAGE_PRESENT, k | (vm_prot_flags(vs, v->prot) & ~PAGE_WRITABLE));
+    vm_frame_release(phys, 0);
+}
+
+static uint64_t stable_find(uint32_t sum, uint64_t phys) {
+    for (ksm_node_t *n = stable[sum % KSM_BUCKETS]; n; n = n->next)
+        if (n->sum == sum && same_page(n->phys, phys))
+            return n->phys;
+    return 0;
+}
+
+// Replace the page at `va` by merged frame `k` if they still match.
+static int merge_stable(vm_space_t *vs, vma_t *v, uint64_t va, uint64_t phys, uint64_t k) {
+    uint64_t old;
+    if (paging_page_take(vs, va, phys, &old) < 0)
+        return 0;
+    tlb_batch_flush();
+    if (!same_page(phys, k)) {
+        paging_swap_set(vs, va, old & ~PAGE_PRESENT, old);
+        return 0;
+    }
+    map_merged(vs, v, va, old, phys, k);
+    return 1;
+}
+
+// Merge the page at `va` with candidate `u`, an identical page seen
+// earlier this pass: `u`'s frame becomes a merged frame that both map.
+// `vs` is locked; `u`'s space, if another, is tried.
+static int merge_pair(vm_space_t *vs, vma_t *v, uint64_t va, uint64_t phys, ksm_node_t *u) {
+    vm_space_t *us = u->vs;
+    uint64_t k = u->phys, rf = 0, size, mapped, uold, old;
+    u->phys = 0;
+    if (us != vs && !vm_mm_trylock(us, &rf))
+        return 0;
+    int merged = 0;
+    vma_t *uv = vma_find(&us->vmas, u->va);
+    ksm_node_t *n = kalloc(sizeof(*n));
+    if (n && uv && !(uv->flags & VMA_SHARED) &&
+        paging_next_mapped(us, u->va, u->va + PAGE_SIZE, &mapped, &size) == u->va &&
+        mapped == k && candidate(k, size) && paging_page_take(us, u->va, k, &uold) == 0) {
+        if (paging_page_take(vs, va, phys, &old) == 0) {
+            tlb_batch_flush();
+            if (same_page(phys, k)) {
+                // The merged frame keeps a reference of its own, so the
+                // last write fault still copies and the scanner frees it.
+                cow_inc_ref(k);
+                page_set_flag(phys_to_page(k), PG_COW | PG_KSM);
+                paging_swap_set(us, u->va, uold & ~PAGE_PRESENT,
+                                k | (vm_prot_flags(us, uv->prot) & ~PAGE_WRITABLE));
+                map_merged(vs, v, va, old, phys, k);
+                n->sum = u->sum;
+                n->phys = k;
+                uint64_t srf = stable_lock_irq();
+                n->next = stable[n->sum % KSM_BUCKETS];
+                stable[n->sum % KSM_BUCKETS] = n;
+                stable_unlock_irq(srf);
+                n = NULL;
+                merged = 1;
+            } else {
+                paging_swap_set(vs, va, old & ~PAGE_PRESENT, old);
+            }
+        }
+        if (!merged)
+            paging_swap_set(us, u->va, uold & ~PAGE_PRESENT, uold);
+    }
+    if (us != vs)
+        vm_mm_unlock(us, rf);
+    kfree(n);
+    return merged;
+}
+
+static ksm_node_t *unstable_find(uint32_t sum, uint64_t phys) {
+    for (ksm_node_t *n = unstable[sum % KSM_BUCKETS]; n; n = n->next)
+        if (n->phys && n->phys != phys && n->sum == sum && same_page(n->phys, phys))
+            return n;
+    return NULL;
+}
+
+static void unstable_add(uint32_t sum, vm_space_t *vs, uint64_t va, uint64_t phys) {
+    ksm_node_t *n = kalloc(sizeof(*n));
+    if (!n)
+        return;
+    paging_space_get(vs);
+    n->sum = sum;
+    n->phys = phys;
+    n->vs = vs;
+    n->va = va;
+    n->next = unstable[sum % KSM_BUCKETS];
+    unstable[sum % KSM_BUCKETS] = n;
+}
+
+// Look at the page at `va`: merge it with a merged frame or a candidate
+// that matches, or make it a candidate once its checksum held for a pass.
+static int scan_page(vm_space_t *vs, vma_t *v, uint64_t va, uint64_t phys, uint64_t size) {
+    page_t *pg = candidate(phys, size);
+    if (!pg)
+        return 0;
+    uint32_t sum = page_sum((const void *)(uintptr_t)phys);
+    uint64_t k = stable_find(sum, phys);
+    if (k)
+        return merge_stable(vs, v, va, phys, k);
+    if (pg->private != sum_tag(sum)) {
+        pg->private = sum_tag(sum);
+        return 0;
+    }
+    ksm_node_t *u = unstable_find(sum, phys);
+    if (u)
+        return merge_pair(vs, v, va, phys, u);
+    unstable_add(sum, vs, va, phys);
+    return 0;
+}
+
+// A pass is over: candidates are forgotten, and merged frames nothing
+// maps any more go back.
+static void end_pass(void) {
+    for (int b = 0; b < KSM_BUCKETS; ++b) {
+        while (unstable[b]) {
+            ksm_node_t *n = unstable[b];
+            unstable[b] = n->next;
+            paging_space_put(n->vs);
+            kfree(n);
+        }
+        for (ksm_node_t **pp = &stable[b], *n; (n = *pp);) {
+            page_t *pg = phys_to_page(n->phys);
+            if (__atomic_load_n(&pg->mapcount, __ATOMIC_RELAXED)) {
+                pp = &n->next;
+                continue;
+            }
+            uint64_t rf = stable_lock_irq();
+            *pp = n->next;
+            stable_unlock_irq(rf);
+            page_clear_flag(pg, PG_KSM);
+            vm_frame_put(n->phys);
+            kfree(n);
+        }
+    }
+    __atomic_fetch_add(&stat_full_scans, 1, __ATOMIC_RELAXED);
+}
+
+// Scan the private mappings of `vs` from the clock hand, at most
+// KSM_SCAN_MAX pages, counting into *scanned until `budget`.  Returns 1
+// once the space is done (or busy), 0 if the hand stopped inside it.
+static int scan_space(vm_space_t *vs, uint64_t budget, uint64_t *scanned, uint64_t *merged) {
+    uint64_t rf;
+    if (!vm_mm_trylock(vs, &rf))
+        return 1;
+    uint64_t seen = 0;
+    int done = 1;
+    tlb_batch_begin();
+    for (vma_t *v = vma_find_after(&vs->vmas, scan_va); v && done; v = vma_next(v)) {
+        if (v->flags & VMA_SHARED)
+            continue;
+        uint64_t va = scan_va > v->start ? scan_va : v->start, phys, size;
+        while ((va = paging_next_mapped(vs, va, v->end, &phys, &size)) < v->end) {
+            if (seen++ == KSM_SCAN_MAX || *scanned == budget) {
+                done = 0;
+                break;
+            }
+            ++*scanned;
+            *merged += scan_page(vs, v, va, phys, size);
+            va += size;
+        }
+        scan_va = va;
+    }
+    tlb_batch_end();
+    vm_mm_unlock(vs, rf);
+    return done;
+}
+
+uint64_t ksm_scan(uint64_t nr_pages) {
+    if (__sync_lock_test_and_set(&scan_lock, 1))
+        return 0;
+    uint64_t scanned = 0, merged = 0;
+    int ends = 0;
+    vm_space_t *vs = NULL;
+    // Spaces in id order from the hand, as zswap visits them.
+    while (scanned < nr_pages && ends < 2) {
+        vs = paging_space_next(vs);
+        if (!vs) {
+            ends++;
+            end_pass();
+            scan_id = 0;
+            scan_va = 0;
+            continue;
+        }
+        if (vs->id < scan_id)
+            continue;
+        if (vs->id > scan_id) {
+            scan_id = vs->id;
+            scan_va = 0;
+        }
+        while (!scan_space(vs, nr_pages, &scanned, &merged) && scanned < nr_pages)
+            ;
+        if (scanned < nr_pages) {
+            scan_id = vs->id + 1;
+            scan_va = 0;
+        }
+    }
+    paging_space_put(vs);
+    __atomic_fetch_add(&stat_scanned, scanned, __ATOMIC_RELAXED);
+    __sync_lock_release(&scan_lock);
+    return merged;
+}
+
+void ksm_get_stats(meminfo_ksm_t *out) {
+    uint64_t pages = 0, sharing = 0;
+    uint64_t rf = stable_lock_irq();
+    for (int b = 0; b < KSM_BUCKETS; ++b)
+        for (ksm_node_t *n = stable[b]; n; n = n->next) {
+            pages++;
+            sharing += __atomic_load_n(&phys_to_page(n->phys)->mapcount, __ATOMIC_RELAXED);
+        }
+    stable_unlock_irq(rf);
+    out->merged_pages = pages;
+    out->sharing = sharing;
+    out->saved = sharing > pages ? sharing - pages : 0;
+    out->scanned = __atomic_load_n(&stat_scanned, __ATOMIC_RELAXED);
+    out->full_scans = __atomic_load_n(&stat_full_scans, __ATOMIC_RELAXED);
+}
+
+// ----------- Thread -----------
+
+// A few hundred pages per run keeps the scan's cost a small, steady
+// fraction of one CPU however much memory there is.
+static void ksm_main(void) {
+    for (;;) {
+        ksm_scan(KSM_PAGES_PER_RUN);
+        thread_sleep(KSM_RUN_TICKS);
+    }
+}
+
+void ksm_start(void) {
+    thread_create_with_priority(ksm_main, MIN_PRIORITY + 1);
+}
@@ -0,0 +1,46 @@
+// Kernel same-page merging for private anonymous memory.
+#pragma once
+#include <stdint.h>
+#include "../../include/meminfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Agents loaded from the same image hold the same pages in separate frames,
+ * and much of their memory stays zero.  A low-priority thread walks every
+ * space a few hundred pages at a time, checksums private anonymous pages
+ * and maps identical ones to a single frame shared copy-on-write, freeing
+ * the rest; the first write to a merged page copies it back out (cow.c).
+ *
+ * Merged frames live in the stable table, indexed by checksum.  A page
+ * only becomes a merge candidate once its checksum held for a whole pass,
+ * so pages being written are left alone; candidates wait in the unstable
+ * table, rebuilt every pass, until an identical page turns up.  Contents
+ * are always compared in full, with the pages unmapped so nothing writes
+ * them meanwhile.
+ */
+
+#define KSM_PAGES_PER_RUN    256                // pages examined per wakeup
+#define KSM_RUN_TICKS        1                  // timer ticks between wakeups
+
+/** Pick the checksum routine (SSE4.2 crc32 when the CPU has it). */
+void ksm_init(void);
+
+/** Spawn the rate-limited scanning thread. */
+void ksm_start(void);
+
+/**
+ * Examine up to `nr_pages` pages from where the last call stopped, or until
+ * the scan has passed the last space twice.  Returns pages merged.  The
+ * thread calls it; tests may call it directly.  Returns 0 at once if
+ * another scan is running.
+ */
+uint64_t ksm_scan(uint64_t nr_pages);
+
+void ksm_get_stats(meminfo_ksm_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,200 @@
+/*
+ * Memblock boot allocator
+ * -----------------------
+ * Two sorted, coalesced range lists: `memory` (usable RAM from the boot
+ * map) and `reserved` (ranges that must never reach the buddy allocator).
+ * Allocation searches usable ranges top-down for a gap not covered by a
+ * reservation and records the result as reserved.  Physical addresses are
+ * identity mapped at this point in boot, so they are returned as pointers.
+ */
+#include "memblock.h"
+#include "../../user/libc/libc.h"
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+typedef struct {
+    memblock_region_t regions[MEMBLOCK_MAX_REGIONS];
+    uint32_t          cnt;
+} memblock_type_t;
+
+static memblock_type_t mb_memory;
+static memblock_type_t mb_reserved;
+static int mb_retired;
+
+#define ALIGN_UP(x, a)   (((x) + (a) - 1) & ~((uint64_t)(a) - 1))
+#define ALIGN_DOWN(x, a) ((x) & ~((uint64_t)(a) - 1))
+
+// Insert [base, base+size) keeping the list sorted and merging any ranges
+// it overlaps or touches.
+static int mb_insert(memblock_type_t *t, uint64_t base, uint64_t size) {
+    if (!size)
+        return 0;
+    uint64_t end = base + size;
+    if (end < base)
+        end = UINT64_MAX;
+
+    uint32_t i = 0;
+    while (i < t->cnt && t->regions[i].base + t->regions[i].size < base)
+        i++;
+
+    // Absorb every region that overlaps or is adjacent to the new one.
+    uint32_t j = i;
+    while (j < t->cnt && t->regions[j].base <= end) {
+        if (t->regions[j].base < base)
+            base = t->regions[j].base;
+        if (t->regions[j].base + t->regions[j].size > end)
+            end = t->regions[j].base + t->regions[j].size;
+        j++;
+    }
+
+    if (j == i) {
+        if (t->cnt >= MEMBLOCK_MAX_REGIONS)
+            return -1;
+        memmove(&t->regions[i + 1], &t->regions[i],
+                (t->cnt - i) * sizeof(memblock_region_t));
+        t->cnt++;
+    } else if (j > i + 1) {
+        memmove(&t->regions[i + 1], &t->regions[j],
+                (t->cnt - j) * sizeof(memblock_region_t));
+        t->cnt -= j - i - 1;
+    }
+    t->regions[i].base = base;
+    t->regions[i].size = end - base;
+    return 0;
+}
+
+int memblock_add(uint64_t base, uint64_t size) {
+    return mb_insert(&mb_memory, base, size);
+}
+
+int memblock_reserve(uint64_t base, uint64_t size) {
+    return mb_insert(&mb_reserved, base, size);
+}
+
+void memblock_init(const bootinfo_t *bootinfo) {
+    memset(&mb_memory, 0, sizeof(mb_memory));
+    memset(&mb_reserved, 0, sizeof(mb_reserved));
+    mb_retired = 0;
+
+    for (uint32_t i = 0; i < bootinfo->mmap_entries; ++i) {
+        if (bootinfo->mmap[i].type != 7)
+            continue; /* only EfiConventionalMemory */
+        memblock_add(bootinfo->mmap[i].addr, bootinfo->mmap[i].len);
+    }
+    /* Fallback: use the first entry if no usable region was found (numa_init
+     * makes the same choice). */
+    if (!mb_memory.cnt && bootinfo->mmap_entries)
+        memblock_add(bootinfo->mmap[0].addr, bootinfo->mmap[0].len);
+
+    // Real-mode IVT, BDA, EBDA and legacy VGA/ROM space stay untouched.
+    memblock_reserve(0, 0x100000);
+    memblock_reserve(bootinfo->kernel_load_base, bootinfo->kernel_load_size);
+    for (uint32_t i = 0; i < bootinfo->module_count && i < 16; ++i)
+        memblock_reserve((uint64_t)(uintptr_t)bootinfo->modules[i].base,
+                         bootinfo->modules[i].size);
+}
+
+// Returns the first reserved region overlapping [base, end), or NULL.
+static const memblock_region_t *mb_overlap(uint64_t base, uint64_t end) {
+    for (uint32_t i = 0; i < mb_reserved.cnt; ++i) {
+        const memblock_region_t *r = &mb_reserved.regions[i];
+        if (r->base < end && r->base + r->size > base)
+            return r;
+    }
+    return NULL;
+}
+
+void *memblock_alloc(uint64_t size, uint64_t align) {
+    if (mb_retired || !size)
+        return NULL;
+    if (align < sizeof(uint64_t))
+        align = sizeof(uint64_t);
+
+    // Top-down keeps low (DMA-reachable) memory free for devices.
+    for (uint32_t i = mb_memory.cnt; i-- > 0;) {
+        uint64_t lo = mb_memory.regions[i].base;
+        uint64_t hi = lo + mb_memory.regions[i].size;
+        while (hi > lo && hi - lo >= size) {
+            uint64_t cand = ALIGN_DOWN(hi - size, align);
+            if (cand < lo)
+                break;
+            const memblock_region_t *r = mb_overlap(cand, cand + size);
+            if (!r) {
+                if (memblock_reserve(cand, size) < 0)
+                    return NULL;
+                memset((void *)(uintptr_t)cand, 0, size);
+                return (void *)(uintptr_t)cand;
+            }
+            hi = r->base;
+        }
+    }
+    return NULL;
+}
+
+uint64_t memblock_start(void) {
+    return mb_memory.cnt ? mb_memory.regions[0].base : 0;
+}
+
+uint64_t memblock_end(void) {
+    if (!mb_memory.cnt)
+        return 0;
+    const memblock_region_t *r = &mb_memory.regions[mb_memory.cnt - 1];
+    return r->base + r->size;
+}
+
+uint64_t memblock_phys_mem_size(void) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < mb_memory.cnt; ++i)
+        total += mb_memory.regions[i].size;
+    return total;
+}
+
+uint64_t memblock_reserved_size(void) {
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < mb_memory.cnt; ++i) {
+        uint64_t lo = mb_memory.regions[i].base;
+        uint64_t hi = lo + mb_memory.regions[i].size;
+        for (uint32_t j = 0; j < mb_reserved.cnt; ++j) {
+            uint64_t rlo = mb_reserved.regions[j].base;
+            uint64_t rhi = rlo + mb_reserved.regions[j].size;
+            if (rlo < lo) rlo = lo;
+            if (rhi > hi) rhi = hi;
+            if (rhi > rlo)
+                total += rhi - rlo;
+        }
+    }
+    return total;
+}
+
+uint64_t memblock_free_all(memblock_range_fn fn, void *ctx) {
+    uint64_t pages = 0;
+    for (uint32_t i = 0; i < mb_memory.cnt; ++i) {
+        uint64_t lo = mb_memory.regions[i].base;
+        uint64_t hi = lo + mb_memory.regions[i].size;
+        // Both lists are sorted; walk the reservations that cut this range.
+        uint32_t j = 0;
+        while (lo < hi) {
+            while (j < mb_reserved.cnt &&
+                   mb_reserved.regions[j].base + mb_reserved.regions[j].size <= lo)
+                j++;
+            uint64_t gap_end = hi;
+            uint64_t next_lo = hi;
+            if (j < mb_reserved.cnt && mb_reserved.regions[j].base < hi) {
+                gap_end = mb_reserved.regions[j].base;
+                next_lo = mb_reserved.regions[j].base + mb_reserved.regions[j].size;
+            }
+            // Partial pages at either edge stay with their reservation.
+            uint64_t a = ALIGN_UP(lo, PAGE_SIZE);
+            uint64_t b = ALIGN_DOWN(gap_end, PAGE_SIZE);
+            if (b > a) {
+                fn(a, b - a, ctx);
+                pages += (b - a) / PAGE_SIZE;
+            }
+            lo = next_lo;
+        }
+    }
+    mb_retired = 1;
+    return pages;
+}
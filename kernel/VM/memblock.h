@@ -0,0 +1,63 @@
+/*
+ * Memblock Boot Allocator
+ * -----------------------
+ * Tracks usable and reserved physical ranges from the firmware memory map
+ * before the buddy allocator exists.  Early consumers (buddy bitmaps, page
+ * frame metadata) carve their storage from here so it scales with installed
+ * RAM instead of the libc static heap.  Once the buddy allocator is online
+ * every unreserved page is handed over and memblock retires.
+ */
+#pragma once
+#include <stdint.h>
+#include "../../boot/include/bootinfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MEMBLOCK_MAX_REGIONS 128
+
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+} memblock_region_t;
+
+/**
+ * Build the memory and reserved lists from the boot memory map.  Usable
+ * (EfiConventionalMemory) ranges are added; the first megabyte, the kernel
+ * image and boot modules are reserved.  Resets any previous state.
+ */
+void memblock_init(const bootinfo_t *bootinfo);
+
+/** Add a usable physical range.  Returns 0 on success, -1 if the table is full. */
+int memblock_add(uint64_t base, uint64_t size);
+
+/** Mark a physical range as in use.  Returns 0 on success, -1 if the table is full. */
+int memblock_reserve(uint64_t base, uint64_t size);
+
+/**
+ * Allocate `size` zeroed bytes aligned to `align` (a power of two), top-down
+ * from the highest usable range.  Returns NULL once memblock has retired or
+ * when no range fits.  Allocations are permanent.
+ */
+void *memblock_alloc(uint64_t size, uint64_t align);
+
+/** Lowest and one-past-highest usable physical address. */
+uint64_t memblock_start(void);
+uint64_t memblock_end(void);
+
+/** Bytes of usable RAM, and bytes of it currently reserved. */
+uint64_t memblock_phys_mem_size(void);
+uint64_t memblock_reserved_size(void);
+
+typedef void (*memblock_range_fn)(uint64_t base, uint64_t size, void *ctx);
+
+/**
+ * Hand every page-aligned range that is usable and not reserved to `fn`,
+ * then retire the allocator.  Returns the number of pages released.
+ */
+uint64_t memblock_free_all(memblock_range_fn fn, void *ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,58 @@
+#include "meminfo.h"
+#include "pmm_buddy.h"
+#include "memblock.h"
+#include "shrinker.h"
+#include "zswap.h"
+#include "ksm.h"
+#include <string.h>
+#include <printf.h>
+
+void meminfo_fill(meminfo_t *out) {
+    memset(out, 0, sizeof(*out));
+    int n = buddy_zone_count();
+    if (n > MEMINFO_MAX_ZONES)
+        n = MEMINFO_MAX_ZONES;
+    for (int i = 0; i < n; ++i) {
+        if (buddy_zone_report(i, &out->zones[i]) == 0)
+            out->free_pages += out->zones[i].free_frames;
+    }
+    out->zone_count = (uint32_t)n;
+    out->total_pages = memblock_phys_mem_size() / PAGE_SIZE;
+    out->reclaimable_pages = shrinker_reclaimable();
+    zswap_get_stats(&out->zswap);
+    ksm_get_stats(&out->ksm);
+}
+
+// Modelled on /proc/buddyinfo plus the extfrag debugfs view.
+void meminfo_dump(void) {
+    static meminfo_t mi;        // too large for an 8KiB thread stack
+    meminfo_fill(&mi);
+    kprintf("[meminfo] total=%llu free=%llu reclaimable=%llu pages\n",
+            (unsigned long long)mi.total_pages,
+            (unsigned long long)mi.free_pages,
+            (unsigned long long)mi.reclaimable_pages);
+    const meminfo_zswap_t *zs = &mi.zswap;
+    // Ratio of pages held to frames holding them, in tenths.
+    uint64_t ratio = zs->pool_pages ? zs->stored_pages * 10 / zs->pool_pages : 0;
+    kprintf("[meminfo] zswap stored=%llu zero=%llu pool=%llu ratio=%llu.%llu rejected=%llu "
+            "loads=%llu cyc/load=%llu\n",
+            (unsigned long long)zs->stored_pages, (unsigned long long)zs->same_filled,
+            (unsigned long long)zs->pool_pages, (unsigned long long)(ratio / 10),
+            (unsigned long long)(ratio % 10), (unsigned long long)zs->rejected,
+            (unsigned long long)zs->loads,
+            (unsigned long long)(zs->loads ? zs->load_cycles / zs->loads : 0));
+    kprintf("[meminfo] ksm merged=%llu sharing=%llu saved=%llu scans=%llu\n",
+            (unsigned long long)mi.ksm.merged_pages, (unsigned long long)mi.ksm.sharing,
+            (unsigned long long)mi.ksm.saved, (unsigned long long)mi.ksm.full_scans);
+    for (uint32_t z = 0; z < mi.zone_count; ++z) {
+        const meminfo_zone_t *zi = &mi.zones[z];
+        kprintf("[meminfo] node %u base=0x%llx frames=%llu free=%llu\n",
+                zi->node, (unsigned long long)zi->base,
+                (unsigned long long)zi->frames,
+                (unsigned long long)zi->free_frames);
+        for (uint32_t o = 0; o <= zi->max_order && o < MEMINFO_ORDERS; ++o)
+            kprintf("[meminfo]   order %2u: %8llu free, unusable %4u\n", o,
+                    (unsigned long long)zi->free_blocks[o],
+                    (unsigned)zi->unusable[o]);
+    }
+}
@@ -0,0 +1,17 @@
+// Physical memory report (buddy zones, fragmentation, reclaimable caches).
+#pragma once
+#include "../../include/meminfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Fill `out` with a snapshot of every buddy zone and the global totals. */
+void meminfo_fill(meminfo_t *out);
+
+/** Print the report to the kernel log, one line per zone and order table. */
+void meminfo_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
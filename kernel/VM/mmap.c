@@ -0,0 +1,511 @@
+#include "mmap.h"
+#include <stddef.h>
+#include "../../include/mman.h"
+#include "../../user/libc/libc.h"
+#include "heap.h"
+#include "page.h"
+#include "cow.h"
+#include "numa.h"
+#include "tlb.h"
+#include "zeropool.h"
+#include "zswap.h"
+
+#define PAGE_MASK (PAGE_SIZE - 1)
+
+// Locking.  Each space's mmap_lock covers its VMA tree and the frames its
+// mappings hold; page table entries below it keep their own locks.  The
+// holder may wait for a TLB shootdown, so a CPU spinning for the lock
+// serves shootdowns in the meantime.
+
+uint64_t vm_mm_lock(vm_space_t *vs) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    while (__sync_lock_test_and_set(&vs->mmap_lock, 1)) {
+        tlb_shootdown_handler();
+        __asm__ volatile("pause");
+    }
+    return rf;
+}
+
+int vm_mm_trylock(vm_space_t *vs, uint64_t *rf) {
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(*rf) :: "memory");
+    if (!__sync_lock_test_and_set(&vs->mmap_lock, 1))
+        return 1;
+    __asm__ volatile("push %0; popfq" :: "r"(*rf) : "memory");
+    return 0;
+}
+
+void vm_mm_unlock(vm_space_t *vs, uint64_t rf) {
+    __sync_lock_release(&vs->mmap_lock);
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+uint64_t vm_prot_flags(const vm_space_t *vs, uint32_t prot) {
+    uint64_t flags = PAGE_PRESENT;
+    if (vs->ring3 && (prot & (VMA_READ | VMA_WRITE | VMA_EXEC)))
+        flags |= PAGE_USER;
+    if (prot & VMA_WRITE)
+        flags |= PAGE_WRITABLE;
+    if (!(prot & VMA_EXEC))
+        flags |= PAGE_NO_EXEC;
+    return flags;
+}
+
+// ----------- Shared objects -----------
+
+static vm_object_t *vm_object_create(uint64_t npages) {
+    size_t size = sizeof(vm_object_t) + npages * sizeof(uint64_t);
+    vm_object_t *obj = kalloc(size);
+    if (!obj)
+        return NULL;
+    memset(obj, 0, size);
+    obj->refs = 1;
+    obj->npages = npages;
+    return obj;
+}
+
+void vm_object_get(struct vm_object *obj) {
+    __atomic_fetch_add(&obj->refs, 1, __ATOMIC_RELAXED);
+}
+
+void vm_object_put(struct vm_object *obj) {
+    if (__atomic_sub_fetch(&obj->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    for (uint64_t i = 0; i < obj->npages; ++i) {
+        if (!obj->frames[i])
+            continue;
+        cow_put_frame(obj->frames[i]);
+    }
+    kfree(obj);
+}
+
+uint64_t vm_object_page(vm_object_t *obj, uint64_t idx) {
+    if (idx >= obj->npages)
+        return 0;
+    while (__sync_lock_test_and_set(&obj->lock, 1))
+        __asm__ volatile("pause");
+    uint64_t phys = obj->frames[idx];
+    if (!phys) {
+        void *page = alloc_zeroed_page();
+        if (page) {
+            phys = (uint64_t)page;
+            cow_inc_ref(phys);      // the object's reference
+            page_t *pg = phys_to_page(phys);
+            if (pg)
+                pg->owner = PAGE_OWNER_USER;
+            obj->frames[idx] = phys;
+        }
+    }
+    __sync_lock_release(&obj->lock);
+    return phys;
+}
+
+// ----------- Mappings -----------
+
+// Private frames in use, each claimed fresh and freed by its last release.
+static uint64_t anon_frames;
+
+void vm_frame_claim(uint64_t phys, int shared) {
+    if (!shared) {
+        cow_inc_ref(phys);
+        __atomic_fetch_add(&anon_frames, 1, __ATOMIC_RELAXED);
+    }
+    page_t *pg = phys_to_page(phys);
+    if (pg) {
+        pg->owner = PAGE_OWNER_USER;
+        page_mapcount_inc(pg);
+    }
+}
+
+void vm_frame_put(uint64_t phys) {
+    if (cow_put_frame(phys))
+        __atomic_fetch_sub(&anon_frames, 1, __ATOMIC_RELAXED);
+}
+
+void vm_frame_release(uint64_t phys, int shared) {
+    page_t *pg = phys_to_page(phys);
+    if (pg)
+        page_mapcount_dec(pg);
+    if (!shared)
+        vm_frame_put(phys);
+}
+
+uint64_t vm_anon_pages(void) {
+    return __atomic_load_n(&anon_frames, __ATOMIC_RELAXED);
+}
+
+#define ZAP_BATCH  64
+
+// Release frames unmapped inside a TLB batch.  Until the flush lands, a
+// CPU may still reach them through a stale entry.
+static void zap_release(const uint64_t *frames, unsigned n, int shared) {
+    if (!n)
+        return;
+    tlb_batch_flush();
+    for (unsigned i = 0; i < n; ++i)
+        vm_frame_release(frames[i], shared);
+}
+
+// Unmap the pages of `v` in [start, end), in the current space, and drop
+// the compressed ones.
+static void zap_pages(vm_space_t *vs, vma_t *v, uint64_t start, uint64_t end) {
+    uint64_t va = start, phys, size, frames[ZAP_BATCH];
+    unsigned n = 0;
+    int shared = v->flags & VMA_SHARED;
+    while ((va = paging_next_mapped(vs, va, end, &phys, &size)) < end) {
+        paging_unmap_adv(va);
+        frames[n++] = phys;
+        if (n == ZAP_BATCH) {
+            zap_release(frames, n, shared);
+            n = 0;
+        }
+        va += PAGE_SIZE;
+    }
+    zap_release(frames, n, shared);
+    if (!shared)
+        zswap_zap(vs, start, end);
+}
+
+// Cut the VMAs straddling `start` and `end` so [start, end) is made of
+// whole VMAs.  -1 when out of memory; the cuts made so far stay, harmless.
+static int split_range(vma_tree_t *t, uint64_t start, uint64_t end) {
+    vma_t *v = vma_find(t, start);
+    if (v && v->start < start && !vma_split(t, v, start))
+        return -1;
+    v = vma_find(t, end - 1);
+    if (v && v->end > end && !vma_split(t, v, end))
+        return -1;
+    return 0;
+}
+
+// Whether VMAs cover [start, end) with no holes.
+static int range_mapped(const vma_tree_t *t, uint64_t start, uint64_t end) {
+    uint64_t covered = start;
+    for (const vma_t *v = vma_find(t, start); v && v->start <= covered && covered < end;
+         v = vma_next(v))
+        covered = v->end;
+    return covered >= end;
+}
+
+// Fold the VMAs of [start, end), all present, back together and into
+// their neighbours.
+static void merge_range(vma_tree_t *t, uint64_t start, uint64_t end) {
+    vma_t *v = vma_merge(t, vma_find(t, start));
+    while ((v = vma_next(v)) && v->start <= end)
+        v = vma_merge(t, v);
+}
+
+static int unmap_range(vm_space_t *vs, uint64_t start, uint64_t end) {
+    if (split_range(&vs->vmas, start, end) < 0)
+        return -1;
+    vma_t *v;
+    tlb_batch_begin();
+    while ((v = vma_find_after(&vs->vmas, start)) && v->start < end) {
+        vma_remove(&vs->vmas, v);
+        zap_pages(vs, v, v->start, v->end);
+        vma_free(v);
+    }
+    tlb_batch_end();
+    return 0;
+}
+
+// Page-rounded length, or 0 if it is zero or wraps past `addr`.
+static uint64_t page_len(uint64_t addr, uint64_t len) {
+    uint64_t rounded = (len + PAGE_MASK) & ~PAGE_MASK;
+    if (!len || rounded < len || addr + rounded < addr)
+        return 0;
+    return rounded;
+}
+
+uint64_t vm_mmap(uint64_t addr, uint64_t len, int prot, int flags) {
+    int share = flags & (MAP_SHARED | MAP_PRIVATE);
+    if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) || !(flags & MAP_ANONYMOUS) ||
+        (share != MAP_SHARED && share != MAP_PRIVATE))
+        return MMAP_ERR;
+    if (flags & MAP_FIXED) {
+        if (addr & PAGE_MASK)
+            return MMAP_ERR;
+    } else {
+        addr &= ~PAGE_MASK;
+    }
+    len = page_len(addr, len);
+    if (!len)
+        return MMAP_ERR;
+
+    vma_t *v = vma_alloc();
+    if (!v)
+        return MMAP_ERR;
+    v->prot = (uint32_t)prot;
+    if (share == MAP_SHARED) {
+        v->flags = VMA_SHARED;
+        v->obj = vm_object_create(len / PAGE_SIZE);
+        if (!v->obj) {
+            vma_free(v);
+            return MMAP_ERR;
+        }
+    }
+
+    vm_space_t *vs = paging_current_space();
+    uint64_t rf = vm_mm_lock(vs);
+    if (flags & MAP_FIXED) {
+        if (!paging_range_private(addr, len) || unmap_range(vs, addr, addr + len) < 0)
+            addr = MMAP_ERR;
+    } else {
+        vma_t *n = addr ? vma_find_after(&vs->vmas, addr) : NULL;
+        if (!addr || !paging_range_private(addr, len) || (n && n->start < addr + len)) {
+            addr = vma_gap_find(&vs->vmas, MMAP_FLOOR, MMAP_CEIL, len);
+            if (addr == VMA_NO_GAP || !paging_range_private(addr, len))
+                addr = MMAP_ERR;
+        }
+    }
+    if (addr != MMAP_ERR) {
+        v->start = addr;
+        v->end = addr + len;
+        vma_insert(&vs->vmas, v);
+        vma_merge(&vs->vmas, v);
+        v = NULL;
+    }
+    vm_mm_unlock(vs, rf);
+    vma_free(v);
+    return addr;
+}
+
+int vm_munmap(uint64_t addr, uint64_t len) {
+    if (addr & PAGE_MASK)
+        return -1;
+    len = page_len(addr, len);
+    if (!len || !paging_range_private(addr, len))
+        return -1;
+    vm_space_t *vs = paging_current_space();
+    uint64_t rf = vm_mm_lock(vs);
+    int ret = unmap_range(vs, addr, addr + len);
+    vm_mm_unlock(vs, rf);
+    return ret;
+}
+
+// Apply `v`'s protection to the pages it has mapped.  Pages shared
+// copy-on-write stay read-only; the write fault still has to copy them.
+static void reprotect_vma(vm_space_t *vs, vma_t *v) {
+    uint64_t flags = vm_prot_flags(vs, v->prot);
+    uint64_t va = v->start, phys, size;
+    while ((va = paging_next_mapped(vs, va, v->end, &phys, &size)) < v->end) {
+        page_t *pg = phys_to_page(phys);
+        uint64_t f = flags;
+        if (pg && page_test_flag(pg, PG_COW))
+            f &= ~PAGE_WRITABLE;
+        paging_map_adv(va, phys, f, 0, current_cpu_node());
+        va += PAGE_SIZE;
+    }
+}
+
+int vm_mprotect(uint64_t addr, uint64_t len, int prot) {
+    if ((addr & PAGE_MASK) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)))
+        return -1;
+    len = page_len(addr, len);
+    if (!len)
+        return -1;
+    uint64_t end = addr + len;
+    vm_space_t *vs = paging_current_space();
+    vma_tree_t *t = &vs->vmas;
+    uint64_t rf = vm_mm_lock(vs);
+
+    if (!range_mapped(t, addr, end) || split_range(t, addr, end) < 0) {
+        vm_mm_unlock(vs, rf);
+        return -1;
+    }
+
+    tlb_batch_begin();
+    for (vma_t *v = vma_find(t, addr); v && v->start < end; v = vma_next(v)) {
+        v->prot = (uint32_t)prot;
+        reprotect_vma(vs, v);
+    }
+    tlb_batch_end();
+
+    merge_range(t, addr, end);
+    vm_mm_unlock(vs, rf);
+    return 0;
+}
+
+// ----------- Populating -----------
+
+// Frames gathered per paging_map_pages call; its walk covers them all.
+#define POPULATE_BATCH    128
+// Largest fault-around window, in pages (1 MiB).
+#define FAULT_AROUND_MAX  256
+
+int64_t vm_populate(vma_t *v, uint64_t start, uint64_t end) {
+    uint64_t flags = vm_prot_flags(paging_current_space(), v->prot);
+    int shared = v->flags & VMA_SHARED;
+    int node = current_cpu_node();
+    uint64_t frames[POPULATE_BATCH];
+    int64_t total = 0;
+    int oom = 0;
+
+    // Compressed pages come back first; the rest of the range is empty.
+    if (!shared && zswap_load_range(paging_current_space(), v, start, end) < 0)
+        return -1;
+    uint64_t va = start;
+    while (va < end && !oom) {
+        uint64_t base = va, n = 0;
+        for (; n < POPULATE_BATCH && va < end; ++n, va += PAGE_SIZE) {
+            frames[n] = 0;
+            if (paging_lookup_adv(va, NULL, NULL))
+                continue;
+            frames[n] = shared ? vm_object_page(v->obj, v->pgoff + (va - v->start) / PAGE_SIZE)
+                               : (uint64_t)alloc_zeroed_page();
+            if (!frames[n]) {
+                oom = 1;
+                break;
+            }
+            vm_frame_claim(frames[n], shared);
+        }
+        total += (int64_t)paging_map_pages(base, frames, n, flags, node);
+        for (uint64_t k = 0; k < n; ++k)
+            if (frames[k])
+                vm_frame_release(frames[k], shared);
+    }
+    return total || !oom ? total : -1;
+}
+
+// Pages to map for a fault at `virt`: the window doubles while faults
+// keep landing just past the previous one and drops back to one page
+// otherwise, so sweeps trap a few times per MiB and random access maps
+// nothing it did not touch.
+static uint64_t fault_window(vma_t *v, uint64_t virt) {
+    uint64_t w;
+    if (v->flags & VMA_RAND)
+        w = 1;
+    else if (v->flags & VMA_SEQ)
+        w = FAULT_AROUND_MAX;
+    else if (virt == v->fault_next && v->fault_window)
+        w = v->fault_window * 2 > FAULT_AROUND_MAX ? FAULT_AROUND_MAX : v->fault_window * 2;
+    else
+        w = 1;
+    uint64_t left = (v->end - virt) / PAGE_SIZE;
+    if (w > left)
+        w = left;
+    v->fault_window = (uint32_t)w;
+    v->fault_next = virt + w * PAGE_SIZE;
+    return w;
+}
+
+int vm_fault_around(vma_t *v, uint64_t virt) {
+    uint64_t w = fault_window(v, virt);
+    return vm_populate(v, virt, virt + w * PAGE_SIZE) < 0 ? -1 : 0;
+}
+
+int vm_madvise(uint64_t addr, uint64_t len, int advice) {
+    if (addr & PAGE_MASK)
+        return -1;
+    len = page_len(addr, len);
+    if (!len)
+        return -1;
+    uint64_t end = addr + len;
+    vm_space_t *vs = paging_current_space();
+    vma_tree_t *t = &vs->vmas;
+    uint64_t rf = vm_mm_lock(vs);
+    int ret = range_mapped(t, addr, end) ? 0 : -1;
+
+    switch (ret ? -1 : advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+        if (split_range(t, addr, end) < 0) {
+            ret = -1;
+            break;
+        }
+        for (vma_t *v = vma_find(t, addr); v && v->start < end; v = vma_next(v)) {
+            v->flags &= ~(uint32_t)(VMA_SEQ | VMA_RAND);
+            v->flags |= advice == MADV_RANDOM ? VMA_RAND : advice == MADV_SEQUENTIAL ? VMA_SEQ : 0;
+            v->fault_window = 0;
+        }
+        merge_range(t, addr, end);
+        break;
+    case MADV_DONTNEED:
+        // Private pages come back zeroed on the next touch; shared ones
+        // keep their contents in the object.
+        tlb_batch_begin();
+        for (vma_t *v = vma_find(t, addr); v && v->start < end; v = vma_next(v))
+            zap_pages(vs, v, v->start > addr ? v->start : addr, v->end < end ? v->end : end);
+        tlb_batch_end();
+        break;
+    case MADV_WILLNEED:
+    case MADV_POPULATE_READ:
+    case MADV_POPULATE_WRITE:
+        for (vma_t *v = vma_find(t, addr); v && v->start < end; v = vma_next(v)) {
+            if (!(v->prot & (VMA_READ | VMA_WRITE | VMA_EXEC)) ||
+                (advice == MADV_POPULATE_WRITE && !(v->prot & VMA_WRITE))) {
+                // WILLNEED is only a hint; populating promises access.
+                if (advice != MADV_WILLNEED)
+                    ret = -1;
+                continue;
+            }
+            if (vm_populate(v, v->start > addr ? v->start : addr, v->end < end ? v->end : end) < 0)
+                ret = -1;
+        }
+        break;
+    default:
+        ret = -1;
+        break;
+    }
+    vm_mm_unlock(vs, rf);
+    return ret;
+}
+
+// ----------- Fork -----------
+
+vm_space_t *vm_fork(vm_space_t *src) {
+    vm_space_t *dst = paging_space_create();
+    if (!dst)
+        return NULL;
+    dst->ring3 = src->ring3;
+    int node = current_cpu_node(), ret = 0;
+    uint64_t rf = vm_mm_lock(src);
+    tlb_batch_begin();
+    for (vma_t *v = vma_first(&src->vmas); v && !ret; v = vma_next(v)) {
+        vma_t *c = vma_alloc();
+        if (!c) {
+            ret = -1;
+            break;
+        }
+        c->start = v->start;
+        c->end = v->end;
+        c->prot = v->prot;
+        c->flags = v->flags;
+        c->obj = v->obj;
+        c->pgoff = v->pgoff;
+        if (c->obj)
+            vm_object_get(c->obj);
+        vma_insert(&dst->vmas, c);
+        // Shared pages stay shared; private ones go copy-on-write, after
+        // those compressed are loaded back for both sides to share.
+        int priv = !(v->flags & VMA_SHARED);
+        if ((priv && zswap_load_range(src, v, v->start, v->end) < 0) ||
+            paging_copy_range(dst, src, v->start, v->end, priv, node) < 0)
+            ret = -1;
+    }
+    tlb_batch_end();
+    vm_mm_unlock(src, rf);
+    if (ret) {
+        // vm_exit_mmap gives back what was copied; pages `src` kept marked
+        // copy-on-write are reused in place on their next write.
+        paging_space_put(dst);
+        return NULL;
+    }
+    return dst;
+}
+
+void vm_exit_mmap(vm_space_t *vs) {
+    vma_t *v;
+    while ((v = vs->vmas.root)) {
+        uint64_t va = v->start, phys, size;
+        while ((va = paging_next_mapped(vs, va, v->end, &phys, &size)) < v->end) {
+            vm_frame_release(phys, v->flags & VMA_SHARED);
+            va += PAGE_SIZE;
+        }
+        if (!(v->flags & VMA_SHARED))
+            zswap_zap(vs, v->start, v->end);
+        vma_remove(&vs->vmas, v);
+        vma_free(v);
+    }
+}
@@ -0,0 +1,115 @@
+/*
+ * Anonymous memory mappings
+ * -------------------------
+ * mmap/munmap/mprotect on the calling thread's address space.  A mapping
+ * only records a VMA (vma.h); frames arrive on first touch through
+ * paging_handle_fault, which also refuses accesses outside any VMA or
+ * beyond its protection.  Private pages come zeroed from the zero pool and
+ * belong to the mapping; shared pages belong to a vm_object that every
+ * VMA split from the same mmap call refers to.
+ */
+#pragma once
+#include <stdint.h>
+#include "paging_adv.h"
+#include "vma.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Where mappings without MAP_FIXED (or with an unusable hint) are placed. */
+#define MMAP_FLOOR  0x0000100000000000ULL
+#define MMAP_CEIL   0x0000700000000000ULL
+
+#define MMAP_ERR    ((uint64_t)-1)
+
+/* Pages of a shared mapping, looked up by page index. */
+typedef struct vm_object {
+    uint32_t     refs;          /* VMAs using it */
+    volatile int lock;
+    uint64_t     npages;
+    uint64_t     frames[];      /* 0 until first touched */
+} vm_object_t;
+
+/**
+ * Map `len` bytes (rounded up to pages) of anonymous memory with PROT_*
+ * `prot`.  `flags` needs MAP_ANONYMOUS and exactly one of MAP_SHARED and
+ * MAP_PRIVATE.  With MAP_FIXED the mapping goes at `addr`, replacing what
+ * was there; otherwise `addr` is a hint, used if free, and the lowest free
+ * range in [MMAP_FLOOR, MMAP_CEIL) is taken instead.  Returns the address
+ * or MMAP_ERR.
+ */
+uint64_t vm_mmap(uint64_t addr, uint64_t len, int prot, int flags);
+
+/** Remove mappings in [addr, addr+len) and free their private frames.
+ *  Holes are fine.  Returns 0, or -1 for bad arguments or no memory. */
+int vm_munmap(uint64_t addr, uint64_t len);
+
+/** Change the protection of [addr, addr+len), which must be fully mapped.
+ *  Returns 0 or -1. */
+int vm_mprotect(uint64_t addr, uint64_t len, int prot);
+
+/** Apply madvise `advice` (include/mman.h) to [addr, addr+len), which
+ *  must be fully mapped.  NORMAL, RANDOM and SEQUENTIAL steer fault-around;
+ *  WILLNEED and POPULATE_READ/WRITE map every page now; DONTNEED drops
+ *  the pages, private ones reading back as zero.  Returns 0 or -1. */
+int vm_madvise(uint64_t addr, uint64_t len, int advice);
+
+/** Map the unmapped pages of [start, end) inside `v`, a VMA of the current
+ *  space, gathering frames so each page table is walked once; compressed
+ *  pages (zswap.h) are loaded back.  Call under the mmap lock.  Returns
+ *  pages mapped, or -1 if memory ran out first. */
+int64_t vm_populate(vma_t *v, uint64_t start, uint64_t end);
+
+/** Resolve a not-present fault at `virt` in `v`, mapping the pages after
+ *  it as well while faults look sequential.  Call under the mmap lock. */
+int vm_fault_around(vma_t *v, uint64_t virt);
+
+/** Page table flags for PROT_* bits in `vs`.  Only spaces whose threads
+ *  run in ring 3 get PAGE_USER: ring-0 agents would otherwise trip SMAP
+ *  and SMEP on their own mappings.  PROT_NONE maps kernel-only. */
+uint64_t vm_prot_flags(const vm_space_t *vs, uint32_t prot);
+
+/** Frame backing page `idx` of `obj`, allocated zeroed on first use;
+ *  0 when out of memory. */
+uint64_t vm_object_page(vm_object_t *obj, uint64_t idx);
+
+/** Lock serializing the VMA tree of `vs`.  Interrupts stay off while held
+ *  since the page fault handler takes it too. */
+uint64_t vm_mm_lock(vm_space_t *vs);
+void vm_mm_unlock(vm_space_t *vs, uint64_t rf);
+
+/** vm_mm_lock unless another holder has it: returns 1 with the lock and
+ *  interrupts off, or 0 with nothing changed. */
+int vm_mm_trylock(vm_space_t *vs, uint64_t *rf);
+
+/** A page table entry of a VMA now maps `phys` (shared: `phys` belongs to
+ *  its object).  A private frame gains the mapping's reference and must
+ *  be fresh: it counts as anonymous memory from here on. */
+void vm_frame_claim(uint64_t phys, int shared);
+
+/** A mapping of `phys` went away.  Private frames carry one reference per
+ *  mapping (more once shared copy-on-write) and are freed with the last;
+ *  shared ones are held by their object. */
+void vm_frame_release(uint64_t phys, int shared);
+
+/** Drop a reference on a private frame other than a mapping's (ksm.c
+ *  holds one on each merged frame), freeing it with the last. */
+void vm_frame_put(uint64_t phys);
+
+/** Private frames mapped in user spaces, which zswap may compress. */
+uint64_t vm_anon_pages(void);
+
+/** New space with the VMAs of `src` and its pages mapped at the same
+ *  addresses: shared mappings share them, private ones share them
+ *  copy-on-write, so nothing is copied until one side writes.  NULL when
+ *  out of memory. */
+vm_space_t *vm_fork(vm_space_t *src);
+
+/** Release the frames and VMAs of a space nothing runs in any more;
+ *  paging_space_put calls it before freeing the page tables. */
+void vm_exit_mmap(vm_space_t *vs);
+
+#ifdef __cplusplus
+}
+#endif
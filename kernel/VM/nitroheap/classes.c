@@ -1,4 +1,5 @@
 #include "classes.h"
+#include <stdint.h>
 
 const nh_size_class_t nh_size_classes[] = {
     {8,8}, {16,16}, {24,16}, {32,16}, {40,16}, {48,16}, {56,16}, {64,64},
@@ -15,7 +16,14 @@ const nh_size_class_t nh_size_classes[] = {
 
 const size_t nh_size_class_count = sizeof(nh_size_classes)/sizeof(nh_size_classes[0]);
 
-int nh_class_from_size(size_t sz, size_t align) {
+// Direct lookup for small requests with no alignment beyond 8, which is
+// nearly every kmalloc.  Built by nh_classes_init(); until then, and for
+// everything else, the binary search below answers.
+#define NH_LUT_MAX 4096
+static int8_t nh_small_lut[NH_LUT_MAX / 8 + 1];
+static int nh_lut_ready;
+
+static int nh_class_search(size_t sz, size_t align) {
     if (align == 0) align = 1;
 
     // Binary search for the first size class whose size >= sz
@@ -37,6 +45,18 @@ int nh_class_from_size(size_t sz, size_t align) {
     return -1;
 }
 
+void nh_classes_init(void) {
+    for (size_t i = 0; i <= NH_LUT_MAX / 8; ++i)
+        nh_small_lut[i] = (int8_t)nh_class_search(i * 8, 8);
+    nh_lut_ready = 1;
+}
+
+int nh_class_from_size(size_t sz, size_t align) {
+    if (nh_lut_ready && sz <= NH_LUT_MAX && align <= 8)
+        return nh_small_lut[(sz + 7) >> 3];
+    return nh_class_search(sz, align);
+}
+
 size_t nh_class_align(int cls) {
     if (cls < 0 || (size_t)cls >= nh_size_class_count)
         return 0;
@@ -9,5 +9,7 @@ typedef struct {
 extern const nh_size_class_t nh_size_classes[];
 extern const size_t nh_size_class_count;
 
+/** Build the small-size lookup table; called once from nitroheap_init(). */
+void nh_classes_init(void);
 int nh_class_from_size(size_t sz, size_t align);
 size_t nh_class_align(int cls);
@@ -2,353 +2,1679 @@
 #include "classes.h"
 #include "nitroheap_sys.h"
 #include "../pmm_buddy.h"
+#include "../shrinker.h"
+#include "../page.h"
+#include "../numa.h"
 #include "../../arch/CPU/smp.h"
 #include "nitroheap_stats.h"
 #include <string.h>
 #include <printf.h>
 #include <stdatomic.h>
 
-// Simple production-ready NitroHeap implementation.
-// Provides size-class-based caching directly atop the buddy allocator.
+#ifdef KERNEL_BUILD
+#include "../../Task/thread.h"
+#else
+#include <stdlib.h>
+#endif
 
-typedef struct nh_span {
-    struct nh_span* next;
-    int class_idx;
-    size_t total_blocks;
-    size_t free_blocks;
-    uint32_t order;      // buddy order used to allocate this span
-} nh_span_t;
+// NitroHeap: partitioned slab allocator atop the buddy allocator.
+//
+// Each partition keeps, per size class, slabs carved from buddy blocks with
+// an in-slab freelist, and a magazine depot.  Slab objects carry no
+// header: the slab owning an address is found from its page.  Each CPU
+// holds a loaded and a previous magazine per class.  Allocation pops the loaded magazine; frees
+// wait in a per-CPU epoch quarantine and are pushed onto it by an amortized
+// harvest.  CPUs trade whole full and empty magazines with the depot, and
+// fall through to the slabs only when the depot has nothing to give.
+// Slabs and depot magazines are returned to buddy off the free path, by a
+// background reclaimer.
+//
+// Allocation flags pick where a block comes from: NH_NUMA_LOCAL a
+// partition whose slabs sit on the CPU's node, NH_LOW_LATENCY a reserve
+// that is filled ahead of time, NH_EPHEMERAL a per-CPU bump arena, and
+// handles (NH_MOVABLE) a partition that compaction may rearrange.
 
+// Header in front of blocks that do not come from a slab: large blocks
+// and ephemeral arena blocks.  32 bytes, so the block after it stays
+// 16-byte aligned.
 typedef struct nh_block_header {
-    nh_span_t* span;   // NULL for big allocations
-    size_t     size;   // class size or big allocation size
-    uint32_t   order;  // buddy order for big allocations
+    size_t     size;       // requested size
+    uint32_t   order;      // buddy order, or NH_ARENA_BLOCK
     uint32_t   home_cpu;
-    uint64_t   reuse_epoch; // epoch when block may be reused
+    uint64_t   arena_off;  // arena blocks: offset from the arena base
+    uint64_t   _reserved;
 } nh_block_header_t;
 
+// A free block.  While quarantined it also holds the epoch from which it
+// may be reused, so no slot is smaller than this.
 typedef struct nh_free_node {
     struct nh_free_node* next;
+    uint64_t             reuse_epoch;
 } nh_free_node_t;
 
-#define NH_CLASS_LIMIT 64
-#define NH_MAG_SIZE    16
-#define NH_MAX_CPUS    32
 #define NH_REUSE_DELAY 1
+#define NH_HARVEST_BATCH 64  // default local frees between amortized harvests
+#define NH_SLAB_TARGET_SLOTS 16
+#define NH_SLAB_MAX_BYTES (64 * 1024)
+#define NH_EMPTY_KEEP  1     // empty slabs a pool keeps for refills
+#define NH_MAG_MIN_ROUNDS   4
+#define NH_MAG_INIT_ROUNDS  32
+#define NH_MAG_INIT_BYTES   (8 * 1024)    // object bytes a new magazine holds
+#define NH_MAG_MAX_BYTES    (256 * 1024)  // ceiling for contention growth
+#define NH_DEPOT_WINDOW     256  // depot acquisitions per contention check
+#define NH_DEPOT_CONTENDED  16   // contended ones per window that grow magazines
+#define NH_DEPOT_WAKE       32   // full magazines that wake the reclaimer
+#define NH_RECLAIM_HIGH     1024 // default empty-slab pages that wake the reclaimer
+#define NH_RECLAIM_LOW      256  // ... and that it works down to
+#define NH_RECLAIM_BATCH    16   // slabs released per pool lock hold
+#define NH_LOWLAT_RESERVE   32   // free slots a low-latency class keeps ready
+#define NH_ARENA_ORDER      4    // 64 KiB per-CPU ephemeral arena
+#define NH_ARENA_BYTES      ((size_t)PAGE_SIZE << NH_ARENA_ORDER)
+#define NH_ARENA_MAX        (NH_ARENA_BYTES / 8)  // larger requests use slabs
+#define NH_ARENA_BLOCK      UINT32_MAX           // header order of arena blocks
+#define NH_ANY_NODE         (-1)
 
+// How nh_pool_take may grow a pool that has no free slots.
+enum { NH_GROW = 0, NH_GROW_NORECLAIM, NH_GROW_NEVER };
+
+// Which pool list holds a slab; full slabs are on none.
+enum { NH_SLAB_FULL = 0, NH_SLAB_PARTIAL, NH_SLAB_EMPTY, NH_SLAB_DRAINING };
+
+// Ephemeral bump arena, at the base of its buddy block.  Its blocks keep
+// their offset from the base in their header.  `live` counts the blocks carved from
+// it, plus one while it is a CPU's current arena; the arena goes back to
+// buddy in one piece when the count drops to zero.
+typedef struct nh_arena {
+    _Atomic(uint32_t) live;
+    uint32_t          cpu;
+    size_t            bump;    // offset of the next free byte
+} nh_arena_t;
+
+static inline nh_block_header_t* nh_hdr(void* p) {
+    return ((nh_block_header_t*)p) - 1;
+}
+
+static nh_sizeclass nh_class_info[NH_MAX_SIZE_CLASSES];
+static size_t nh_class_count;
+
+// Slab pool that magazines themselves are carved from.
+static nh_sizeclass nh_mag_class;
+static nh_class_pool nh_mag_pool;
+
+static nh_partition nh_default_part;
+static nh_partition* nh_parts[NH_MAX_PARTITIONS];
+static uint32_t nh_part_count;
+static volatile int nh_parts_lock;
+static uint32_t nh_part_order;       // buddy order of a partition object
+static uint32_t nh_cpu_heap_order;   // buddy order of a per-CPU heap
+
+// Basic statistics per partition, kept per CPU so the fast path never
+// touches a shared cache line.  bytes_inuse is signed because a block may
+// be freed on a different CPU than the one that allocated it.
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    int64_t  bytes_inuse;
+    uint64_t mag_hits;
+    uint64_t mag_misses;
+} nh_cpu_stats_t;
+
+// Per-CPU counters for one size class across all partitions.  The signed
+// ones may be decremented on a CPU other than the one that raised them.
 typedef struct {
-    nh_free_node_t* head;
-    size_t          count;
-} nh_magazine_t;
+    uint64_t hits;           // allocations served by the loaded magazine
+    uint64_t refills;        // magazines loaded from the depot or the slabs
+    uint64_t drains;         // full magazines handed back to the depot
+    int64_t  quarantined;
+    int64_t  bytes_inuse;
+} nh_class_stats_t;
 
+// Per-CPU state shared by all partitions.
 typedef struct {
-    _Atomic(nh_free_node_t*) remote[NH_MAX_CPUS]; // cross-CPU frees
-    nh_free_node_t*          freelist;           // central freelist
-    nh_span_t*               spans;
-    nh_magazine_t            magazines[NH_MAX_CPUS]; // per-CPU magazines
-} nh_class_state_t;
-static nh_class_state_t nh_classes[NH_CLASS_LIMIT];
+    nh_free_node_t*          quarantine;   // local frees awaiting reuse epoch
+    _Atomic(nh_free_node_t*) remote;       // frees from other CPUs
+    uint64_t                 epoch;
+    uint32_t                 qpending;     // frees queued since the last harvest
+    uint32_t                 flush_gen;    // last nh_flush_gen honoured
+    nh_arena_t*              arena;        // current NH_EPHEMERAL arena
+    uint64_t                 harvests;
+    int64_t                  prof_left;    // bytes until the next sample
+    uint64_t                 prof_rng;
+    nh_cpu_stats_t           stats[NH_MAX_PARTITIONS];
+    nh_class_stats_t         cls[NH_MAX_SIZE_CLASSES];
+} __attribute__((aligned(NH_CACHELINE))) nh_cpu_t;
+static nh_cpu_t nh_cpus[NH_MAX_CPUS];
+
+// Bumped to ask every CPU to flush its magazines at its next harvest.
+static _Atomic(uint32_t) nh_flush_gen;
 
+// Cached large blocks, per NUMA node and order.
 #define NH_LARGE_ORDERS 32
-static nh_free_node_t* nh_large_freelists[NH_LARGE_ORDERS];
+static nh_free_node_t* nh_large_freelists[MAX_NUMA_NODES][NH_LARGE_ORDERS];
+static volatile int nh_large_lock;
+
+// Partitions behind allocation flags, created on first use: one per NUMA
+// node for NH_NUMA_LOCAL, the low-latency reserves and the movable heap.
+static nh_partition* nh_node_parts[MAX_NUMA_NODES];
+static nh_partition* nh_lowlat_part;
+static nh_partition* nh_movable_part;
+// Unbalanced hunpin calls: the handle held no pin, or was freed since.
+static _Atomic(uint64_t) nh_stale_unpins;
+
+// Handle table for NH_MOVABLE allocations.  A handle is (generation << 32)
+// | slot, slot 0 never used.  Slots sit in page-sized leaves hung off a
+// fixed directory, allocated as the table grows and never freed, and are
+// recycled through a free list.  Freeing a handle bumps its slot's
+// generation, so a stale handle misses instead of aliasing the slot's next
+// owner.  Writers (halloc, hfree, compaction) hold the lock; lookups do
+// not, and check the generation on both sides of the pointer load.
+//
+// hptr pins the object until hunpin: compaction leaves pinned handles
+// where they are, so a pointer it handed out never outlives its block.
+// Compaction claims a slot by swapping a pin count of 0 for NH_PIN_MOVING,
+// and a pin arriving meanwhile waits for the one object's copy.
+typedef struct nh_handle_slot {
+    _Atomic(void*)    ptr;
+    _Atomic(uint32_t) gen;
+    uint32_t          next_free;        // free list link, 0 ends it
+    _Atomic(uint32_t) pins;             // hptr calls not yet matched by hunpin
+} nh_handle_slot;
+
+#define NH_PIN_MOVING  (1u << 31)
 
-typedef struct { nh_free_node_t* head; } nh_quarantine_t;
-static nh_quarantine_t nh_quarantine[NH_MAX_CPUS];
-static _Atomic(nh_free_node_t*) nh_large_remote[NH_MAX_CPUS];
-static uint64_t nh_epoch[NH_MAX_CPUS];
+#define NH_HANDLE_LEAF (PAGE_SIZE / sizeof(nh_handle_slot))
+#define NH_HANDLE_DIR  4096
+#define NH_HANDLE_MAX  (NH_HANDLE_DIR * NH_HANDLE_LEAF)
+static _Atomic(nh_handle_slot*) nh_handle_dir[NH_HANDLE_DIR];
+static uint32_t nh_handle_top;          // slots ever handed out, plus slot 0
+static uint32_t nh_handle_free;
+static volatile int nh_handle_lock;
 
-// simple handle table for NH_MOVABLE allocations
-#define NH_HANDLE_LIMIT 1024
-static _Atomic(uint64_t) nh_handle_next = 1;
-static void* nh_handle_table[NH_HANDLE_LIMIT];
+// Pages currently obtained from the buddy allocator; shrinkers report
+// progress as the drop in this counter.
+static _Atomic(uint64_t) nh_pages_held;
 
-// basic statistics for the default heap partition
-static _Atomic(uint64_t) nh_stat_allocs;
-static _Atomic(uint64_t) nh_stat_frees;
-static _Atomic(uint64_t) nh_stat_bytes_inuse;
+// Pages in large blocks that are waiting out a quarantine (local or
+// remote) or sit in the large-block cache: what the quarantine shrinker
+// can give back.  Kept as a counter because the lists belong to other
+// CPUs and the large-block lock.
+static _Atomic(uint64_t) nh_parked_pages;
 
-static inline void nh_stats_alloc(size_t sz) {
-    atomic_fetch_add(&nh_stat_allocs, 1);
-    atomic_fetch_add(&nh_stat_bytes_inuse, sz);
+// Pages in empty slabs across every pool.  The gap between the reclaim_high
+// and reclaim_low tunables keeps a class that frees and refills a few slabs'
+// worth from bouncing pages off buddy.
+static _Atomic(uint64_t) nh_empty_pages;
+static volatile int nh_reclaim_wanted;
+
+#ifdef KERNEL_BUILD
+static thread_wait_t nh_reclaimd_wait;
+#endif
+
+// Ask the reclaim thread for a pass.  Safe from any path: the wake never
+// reschedules.
+static inline void nh_reclaim_wake(void) {
+    if (nh_reclaim_wanted)
+        return;
+    nh_reclaim_wanted = 1;
+#ifdef KERNEL_BUILD
+    thread_wake(&nh_reclaimd_wait);
+#endif
 }
 
-static inline void nh_stats_free(size_t sz) {
-    atomic_fetch_add(&nh_stat_frees, 1);
-    atomic_fetch_sub(&nh_stat_bytes_inuse, sz);
+// Runtime tunables (NH_HEAPCTL_SET_TUNABLES), reset by nitroheap_init.
+static nh_heap_tunables nh_tune;
+
+// ---- Span lookup ----
+
+#ifdef KERNEL_BUILD
+// Every frame buddy hands out has a descriptor.
+static inline nh_slab* nh_span_map_get(const void* p) {
+    (void)p;
+    return NULL;
+}
+static inline void nh_span_map_set(const void* page, nh_slab* slab) {
+    (void)page;
+    (void)slab;
 }
+#else
+// Host tests back buddy with malloc, outside the page frame database, so
+// their frames are mapped to slabs here instead: a radix tree over virtual
+// page numbers, 12 bits a level.  Nodes are installed with a CAS and never
+// freed; entries are only written by the owner of the page.
+#define NH_SPAN_BITS 12
+#define NH_SPAN_FAN  (1u << NH_SPAN_BITS)
+typedef struct nh_span_node {
+    _Atomic(void*) e[NH_SPAN_FAN];
+} nh_span_node;
+static nh_span_node nh_span_root;
 
-static void nh_quarantine_push(uint32_t cpu, nh_free_node_t* node) {
-    node->next = nh_quarantine[cpu].head;
-    nh_quarantine[cpu].head = node;
+static nh_span_node* nh_span_child(nh_span_node* n, uint64_t i, int create) {
+    i &= NH_SPAN_FAN - 1;
+    void* c = atomic_load_explicit(&n->e[i], memory_order_acquire);
+    if (c || !create)
+        return c;
+    void* fresh = calloc(1, sizeof(nh_span_node));
+    if (fresh && !atomic_compare_exchange_strong(&n->e[i], &c, fresh)) {
+        free(fresh);
+        return c;
+    }
+    return fresh;
 }
 
-static void nh_quarantine_enqueue(uint32_t cpu, nh_free_node_t* node) {
-    nh_block_header_t* bh = ((nh_block_header_t*)node) - 1;
-    bh->reuse_epoch = nh_epoch[cpu] + NH_REUSE_DELAY;
-    nh_quarantine_push(cpu, node);
+static inline nh_slab* nh_span_map_get(const void* p) {
+    uint64_t vpn = (uint64_t)(uintptr_t)p >> PAGE_SHIFT;
+    nh_span_node* mid = nh_span_child(&nh_span_root, vpn >> (2 * NH_SPAN_BITS), 0);
+    nh_span_node* leaf = mid ? nh_span_child(mid, vpn >> NH_SPAN_BITS, 0) : NULL;
+    return leaf ? atomic_load_explicit(&leaf->e[vpn & (NH_SPAN_FAN - 1)],
+                                       memory_order_relaxed) : NULL;
 }
 
-static void nh_quarantine_harvest_large(uint32_t cpu) {
-    nh_free_node_t* r = atomic_exchange(&nh_large_remote[cpu], NULL);
-    while (r) {
-        nh_free_node_t* next = r->next;
-        r->next = nh_quarantine[cpu].head;
-        nh_quarantine[cpu].head = r;
-        r = next;
+static void nh_span_map_set(const void* page, nh_slab* slab) {
+    uint64_t vpn = (uint64_t)(uintptr_t)page >> PAGE_SHIFT;
+    nh_span_node* mid = nh_span_child(&nh_span_root, vpn >> (2 * NH_SPAN_BITS), slab != NULL);
+    nh_span_node* leaf = mid ? nh_span_child(mid, vpn >> NH_SPAN_BITS, slab != NULL) : NULL;
+    if (leaf)
+        atomic_store_explicit(&leaf->e[vpn & (NH_SPAN_FAN - 1)], slab, memory_order_relaxed);
+}
+#endif
+
+// Record heap ownership in the page frame database, and for slab pages the
+// slab, which is how a headerless object finds its slab on free.
+static void nh_page_tag(void* p, uint32_t order, nh_slab* slab) {
+    for (uint64_t i = 0; i < ((uint64_t)1 << order); ++i) {
+        char* page = (char*)p + i * PAGE_SIZE;
+        page_t* pg = phys_to_page((uint64_t)(uintptr_t)page);
+        if (!pg) {
+            nh_span_map_set(page, slab);
+            continue;
+        }
+        pg->owner = PAGE_OWNER_HEAP;
+        pg->private = slab;
+        if (slab)
+            page_set_flag(pg, PG_SLAB);
+        else
+            page_clear_flag(pg, PG_SLAB);
+    }
+}
+
+// The slab holding `p`, or NULL if `p` is a headed block.
+static inline nh_slab* nh_span_lookup(const void* p) {
+    page_t* pg = phys_to_page((uint64_t)(uintptr_t)p);
+    if (__builtin_expect(!pg, 0))
+        return nh_span_map_get(p);
+    return page_test_flag(pg, PG_SLAB) ? pg->private : NULL;
+}
+
+// With NH_ANY_NODE the pages come from the calling CPU's node if it has
+// any, else from any node; otherwise only from `node`.  `noreclaim` is for
+// paths that may already be inside a NitroHeap shrinker.
+static void* nh_page_alloc(uint32_t order, int node, int noreclaim) {
+    int strict = node != NH_ANY_NODE;
+    if (!strict)
+        node = current_cpu_node();
+    void* p = noreclaim ? buddy_try_alloc(order, node, strict)
+                        : buddy_alloc(order, node, strict);
+    if (p) {
+        atomic_fetch_add(&nh_pages_held, (uint64_t)1 << order);
+        nh_page_tag(p, order, NULL);
+    }
+    return p;
+}
+
+static void nh_page_free(void* p, uint32_t order) {
+    nh_page_tag(p, order, NULL);
+    atomic_fetch_sub(&nh_pages_held, (uint64_t)1 << order);
+    buddy_free(p, order, numa_addr_node((uint64_t)(uintptr_t)p));
+}
+
+static uint32_t nh_order_for(size_t bytes) {
+    uint32_t order = 0;
+    while (((size_t)PAGE_SIZE << order) < bytes)
+        order++;
+    return order;
+}
+
+#ifdef KERNEL_BUILD
+static inline uint64_t nh_irq_save(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    return rf;
+}
+static inline void nh_irq_restore(uint64_t rf) {
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+#else
+static inline uint64_t nh_irq_save(void) { return 0; }
+static inline void nh_irq_restore(uint64_t rf) { (void)rf; }
+#endif
+
+static inline void nh_spin_lock(volatile int* l) {
+    while (__sync_lock_test_and_set(l, 1))
+        while (*l)
+            __asm__ volatile("pause");
+}
+static inline void nh_spin_unlock(volatile int* l) {
+    __sync_lock_release(l);
+}
+
+static inline uint32_t nh_cpu(void) {
+    uint32_t cpu = smp_cpu_index();
+    return cpu < NH_MAX_CPUS ? cpu : 0;
+}
+
+// Callers run with interrupts disabled, so plain per-CPU updates suffice.
+// Headed blocks count against the default partition.
+static inline void nh_stats_slab_alloc(uint32_t cpu, uint16_t part, uint32_t cls) {
+    uint32_t sz = nh_class_info[cls].size;
+    nh_cpus[cpu].stats[part].allocs++;
+    nh_cpus[cpu].stats[part].bytes_inuse += sz;
+    nh_cpus[cpu].cls[cls].bytes_inuse += sz;
+}
+
+static inline void nh_stats_slab_free(uint32_t cpu, uint16_t part, uint32_t cls) {
+    uint32_t sz = nh_class_info[cls].size;
+    nh_cpus[cpu].stats[part].frees++;
+    nh_cpus[cpu].stats[part].bytes_inuse -= sz;
+    nh_cpus[cpu].cls[cls].bytes_inuse -= sz;
+}
+
+static inline void nh_stats_alloc(uint32_t cpu, size_t sz) {
+    nh_cpus[cpu].stats[0].allocs++;
+    nh_cpus[cpu].stats[0].bytes_inuse += (int64_t)sz;
+}
+
+static inline void nh_stats_free(uint32_t cpu, size_t sz) {
+    nh_cpus[cpu].stats[0].frees++;
+    nh_cpus[cpu].stats[0].bytes_inuse -= (int64_t)sz;
+}
+
+// Node a partition's memory must come from.
+static inline int nh_part_node(nh_partition* part) {
+    return (part->traits.flags_mask & NH_NUMA_LOCAL) ? part->numa_node : NH_ANY_NODE;
+}
+
+// ---- Size classes ----
+
+static void nh_sizeclass_init(nh_sizeclass* c, size_t size, size_t align, uint16_t id) {
+    // Slots are a multiple of the class alignment, and the first slot is
+    // aligned, so every slot in the slab is.  A slot must hold a
+    // quarantined free node.
+    size_t min = size < sizeof(nh_free_node_t) ? sizeof(nh_free_node_t) : size;
+    size_t slot = (min + align - 1) & ~(align - 1);
+    size_t first = (sizeof(nh_slab) + align - 1) & ~(align - 1);
+    size_t bytes = PAGE_SIZE;
+    uint32_t order = 0;
+    // Enough slots to refill a magazine, within NH_SLAB_MAX_BYTES.
+    while (bytes < first + min ||
+           (bytes < first + (NH_SLAB_TARGET_SLOTS - 1) * slot + min &&
+            bytes < NH_SLAB_MAX_BYTES)) {
+        bytes <<= 1;
+        order++;
+    }
+    c->size = (uint32_t)size;
+    c->slot_size = (uint32_t)slot;
+    c->first_offset = (uint32_t)first;
+    c->slots_per_slab = (uint16_t)((bytes - first - min) / slot + 1);
+    c->class_id = id;
+    c->slab_order = (uint16_t)order;
+    c->flags = size <= 512 ? NH_SC_TINY : size <= 8192 ? NH_SC_SMALL : NH_SC_MEDIUM;
+}
+
+static void nh_sizeclass_setup(void) {
+    nh_class_count = nh_size_class_count < NH_MAX_SIZE_CLASSES
+                   ? nh_size_class_count : NH_MAX_SIZE_CLASSES;
+    for (size_t i = 0; i < nh_class_count; ++i)
+        nh_sizeclass_init(&nh_class_info[i], nh_size_classes[i].size,
+                          nh_size_classes[i].align, (uint16_t)i);
+    nh_sizeclass_init(&nh_mag_class, sizeof(nh_magazine), NH_CACHELINE, NH_MAX_SIZE_CLASSES);
+}
+
+// ---- Slabs ----
+
+static void nh_slab_link(nh_slab** list, nh_slab* s) {
+    s->prev = NULL;
+    s->next = *list;
+    if (*list)
+        (*list)->prev = s;
+    *list = s;
+}
+
+static void nh_slab_unlink(nh_slab** list, nh_slab* s) {
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        *list = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+}
+
+static nh_slab* nh_slab_create(nh_partition* part, const nh_sizeclass* c, int noreclaim) {
+    nh_slab* s = nh_page_alloc(c->slab_order, nh_part_node(part), noreclaim);
+    if (!s)
+        return NULL;
+    nh_page_tag(s, c->slab_order, s);
+    s->part = part;
+    s->cls = c;
+    s->list = NH_SLAB_FULL;
+    s->next = s->prev = NULL;
+    s->user_base = (char*)s + c->first_offset;
+    s->freelist = NULL;
+    // Chain slots in address order so fresh slabs are handed out linearly.
+    for (uint32_t i = c->slots_per_slab; i-- > 0; ) {
+        nh_free_node_t* node = (nh_free_node_t*)((char*)s->user_base + (size_t)i * c->slot_size);
+        node->next = s->freelist;
+        s->freelist = node;
+    }
+    s->free_count = c->slots_per_slab;
+    atomic_fetch_add(&part->bytes_committed, (uint64_t)PAGE_SIZE << c->slab_order);
+    return s;
+}
+
+// Return one slot to its slab.  Caller holds the pool lock.
+static void nh_slab_put_locked(nh_class_pool* pool, nh_free_node_t* node) {
+    nh_slab* s = nh_span_lookup(node);
+    node->next = s->freelist;
+    s->freelist = node;
+    s->free_count++;
+    pool->nr_free++;
+    if (s->list == NH_SLAB_FULL) {
+        nh_slab_link(&pool->partial_list, s);
+        s->list = NH_SLAB_PARTIAL;
+    }
+    if (s->free_count == s->cls->slots_per_slab) {
+        if (s->list == NH_SLAB_DRAINING) {
+            nh_slab_unlink(&pool->draining_list, s);
+            pool->nr_draining--;
+        } else {
+            nh_slab_unlink(&pool->partial_list, s);
+        }
+        nh_slab_link(&pool->empty_list, s);
+        s->list = NH_SLAB_EMPTY;
+        pool->nr_empty++;
+        uint64_t pages = (uint64_t)1 << s->cls->slab_order;
+        if (atomic_fetch_add(&nh_empty_pages, pages) + pages > nh_tune.reclaim_high)
+            nh_reclaim_wake();
+    }
+}
+
+// Give up to `max` empty slabs beyond `keep` back to buddy, never cutting
+// into the pool's reserve; returns pages released.
+static uint64_t nh_pool_release_empty(nh_partition* part, nh_class_pool* pool, uint32_t keep,
+                                      uint32_t max) {
+    nh_slab* victims = NULL;
+    nh_spin_lock(&pool->lock);
+    for (; pool->nr_empty > keep && max; --max) {
+        nh_slab* s = pool->empty_list;
+        if (pool->nr_free - s->cls->slots_per_slab < pool->reserve)
+            break;
+        nh_slab_unlink(&pool->empty_list, s);
+        pool->nr_empty--;
+        pool->nr_slabs--;
+        pool->nr_free -= s->cls->slots_per_slab;
+        s->next = victims;
+        victims = s;
+    }
+    nh_spin_unlock(&pool->lock);
+
+    uint64_t pages = 0;
+    while (victims) {
+        nh_slab* next = victims->next;
+        uint32_t order = victims->cls->slab_order;
+        atomic_fetch_sub(&part->bytes_committed, (uint64_t)PAGE_SIZE << order);
+        atomic_fetch_sub(&nh_empty_pages, (uint64_t)1 << order);
+        nh_page_free(victims, order);
+        pages += (uint64_t)1 << order;
+        victims = next;
+    }
+    return pages;
+}
+
+// Return a chain of slots to their slabs in `pool`.  Slabs left empty wait
+// for the reclaimer.
+static void nh_pool_put_chain(nh_class_pool* pool, nh_free_node_t* chain) {
+    nh_spin_lock(&pool->lock);
+    while (chain) {
+        nh_free_node_t* next = chain->next;
+        nh_slab_put_locked(pool, chain);
+        chain = next;
+    }
+    nh_spin_unlock(&pool->lock);
+}
+
+// Take up to `want` slots of class `c` from `pool` into `out`, creating a
+// slab if none has free slots and `grow` allows.  Returns the number taken.
+static uint32_t nh_pool_take(nh_partition* part, nh_class_pool* pool, const nh_sizeclass* c,
+                             void** out, uint32_t want, int grow) {
+    uint32_t got = 0;
+    nh_spin_lock(&pool->lock);
+    while (got < want) {
+        nh_slab* s = pool->partial_list;
+        if (!s && (s = pool->empty_list)) {
+            nh_slab_unlink(&pool->empty_list, s);
+            pool->nr_empty--;
+            atomic_fetch_sub(&nh_empty_pages, (uint64_t)1 << c->slab_order);
+            nh_slab_link(&pool->partial_list, s);
+            s->list = NH_SLAB_PARTIAL;
+        }
+        if (!s && (s = pool->draining_list)) {
+            // Better to refill a draining slab than to grow the pool.
+            nh_slab_unlink(&pool->draining_list, s);
+            pool->nr_draining--;
+            nh_slab_link(&pool->partial_list, s);
+            s->list = NH_SLAB_PARTIAL;
+        }
+        if (!s) {
+            if (grow == NH_GROW_NEVER)
+                break;
+            // Never call into buddy with the pool locked: reclaim may come
+            // back here through the shrinkers.
+            nh_spin_unlock(&pool->lock);
+            s = nh_slab_create(part, c, grow == NH_GROW_NORECLAIM);
+            nh_spin_lock(&pool->lock);
+            if (!s)
+                break;
+            pool->nr_slabs++;
+            pool->nr_free += c->slots_per_slab;
+            nh_slab_link(&pool->partial_list, s);
+            s->list = NH_SLAB_PARTIAL;
+        }
+        while (got < want && s->freelist) {
+            nh_free_node_t* node = s->freelist;
+            s->freelist = node->next;
+            s->free_count--;
+            pool->nr_free--;
+            out[got++] = node;
+        }
+        if (!s->freelist) {
+            nh_slab_unlink(&pool->partial_list, s);
+            s->list = NH_SLAB_FULL;
+        }
+    }
+    nh_spin_unlock(&pool->lock);
+    return got;
+}
+
+// ---- Magazines ----
+
+// Magazines are slab objects too, from a pool of their own.  With
+// `noreclaim` the pool may only grow if buddy has memory to spare.
+static nh_magazine* nh_mag_alloc(uint32_t size, int noreclaim) {
+    void* p;
+    if (!nh_pool_take(&nh_default_part, &nh_mag_pool, &nh_mag_class, &p, 1,
+                      noreclaim ? NH_GROW_NORECLAIM : NH_GROW))
+        return NULL;
+    nh_magazine* m = p;
+    m->next = NULL;
+    m->rounds = 0;
+    m->size = size;
+    return m;
+}
+
+static void nh_mag_free(nh_magazine* m) {
+    nh_free_node_t* node = (nh_free_node_t*)m;
+    node->next = NULL;
+    nh_pool_put_chain(&nh_mag_pool, node);
+}
+
+// Return every object a magazine holds to its slab, leaving it empty.
+static void nh_mag_drain(nh_partition* part, uint32_t cls, nh_magazine* m) {
+    nh_free_node_t* chain = NULL;
+    while (m->rounds) {
+        nh_free_node_t* node = m->objs[--m->rounds];
+        node->next = chain;
+        chain = node;
+    }
+    if (chain)
+        nh_pool_put_chain(&part->pools[cls], chain);
+}
+
+static uint32_t nh_mag_rounds(size_t bytes, uint32_t size, uint32_t cap) {
+    size_t n = bytes / size;
+    if (n < NH_MAG_MIN_ROUNDS)
+        n = NH_MAG_MIN_ROUNDS;
+    return n > cap ? cap : (uint32_t)n;
+}
+
+// ---- Depot ----
+
+static void nh_depot_init(nh_depot* d, const nh_sizeclass* c) {
+    d->mag_size = nh_mag_rounds(nh_tune.mag_bytes, c->size, nh_tune.mag_rounds);
+    d->mag_max = nh_mag_rounds(NH_MAG_MAX_BYTES, c->size, NH_MAG_ROUNDS_MAX);
+    if (d->mag_max < d->mag_size)
+        d->mag_max = d->mag_size;
+}
+
+// Take the depot lock, counting how often it was found held.  A lock that
+// is often contended means magazines are too small to amortize it, so
+// magazines loaded from then on get half as many rounds again.
+static void nh_depot_lock(nh_depot* d) {
+    uint32_t contended = 0;
+    if (__sync_lock_test_and_set(&d->lock, 1)) {
+        contended = 1;
+        nh_spin_lock(&d->lock);
+    }
+    d->contended += contended;
+    if (++d->ops >= NH_DEPOT_WINDOW) {
+        if (d->contended >= NH_DEPOT_CONTENDED && d->mag_size < d->mag_max) {
+            d->mag_size += d->mag_size / 2;
+            if (d->mag_size > d->mag_max)
+                d->mag_size = d->mag_max;
+        }
+        d->ops = d->contended = 0;
+    }
+}
+
+static inline void nh_depot_unlock(nh_depot* d) {
+    nh_spin_unlock(&d->lock);
+}
+
+static inline nh_magazine* nh_depot_get_full(nh_depot* d) {
+    nh_magazine* m = d->full;
+    if (m) {
+        d->full = m->next;
+        if (--d->nr_full < d->min_full)
+            d->min_full = d->nr_full;
+    }
+    return m;
+}
+
+static inline nh_magazine* nh_depot_get_empty(nh_depot* d) {
+    nh_magazine* m = d->empty;
+    if (m) {
+        d->empty = m->next;
+        if (--d->nr_empty < d->min_empty)
+            d->min_empty = d->nr_empty;
+    }
+    return m;
+}
+
+static inline void nh_depot_put_full(nh_depot* d, nh_magazine* m) {
+    m->next = d->full;
+    d->full = m;
+    if (++d->nr_full > NH_DEPOT_WAKE)
+        nh_reclaim_wake();
+}
+
+static inline void nh_depot_put_empty(nh_depot* d, nh_magazine* m) {
+    m->next = d->empty;
+    d->empty = m;
+    d->nr_empty++;
+}
+
+// Empty full magazines into the slabs and give every magazine on both
+// chains back to the magazine pool.
+static void nh_depot_release(nh_partition* part, uint32_t cls, nh_magazine* full,
+                             nh_magazine* empty) {
+    while (full) {
+        nh_magazine* next = full->next;
+        nh_mag_drain(part, cls, full);
+        nh_mag_free(full);
+        full = next;
+    }
+    while (empty) {
+        nh_magazine* next = empty->next;
+        nh_mag_free(empty);
+        empty = next;
+    }
+}
+
+static void nh_depot_drain(nh_partition* part, uint32_t cls) {
+    nh_depot* d = &part->pools[cls].depot;
+    nh_spin_lock(&d->lock);
+    nh_magazine* full = d->full;
+    nh_magazine* empty = d->empty;
+    d->full = d->empty = NULL;
+    d->nr_full = d->nr_empty = 0;
+    d->min_full = d->min_empty = 0;
+    nh_spin_unlock(&d->lock);
+    nh_depot_release(part, cls, full, empty);
+}
+
+// Working-set reap (Bonwick): as many magazines as the depot held at its
+// lowest point since the last pass went unused for the whole interval, so
+// release that many, then start a new interval.
+static void nh_depot_reap(nh_partition* part, uint32_t cls) {
+    nh_depot* d = &part->pools[cls].depot;
+    nh_magazine* full = NULL;
+    nh_magazine* empty = NULL;
+    nh_spin_lock(&d->lock);
+    for (uint32_t n = d->min_full; n && d->full; --n) {
+        nh_magazine* m = d->full;
+        d->full = m->next;
+        d->nr_full--;
+        m->next = full;
+        full = m;
+    }
+    for (uint32_t n = d->min_empty; n && d->empty; --n) {
+        nh_magazine* m = d->empty;
+        d->empty = m->next;
+        d->nr_empty--;
+        m->next = empty;
+        empty = m;
+    }
+    d->min_full = d->nr_full;
+    d->min_empty = d->nr_empty;
+    nh_spin_unlock(&d->lock);
+    nh_depot_release(part, cls, full, empty);
+}
+
+// ---- Per-CPU caches ----
+
+static void nh_harvest(uint32_t cpu);
+
+// The loaded magazine is empty.  Harvest first, then swap in a full
+// previous magazine, then trade both empties for a full one from the depot,
+// and only when the depot has none carve a batch out of the slabs.
+static nh_magazine* nh_cache_reload(nh_partition* part, uint32_t cls, nh_cpu_cache* cc,
+                                    uint32_t cpu) {
+    nh_harvest(cpu);
+    nh_magazine* m = cc->loaded;
+    if (m && m->rounds)
+        return m;
+    if (cc->prev && cc->prev->rounds) {
+        cc->loaded = cc->prev;
+        cc->prev = m;
+        return cc->loaded;
+    }
+
+    nh_depot* d = &part->pools[cls].depot;
+    nh_depot_lock(d);
+    nh_magazine* full = nh_depot_get_full(d);
+    nh_cpus[cpu].cls[cls].refills++;
+    if (full) {
+        if (cc->prev)
+            nh_depot_put_empty(d, cc->prev);
+        cc->prev = m;
+        cc->loaded = full;
+        nh_depot_unlock(d);
+        return full;
+    }
+    uint32_t size = d->mag_size;
+    nh_depot_unlock(d);
+
+    if (!m) {
+        // Reclaim may run inside the allocation, but it only empties this
+        // CPU's magazines in place; it never attaches or frees them.
+        if (!(m = nh_mag_alloc(size, 0)))
+            return NULL;
+        cc->loaded = m;
+    }
+    m->size = size;
+    m->rounds = nh_pool_take(part, &part->pools[cls], &nh_class_info[cls],
+                             m->objs, (size + 1) / 2, NH_GROW);
+    return m->rounds ? m : NULL;
+}
+
+// Cache a freed object on this CPU.  A full loaded magazine is swapped with
+// an empty previous one; failing that, the full previous magazine goes to
+// the depot and an empty one comes back.  Returns 0 if no empty magazine
+// can be had without reclaim.
+static int nh_cache_push(nh_partition* part, uint32_t cls, nh_cpu_cache* cc, void* p,
+                         uint32_t cpu) {
+    nh_magazine* m = cc->loaded;
+    if (m && m->rounds < m->size) {
+        m->objs[m->rounds++] = p;
+        return 1;
+    }
+    if (m && cc->prev && !cc->prev->rounds) {
+        cc->loaded = cc->prev;
+        cc->prev = m;
+        m = cc->loaded;
+        m->objs[m->rounds++] = p;
+        return 1;
+    }
+
+    nh_depot* d = &part->pools[cls].depot;
+    nh_magazine* full = m ? cc->prev : NULL;
+    nh_depot_lock(d);
+    nh_magazine* e = nh_depot_get_empty(d);
+    if (e && full)
+        nh_depot_put_full(d, full);
+    uint32_t size = d->mag_size;
+    nh_depot_unlock(d);
+    if (full)
+        nh_cpus[cpu].cls[cls].drains++;
+    if (!e) {
+        if (!(e = nh_mag_alloc(size, 1)))
+            return 0;
+        if (full) {
+            nh_depot_lock(d);
+            nh_depot_put_full(d, full);
+            nh_depot_unlock(d);
+        }
+    }
+    if (m)
+        cc->prev = m;
+    e->size = size;
+    e->objs[e->rounds++] = p;
+    cc->loaded = e;
+    return 1;
+}
+
+static nh_cpu_heap* nh_cpu_heap_create(nh_partition* part, uint32_t cpu) {
+    nh_cpu_heap* h = nh_page_alloc(nh_cpu_heap_order, NH_ANY_NODE, 0);
+    if (!h)
+        return NULL;
+    h->cpu_id = cpu;
+    for (size_t i = 0; i < NH_MAX_SIZE_CLASSES; ++i)
+        h->caches[i].loaded = h->caches[i].prev = NULL;
+    part->cpu_heaps[cpu] = h;
+    return h;
+}
+
+// Empty this CPU's magazines in every partition back into the slabs.  The
+// magazines stay attached.
+static void nh_cpu_flush(uint32_t cpu) {
+    for (uint32_t i = 0; i < nh_part_count; ++i) {
+        nh_partition* part = nh_parts[i];
+        nh_cpu_heap* h = part->cpu_heaps[cpu];
+        if (!h)
+            continue;
+        for (size_t c = 0; c < nh_class_count; ++c) {
+            if (h->caches[c].loaded)
+                nh_mag_drain(part, (uint32_t)c, h->caches[c].loaded);
+            if (h->caches[c].prev)
+                nh_mag_drain(part, (uint32_t)c, h->caches[c].prev);
+        }
+    }
+}
+
+// ---- Quarantine and harvest ----
+
+static void nh_large_put(nh_block_header_t* bh) {
+    if (bh->order >= NH_LARGE_ORDERS) {
+        atomic_fetch_sub(&nh_parked_pages, (uint64_t)1 << bh->order);
+        nh_page_free(bh, bh->order);
+        return;
+    }
+    nh_free_node_t* node = (nh_free_node_t*)(bh + 1);
+    nh_free_node_t** list = &nh_large_freelists[numa_addr_node((uint64_t)(uintptr_t)bh)][bh->order];
+    nh_spin_lock(&nh_large_lock);
+    node->next = *list;
+    *list = node;
+    nh_spin_unlock(&nh_large_lock);
+}
+
+// Put a block that finished its quarantine back into service: into this
+// CPU's magazines if it has them, else straight back to its slab.  Never
+// runs reclaim.
+static void nh_recycle(uint32_t cpu, nh_free_node_t* node) {
+    nh_slab* s = nh_span_lookup(node);
+    if (!s) {
+        nh_large_put(nh_hdr(node));
+        return;
+    }
+    nh_partition* part = s->part;
+    uint32_t cls = s->cls->class_id;
+    nh_cpu_heap* h = part->cpu_heaps[cpu];
+    nh_cpus[cpu].cls[cls].quarantined--;
+    if (!h || !nh_cache_push(part, cls, &h->caches[cls], node, cpu)) {
+        node->next = NULL;
+        nh_pool_put_chain(&part->pools[cls], node);
     }
 }
 
 static void nh_quarantine_drain(uint32_t cpu) {
-    nh_free_node_t** cur = &nh_quarantine[cpu].head;
-    uint64_t now = nh_epoch[cpu];
+    nh_free_node_t** cur = &nh_cpus[cpu].quarantine;
+    uint64_t now = nh_cpus[cpu].epoch;
     while (*cur) {
-        nh_block_header_t* bh = ((nh_block_header_t*)(*cur)) - 1;
-        if (bh->reuse_epoch > now) {
+        if ((*cur)->reuse_epoch > now) {
             cur = &(*cur)->next;
             continue;
         }
         nh_free_node_t* node = *cur;
         *cur = node->next;
-        if (bh->span) {
-            nh_class_state_t* cs = &nh_classes[bh->span->class_idx];
-            nh_magazine_t* mag = &cs->magazines[cpu];
-            if (mag->count >= NH_MAG_SIZE) {
-                node->next = cs->freelist;
-                cs->freelist = node;
-            } else {
-                node->next = mag->head;
-                mag->head = node;
-                mag->count++;
-            }
+        nh_recycle(cpu, node);
+    }
+}
+
+static void nh_remote_collect(uint32_t cpu) {
+    nh_cpu_t* c = &nh_cpus[cpu];
+    if (!atomic_load_explicit(&c->remote, memory_order_relaxed))
+        return;
+    nh_free_node_t* r = atomic_exchange(&c->remote, NULL);
+    while (r) {
+        nh_free_node_t* next = r->next;
+        r->next = c->quarantine;
+        c->quarantine = r;
+        r = next;
+    }
+}
+
+// Amortized slow path: advance this CPU's epoch, pull in blocks other CPUs
+// freed on its behalf and move everything whose reuse epoch has passed back
+// to a magazine.  Runs every quarantine_limit local frees and whenever an
+// allocation finds its magazine empty.
+static void nh_harvest(uint32_t cpu) {
+    nh_cpu_t* c = &nh_cpus[cpu];
+    c->epoch++;
+    c->qpending = 0;
+    c->harvests++;
+    uint32_t gen = atomic_load_explicit(&nh_flush_gen, memory_order_relaxed);
+    if (c->flush_gen != gen) {
+        c->flush_gen = gen;
+        nh_cpu_flush(cpu);
+    }
+    nh_remote_collect(cpu);
+    nh_quarantine_drain(cpu);
+}
+
+// Recycle everything this CPU has quarantined, ignoring reuse epochs, and
+// send small blocks straight back to their slabs.
+static void nh_flush_quarantine(uint32_t cpu) {
+    nh_remote_collect(cpu);
+    nh_free_node_t* q = nh_cpus[cpu].quarantine;
+    nh_cpus[cpu].quarantine = NULL;
+    while (q) {
+        nh_free_node_t* next = q->next;
+        nh_slab* s = nh_span_lookup(q);
+        if (s) {
+            nh_cpus[cpu].cls[s->cls->class_id].quarantined--;
+            q->next = NULL;
+            nh_pool_put_chain(&s->part->pools[s->cls->class_id], q);
         } else {
-            if (bh->order < NH_LARGE_ORDERS) {
-                node->next = nh_large_freelists[bh->order];
-                nh_large_freelists[bh->order] = node;
-            } else {
-                buddy_free(bh, bh->order, 0);
-            }
+            nh_large_put(nh_hdr(q));
         }
+        q = next;
     }
 }
 
-static void nh_remove_span_blocks(nh_class_state_t* cs, nh_span_t* sp) {
-    nh_free_node_t** cur = &cs->freelist;
-    while (*cur) {
-        nh_block_header_t* bh = ((nh_block_header_t*)(*cur)) - 1;
-        if (bh->span == sp)
-            *cur = (*cur)->next;
+// ---- Partitions ----
+
+static void nh_partition_setup(nh_partition* part, uint16_t id, const char* name) {
+    memset(part, 0, sizeof(*part));
+    strncpy(part->name, name ? name : "", NH_PARTITION_NAME - 1);
+    part->id = id;
+    part->traits.reuse_epoch_ticks = NH_REUSE_DELAY;
+    for (size_t i = 0; i < nh_class_count; ++i)
+        nh_depot_init(&part->pools[i].depot, &nh_class_info[i]);
+}
+
+// Caller holds nh_parts_lock.  A partition with NH_NUMA_LOCAL in `traits`
+// lives on `node` along with all of its slabs.
+static nh_partition* nh_partition_new(const char* name, int node, nh_flags_t traits) {
+    if (nh_part_count >= NH_MAX_PARTITIONS)
+        return NULL;
+    nh_partition* part = nh_page_alloc(nh_part_order,
+                                       (traits & NH_NUMA_LOCAL) ? node : NH_ANY_NODE, 0);
+    if (!part)
+        return NULL;
+    nh_partition_setup(part, (uint16_t)nh_part_count, name);
+    part->numa_node = (uint16_t)(node < 0 ? 0 : node);
+    part->traits.flags_mask = traits;
+    if (traits & NH_NUMA_LOCAL)
+        part->traits.numa_policy = 1;
+    nh_parts[nh_part_count++] = part;
+    return part;
+}
+
+nh_partition* nitro_partition_create(const char* name) {
+    nh_spin_lock(&nh_parts_lock);
+    nh_partition* part = nh_partition_new(name, NH_ANY_NODE, 0);
+    nh_spin_unlock(&nh_parts_lock);
+    return part;
+}
+
+// The partition behind an allocation flag, created the first time the flag
+// is used.  Falls back to the default partition if none can be made.
+static nh_partition* nh_flag_part(nh_partition** slot, const char* name, int node,
+                                  nh_flags_t traits) {
+    nh_partition* part = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (part)
+        return part;
+    nh_spin_lock(&nh_parts_lock);
+    if (!(part = *slot) && (part = nh_partition_new(name, node, traits)))
+        __atomic_store_n(slot, part, __ATOMIC_RELEASE);
+    nh_spin_unlock(&nh_parts_lock);
+    return part ? part : &nh_default_part;
+}
+
+static nh_partition* nh_node_part(int node) {
+    char name[] = "node0";
+    name[4] = (char)('0' + node);
+    return nh_flag_part(&nh_node_parts[node], name, node, NH_NUMA_LOCAL);
+}
+
+nh_partition* nitro_partition_get(uint16_t id) {
+    return id < nh_part_count ? nh_parts[id] : NULL;
+}
+
+// ---- Sampling profiler ----
+
+// With a sampling rate of R bytes set through NH_HEAPCTL_PROF_SET, each CPU
+// counts allocated bytes down from an exponentially distributed gap of mean
+// R, so every byte is equally likely to be the sampled one and the cost per
+// allocation is a subtraction.  The allocation that crosses zero records
+// its call stack by walking frame pointers.  Live samples sit in a hash
+// table keyed by address until the block is freed; NH_HEAPCTL_PROF_DUMP
+// writes them out in the pprof legacy heap format ("heap_v2"), which
+// tools/nhprof.py symbolizes.  Records come from a fixed pool allocated on
+// first use; samples past it are dropped and counted.
+#define NH_PROF_DEPTH    16
+#define NH_PROF_SAMPLES  1024
+#define NH_PROF_BUCKETS  1024
+#define NH_PROF_IDLE     (16ll << 20)   // re-check of a disabled profiler
+#define NH_PROF_FRAME    (64u << 10)    // largest believable stack frame
+
+typedef struct nh_prof_sample {
+    struct nh_prof_sample* next;
+    uintptr_t              addr;
+    size_t                 size;
+    uint32_t               depth;
+    uint32_t               dumped;      // report pass that emitted it
+    uintptr_t              pcs[NH_PROF_DEPTH];
+} nh_prof_sample;
+
+static uint64_t nh_prof_rate;
+static nh_prof_sample* nh_prof_pool;
+static nh_prof_sample* nh_prof_free;
+static _Atomic(nh_prof_sample*) nh_prof_buckets[NH_PROF_BUCKETS];
+static _Atomic(uint32_t) nh_prof_live;
+static uint64_t nh_prof_dropped;
+static uint32_t nh_prof_pass;
+static volatile int nh_prof_lock;
+
+static inline uint32_t nh_prof_hash(uintptr_t addr) {
+    return (uint32_t)((addr >> 4) * 0x9E3779B97F4A7C15ull >> 54) & (NH_PROF_BUCKETS - 1);
+}
+
+// Bytes to the next sample: -ln(u) * rate for u uniform in (0, 1), with
+// log2 taken piecewise-linearly in 16.16 fixed point.
+static int64_t nh_prof_gap(nh_cpu_t* c) {
+    uint64_t x = c->prof_rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    c->prof_rng = x;
+    uint32_t u = (uint32_t)(x >> 32) | 1;
+    uint32_t msb = 31u - (uint32_t)__builtin_clz(u);
+    uint64_t log2u = ((uint64_t)msb << 16) + (((uint64_t)(u ^ (1u << msb)) << 16) >> msb);
+    uint64_t ln = (((uint64_t)32 << 16) - log2u) * 45426 >> 16;   // * ln 2
+    return (int64_t)((nh_prof_rate * ln) >> 16) + 1;
+}
+
+// Return addresses up the frame-pointer chain, starting with the one into
+// the allocator entry point that called nh_prof_record.  A chain that goes
+// down the stack or jumps too far ends the walk.
+static __attribute__((noinline)) uint32_t nh_prof_backtrace(uintptr_t* pcs) {
+    uintptr_t* fp = __builtin_frame_address(0);
+    fp = (uintptr_t*)fp[0];
+    uint32_t n = 0;
+    while (fp && n < NH_PROF_DEPTH) {
+        uintptr_t* next = (uintptr_t*)fp[0];
+        if (!fp[1])
+            break;
+        pcs[n++] = fp[1];
+        if (next <= fp || (uintptr_t)next - (uintptr_t)fp > NH_PROF_FRAME ||
+            ((uintptr_t)next & 7))
+            break;
+        fp = next;
+    }
+    return n;
+}
+
+static __attribute__((noinline)) void nh_prof_record(nh_cpu_t* c, void* p, size_t sz) {
+    c->prof_left = nh_prof_rate ? nh_prof_gap(c) : NH_PROF_IDLE;
+    if (!nh_prof_rate || !p)
+        return;
+    uintptr_t pcs[NH_PROF_DEPTH];
+    uint32_t depth = nh_prof_backtrace(pcs);
+    nh_spin_lock(&nh_prof_lock);
+    nh_prof_sample* r = nh_prof_free;
+    if (!r) {
+        nh_prof_dropped++;
+        nh_spin_unlock(&nh_prof_lock);
+        return;
+    }
+    nh_prof_free = r->next;
+    r->addr = (uintptr_t)p;
+    r->size = sz;
+    r->depth = depth;
+    r->dumped = nh_prof_pass;
+    memcpy(r->pcs, pcs, depth * sizeof(pcs[0]));
+    _Atomic(nh_prof_sample*)* b = &nh_prof_buckets[nh_prof_hash(r->addr)];
+    r->next = atomic_load_explicit(b, memory_order_relaxed);
+    atomic_store_explicit(b, r, memory_order_release);
+    atomic_fetch_add(&nh_prof_live, 1);
+    nh_spin_unlock(&nh_prof_lock);
+}
+
+// Count `sz` bytes against this CPU's sampling gap.  Interrupts are off.
+static inline void nh_prof_note(uint32_t cpu, void* p, size_t sz) {
+    nh_cpu_t* c = &nh_cpus[cpu];
+    if (__builtin_expect((c->prof_left -= (int64_t)sz) < 0, 0))
+        nh_prof_record(c, p, sz);
+}
+
+// Unlink the sample for `addr`, if any.  Caller holds nh_prof_lock; only
+// the bucket heads are read without it.
+static nh_prof_sample* nh_prof_unlink(uintptr_t addr) {
+    _Atomic(nh_prof_sample*)* head = &nh_prof_buckets[nh_prof_hash(addr)];
+    nh_prof_sample* prev = NULL;
+    for (nh_prof_sample* r = atomic_load_explicit(head, memory_order_relaxed); r;
+         prev = r, r = r->next) {
+        if (r->addr != addr)
+            continue;
+        if (prev)
+            prev->next = r->next;
         else
-            cur = &(*cur)->next;
+            atomic_store_explicit(head, r->next, memory_order_relaxed);
+        return r;
     }
-    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu) {
-        nh_magazine_t* mag = &cs->magazines[cpu];
-        nh_free_node_t** mcur = &mag->head;
-        while (*mcur) {
-            nh_block_header_t* bh = ((nh_block_header_t*)(*mcur)) - 1;
-            if (bh->span == sp) {
-                *mcur = (*mcur)->next;
-                if (mag->count) mag->count--;
-            } else {
-                mcur = &(*mcur)->next;
-            }
+    return NULL;
+}
+
+// Drop the sample for a freed block.  With no live samples, or none in the
+// block's bucket, this costs a load or two and takes no lock.
+static inline void nh_prof_forget(void* p) {
+    if (__builtin_expect(!atomic_load_explicit(&nh_prof_live, memory_order_relaxed), 1))
+        return;
+    uintptr_t addr = (uintptr_t)p;
+    if (!atomic_load_explicit(&nh_prof_buckets[nh_prof_hash(addr)], memory_order_acquire))
+        return;
+    nh_spin_lock(&nh_prof_lock);
+    nh_prof_sample* r = nh_prof_unlink(addr);
+    if (r) {
+        r->next = nh_prof_free;
+        nh_prof_free = r;
+        atomic_fetch_sub(&nh_prof_live, 1);
+    }
+    nh_spin_unlock(&nh_prof_lock);
+}
+
+// Compaction moved a block from `from` to `to`.
+static void nh_prof_move(void* from, void* to) {
+    if (!atomic_load_explicit(&nh_prof_live, memory_order_relaxed))
+        return;
+    nh_spin_lock(&nh_prof_lock);
+    nh_prof_sample* r = nh_prof_unlink((uintptr_t)from);
+    if (r) {
+        r->addr = (uintptr_t)to;
+        _Atomic(nh_prof_sample*)* b = &nh_prof_buckets[nh_prof_hash(r->addr)];
+        r->next = atomic_load_explicit(b, memory_order_relaxed);
+        atomic_store_explicit(b, r, memory_order_release);
+    }
+    nh_spin_unlock(&nh_prof_lock);
+}
+
+// Rate 0 stops sampling and drops every live sample.  CPUs pick up a new
+// rate at once; one that races the reset picks it up within NH_PROF_IDLE
+// bytes.
+static int nh_ctl_prof_set(const nh_heapctl_prof_set_args* a) {
+    if (a->sample_bytes > NH_PROF_RATE_MAX)
+        return -1;
+    uint32_t order = nh_order_for(NH_PROF_SAMPLES * sizeof(nh_prof_sample));
+    nh_prof_sample* pool = NULL;
+    if (a->sample_bytes && !nh_prof_pool && !(pool = nh_page_alloc(order, NH_ANY_NODE, 0)))
+        return -1;
+    uint64_t rf = nh_irq_save();
+    nh_spin_lock(&nh_prof_lock);
+    if (pool && !nh_prof_pool) {
+        for (uint32_t i = 0; i < NH_PROF_SAMPLES; ++i) {
+            pool[i].next = nh_prof_free;
+            nh_prof_free = &pool[i];
         }
-        nh_free_node_t* rhead = atomic_exchange(&cs->remote[cpu], NULL);
-        nh_free_node_t* keep = NULL;
-        while (rhead) {
-            nh_free_node_t* next = rhead->next;
-            nh_block_header_t* bh = ((nh_block_header_t*)rhead) - 1;
-            if (bh->span != sp) {
-                rhead->next = keep;
-                keep = rhead;
+        nh_prof_pool = pool;
+        pool = NULL;
+    }
+    nh_prof_rate = a->sample_bytes;
+    if (!nh_prof_rate) {
+        for (uint32_t b = 0; b < NH_PROF_BUCKETS; ++b) {
+            nh_prof_sample* r = atomic_exchange(&nh_prof_buckets[b], NULL);
+            while (r) {
+                nh_prof_sample* next = r->next;
+                r->next = nh_prof_free;
+                nh_prof_free = r;
+                r = next;
             }
-            rhead = next;
-        }
-        while (keep) {
-            nh_free_node_t* next = keep->next;
-            nh_free_node_t* old = atomic_load(&cs->remote[cpu]);
-            do {
-                keep->next = old;
-            } while (!atomic_compare_exchange_weak(&cs->remote[cpu], &old, keep));
-            keep = next;
-        }
-        nh_free_node_t** qcur = &nh_quarantine[cpu].head;
-        while (*qcur) {
-            nh_block_header_t* qbh = ((nh_block_header_t*)(*qcur)) - 1;
-            if (qbh->span == sp)
-                *qcur = (*qcur)->next;
-            else
-                qcur = &(*qcur)->next;
-        }
-    }
-}
-
-static nh_span_t* nh_alloc_span(int cls) {
-    nh_class_state_t* cs = &nh_classes[cls];
-    size_t bsz = nh_size_classes[cls].size;
-    size_t block_sz = sizeof(nh_block_header_t) + bsz;
-    size_t span_bytes = PAGE_SIZE;
-    size_t blocks = (span_bytes - sizeof(nh_span_t)) / block_sz;
-    if (blocks == 0) {
-        blocks = 1;
-        span_bytes = sizeof(nh_span_t) + block_sz;
-    } else {
-        span_bytes = sizeof(nh_span_t) + blocks * block_sz;
+        }
+        atomic_store(&nh_prof_live, 0);
+        nh_prof_dropped = 0;
+    }
+    for (uint32_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu) {
+        if (!nh_cpus[cpu].prof_rng)
+            nh_cpus[cpu].prof_rng = 0x9E3779B97F4A7C15ull * (cpu + 1);
+        nh_cpus[cpu].prof_left = 0;
+    }
+    nh_spin_unlock(&nh_prof_lock);
+    nh_irq_restore(rf);
+    if (pool)
+        nh_page_free(pool, order);
+    return 0;
+}
+
+// Report text goes through a cursor that counts what did not fit, so the
+// caller learns the size it needs.
+typedef struct {
+    char*  buf;
+    size_t len;
+    size_t pos;
+} nh_prof_out;
+
+static void nh_prof_puts(nh_prof_out* o, const char* str) {
+    for (; *str; ++str, ++o->pos)
+        if (o->pos + 1 < o->len)
+            o->buf[o->pos] = *str;
+}
+
+static void nh_prof_putu(nh_prof_out* o, uint64_t v, unsigned base) {
+    char tmp[24];
+    int i = (int)sizeof(tmp) - 1;
+    tmp[i] = '\0';
+    do {
+        tmp[--i] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    if (base == 16) {
+        tmp[--i] = 'x';
+        tmp[--i] = '0';
     }
+    nh_prof_puts(o, &tmp[i]);
+}
 
-    uint32_t order = 0;
-    size_t alloc_bytes = PAGE_SIZE;
-    while (alloc_bytes < span_bytes) { alloc_bytes <<= 1; order++; }
-    nh_span_t* sp = buddy_alloc(order, 0, 0);
-    if (!sp) return NULL;
-    sp->order = order;
-    sp->next = cs->spans;
-    cs->spans = sp;
-    sp->class_idx = cls;
-    // use full allocation
-    blocks = (alloc_bytes - sizeof(nh_span_t)) / block_sz;
-    sp->total_blocks = blocks;
-    sp->free_blocks = blocks;
-
-    char* ptr = (char*)(sp + 1);
-    for (size_t i = 0; i < blocks; ++i) {
-        nh_block_header_t* bh = (nh_block_header_t*)ptr;
-        bh->span = sp;
-        bh->size = bsz;
-        bh->order = 0;
-        nh_free_node_t* node = (nh_free_node_t*)(bh + 1);
-        node->next = cs->freelist;
-        cs->freelist = node;
-        ptr += block_sz;
-    }
-    return sp;
+// One line per distinct stack: "objects: bytes [objects: bytes] @ pcs".
+// Only live samples are kept, so the allocated figures repeat the in-use
+// ones.  Returns the report length; the buffer gets as much as fits,
+// NUL-terminated.
+static int nh_ctl_prof_dump(const nh_heapctl_prof_dump_args* a) {
+    if (!a->user_buf || !a->user_buf_len)
+        return -1;
+    nh_prof_out o = { a->user_buf, a->user_buf_len, 0 };
+    uint64_t rf = nh_irq_save();
+    nh_spin_lock(&nh_prof_lock);
+    uint32_t pass = ++nh_prof_pass;
+    uint64_t objs = 0, bytes = 0;
+    for (uint32_t b = 0; b < NH_PROF_BUCKETS; ++b)
+        for (nh_prof_sample* r = nh_prof_buckets[b]; r; r = r->next) {
+            objs++;
+            bytes += r->size;
+        }
+    nh_prof_puts(&o, "heap profile: ");
+    for (int twice = 0; twice < 2; ++twice) {
+        nh_prof_putu(&o, objs, 10);
+        nh_prof_puts(&o, ": ");
+        nh_prof_putu(&o, bytes, 10);
+        nh_prof_puts(&o, twice ? "] @ heap_v2/" : " [");
+    }
+    nh_prof_putu(&o, nh_prof_rate, 10);
+    nh_prof_puts(&o, "\n");
+    for (uint32_t b = 0; b < NH_PROF_BUCKETS; ++b) {
+        for (nh_prof_sample* r = nh_prof_buckets[b]; r; r = r->next) {
+            if (r->dumped == pass)
+                continue;
+            // Fold in every later sample with the same stack.
+            objs = bytes = 0;
+            for (uint32_t b2 = b; b2 < NH_PROF_BUCKETS; ++b2)
+                for (nh_prof_sample* q = b2 == b ? r : nh_prof_buckets[b2]; q; q = q->next)
+                    if (q->dumped != pass && q->depth == r->depth &&
+                        !memcmp(q->pcs, r->pcs, r->depth * sizeof(r->pcs[0]))) {
+                        q->dumped = pass;
+                        objs++;
+                        bytes += q->size;
+                    }
+            for (int twice = 0; twice < 2; ++twice) {
+                nh_prof_putu(&o, objs, 10);
+                nh_prof_puts(&o, ": ");
+                nh_prof_putu(&o, bytes, 10);
+                nh_prof_puts(&o, twice ? "] @" : " [");
+            }
+            for (uint32_t i = 0; i < r->depth; ++i) {
+                nh_prof_puts(&o, " ");
+                nh_prof_putu(&o, r->pcs[i], 16);
+            }
+            nh_prof_puts(&o, "\n");
+        }
+    }
+    if (nh_prof_dropped) {
+        nh_prof_puts(&o, "# dropped ");
+        nh_prof_putu(&o, nh_prof_dropped, 10);
+        nh_prof_puts(&o, "\n");
+    }
+    nh_spin_unlock(&nh_prof_lock);
+    nh_irq_restore(rf);
+    o.buf[o.pos < o.len ? o.pos : o.len - 1] = '\0';
+    return (int)o.pos;
 }
 
+static shrinker_t nh_quarantine_shrinker;
+static shrinker_t nh_magazine_shrinker;
+
 void nitroheap_init(void) {
-    memset(nh_classes, 0, sizeof(nh_class_state_t) * NH_CLASS_LIMIT);
+    nh_classes_init();
+    nh_sizeclass_setup();
+    nh_part_order = nh_order_for(sizeof(nh_partition));
+    nh_cpu_heap_order = nh_order_for(sizeof(nh_cpu_heap));
+    memset(nh_cpus, 0, sizeof(nh_cpus));
     memset(nh_large_freelists, 0, sizeof(nh_large_freelists));
-    memset(nh_quarantine, 0, sizeof(nh_quarantine));
-    memset(nh_epoch, 0, sizeof(nh_epoch));
-    for (size_t i = 0; i < NH_MAX_CPUS; ++i)
-        atomic_store(&nh_large_remote[i], NULL);
-    atomic_store(&nh_stat_allocs, 0);
-    atomic_store(&nh_stat_frees, 0);
-    atomic_store(&nh_stat_bytes_inuse, 0);
+    memset(&nh_mag_pool, 0, sizeof(nh_mag_pool));
+    memset(nh_node_parts, 0, sizeof(nh_node_parts));
+    nh_lowlat_part = nh_movable_part = NULL;
+    nh_large_lock = 0;
+    nh_parts_lock = 0;
+    memset(nh_handle_dir, 0, sizeof(nh_handle_dir));
+    atomic_store(&nh_stale_unpins, 0);
+    nh_handle_top = 1;
+    nh_handle_free = 0;
+    nh_handle_lock = 0;
+    atomic_store(&nh_flush_gen, 0);
+    nh_prof_rate = 0;
+    nh_prof_pool = nh_prof_free = NULL;
+    memset(nh_prof_buckets, 0, sizeof(nh_prof_buckets));
+    atomic_store(&nh_prof_live, 0);
+    nh_prof_dropped = 0;
+    nh_prof_lock = 0;
+    nh_tune = (nh_heap_tunables){
+        .mag_bytes = NH_MAG_INIT_BYTES,
+        .mag_rounds = NH_MAG_INIT_ROUNDS,
+        .quarantine_limit = NH_HARVEST_BATCH,
+        .reclaim_high = NH_RECLAIM_HIGH,
+        .reclaim_low = NH_RECLAIM_LOW,
+    };
+    nh_partition_setup(&nh_default_part, 0, "default");
+    nh_parts[0] = &nh_default_part;
+    nh_part_count = 1;
+    atomic_store(&nh_pages_held, 0);
+    atomic_store(&nh_empty_pages, 0);
+    atomic_store(&nh_parked_pages, 0);
+    nh_reclaim_wanted = 0;
+    register_shrinker(&nh_quarantine_shrinker);
+    register_shrinker(&nh_magazine_shrinker);
 }
 
-void* nitro_kmalloc(size_t sz, size_t align) {
-    int cls = nh_class_from_size(sz, align);
-    uint32_t cpu = smp_cpu_index();
-    if (cpu >= NH_MAX_CPUS) cpu = 0;
-    nh_epoch[cpu]++;
-    nh_quarantine_harvest_large(cpu);
-    nh_quarantine_drain(cpu);
-    if (cls < 0) {
-        size_t total = sizeof(nh_block_header_t) + sz;
-        size_t alloc_bytes = PAGE_SIZE;
-        uint32_t order = 0;
-        size_t min_align = align ? align : 1;
-        while (alloc_bytes < total || alloc_bytes < min_align) { alloc_bytes <<= 1; order++; }
-        nh_block_header_t* bh;
-        if (order < NH_LARGE_ORDERS && nh_large_freelists[order]) {
-            nh_free_node_t* n = nh_large_freelists[order];
-            nh_large_freelists[order] = n->next;
-            bh = ((nh_block_header_t*)n) - 1;
-        } else {
-            bh = buddy_alloc(order, 0, 0);
-            if (!bh) return NULL;
+// ---- Allocation ----
+
+// Cached blocks are reused only on the node they sit on.
+static void* nh_alloc_large(uint32_t cpu, size_t sz, size_t align, int node) {
+    size_t total = sizeof(nh_block_header_t) + sz;
+    size_t alloc_bytes = PAGE_SIZE;
+    uint32_t order = 0;
+    size_t min_align = align ? align : 1;
+    while (alloc_bytes < total || alloc_bytes < min_align) { alloc_bytes <<= 1; order++; }
+    nh_block_header_t* bh = NULL;
+    if (order < NH_LARGE_ORDERS) {
+        nh_free_node_t** list =
+            &nh_large_freelists[node == NH_ANY_NODE ? current_cpu_node() : node][order];
+        if (!*list)
+            nh_harvest(cpu);
+        nh_spin_lock(&nh_large_lock);
+        nh_free_node_t* n = *list;
+        if (n) {
+            *list = n->next;
+            bh = nh_hdr(n);
+            atomic_fetch_sub(&nh_parked_pages, (uint64_t)1 << order);
         }
-        bh->span = NULL;
-        bh->size = sz;
-        bh->order = order;
-        bh->home_cpu = cpu;
-        bh->reuse_epoch = 0;
-        nh_stats_alloc(bh->size);
-        return bh + 1;
+        nh_spin_unlock(&nh_large_lock);
     }
+    if (!bh) {
+        bh = nh_page_alloc(order, node, 0);
+        if (!bh) return NULL;
+    }
+    bh->size = sz;
+    bh->order = order;
+    bh->home_cpu = cpu;
+    bh->arena_off = 0;
+    nh_stats_alloc(cpu, sz);
+    return bh + 1;
+}
 
-    nh_class_state_t* cs = &nh_classes[cls];
-    nh_magazine_t* mag = &cs->magazines[cpu];
-    nh_free_node_t* rem = atomic_exchange(&cs->remote[cpu], NULL);
-    while (rem) {
-        nh_free_node_t* next = rem->next;
-        nh_quarantine_push(cpu, rem);
-        rem = next;
+static inline void* nh_alloc_small(nh_partition* part, int cls, uint32_t cpu) {
+    nh_cpu_heap* h = part->cpu_heaps[cpu];
+    if (__builtin_expect(!h, 0) && !(h = nh_cpu_heap_create(part, cpu)))
+        return NULL;
+    nh_cpu_cache* cc = &h->caches[cls];
+    nh_magazine* m = cc->loaded;
+    if (__builtin_expect(!m || !m->rounds, 0)) {
+        nh_cpus[cpu].stats[part->id].mag_misses++;
+        if (!(m = nh_cache_reload(part, cls, cc, cpu)))
+            return NULL;
+    } else {
+        nh_cpus[cpu].stats[part->id].mag_hits++;
+        nh_cpus[cpu].cls[cls].hits++;
     }
-    nh_quarantine_drain(cpu);
-    if (!mag->head) {
-        if (!cs->freelist && !nh_alloc_span(cls))
+    nh_stats_slab_alloc(cpu, part->id, (uint32_t)cls);
+    return m->objs[--m->rounds];
+}
+
+void* nitro_pkmalloc(nh_partition* part, size_t sz, size_t align) {
+    int cls = nh_class_from_size(sz, align);
+    uint64_t rf = nh_irq_save();
+    uint32_t cpu = nh_cpu();
+    void* p = cls < 0 ? nh_alloc_large(cpu, sz, align, nh_part_node(part))
+                      : nh_alloc_small(part, cls, cpu);
+    nh_prof_note(cpu, p, sz);
+    nh_irq_restore(rf);
+    return p;
+}
+
+void* nitro_kmalloc(size_t sz, size_t align) {
+    return nitro_pkmalloc(&nh_default_part, sz, align);
+}
+
+// ---- Flagged allocations ----
+
+// Drop a reference to an arena; the last one returns it to buddy.
+static void nh_arena_put(nh_arena_t* a) {
+    if (atomic_fetch_sub(&a->live, 1) == 1)
+        nh_page_free(a, NH_ARENA_ORDER);
+}
+
+// NH_EPHEMERAL: bump-allocate from this CPU's arena.  Blocks are never
+// reused one by one; an arena whose blocks are all freed starts over from
+// its base, and a full one is retired and goes back to buddy once its last
+// block is freed.
+static void* nh_alloc_ephemeral(uint32_t cpu, size_t sz, size_t align) {
+    nh_cpu_t* c = &nh_cpus[cpu];
+    if (align < sizeof(void*))
+        align = sizeof(void*);
+    for (;;) {
+        nh_arena_t* a = c->arena;
+        if (a) {
+            // Only this CPU adds blocks, so a count of one means none live.
+            if (atomic_load(&a->live) == 1)
+                a->bump = sizeof(nh_arena_t);
+            size_t off = (a->bump + sizeof(nh_block_header_t) + align - 1) & ~(align - 1);
+            if (off + sz <= NH_ARENA_BYTES) {
+                a->bump = off + sz;
+                atomic_fetch_add(&a->live, 1);
+                nh_block_header_t* bh = nh_hdr((char*)a + off);
+                bh->size = sz;
+                bh->order = NH_ARENA_BLOCK;
+                bh->home_cpu = cpu;
+                bh->arena_off = off;
+                nh_stats_alloc(cpu, sz);
+                return bh + 1;
+            }
+            c->arena = NULL;
+            nh_arena_put(a);
+        }
+        a = nh_page_alloc(NH_ARENA_ORDER, NH_ANY_NODE, 0);
+        if (!a)
             return NULL;
-        for (size_t i = 0; i < NH_MAG_SIZE && cs->freelist; ++i) {
-            nh_free_node_t* n = cs->freelist;
-            cs->freelist = n->next;
-            n->next = mag->head;
-            mag->head = n;
-            mag->count++;
+        atomic_store(&a->live, 1);
+        a->cpu = cpu;
+        a->bump = sizeof(nh_arena_t);
+        c->arena = a;
+    }
+}
+
+// NH_LOW_LATENCY: one slot from the class's reserve, under the pool lock
+// and nothing else: no magazines to set up and never a call into buddy.
+// An exhausted reserve fails the allocation, and one that falls below half
+// wakes the reclaimer to refill it.
+static void* nh_alloc_reserve(uint32_t cpu, int cls) {
+    nh_partition* part = nh_lowlat_part;
+    nh_class_pool* pool = &part->pools[cls];
+    void* p;
+    if (!nh_pool_take(part, pool, &nh_class_info[cls], &p, 1, NH_GROW_NEVER)) {
+        nh_reclaim_wake();
+        return NULL;
+    }
+    if (pool->nr_free < pool->reserve / 2)
+        nh_reclaim_wake();
+    nh_stats_slab_alloc(cpu, part->id, (uint32_t)cls);
+    return p;
+}
+
+// Grow the low-latency pool of class `cls` until its free slots cover its
+// reserve.  May reclaim, so it runs at reserve time and in the reclaimer,
+// never on behalf of an NH_LOW_LATENCY allocation.
+static int nh_reserve_fill(uint32_t cls) {
+    nh_partition* part = nh_lowlat_part;
+    nh_class_pool* pool = &part->pools[cls];
+    const nh_sizeclass* c = &nh_class_info[cls];
+    while (pool->nr_free < pool->reserve) {
+        nh_slab* s = nh_slab_create(part, c, 0);
+        if (!s)
+            return -1;
+        uint64_t rf = nh_irq_save();
+        nh_spin_lock(&pool->lock);
+        pool->nr_slabs++;
+        pool->nr_free += c->slots_per_slab;
+        pool->nr_empty++;
+        nh_slab_link(&pool->empty_list, s);
+        s->list = NH_SLAB_EMPTY;
+        atomic_fetch_add(&nh_empty_pages, (uint64_t)1 << c->slab_order);
+        nh_spin_unlock(&pool->lock);
+        nh_irq_restore(rf);
+    }
+    return 0;
+}
+
+// Raise the reserve of class `cls` to at least `floor` plus `add` slots.
+static nh_class_pool* nh_reserve_grow(int cls, uint32_t floor, uint32_t add) {
+    nh_partition* part = nh_flag_part(&nh_lowlat_part, "lowlat", NH_ANY_NODE, NH_LOW_LATENCY);
+    if (part == &nh_default_part)
+        return NULL;
+    nh_class_pool* pool = &part->pools[cls];
+    uint64_t rf = nh_irq_save();
+    nh_spin_lock(&pool->lock);
+    if (pool->reserve < floor)
+        pool->reserve = floor;
+    pool->reserve += add;
+    nh_spin_unlock(&pool->lock);
+    nh_irq_restore(rf);
+    return pool;
+}
+
+int nitro_kheap_reserve(size_t sz, size_t align, uint32_t objects) {
+    int cls = nh_class_from_size(sz, align);
+    if (cls < 0 || !nh_reserve_grow(cls, 0, objects))
+        return -1;
+    return nh_reserve_fill((uint32_t)cls);
+}
+
+void* nitro_kmalloc_flags(size_t sz, size_t align, nh_flags_t flags) {
+    if ((flags & NH_EPHEMERAL) && sz + align <= NH_ARENA_MAX) {
+        uint64_t rf = nh_irq_save();
+        uint32_t cpu = nh_cpu();
+        void* p = nh_alloc_ephemeral(cpu, sz, align);
+        nh_prof_note(cpu, p, sz);
+        nh_irq_restore(rf);
+        return p;
+    }
+    if (flags & NH_LOW_LATENCY) {
+        int cls = nh_class_from_size(sz, align);
+        nh_partition* part = nh_lowlat_part;
+        if (cls >= 0 && part && part->pools[cls].reserve) {
+            uint64_t rf = nh_irq_save();
+            uint32_t cpu = nh_cpu();
+            void* p = nh_alloc_reserve(cpu, cls);
+            nh_prof_note(cpu, p, sz);
+            nh_irq_restore(rf);
+            return p;
         }
+        // First use of the class: this allocation takes the normal path
+        // and the reclaimer fills a reserve for the ones after it.
+        if (cls >= 0 && nh_reserve_grow(cls, NH_LOWLAT_RESERVE, 0))
+            nh_reclaim_wake();
+    } else if ((flags & NH_NUMA_LOCAL) && numa_node_count() > 1) {
+        return nitro_pkmalloc(nh_node_part(current_cpu_node()), sz, align);
     }
-    nh_free_node_t* node = mag->head;
-    mag->head = node->next;
-    mag->count--;
-    nh_block_header_t* bh = ((nh_block_header_t*)node) - 1;
-      bh->span->free_blocks--;
-      bh->home_cpu = cpu;
-      bh->reuse_epoch = 0;
-      nh_stats_alloc(bh->size);
-      return node;
+    return nitro_kmalloc(sz, align);
 }
 
+// A slab object has no record of the CPU that allocated it, so it waits out
+// its quarantine on the freeing CPU and is reused there.  Large blocks go
+// back to the CPU in their header.
 void nitro_kfree(void* p) {
     if (!p) return;
-    uint32_t cpu = smp_cpu_index();
-    if (cpu >= NH_MAX_CPUS) cpu = 0;
-    nh_epoch[cpu]++;
-    nh_block_header_t* bh = ((nh_block_header_t*)p) - 1;
-    nh_stats_free(bh->size);
-    uint32_t home = bh->home_cpu;
-    if (home >= NH_MAX_CPUS) home = 0;
+    uint64_t rf = nh_irq_save();
+    uint32_t cpu = nh_cpu();
+    nh_prof_forget(p);
     nh_free_node_t* node = (nh_free_node_t*)p;
-    if (!bh->span) {
-        if (home != cpu && home < NH_MAX_CPUS) {
-            bh->reuse_epoch = nh_epoch[home] + NH_REUSE_DELAY;
-            nh_free_node_t* head;
-            do {
-                head = atomic_load(&nh_large_remote[home]);
-                node->next = head;
-            } while (!atomic_compare_exchange_weak(&nh_large_remote[home], &head, node));
-        } else {
-            nh_quarantine_enqueue(home, node);
+    nh_slab* s = nh_span_lookup(p);
+    uint32_t home = cpu;
+    if (s) {
+        nh_stats_slab_free(cpu, s->part->id, s->cls->class_id);
+        nh_cpus[cpu].cls[s->cls->class_id].quarantined++;
+        node->reuse_epoch = nh_cpus[cpu].epoch + s->part->traits.reuse_epoch_ticks;
+    } else {
+        nh_block_header_t* bh = nh_hdr(p);
+        nh_stats_free(cpu, bh->size);
+        if (bh->order == NH_ARENA_BLOCK) {
+            nh_arena_put((nh_arena_t*)((char*)p - bh->arena_off));
+            nh_irq_restore(rf);
+            return;
         }
-        return;
+        atomic_fetch_add(&nh_parked_pages, (uint64_t)1 << bh->order);
+        home = bh->home_cpu < NH_MAX_CPUS ? bh->home_cpu : 0;
+        node->reuse_epoch = nh_cpus[home].epoch + nh_default_part.traits.reuse_epoch_ticks;
     }
-    nh_class_state_t* cs = &nh_classes[bh->span->class_idx];
-    if (home != cpu && home < NH_MAX_CPUS) {
-        bh->reuse_epoch = nh_epoch[home] + NH_REUSE_DELAY;
-        nh_free_node_t* head;
+    if (home != cpu) {
+        _Atomic(nh_free_node_t*)* list = &nh_cpus[home].remote;
+        nh_free_node_t* head = atomic_load(list);
         do {
-            head = atomic_load(&cs->remote[home]);
             node->next = head;
-        } while (!atomic_compare_exchange_weak(&cs->remote[home], &head, node));
+        } while (!atomic_compare_exchange_weak(list, &head, node));
     } else {
-        nh_quarantine_enqueue(home, node);
+        nh_cpu_t* c = &nh_cpus[cpu];
+        node->next = c->quarantine;
+        c->quarantine = node;
+        if (++c->qpending >= nh_tune.quarantine_limit)
+            nh_harvest(cpu);
     }
-    bh->span->free_blocks++;
-    if (bh->span->free_blocks == bh->span->total_blocks) {
-        nh_remove_span_blocks(cs, bh->span);
-        nh_span_t** cur = &cs->spans;
-        while (*cur && *cur != bh->span) cur = &(*cur)->next;
-        if (*cur == bh->span) *cur = bh->span->next;
-        buddy_free(bh->span, bh->span->order, 0);
+    nh_irq_restore(rf);
+}
+
+void nitro_kheap_harvest(void) {
+    uint64_t rf = nh_irq_save();
+    nh_harvest(nh_cpu());
+    nh_irq_restore(rf);
+}
+
+// Resize a large block in place, within the pages it already spans or by
+// claiming the free buddy blocks above it.  Returns 0 if it has to move.
+static int nh_large_resize(nh_block_header_t* bh, size_t newsz) {
+    uint32_t order = nh_order_for(sizeof(*bh) + newsz);
+    if (order > bh->order) {
+        if (buddy_try_grow(bh, bh->order, order) != 0)
+            return 0;
+        atomic_fetch_add(&nh_pages_held, ((uint64_t)1 << order) - ((uint64_t)1 << bh->order));
+        nh_page_tag(bh, order, NULL);
+        bh->order = order;
     }
+    uint64_t rf = nh_irq_save();
+    nh_cpus[nh_cpu()].stats[0].bytes_inuse += (int64_t)newsz - (int64_t)bh->size;
+    nh_irq_restore(rf);
+    bh->size = newsz;
+    return 1;
 }
 
+// Blocks stay put whenever they can: a slab object while the new size fits
+// its class, a large block while its pages (plus any it can claim) hold it.
 void* nitro_krealloc(void* p, size_t newsz, size_t align) {
     if (!p) return nitro_kmalloc(newsz, align);
     if (!newsz) { nitro_kfree(p); return NULL; }
 
-    nh_block_header_t* bh = ((nh_block_header_t*)p) - 1;
-    if (!bh->span) {
+    nh_slab* s = nh_span_lookup(p);
+    if (!s) {
+        nh_block_header_t* bh = nh_hdr(p);
         size_t oldsz = bh->size;
-        if (newsz <= oldsz)
+        int stays = bh->order == NH_ARENA_BLOCK
+                        ? newsz <= oldsz
+                        : !((uintptr_t)p & (align ? align - 1 : 0)) && nh_large_resize(bh, newsz);
+        if (stays)
             return p;
         void* n = nitro_kmalloc(newsz, align);
         if (!n) return NULL;
@@ -357,12 +1683,11 @@ void* nitro_krealloc(void* p, size_t newsz, size_t align) {
         return n;
     }
 
-    size_t oldsz = bh->size;
-    int oldcls = bh->span->class_idx;
-    if (newsz <= oldsz && align <= nh_size_classes[oldcls].align)
+    size_t oldsz = s->cls->size;
+    if (newsz <= oldsz && align <= nh_size_classes[s->cls->class_id].align)
         return p;
 
-    void* n = nitro_kmalloc(newsz, align);
+    void* n = nitro_pkmalloc(s->part, newsz, align);
     if (!n) return NULL;
     memcpy(n, p, oldsz < newsz ? oldsz : newsz);
     nitro_kfree(p);
@@ -371,131 +1696,569 @@ void* nitro_krealloc(void* p, size_t newsz, size_t align) {
 
 void nitro_kheap_dump_stats(const char* tag) {
     kprintf("[nitroheap] %s\n", tag ? tag : "");
-    for (size_t i = 0; i < nh_size_class_count; ++i) {
-        nh_class_state_t* cs = &nh_classes[i];
-        size_t spans = 0, free_blocks = 0, total = 0;
-        for (nh_span_t* sp = cs->spans; sp; sp = sp->next) {
-            spans++;
-            total += sp->total_blocks;
-            free_blocks += sp->free_blocks;
+    for (uint32_t p = 0; p < nh_part_count; ++p) {
+        nh_partition* part = nh_parts[p];
+        for (size_t i = 0; i < nh_class_count; ++i) {
+            nh_class_pool* pool = &part->pools[i];
+            if (pool->nr_slabs)
+                kprintf(" %s class %zu size %u: slabs=%u empty=%u draining=%u slots/slab=%u"
+                        " mags full=%u empty=%u rounds=%u\n",
+                        part->name, i, nh_class_info[i].size, pool->nr_slabs,
+                        pool->nr_empty, pool->nr_draining, nh_class_info[i].slots_per_slab,
+                        pool->depot.nr_full, pool->depot.nr_empty, pool->depot.mag_size);
         }
-        if (spans)
-            kprintf(" class %zu size %zu: spans=%zu free=%zu/%zu\n",
-                    i, nh_size_classes[i].size, spans, free_blocks, total);
     }
 }
 
-void nitro_kheap_trim(void) {
-    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu) {
-        for (size_t i = 0; i < nh_size_class_count; ++i) {
-            nh_class_state_t* cs = &nh_classes[i];
-            nh_free_node_t* r = atomic_exchange(&cs->remote[cpu], NULL);
-            while (r) {
-                nh_free_node_t* next = r->next;
-                nh_quarantine_push(cpu, r);
-                r = next;
-            }
-        }
-        nh_free_node_t* lr = atomic_exchange(&nh_large_remote[cpu], NULL);
-        while (lr) {
-            nh_free_node_t* next = lr->next;
-            nh_quarantine_push(cpu, lr);
-            lr = next;
-        }
-        nh_free_node_t* q = nh_quarantine[cpu].head;
-        nh_quarantine[cpu].head = NULL;
-        while (q) {
-            nh_free_node_t* next = q->next;
-            nh_block_header_t* bh = ((nh_block_header_t*)q) - 1;
-            if (bh->span) {
-                nh_class_state_t* cs = &nh_classes[bh->span->class_idx];
-                q->next = cs->freelist;
-                cs->freelist = q;
-            } else {
-                if (bh->order < NH_LARGE_ORDERS) {
-                    q->next = nh_large_freelists[bh->order];
-                    nh_large_freelists[bh->order] = q;
-                } else {
-                    buddy_free(bh, bh->order, 0);
+// Free cached large blocks, smallest orders first, until `max_pages` have
+// been released.
+static void nh_release_large(uint64_t max_pages) {
+    uint64_t freed = 0;
+    for (size_t o = 0; o < NH_LARGE_ORDERS && freed < max_pages; ++o) {
+        for (int node = 0; node < MAX_NUMA_NODES; ++node) {
+            for (;;) {
+                nh_spin_lock(&nh_large_lock);
+                nh_free_node_t* n = freed < max_pages ? nh_large_freelists[node][o] : NULL;
+                if (n) {
+                    nh_large_freelists[node][o] = n->next;
+                    atomic_fetch_sub(&nh_parked_pages, (uint64_t)1 << o);
                 }
+                nh_spin_unlock(&nh_large_lock);
+                if (!n)
+                    break;
+                nh_page_free(nh_hdr(n), o);
+                freed += (uint64_t)1 << o;
             }
-            q = next;
-        }
-    }
-    for (size_t i = 0; i < nh_size_class_count; ++i) {
-        nh_class_state_t* cs = &nh_classes[i];
-        nh_span_t* sp = cs->spans;
-        while (sp) {
-            nh_span_t* next = sp->next;
-            if (sp->free_blocks == sp->total_blocks) {
-                nh_remove_span_blocks(cs, sp);
-                nh_span_t** cur = &cs->spans;
-                while (*cur && *cur != sp) cur = &(*cur)->next;
-                if (*cur == sp) *cur = sp->next;
-                buddy_free(sp, sp->order, 0);
+        }
+    }
+}
+
+// Return this CPU's caches and every depot to the slabs, then give empty
+// slabs above `keep` per class back to buddy.  Other CPUs flush their
+// magazines at their next harvest; the magazines themselves stay with
+// their CPU until it trims.
+static void nh_reclaim_slabs(uint32_t cpu, uint32_t keep) {
+    uint32_t gen = atomic_fetch_add(&nh_flush_gen, 1) + 1;
+    nh_cpus[cpu].flush_gen = gen;
+    nh_cpu_flush(cpu);
+    for (uint32_t p = 0; p < nh_part_count; ++p) {
+        nh_partition* part = nh_parts[p];
+        for (size_t i = 0; i < nh_class_count; ++i) {
+            nh_depot_drain(part, (uint32_t)i);
+            nh_pool_release_empty(part, &part->pools[i], keep, UINT32_MAX);
+        }
+    }
+    nh_pool_release_empty(&nh_default_part, &nh_mag_pool, keep, UINT32_MAX);
+}
+
+void nitro_kheap_trim(void) {
+    uint64_t rf = nh_irq_save();
+    uint32_t cpu = nh_cpu();
+    nh_flush_quarantine(cpu);
+    nh_reclaim_slabs(cpu, 0);
+    if (nh_cpus[cpu].arena) {
+        nh_arena_put(nh_cpus[cpu].arena);
+        nh_cpus[cpu].arena = NULL;
+    }
+    // The calling CPU's heaps and magazines are rebuilt on its next
+    // allocation.
+    for (uint32_t p = 0; p < nh_part_count; ++p) {
+        nh_partition* part = nh_parts[p];
+        nh_cpu_heap* h = part->cpu_heaps[cpu];
+        if (!h)
+            continue;
+        for (size_t c = 0; c < nh_class_count; ++c) {
+            if (h->caches[c].loaded)
+                nh_mag_free(h->caches[c].loaded);
+            if (h->caches[c].prev)
+                nh_mag_free(h->caches[c].prev);
+        }
+        nh_page_free(h, nh_cpu_heap_order);
+        part->cpu_heaps[cpu] = NULL;
+    }
+    nh_pool_release_empty(&nh_default_part, &nh_mag_pool, 0, UINT32_MAX);
+    nh_release_large(UINT64_MAX);
+    nh_irq_restore(rf);
+}
+
+// ---- Background reclaim ----
+
+// When a class holds more than two slabs' worth of free slots in partial
+// slabs, mark the sparse ones (at most `live_quarters` quarters live)
+// draining so new allocations fill the denser ones and the sparse ones
+// empty out.
+static void nh_pool_mark_draining(nh_class_pool* pool, const nh_sizeclass* c,
+                                  uint32_t live_quarters) {
+    nh_spin_lock(&pool->lock);
+    uint64_t holes = 0;
+    for (nh_slab* s = pool->partial_list; s; s = s->next)
+        holes += s->free_count;
+    if (holes > 2u * c->slots_per_slab) {
+        nh_slab* s = pool->partial_list;
+        while (s) {
+            nh_slab* next = s->next;
+            if (4u * s->free_count >= (4u - live_quarters) * c->slots_per_slab) {
+                nh_slab_unlink(&pool->partial_list, s);
+                nh_slab_link(&pool->draining_list, s);
+                s->list = NH_SLAB_DRAINING;
+                pool->nr_draining++;
             }
-            sp = next;
+            s = next;
+        }
+    }
+    nh_spin_unlock(&pool->lock);
+}
+
+// Release empty slabs from `pool` in batches, with interrupts enabled in
+// between, until the heap-wide empty-slab pages fall to reclaim_low.
+static uint64_t nh_pool_reclaim(nh_partition* part, nh_class_pool* pool) {
+    uint64_t pages = 0;
+    while (atomic_load_explicit(&nh_empty_pages, memory_order_relaxed) > nh_tune.reclaim_low) {
+        uint64_t rf = nh_irq_save();
+        uint64_t n = nh_pool_release_empty(part, pool, NH_EMPTY_KEEP, NH_RECLAIM_BATCH);
+        nh_irq_restore(rf);
+        if (!n)
+            break;
+        pages += n;
+    }
+    return pages;
+}
+
+// A free slot for compaction to move a block out of draining slab `from`:
+// from a partial slab, else from the fullest other draining slab, which
+// then stops draining.  NULL when `from` is the fullest.  Caller holds the
+// pool lock.
+static void* nh_pool_take_dense(nh_class_pool* pool, nh_slab* from) {
+    nh_slab* s = pool->partial_list;
+    if (!s) {
+        for (nh_slab* d = pool->draining_list; d; d = d->next)
+            if (d != from && (!s || d->free_count < s->free_count))
+                s = d;
+        if (!s || s->free_count > from->free_count)
+            return NULL;
+        nh_slab_unlink(&pool->draining_list, s);
+        pool->nr_draining--;
+        nh_slab_link(&pool->partial_list, s);
+        s->list = NH_SLAB_PARTIAL;
+    }
+    nh_free_node_t* node = s->freelist;
+    s->freelist = node->next;
+    s->free_count--;
+    pool->nr_free--;
+    if (!s->freelist) {
+        nh_slab_unlink(&pool->partial_list, s);
+        s->list = NH_SLAB_FULL;
+    }
+    return node;
+}
+
+static nh_handle_slot* nh_handle_slot_at(uint32_t idx) {
+    if (idx == 0 || idx >= NH_HANDLE_MAX)
+        return NULL;
+    nh_handle_slot* leaf = atomic_load(&nh_handle_dir[idx / NH_HANDLE_LEAF]);
+    return leaf ? &leaf[idx % NH_HANDLE_LEAF] : NULL;
+}
+
+// Pops a free slot, or extends the table by one, adding a leaf when the
+// last one is full.  Returns 0 when the table or memory is exhausted.
+static uint32_t nh_handle_take(void) {
+    for (;;) {
+        nh_spin_lock(&nh_handle_lock);
+        uint32_t idx = nh_handle_free;
+        if (idx) {
+            nh_handle_free = nh_handle_slot_at(idx)->next_free;
+            nh_spin_unlock(&nh_handle_lock);
+            return idx;
+        }
+        idx = nh_handle_top;
+        if (idx >= NH_HANDLE_MAX || atomic_load(&nh_handle_dir[idx / NH_HANDLE_LEAF])) {
+            if (idx < NH_HANDLE_MAX)
+                nh_handle_top++;
+            nh_spin_unlock(&nh_handle_lock);
+            return idx < NH_HANDLE_MAX ? idx : 0;
+        }
+        nh_spin_unlock(&nh_handle_lock);
+
+        // Allocating may reclaim, and reclaim compacts under the handle
+        // lock, so the leaf is installed in a second pass.
+        nh_handle_slot* leaf = nh_page_alloc(0, NH_ANY_NODE, 0);
+        if (!leaf)
+            return 0;
+        memset(leaf, 0, PAGE_SIZE);
+        nh_spin_lock(&nh_handle_lock);
+        if (!atomic_load(&nh_handle_dir[idx / NH_HANDLE_LEAF])) {
+            atomic_store(&nh_handle_dir[idx / NH_HANDLE_LEAF], leaf);
+            leaf = NULL;
         }
+        nh_spin_unlock(&nh_handle_lock);
+        if (leaf)
+            nh_page_free(leaf, 0);
     }
-    for (size_t o = 0; o < NH_LARGE_ORDERS; ++o) {
-        nh_free_node_t* n = nh_large_freelists[o];
-        while (n) {
-            nh_free_node_t* next = n->next;
-            buddy_free(((nh_block_header_t*)n) - 1, o, 0);
-            n = next;
+}
+
+// Drop a pin, never below zero: hfree may have cleared the count already.
+// Drop a pin; -1 if there was none to drop.
+static int nh_handle_unpin_slot(nh_handle_slot* slot) {
+    uint32_t pins = atomic_load(&slot->pins);
+    do {
+        if (!(pins & ~NH_PIN_MOVING))
+            return -1;
+    } while (!atomic_compare_exchange_weak(&slot->pins, &pins, pins - 1));
+    return 0;
+}
+
+// Lock-free lookup that pins the object.  hfree clears the pointer and
+// bumps the generation; a reused slot only gets its new pointer after
+// that, so a pointer read between two matching generation reads belongs
+// to this handle.  The pin is taken before the pointer is read, so a
+// concurrent compaction has either finished moving the object or will
+// skip it.
+static void* nh_handle_lookup(uint64_t h) {
+    nh_handle_slot* slot = nh_handle_slot_at((uint32_t)h);
+    uint32_t gen = (uint32_t)(h >> 32);
+    if (!slot || atomic_load(&slot->gen) != gen)
+        return NULL;
+    uint32_t pins = atomic_load(&slot->pins);
+    for (;;) {
+        if (pins & NH_PIN_MOVING) {
+            __asm__ volatile("pause");
+            pins = atomic_load(&slot->pins);
+        } else if (atomic_compare_exchange_weak(&slot->pins, &pins, pins + 1)) {
+            break;
         }
-        nh_large_freelists[o] = NULL;
     }
+    void* p = atomic_load(&slot->ptr);
+    if (!p || atomic_load(&slot->gen) != gen) {
+        nh_handle_unpin_slot(slot);
+        return NULL;
+    }
+    return p;
 }
 
-static size_t nh_count_list(nh_free_node_t* head) {
+uint64_t nitro_kheap_compact(void) {
+    nh_partition* part = nh_movable_part;
+    if (!part)
+        return 0;
+
+    // Free slots in this CPU's magazines and in the depots would keep
+    // sparse slabs from emptying; send them home first.
+    uint64_t rf = nh_irq_save();
+    nh_cpu_heap* h = part->cpu_heaps[nh_cpu()];
+    for (size_t c = 0; c < nh_class_count; ++c) {
+        if (h && h->caches[c].loaded)
+            nh_mag_drain(part, (uint32_t)c, h->caches[c].loaded);
+        if (h && h->caches[c].prev)
+            nh_mag_drain(part, (uint32_t)c, h->caches[c].prev);
+        nh_depot_drain(part, (uint32_t)c);
+        nh_pool_mark_draining(&part->pools[c], &nh_class_info[c], 2);
+    }
+    nh_irq_restore(rf);
+
+    uint64_t moved = 0;
+    nh_spin_lock(&nh_handle_lock);
+    for (uint32_t i = 1; i < nh_handle_top; ++i) {
+        nh_handle_slot* slot = nh_handle_slot_at(i);
+        void* p = atomic_load(&slot->ptr);
+        if (!p)
+            continue;
+        nh_slab* from = nh_span_lookup(p);
+        uint32_t unpinned = 0;
+        if (!from || from->part != part ||
+            !atomic_compare_exchange_strong(&slot->pins, &unpinned, NH_PIN_MOVING))
+            continue;
+        nh_class_pool* pool = &part->pools[from->cls->class_id];
+        rf = nh_irq_save();
+        nh_spin_lock(&pool->lock);
+        void* dst = from->list == NH_SLAB_DRAINING ? nh_pool_take_dense(pool, from) : NULL;
+        if (dst) {
+            memcpy(dst, p, from->cls->size);
+            nh_prof_move(p, dst);
+            nh_slab_put_locked(pool, p);
+            atomic_store(&slot->ptr, dst);
+            moved++;
+        }
+        atomic_store(&slot->pins, 0);
+        nh_spin_unlock(&pool->lock);
+        nh_irq_restore(rf);
+    }
+    nh_spin_unlock(&nh_handle_lock);
+    return moved;
+}
+
+uint64_t nitro_kheap_reclaim(void) {
+    nh_reclaim_wanted = 0;
+    uint64_t pages = 0;
+    nh_partition* lowlat = nh_lowlat_part;
+    for (size_t i = 0; lowlat && i < nh_class_count; ++i)
+        if (lowlat->pools[i].reserve)
+            nh_reserve_fill((uint32_t)i);
+    nitro_kheap_compact();
+    for (uint32_t p = 0; p < nh_part_count; ++p) {
+        nh_partition* part = nh_parts[p];
+        for (size_t i = 0; i < nh_class_count; ++i) {
+            uint64_t rf = nh_irq_save();
+            nh_depot_reap(part, (uint32_t)i);
+            nh_pool_mark_draining(&part->pools[i], &nh_class_info[i], 1);
+            nh_irq_restore(rf);
+        }
+    }
+    for (uint32_t p = 0; p < nh_part_count; ++p)
+        for (size_t i = 0; i < nh_class_count; ++i)
+            pages += nh_pool_reclaim(nh_parts[p], &nh_parts[p]->pools[i]);
+    return pages + nh_pool_reclaim(&nh_default_part, &nh_mag_pool);
+}
+
+#ifdef KERNEL_BUILD
+static void nh_reclaimd_main(void) {
+    for (;;) {
+        thread_wait(&nh_reclaimd_wait);
+        nitro_kheap_reclaim();
+    }
+}
+
+void nitro_reclaimd_start(void) {
+    thread_create_with_priority(nh_reclaimd_main, MIN_PRIORITY + 1);
+}
+#else
+void nitro_reclaimd_start(void) {}
+#endif
+
+// ---- Shrinkers ----
+
+// Quarantine and the large-block cache: blocks parked there only wait out
+// their reuse epoch, so under pressure they go straight back to buddy.
+static uint64_t nh_shrink_quarantine_count(shrinker_t* s) {
+    (void)s;
+    return atomic_load_explicit(&nh_parked_pages, memory_order_relaxed);
+}
+
+static uint64_t nh_shrink_quarantine_scan(shrinker_t* s, uint64_t nr_pages) {
+    (void)s;
+    uint64_t before = atomic_load(&nh_pages_held);
+    uint64_t rf = nh_irq_save();
+    nh_flush_quarantine(nh_cpu());
+    nh_release_large(nr_pages);
+    nh_irq_restore(rf);
+    return before - atomic_load(&nh_pages_held);
+}
+
+// Magazines and depots: return cached objects to their slabs and drop every
+// slab left with no live objects.
+static uint64_t nh_shrink_magazine_count(shrinker_t* s) {
+    (void)s;
+    uint64_t pages = 0;
+    for (uint32_t p = 0; p < nh_part_count; ++p)
+        for (size_t i = 0; i < nh_class_count; ++i)
+            pages += (uint64_t)nh_parts[p]->pools[i].nr_empty << nh_class_info[i].slab_order;
+    return pages + ((uint64_t)nh_mag_pool.nr_empty << nh_mag_class.slab_order);
+}
+
+static uint64_t nh_shrink_magazine_scan(shrinker_t* s, uint64_t nr_pages) {
+    (void)s;
+    (void)nr_pages;
+    uint64_t before = atomic_load(&nh_pages_held);
+    uint64_t rf = nh_irq_save();
+    nh_reclaim_slabs(nh_cpu(), 0);
+    nh_irq_restore(rf);
+    return before - atomic_load(&nh_pages_held);
+}
+
+static shrinker_t nh_quarantine_shrinker = {
+    .name = "nitroheap-quarantine",
+    .count = nh_shrink_quarantine_count,
+    .scan = nh_shrink_quarantine_scan,
+    .priority = SHRINKER_PRIO_DEFAULT,
+};
+
+static shrinker_t nh_magazine_shrinker = {
+    .name = "nitroheap-magazines",
+    .count = nh_shrink_magazine_count,
+    .scan = nh_shrink_magazine_scan,
+    .priority = SHRINKER_PRIO_DEFAULT + 1,
+};
+
+// Count blocks on a list that belong to partition `part_id`.
+static size_t nh_count_list(nh_free_node_t* head, uint16_t part_id) {
     size_t count = 0;
     while (head) {
-        count++;
+        nh_slab* s = nh_span_lookup(head);
+        if ((s ? s->part->id : 0) == part_id)
+            count++;
         head = head->next;
     }
     return count;
 }
 
-int sys_heapctl(nh_heapctl_op op, const void* args, size_t args_len) {
-    if (op != NH_HEAPCTL_GET_STATS)
-        return -1; // only GET_STATS supported for now
-    if (!args || args_len < sizeof(nh_heapctl_get_stats_args))
-        return -1;
-
-    const nh_heapctl_get_stats_args* a = args;
+static int nh_ctl_get_stats(const nh_heapctl_get_stats_args* a) {
     if (!a->user_buf || a->user_buf_len < sizeof(nh_part_stats_summary))
         return -1;
-    if (a->part_id != 0)
-        return -1; // only default partition
+    nh_partition* part = nitro_partition_get(a->part_id);
+    if (!part)
+        return -1;
+    uint32_t ncpu = smp_cpu_count();
+    if (ncpu > NH_MAX_CPUS)
+        ncpu = NH_MAX_CPUS;
+    if (a->include_per_cpu &&
+        a->user_buf_len < sizeof(nh_part_stats_blob) + ncpu * sizeof(nh_part_stats_cpu))
+        return -1;
 
     nh_part_stats_summary s;
     memset(&s, 0, sizeof(s));
-    s.part_id = 0;
-    strncpy(s.name, "default", sizeof(s.name) - 1);
-    s.bytes_inuse = atomic_load(&nh_stat_bytes_inuse);
-    s.bytes_committed = s.bytes_inuse;
-    s.allocs = atomic_load(&nh_stat_allocs);
-    s.frees = atomic_load(&nh_stat_frees);
-    s.guard_sample_rate = 0;
-    s.reuse_epoch_ticks = NH_REUSE_DELAY;
-
-    uint64_t q_backlog = 0;
-    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu)
-        q_backlog += nh_count_list(nh_quarantine[cpu].head);
-    uint64_t r_backlog = 0;
-    for (size_t i = 0; i < nh_size_class_count; ++i)
-        for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu)
-            r_backlog += nh_count_list(atomic_load(&nh_classes[i].remote[cpu]));
-    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu)
-        r_backlog += nh_count_list(atomic_load(&nh_large_remote[cpu]));
+    s.part_id = part->id;
+    memcpy(s.name, part->name, sizeof(s.name) - 1);
+    int64_t inuse = 0;
+    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu) {
+        s.allocs += nh_cpus[cpu].stats[part->id].allocs;
+        s.frees += nh_cpus[cpu].stats[part->id].frees;
+        inuse += nh_cpus[cpu].stats[part->id].bytes_inuse;
+    }
+    s.bytes_inuse = inuse > 0 ? (uint64_t)inuse : 0;
+    s.bytes_committed = atomic_load(&part->bytes_committed);
+    s.guard_sample_rate = part->traits.guard_sample_rate;
+    s.reuse_epoch_ticks = part->traits.reuse_epoch_ticks;
+    if (part == nh_movable_part)
+        s.stale_unpins = atomic_load(&nh_stale_unpins);
+
+    uint64_t q_backlog = 0, r_backlog = 0;
+    for (size_t cpu = 0; cpu < NH_MAX_CPUS; ++cpu) {
+        q_backlog += nh_count_list(nh_cpus[cpu].quarantine, part->id);
+        r_backlog += nh_count_list(atomic_load(&nh_cpus[cpu].remote), part->id);
+    }
     s.quarantine_backlog = q_backlog;
     s.remote_free_backlog = r_backlog;
 
-    memcpy(a->user_buf, &s, sizeof(s));
+    if (!a->include_per_cpu) {
+        memcpy(a->user_buf, &s, sizeof(s));
+        return 0;
+    }
+    nh_part_stats_blob* blob = a->user_buf;
+    blob->summary = s;
+    blob->n_cpus = ncpu;
+    nh_part_stats_cpu* pc = (nh_part_stats_cpu*)(blob + 1);
+    for (uint32_t cpu = 0; cpu < ncpu; ++cpu) {
+        const nh_cpu_stats_t* st = &nh_cpus[cpu].stats[part->id];
+        pc[cpu] = (nh_part_stats_cpu){
+            .cpu_id = (uint16_t)cpu,
+            .allocs = st->allocs,
+            .frees = st->frees,
+            .mag_hits = st->mag_hits,
+            .mag_misses = st->mag_misses,
+            .harvests = nh_cpus[cpu].harvests,
+        };
+    }
     return 0;
 }
 
+// Class counters are per CPU and summed here, on the read side only.
+static int nh_ctl_class_stats(const nh_heapctl_get_class_stats_args* a) {
+    if (!a->user_buf)
+        return -1;
+    uint32_t first = 0, last = NH_MAX_CPUS;
+    if (a->cpu != NH_STATS_ALL_CPUS) {
+        if (a->cpu >= NH_MAX_CPUS)
+            return -1;
+        first = a->cpu;
+        last = first + 1;
+    }
+    size_t n = a->user_buf_len / sizeof(nh_class_stats);
+    if (n > nh_class_count)
+        n = nh_class_count;
+    nh_class_stats* out = a->user_buf;
+    for (size_t c = 0; c < n; ++c) {
+        int64_t quarantined = 0, inuse = 0;
+        nh_class_stats cs = {
+            .class_id = (uint32_t)c,
+            .size = nh_class_info[c].size,
+            .mag_size = nh_default_part.pools[c].depot.mag_size,
+        };
+        for (uint32_t cpu = first; cpu < last; ++cpu) {
+            const nh_class_stats_t* st = &nh_cpus[cpu].cls[c];
+            cs.fast_hits += st->hits;
+            cs.refills += st->refills;
+            cs.drains += st->drains;
+            quarantined += st->quarantined;
+            inuse += st->bytes_inuse;
+        }
+        cs.quarantined = quarantined > 0 ? (uint64_t)quarantined : 0;
+        cs.bytes_inuse = inuse > 0 ? (uint64_t)inuse : 0;
+        out[c] = cs;
+    }
+    return (int)n;
+}
+
+// New magazine sizes reach every depot at once; magazines already loaded
+// keep their capacity until they next go through the depot.
+static int nh_ctl_set_tunables(const nh_heap_tunables* t) {
+    nh_heap_tunables n = nh_tune;
+    if (t->mag_bytes)
+        n.mag_bytes = t->mag_bytes;
+    if (t->mag_rounds)
+        n.mag_rounds = t->mag_rounds;
+    if (t->quarantine_limit)
+        n.quarantine_limit = t->quarantine_limit;
+    if (t->reclaim_high)
+        n.reclaim_high = t->reclaim_high;
+    if (t->reclaim_low)
+        n.reclaim_low = t->reclaim_low;
+    if (n.mag_rounds < NH_MAG_MIN_ROUNDS || n.mag_rounds > NH_MAG_ROUNDS_MAX ||
+        n.reclaim_low >= n.reclaim_high)
+        return -1;
+
+    int resize = n.mag_bytes != nh_tune.mag_bytes || n.mag_rounds != nh_tune.mag_rounds;
+    nh_tune = n;
+    if (!resize)
+        return 0;
+    uint64_t rf = nh_irq_save();
+    nh_spin_lock(&nh_parts_lock);
+    for (uint32_t p = 0; p < nh_part_count; ++p) {
+        for (size_t c = 0; c < nh_class_count; ++c) {
+            nh_depot* d = &nh_parts[p]->pools[c].depot;
+            nh_spin_lock(&d->lock);
+            nh_depot_init(d, &nh_class_info[c]);
+            nh_spin_unlock(&d->lock);
+        }
+    }
+    nh_spin_unlock(&nh_parts_lock);
+    nh_irq_restore(rf);
+    return 0;
+}
+
+int sys_heapctl(nh_heapctl_op op, const void* args, size_t args_len) {
+    if (!args)
+        return -1;
+    switch (op) {
+    case NH_HEAPCTL_GET_STATS:
+        if (args_len < sizeof(nh_heapctl_get_stats_args))
+            return -1;
+        return nh_ctl_get_stats(args);
+    case NH_HEAPCTL_GET_CLASS_STATS:
+        if (args_len < sizeof(nh_heapctl_get_class_stats_args))
+            return -1;
+        return nh_ctl_class_stats(args);
+    case NH_HEAPCTL_GET_TUNABLES: {
+        const nh_heapctl_get_tunables_args* a = args;
+        if (args_len < sizeof(*a) || !a->user_buf || a->user_buf_len < sizeof(nh_tune))
+            return -1;
+        memcpy(a->user_buf, &nh_tune, sizeof(nh_tune));
+        return 0;
+    }
+    case NH_HEAPCTL_SET_TUNABLES:
+        if (args_len < sizeof(nh_heap_tunables))
+            return -1;
+        return nh_ctl_set_tunables(args);
+    case NH_HEAPCTL_PROF_SET:
+        if (args_len < sizeof(nh_heapctl_prof_set_args))
+            return -1;
+        return nh_ctl_prof_set(args);
+    case NH_HEAPCTL_PROF_DUMP:
+        if (args_len < sizeof(nh_heapctl_prof_dump_args))
+            return -1;
+        return nh_ctl_prof_dump(args);
+    default:
+        return -1;
+    }
+}
+
 static inline size_t nh_extract_align(nh_flags_t flags) {
     nh_flags_t f = flags & NH_ALIGN_MASK;
     if (!f) return 0;
@@ -505,7 +2268,7 @@ static inline size_t nh_extract_align(nh_flags_t flags) {
 int sys_nh_alloc(const nh_alloc_req* in, nh_alloc_resp* out) {
     if (!in || !out) return -1;
     size_t align = nh_extract_align(in->flags);
-    void* p = nitro_kmalloc(in->size, align);
+    void* p = nitro_kmalloc_flags(in->size, align, in->flags);
     if (!p) return -1;
     out->ptr = p;
     return 0;
@@ -526,39 +2289,62 @@ int sys_nh_realloc(const nh_realloc_req* in, nh_alloc_resp* out) {
     return 0;
 }
 
+// Handle objects live in a partition of their own, so compaction only ever
+// has movable blocks to step around.
 int sys_nh_halloc(const nh_halloc_req* in, nh_halloc_resp* out) {
     if (!in || !out) return -1;
     size_t align = nh_extract_align(in->flags);
-    void* p = nitro_kmalloc(in->size, align);
+    nh_partition* part = nh_flag_part(&nh_movable_part, "movable", NH_ANY_NODE, NH_MOVABLE);
+    void* p = nitro_pkmalloc(part, in->size, align);
     if (!p) return -1;
-    uint64_t h = atomic_fetch_add(&nh_handle_next, 1);
-    if (h >= NH_HANDLE_LIMIT) {
-        atomic_fetch_sub(&nh_handle_next, 1);
+    uint32_t idx = nh_handle_take();
+    if (!idx) {
         nitro_kfree(p);
         return -1;
     }
-    nh_handle_table[h] = p;
-    out->handle = h;
+    nh_handle_slot* slot = nh_handle_slot_at(idx);
+    nh_spin_lock(&nh_handle_lock);
+    atomic_store(&slot->ptr, p);
+    out->handle = (uint64_t)atomic_load(&slot->gen) << 32 | idx;
+    nh_spin_unlock(&nh_handle_lock);
     return 0;
 }
 
 int sys_nh_hptr(const nh_hptr_req* in, nh_alloc_resp* out) {
     if (!in || !out) return -1;
-    uint64_t h = in->handle;
-    if (h == 0 || h >= NH_HANDLE_LIMIT) return -1;
-    void* p = nh_handle_table[h];
+    void* p = nh_handle_lookup(in->handle);
     if (!p) return -1;
     out->ptr = p;
     return 0;
 }
 
+int sys_nh_hunpin(const nh_hunpin_req* in) {
+    if (!in) return -1;
+    nh_handle_slot* slot = nh_handle_slot_at((uint32_t)in->handle);
+    if (!slot || atomic_load(&slot->gen) != (uint32_t)(in->handle >> 32) ||
+        nh_handle_unpin_slot(slot) < 0) {
+        atomic_fetch_add(&nh_stale_unpins, 1);
+        return -1;
+    }
+    return 0;
+}
+
 int sys_nh_hfree(const nh_hfree_req* in) {
     if (!in) return -1;
-    uint64_t h = in->handle;
-    if (h == 0 || h >= NH_HANDLE_LIMIT) return -1;
-    void* p = nh_handle_table[h];
-    if (!p) return -1;
-    nh_handle_table[h] = NULL;
+    nh_handle_slot* slot = nh_handle_slot_at((uint32_t)in->handle);
+    if (!slot) return -1;
+    nh_spin_lock(&nh_handle_lock);
+    void* p = atomic_load(&slot->ptr);
+    if (!p || atomic_load(&slot->gen) != (uint32_t)(in->handle >> 32)) {
+        nh_spin_unlock(&nh_handle_lock);
+        return -1;
+    }
+    atomic_store(&slot->ptr, NULL);
+    atomic_fetch_add(&slot->gen, 1);
+    atomic_store(&slot->pins, 0);
+    slot->next_free = nh_handle_free;
+    nh_handle_free = (uint32_t)in->handle;
+    nh_spin_unlock(&nh_handle_lock);
     nitro_kfree(p);
     return 0;
 }
@@ -1,14 +1,48 @@
 #pragma once
 #include <stddef.h>
+#include <stdint.h>
+#include "nitroheap_flags.h"
 #ifdef __cplusplus
 extern "C" {
 #endif
+struct nh_partition;
+
 void nitroheap_init(void);
 void* nitro_kmalloc(size_t sz, size_t align);
+/** nitro_kmalloc honouring placement flags: NH_EPHEMERAL blocks come from
+ *  a per-CPU bump arena, NH_LOW_LATENCY ones from a reserve that is filled
+ *  ahead of time (NULL when it runs out), NH_NUMA_LOCAL ones from the
+ *  calling CPU's node.  Free with nitro_kfree. */
+void* nitro_kmalloc_flags(size_t sz, size_t align, nh_flags_t flags);
+/** Add `objects` slots of the size class for (sz, align) to the
+ *  NH_LOW_LATENCY reserve and fill it now.  Returns -1 if it cannot be. */
+int   nitro_kheap_reserve(size_t sz, size_t align, uint32_t objects);
 void  nitro_kfree(void* p);
 void* nitro_krealloc(void* p, size_t newsz, size_t align);
 void  nitro_kheap_dump_stats(const char* tag);
 void  nitro_kheap_trim(void);
+/** Recycle this CPU's quarantined and remotely freed blocks now rather than
+ *  at the next amortized harvest. */
+void  nitro_kheap_harvest(void);
+/** One background reclaim pass: reap depot magazines unused since the last
+ *  pass, mark sparse slabs draining and return empty slabs to buddy until
+ *  the heap holds NH_RECLAIM_LOW pages of them.  Returns pages released. */
+uint64_t nitro_kheap_reclaim(void);
+/** Move live handle (NH_MOVABLE) blocks out of sparse slabs into fuller
+ *  ones, updating the handle table.  Handles pinned by sys_nh_hptr stay
+ *  where they are.  Run by every reclaim pass.  Returns blocks moved. */
+uint64_t nitro_kheap_compact(void);
+/** Spawn the thread that runs nitro_kheap_reclaim when the heap asks for
+ *  it.  No-op in host builds. */
+void  nitro_reclaimd_start(void);
+
+/** Create an isolated partition: its slabs never serve another partition.
+ *  Returns NULL once NH_MAX_PARTITIONS exist. */
+struct nh_partition* nitro_partition_create(const char* name);
+/** Partition by id; 0 is the default partition behind nitro_kmalloc. */
+struct nh_partition* nitro_partition_get(uint16_t id);
+/** nitro_kmalloc from a specific partition; free with nitro_kfree. */
+void* nitro_pkmalloc(struct nh_partition* part, size_t sz, size_t align);
 #ifdef __cplusplus
 }
 #endif
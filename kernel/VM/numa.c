@@ -5,34 +5,228 @@
 static numa_region_t nodes[MAX_NUMA_NODES];
 static int node_cnt = 0;
 
+// Node of each local APIC id, from the SRAT; APIC_NODE_NONE when unknown.
+#define NUMA_MAX_APIC  256
+#define APIC_NODE_NONE 0xFF
+static uint8_t apic_node[NUMA_MAX_APIC];
+
+/* ---------------- SRAT ---------------- */
+
+struct numa_rsdp {
+    char     signature[8];        /* "RSD PTR " */
+    uint8_t  checksum;
+    char     oemid[6];
+    uint8_t  revision;
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} __attribute__((packed));
+
+struct numa_sdt {
+    char     signature[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oemid[6];
+    char     oemtableid[8];
+    uint32_t oem_revision;
+    uint32_t creator_id;
+    uint32_t creator_revision;
+} __attribute__((packed));
+
+#define SRAT_ENTRIES_OFFSET  48   /* header + 4 + 8 reserved bytes */
+#define SRAT_LAPIC           0
+#define SRAT_MEMORY          1
+#define SRAT_X2APIC          2
+#define SRAT_ENABLED         1u
+
+struct srat_lapic {
+    uint8_t  type;
+    uint8_t  length;              /* 16 */
+    uint8_t  domain_lo;
+    uint8_t  apic_id;
+    uint32_t flags;
+    uint8_t  sapic_eid;
+    uint8_t  domain_hi[3];
+    uint32_t clock_domain;
+} __attribute__((packed));
+
+struct srat_memory {
+    uint8_t  type;
+    uint8_t  length;              /* 40 */
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t len;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed));
+
+struct srat_x2apic {
+    uint8_t  type;
+    uint8_t  length;              /* 24 */
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved1;
+} __attribute__((packed));
+
+static int numa_checksum_ok(const void *p, uint32_t len) {
+    const uint8_t *b = p;
+    uint8_t sum = 0;
+    for (uint32_t i = 0; i < len; ++i)
+        sum += b[i];
+    return sum == 0;
+}
+
+// Find the SRAT through the XSDT (or the RSDT on ACPI 1.0 firmware).
+// Tables are reached through their physical addresses, which the kernel
+// maps 1:1 this early.
+static const struct numa_sdt *numa_find_srat(uint64_t rsdp_addr) {
+    const struct numa_rsdp *rsdp = (const struct numa_rsdp *)(uintptr_t)rsdp_addr;
+    if (!rsdp || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !numa_checksum_ok(rsdp, 20))
+        return NULL;
+    const struct numa_sdt *root;
+    uint32_t entry_size;
+    if (rsdp->revision >= 2 && rsdp->xsdt_addr) {
+        root = (const struct numa_sdt *)(uintptr_t)rsdp->xsdt_addr;
+        entry_size = 8;
+    } else {
+        root = (const struct numa_sdt *)(uintptr_t)rsdp->rsdt_addr;
+        entry_size = 4;
+    }
+    if (!root || root->length < sizeof(*root) || !numa_checksum_ok(root, root->length))
+        return NULL;
+    const uint8_t *entries = (const uint8_t *)root + sizeof(*root);
+    uint32_t count = (root->length - sizeof(*root)) / entry_size;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint64_t addr = 0;
+        memcpy(&addr, entries + i * entry_size, entry_size);
+        const struct numa_sdt *t = (const struct numa_sdt *)(uintptr_t)addr;
+        if (t && memcmp(t->signature, "SRAT", 4) == 0 &&
+            t->length >= SRAT_ENTRIES_OFFSET && numa_checksum_ok(t, t->length))
+            return t;
+    }
+    return NULL;
+}
+
+// Node index for a proximity domain, numbered in order of first
+// appearance; -1 once MAX_NUMA_NODES domains are known.
+static int numa_domain_node(uint32_t *domains, int *ndomains, uint32_t domain) {
+    for (int i = 0; i < *ndomains; ++i)
+        if (domains[i] == domain)
+            return i;
+    if (*ndomains == MAX_NUMA_NODES)
+        return -1;
+    domains[*ndomains] = domain;
+    return (*ndomains)++;
+}
+
+/*
+ * One node per proximity domain with enabled memory.  A domain's span runs
+ * from its lowest to its highest memory affinity range, clipped to
+ * [lo, hi), the span of usable RAM.  CPU affinity entries fill apic_node.
+ * Returns the number of nodes found; 0 leaves the caller's fallback.
+ */
+static int numa_parse_srat(const struct numa_sdt *srat, uint64_t lo, uint64_t hi) {
+    uint32_t domains[MAX_NUMA_NODES];
+    int ndomains = 0;
+    uint64_t base[MAX_NUMA_NODES], end[MAX_NUMA_NODES];
+    for (int i = 0; i < MAX_NUMA_NODES; ++i) {
+        base[i] = UINT64_MAX;
+        end[i] = 0;
+    }
+
+    const uint8_t *p = (const uint8_t *)srat + SRAT_ENTRIES_OFFSET;
+    const uint8_t *stop = (const uint8_t *)srat + srat->length;
+    // Memory first, so node numbers follow the memory layout.
+    for (const uint8_t *e = p; e + 2 <= stop && e[1] >= 2 && e + e[1] <= stop; e += e[1]) {
+        if (e[0] != SRAT_MEMORY || e[1] < sizeof(struct srat_memory))
+            continue;
+        const struct srat_memory *m = (const struct srat_memory *)e;
+        if (!(m->flags & SRAT_ENABLED) || !m->len)
+            continue;
+        uint64_t b = m->base > lo ? m->base : lo;
+        uint64_t t = m->base + m->len < hi ? m->base + m->len : hi;
+        if (t <= b)
+            continue;
+        int n = numa_domain_node(domains, &ndomains, m->domain);
+        if (n < 0)
+            continue;
+        if (b < base[n]) base[n] = b;
+        if (t > end[n]) end[n] = t;
+    }
+
+    int count = 0;
+    for (int n = 0; n < ndomains; ++n) {
+        if (end[n] <= base[n])
+            continue;
+        nodes[count].base = base[n];
+        nodes[count].length = end[n] - base[n];
+        domains[count] = domains[n];
+        count++;
+    }
+    if (count < 2)
+        return count;
+
+    for (const uint8_t *e = p; e + 2 <= stop && e[1] >= 2 && e + e[1] <= stop; e += e[1]) {
+        uint32_t domain, apic, flags;
+        if (e[0] == SRAT_LAPIC && e[1] >= sizeof(struct srat_lapic)) {
+            const struct srat_lapic *l = (const struct srat_lapic *)e;
+            domain = l->domain_lo | (uint32_t)l->domain_hi[0] << 8 |
+                     (uint32_t)l->domain_hi[1] << 16 | (uint32_t)l->domain_hi[2] << 24;
+            apic = l->apic_id;
+            flags = l->flags;
+        } else if (e[0] == SRAT_X2APIC && e[1] >= sizeof(struct srat_x2apic)) {
+            const struct srat_x2apic *x = (const struct srat_x2apic *)e;
+            domain = x->domain;
+            apic = x->x2apic_id;
+            flags = x->flags;
+        } else {
+            continue;
+        }
+        if (!(flags & SRAT_ENABLED) || apic >= NUMA_MAX_APIC)
+            continue;
+        for (int n = 0; n < count; ++n)
+            if (domains[n] == domain)
+                apic_node[apic] = (uint8_t)n;
+    }
+    return count;
+}
+
 void numa_init(const bootinfo_t *bootinfo) {
     node_cnt = 0;
+    memset(apic_node, APIC_NODE_NONE, sizeof(apic_node));
 
     /*
-     * The firmware memory map can contain dozens of small regions marked as
-     * EfiConventionalMemory (type 7).  The previous logic recorded at most the
-     * first MAX_NUMA_NODES such regions which, on some systems, were tiny
-     * fragments below 1MB.  As a result the buddy allocator only managed a
-     * handful of pages and early kalloc() calls failed, leading to boot-time
-     * crashes when loading agents.
-     *
-     * Instead, scan the entire map and keep the single largest usable region
-     * so the buddy allocator has a contiguous arena big enough for kernel
-     * allocations.  Proper NUMA support can add more regions later.
+     * Usable RAM spans the lowest to the highest EfiConventionalMemory
+     * (type 7) address; the holes in between are never freed into the
+     * buddy allocator because memblock only releases usable, unreserved
+     * ranges.  The SRAT, when firmware provides one, splits that span per
+     * proximity domain; otherwise everything is node 0.
      */
-    uint64_t best_len = 0, best_base = 0;
+    uint64_t lo = UINT64_MAX, hi = 0;
     for (uint32_t i = 0; i < bootinfo->mmap_entries; ++i) {
         if (bootinfo->mmap[i].type != 7)
             continue; /* only EfiConventionalMemory */
-        if (bootinfo->mmap[i].len > best_len) {
-            best_len = bootinfo->mmap[i].len;
-            best_base = bootinfo->mmap[i].addr;
-        }
+        uint64_t base = bootinfo->mmap[i].addr;
+        uint64_t end = base + bootinfo->mmap[i].len;
+        if (base < lo) lo = base;
+        if (end > hi) hi = end;
     }
 
-    if (best_len) {
-        nodes[0].base = best_base;
-        nodes[0].length = best_len;
+    if (hi > lo) {
+        const struct numa_sdt *srat = numa_find_srat(bootinfo->acpi_rsdp);
+        if (srat && (node_cnt = numa_parse_srat(srat, lo, hi)) > 1)
+            return;
+        memset(apic_node, APIC_NODE_NONE, sizeof(apic_node));
+        nodes[0].base = lo;
+        nodes[0].length = hi - lo;
         node_cnt = 1;
     } else if (bootinfo->mmap_entries) {
         /* Fallback: use the first entry if no usable region was found. */
@@ -52,11 +246,21 @@ const numa_region_t *numa_node_region(int node) {
     return &nodes[node];
 }
 
-// Return the NUMA node for the current CPU.  If no topology information is
-// available, fall back to a simple modulo distribution across detected nodes.
+int numa_addr_node(uint64_t addr) {
+    for (int n = 0; n < node_cnt; ++n)
+        if (addr - nodes[n].base < nodes[n].length)
+            return n;
+    return 0;
+}
+
+// Return the NUMA node for the current CPU: its SRAT proximity domain, or,
+// if no topology information is available, a simple modulo distribution
+// across detected nodes.
 int current_cpu_node(void) {
     if (node_cnt <= 1)
         return 0;
     uint32_t cpu = smp_cpu_id();
+    if (cpu < NUMA_MAX_APIC && apic_node[cpu] != APIC_NODE_NONE)
+        return apic_node[cpu];
     return cpu % node_cnt;
 }
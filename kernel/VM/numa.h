@@ -16,6 +16,8 @@ typedef struct {
 void numa_init(const bootinfo_t *bootinfo);
 int  numa_node_count(void);
 const numa_region_t *numa_node_region(int node);
+// Node whose span holds physical address `addr`; 0 if none does.
+int  numa_addr_node(uint64_t addr);
 // Best-effort NUMA node for the executing CPU.
 int  current_cpu_node(void);
 
@@ -0,0 +1,29 @@
+#include "page.h"
+#include "memblock.h"
+
+page_t  *page_db;
+uint64_t page_db_base_pfn;
+uint64_t page_db_count;
+
+int page_db_init(uint64_t start, uint64_t end) {
+    page_db = NULL;
+    page_db_base_pfn = 0;
+    page_db_count = 0;
+
+    uint64_t first = start >> PAGE_SHIFT;
+    uint64_t last = (end + PAGE_SIZE - 1) >> PAGE_SHIFT;
+    if (last <= first)
+        return -1;
+
+    // memblock hands back zeroed memory, so descriptors only need flags.
+    page_t *db = memblock_alloc((last - first) * sizeof(page_t), PAGE_SIZE);
+    if (!db)
+        return -1;
+    for (uint64_t i = 0; i < last - first; ++i)
+        db[i].flags = PG_RESERVED;
+
+    page_db = db;
+    page_db_base_pfn = first;
+    page_db_count = last - first;
+    return 0;
+}
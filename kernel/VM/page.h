@@ -0,0 +1,131 @@
+/*
+ * Page Frame Database
+ * -------------------
+ * One compact descriptor per physical 4KiB frame, indexed by PFN, carved
+ * from memblock at boot and sized to installed RAM.  It is the single place
+ * to look up a frame's state: the buddy allocator keeps its free-block
+ * markers here, COW keeps reference counts and the COW bit, and owners such
+ * as NitroHeap record which span a page belongs to.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+#define PAGE_SHIFT 12
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// page_t.flags
+#define PG_RESERVED  (1u << 0)   // hole or boot reservation, never allocatable
+#define PG_BUDDY     (1u << 1)   // head of a free buddy block of `order`
+#define PG_HEAD      (1u << 2)   // head of an allocated block of `order`
+#define PG_COW       (1u << 3)   // mapped copy-on-write
+#define PG_SLAB      (1u << 4)   // heap span; `private` is the span
+#define PG_PTDEAD    (1u << 5)   // page table unlinked, waiting to be freed
+#define PG_KSM       (1u << 6)   // merged by KSM, which holds a reference
+
+// page_t.owner
+enum {
+    PAGE_OWNER_NONE = 0,
+    PAGE_OWNER_KERNEL,
+    PAGE_OWNER_HEAP,
+    PAGE_OWNER_USER,
+    PAGE_OWNER_PAGETABLE,
+};
+
+typedef struct page {
+    uint32_t flags;       // PG_*, updated atomically
+    uint32_t refcount;    // references (COW sharers, pins); present
+                          // entries of a last-level page table
+    union {
+        uint32_t mapcount;    // page-table mappings
+        uint32_t ptl;         // page tables: lock for their entries
+        uint32_t zs_free;     // zswap pool pages: index+1 of the first
+                              // free chunk, 0 when full
+    };
+    uint8_t  order;       // buddy order when PG_BUDDY or PG_HEAD
+    uint8_t  node;        // NUMA node
+    uint16_t owner;       // PAGE_OWNER_*
+    void    *private;     // owner data, e.g. the NitroHeap span; the
+                          // checksum KSM last saw for user frames
+    union {
+        void    *rmap;        // reverse-map link (address space or anon chain)
+        struct page *zs_prev; // zswap pool pages: previous page on the
+                              // class's partial list (`private` is next)
+    };
+} page_t;
+
+extern page_t  *page_db;
+extern uint64_t page_db_base_pfn;
+extern uint64_t page_db_count;
+
+/**
+ * Allocate descriptors for every frame in [start, end) from memblock.  All
+ * frames start out PG_RESERVED; the buddy allocator clears the bit as it
+ * takes ownership of free ranges.  Returns 0 on success, -1 on failure.
+ */
+int page_db_init(uint64_t start, uint64_t end);
+
+/** Descriptor for a physical address, or NULL if outside the database. */
+static inline page_t *phys_to_page(uint64_t phys) {
+    uint64_t idx = (phys >> PAGE_SHIFT) - page_db_base_pfn;
+    return idx < page_db_count ? &page_db[idx] : NULL;
+}
+
+static inline uint64_t page_to_phys(const page_t *pg) {
+    return (page_db_base_pfn + (uint64_t)(pg - page_db)) << PAGE_SHIFT;
+}
+
+static inline void page_set_flag(page_t *pg, uint32_t f) {
+    __atomic_fetch_or(&pg->flags, f, __ATOMIC_RELEASE);
+}
+static inline void page_clear_flag(page_t *pg, uint32_t f) {
+    __atomic_fetch_and(&pg->flags, ~f, __ATOMIC_RELEASE);
+}
+static inline int page_test_flag(const page_t *pg, uint32_t f) {
+    return (__atomic_load_n(&pg->flags, __ATOMIC_ACQUIRE) & f) != 0;
+}
+
+static inline uint32_t page_ref_count(const page_t *pg) {
+    return __atomic_load_n(&pg->refcount, __ATOMIC_ACQUIRE);
+}
+static inline void page_ref_inc(page_t *pg) {
+    __atomic_fetch_add(&pg->refcount, 1, __ATOMIC_RELAXED);
+}
+/** Drop a reference; returns 1 if it was the last one.  Saturates at zero. */
+static inline int page_ref_dec_and_test(page_t *pg) {
+    uint32_t old = __atomic_load_n(&pg->refcount, __ATOMIC_RELAXED);
+    do {
+        if (old == 0)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&pg->refcount, &old, old - 1, 1,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return old == 1;
+}
+
+static inline void page_mapcount_inc(page_t *pg) {
+    __atomic_fetch_add(&pg->mapcount, 1, __ATOMIC_RELAXED);
+}
+static inline void page_mapcount_dec(page_t *pg) {
+    __atomic_fetch_sub(&pg->mapcount, 1, __ATOMIC_RELAXED);
+}
+
+/** Clear everything but the node, as when a frame returns to the allocator. */
+static inline void page_reset(page_t *pg) {
+    __atomic_store_n(&pg->flags, 0, __ATOMIC_RELAXED);
+    pg->refcount = 0;
+    pg->mapcount = 0;
+    pg->order = 0;
+    pg->owner = PAGE_OWNER_NONE;
+    pg->private = NULL;
+    pg->rmap = NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -3,184 +3,1473 @@
 #include "../../user/libc/libc.h"
 #include <stdint.h>
 #include "pmm_buddy.h"
+#include "page.h"
 #include "numa.h"
+#include "heap.h"
+#include "../arch/CPU/smp.h"
+#include "../../include/cpuid.h"
+#include "tlb.h"
+#include "mmap.h"
+#include <printf.h>
 
-// Simple spinlock for SMP safety
-static volatile int page_lock = 0;
-#define PAGING_LOCK()   while(__sync_lock_test_and_set(&page_lock,1)){}
-#define PAGING_UNLOCK() __sync_lock_release(&page_lock)
+// Locking.  Upper-level entries (PML4, PDPT, PD, 2 MiB leaves included)
+// change under the lock of the space that owns them: the kernel space for
+// the shared slots, the space itself for the private ones.  The entries of
+// a page table (4 KiB leaves) change under that table's lock, kept in its
+// page_t, so mappers in the same space only contend when they hit the same
+// 2 MiB.  Lock order: space lock, then table lock.  Lookups take neither;
+// they read entries atomically inside a walk section (see below).
+//
+// A page table page's descriptor has owner PAGE_OWNER_PAGETABLE, its lock
+// in `ptl` and, for the last level, the number of non-zero entries (present
+// ones and swap entries) in `refcount`.  The table is unlinked from its
+// parent when that drops to 0.
 
-// Static page tables (identity map first 4GB as in legacy paging)
-// Export the top-level PML4 so the VMM can share kernel mappings with
-// per-task page tables.
-// Static kernel page tables (identity map first 4GB as in legacy paging)
+#define PAGING_MAX_CPUS 32
+#define PTE_ADDR_MASK   0x000FFFFFFFFFF000ULL
+#define PTE_TABLE(e)    ((uint64_t *)(uintptr_t)((e) & PTE_ADDR_MASK))
+#define PML4_INDEX(va)  (((va) >> 39) & 0x1FF)
+#define PDPT_INDEX(va)  (((va) >> 30) & 0x1FF)
+#define PD_INDEX(va)    (((va) >> 21) & 0x1FF)
+#define PT_INDEX(va)    (((va) >> 12) & 0x1FF)
+#define KERNEL_SLOT_FIRST 256
+
+#define CR3_NOFLUSH   (1ULL << 63)
+#define CR4_PCIDE     (1ULL << 17)
+// PCIDs 1..PCID_SLOTS are handed out per CPU, least recently assigned
+// first; PCID 0 is only used when PCID is off.
+#define PCID_SLOTS    8
+
+// Kernel PML4.  paging_init() fills it from the firmware's tables and
+// loads it; every other space copies its shared slots.
 static uint64_t __attribute__((aligned(PAGE_SIZE))) kernel_pml4[512];
-static uint64_t __attribute__((aligned(PAGE_SIZE), unused)) pdpt[512];
-static uint64_t __attribute__((aligned(PAGE_SIZE), unused)) pd[4][512];
 
-// Pointer to the page table of the currently running task.  By default we
-// operate on the kernel's bootstrap page table until a task switches in a
-// private PML4.
-static uint64_t *current_pml4 = kernel_pml4;
+// Lower-half slots the firmware's identity map occupies.  They are shared
+// by every space and left as the firmware built them: mapping or unmapping
+// inside them is refused, as the kernel runs out of that map.
+static uint64_t boot_slots[KERNEL_SLOT_FIRST / 64];
+
+static vm_space_t kernel_space = { .pml4 = kernel_pml4, .id = 1, .refs = 1 };
+// Every other space, oldest first, for scanners that visit them all.  A
+// space leaves when its last reference goes.
+static volatile int spaces_lock;
+static vm_space_t *spaces_head, *spaces_tail;
+static uint64_t next_space_id = 2;
+static int paging_live;
+static int pcid_supported, invpcid_supported, pcid_on;
+static int gbpages;                       // 1 GiB leaves allowed
+
+// Per-CPU view: the loaded space, the tlb_gen this CPU's translations for
+// it are current with, and which space each PCID last held, at which
+// tlb_gen.  Only the owning CPU touches its entry, with IRQs off, except
+// `walk_epoch`, which table reclaim reads from every CPU.
+typedef struct {
+    vm_space_t *cur;
+    uint64_t    cur_gen;
+    int         cur_slot;                 // -1: PCID 0
+    uint64_t    slot_id[PCID_SLOTS];
+    uint64_t    slot_gen[PCID_SLOTS];
+    uint32_t    victim;
+    uint64_t    switches;
+    uint64_t    flushes;
+    uint64_t    walk_epoch;               // 0: not walking
+    uint32_t    walk_depth;               // nested walk sections
+} paging_cpu_t;
+
+static paging_cpu_t paging_cpu[PAGING_MAX_CPUS];
+static uint64_t cpus_active;              // CPUs that have loaded a space
+
+// Deferred free of page tables.  A walk may still be inside a table after
+// it is unlinked, so the table is only freed once every walk that started
+// before the unlink has ended.  Each walk records the epoch it started in;
+// unlinked tables collect on `pt_pending` until the epoch is bumped, then
+// wait on `pt_waiting` for the CPUs still walking in an older epoch.
+static volatile int pt_free_lock;
+static uint64_t pt_epoch = 1;
+static page_t  *pt_pending;               // chained through page_t.private
+static page_t  *pt_waiting;
+static uint64_t pt_waiting_epoch;
+static volatile int ptl_fallback;         // tables without a descriptor
+
+#ifdef KERNEL_BUILD
+static inline uint64_t paging_irq_save(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    return rf;
+}
+
+static inline void paging_irq_restore(uint64_t rf) {
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    struct { uint64_t pcid, addr; } desc = { pcid, addr };
+    __asm__ volatile("invpcid %0, %1" :: "m"(desc), "r"(type) : "memory");
+}
+
+static inline void invlpg(uint64_t va) {
+    __asm__ volatile("invlpg (%0)" :: "r"(va) : "memory");
+}
+
+static inline uint64_t read_cr3(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3,%0" : "=r"(cr3));
+    return cr3;
+}
+
+static inline void write_cr3(uint64_t cr3) {
+    __asm__ volatile("mov %0,%%cr3" :: "r"(cr3) : "memory");
+}
+
+static inline void cpu_relax(void) {
+    __asm__ volatile("pause");
+}
+#else
+// Host builds (tests/unit/test_paging.c) walk tables in ordinary memory
+// with a thread standing in for each CPU; there is no TLB or CR3, and
+// there may be more threads than host CPUs to spin on.
+#include <sched.h>
+static inline uint64_t paging_irq_save(void) { return 0; }
+static inline void paging_irq_restore(uint64_t rf) { (void)rf; }
+static inline void invpcid(uint64_t type, uint64_t pcid, uint64_t addr) {
+    (void)type; (void)pcid; (void)addr;
+}
+static inline void invlpg(uint64_t va) { (void)va; }
+static inline uint64_t read_cr3(void) { return 0; }
+static inline void write_cr3(uint64_t cr3) { (void)cr3; }
+static inline void cpu_relax(void) { sched_yield(); }
+#endif
+
+static inline void spin_lock(volatile int *l) {
+    while (__sync_lock_test_and_set(l, 1))
+        cpu_relax();
+}
+
+static inline void spin_unlock(volatile int *l) {
+    __sync_lock_release(l);
+}
+
+static inline uint32_t paging_cpu_index(void) {
+    uint32_t cpu = smp_cpu_index();
+    return cpu < PAGING_MAX_CPUS ? cpu : 0;
+}
+
+static inline paging_cpu_t *this_paging_cpu(void) {
+    return &paging_cpu[paging_cpu_index()];
+}
+
+static inline int slot_is_boot(uint64_t slot) {
+    return slot < KERNEL_SLOT_FIRST && (boot_slots[slot / 64] >> (slot % 64)) & 1;
+}
+
+static inline int slot_is_shared(uint64_t slot) {
+    return slot >= KERNEL_SLOT_FIRST || slot_is_boot(slot);
+}
+
+// Space whose private entries the walkers below change.
+static inline vm_space_t *cur_space(void) {
+    vm_space_t *vs = this_paging_cpu()->cur;
+    return vs ? vs : &kernel_space;
+}
+
+// Space whose lock covers the tables mapping `virt`.
+static inline vm_space_t *table_owner(uint64_t virt) {
+    return slot_is_shared(PML4_INDEX(virt)) ? &kernel_space : cur_space();
+}
+
+// Entries are read while other CPUs change them.
+static inline uint64_t pte_read(const uint64_t *e) {
+    return __atomic_load_n(e, __ATOMIC_ACQUIRE);
+}
+
+static inline void pte_write(uint64_t *e, uint64_t val) {
+    __atomic_store_n(e, val, __ATOMIC_RELEASE);
+}
+
+// Walk sections run with IRQs off.  They nest only when a table
+// allocation inside one reclaims memory (zswap walks other spaces); the
+// inner section keeps the outer, older epoch.  The store of the epoch is
+// a full barrier: the entries read after it are ones a reclaim that saw
+// the CPU idle had not unlinked yet.
+static inline void walk_begin(paging_cpu_t *pc) {
+    if (pc->walk_depth++)
+        return;
+    __atomic_store_n(&pc->walk_epoch, __atomic_load_n(&pt_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_SEQ_CST);
+}
+
+static inline void walk_end(paging_cpu_t *pc) {
+    if (--pc->walk_depth)
+        return;
+    __atomic_store_n(&pc->walk_epoch, 0, __ATOMIC_RELEASE);
+}
+
+static page_t *ptl_lock(uint64_t *table) {
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)table);
+    spin_lock(pg ? (volatile int *)&pg->ptl : &ptl_fallback);
+    return pg;
+}
+
+static void ptl_unlock(page_t *pg) {
+    spin_unlock(pg ? (volatile int *)&pg->ptl : &ptl_fallback);
+}
+
+// A table found dead after taking its lock was unlinked under the walk;
+// the caller walks again.
+static inline int pt_dead(const page_t *pg) {
+    return pg && page_test_flag(pg, PG_PTDEAD);
+}
+
+// First address at or above `va` past the region one entry at `shift`
+// covers.
+static inline uint64_t next_entry(uint64_t va, unsigned shift) {
+    return (va | ((1ULL << shift) - 1)) + 1;
+}
+
+// Invalidate `virt` everywhere after its entry changed.
+static void flush_page(uint64_t virt, uint64_t size) {
+    uint64_t slot = PML4_INDEX(virt);
+    tlb_flush(slot_is_shared(slot) ? NULL : cur_space(), virt & ~(size - 1), size);
+}
+
+// Reload CR3 without the no-flush bit: drops the current PCID's entries.
+static void reload_cr3(paging_cpu_t *pc) {
+    uint64_t cr3 = (uint64_t)pc->cur->pml4;
+    if (pcid_on && pc->cur_slot >= 0)
+        cr3 |= (uint64_t)pc->cur_slot + 1;
+    write_cr3(cr3);
+}
+
+static void invlpg_ranges(const tlb_req_t *req, uint64_t pcid, int other) {
+    for (uint32_t i = 0; i < req->nr; ++i)
+        for (uint64_t va = req->r[i].start; va < req->r[i].end; va += PAGE_SIZE) {
+            if (other)
+                invpcid(0, pcid, va);
+            else
+                invlpg(va);
+        }
+}
+
+// Bring this CPU up to date with `req`.  A private space that is not
+// loaded here needs nothing: its PCID is behind req->gen and is flushed
+// when the space is next loaded.  Shared entries may be cached under any
+// PCID.
+void paging_flush_local(const tlb_req_t *req) {
+    if (!paging_live)
+        return;
+    if (req->full && !req->vs) {
+        paging_flush_local_all();
+        return;
+    }
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    if (req->vs) {
+        if (pc->cur == req->vs && pc->cur_gen < req->gen) {
+            if (!req->full && pc->cur_gen + 1 == req->gen) {
+                invlpg_ranges(req, 0, 0);
+                pc->cur_gen = req->gen;
+            } else {
+                // Missed a generation, or too much to do page by page.
+                pc->cur_gen = __atomic_load_n(&req->vs->tlb_gen, __ATOMIC_ACQUIRE);
+                reload_cr3(pc);
+            }
+        }
+    } else {
+        invlpg_ranges(req, 0, 0);
+        for (int i = 0; pcid_on && i < PCID_SLOTS; ++i) {
+            if (!pc->slot_id[i] || i == pc->cur_slot)
+                continue;
+            if (invpcid_supported)
+                invlpg_ranges(req, (uint64_t)i + 1, 1);
+            else
+                pc->slot_gen[i] = ~0ULL;   // flush when next loaded
+        }
+    }
+    paging_irq_restore(rf);
+}
+
+// Drop every translation this CPU holds, under every PCID.
+void paging_flush_local_all(void) {
+    if (!paging_live)
+        return;
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    pc->cur_gen = __atomic_load_n(&pc->cur->tlb_gen, __ATOMIC_ACQUIRE);
+    if (pcid_on && invpcid_supported) {
+        invpcid(2, 0, 0);
+    } else {
+        for (int i = 0; i < PCID_SLOTS; ++i)
+            pc->slot_gen[i] = ~0ULL;
+        reload_cr3(pc);
+    }
+    paging_irq_restore(rf);
+}
+
+uint64_t paging_cpus_active(void) {
+    return __atomic_load_n(&cpus_active, __ATOMIC_SEQ_CST);
+}
 
 static uint64_t *alloc_table(int numa_node) {
     void *page = buddy_alloc(0, numa_node, 0);
     if (!page)
         return NULL;
     memset(page, 0, PAGE_SIZE);
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)page);
+    if (pg)
+        pg->owner = PAGE_OWNER_PAGETABLE;
     return (uint64_t *)page;
 }
 
-static uint64_t *get_or_create(uint64_t *table, uint64_t index, uint64_t flags, int numa_node) {
-    if (!(table[index] & PAGE_PRESENT)) {
+static void free_table(uint64_t *table) {
+    buddy_free(table, 0, numa_addr_node((uint64_t)(uintptr_t)table));
+}
+
+// True when no CPU is still in a walk that started before `epoch`.
+static int walks_past(uint64_t epoch) {
+    for (int cpu = 0; cpu < PAGING_MAX_CPUS; ++cpu) {
+        uint64_t e = __atomic_load_n(&paging_cpu[cpu].walk_epoch, __ATOMIC_SEQ_CST);
+        if (e && e < epoch)
+            return 0;
+    }
+    return 1;
+}
+
+void paging_reclaim_tables(void) {
+    page_t *done = NULL;
+    spin_lock(&pt_free_lock);
+    if (pt_waiting && walks_past(pt_waiting_epoch)) {
+        done = pt_waiting;
+        pt_waiting = NULL;
+    }
+    if (!pt_waiting && pt_pending) {
+        // Walks from here on start in the new epoch and cannot reach the
+        // pending tables, which were unlinked before it.
+        pt_waiting = pt_pending;
+        pt_pending = NULL;
+        pt_waiting_epoch = __atomic_add_fetch(&pt_epoch, 1, __ATOMIC_SEQ_CST);
+    }
+    spin_unlock(&pt_free_lock);
+
+    while (done) {
+        page_t *next = done->private;
+        free_table((uint64_t *)(uintptr_t)page_to_phys(done));
+        done = next;
+    }
+}
+
+int paging_tables_retired(void) {
+    return __atomic_load_n(&pt_pending, __ATOMIC_RELAXED) ||
+           __atomic_load_n(&pt_waiting, __ATOMIC_RELAXED);
+}
+
+// Queue an unlinked table for freeing.  Its TLB flush has completed (not
+// just been batched), so no paging-structure cache points at it any more.
+static void pt_retire(uint64_t *table) {
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)table);
+    if (!pg)
+        return;
+    spin_lock(&pt_free_lock);
+    pg->private = pt_pending;
+    pt_pending = pg;
+    spin_unlock(&pt_free_lock);
+    paging_reclaim_tables();
+}
+
+// Next-level table under table[index], installed under the owner's lock if
+// missing.  NULL if out of memory or if the entry maps a large page.
+static uint64_t *descend(vm_space_t *owner, uint64_t *table, uint64_t index, int numa_node) {
+    uint64_t e = pte_read(&table[index]);
+    if (!(e & PAGE_PRESENT)) {
         uint64_t *new = alloc_table(numa_node);
-        if (!new) return NULL;
-        table[index] = ((uint64_t)new) | flags | PAGE_PRESENT | PAGE_WRITABLE;
+        if (!new)
+            return NULL;
+        spin_lock(&owner->lock);
+        e = pte_read(&table[index]);
+        if (!(e & PAGE_PRESENT)) {
+            e = (uint64_t)(uintptr_t)new | PAGE_USER | PAGE_PRESENT | PAGE_WRITABLE;
+            pte_write(&table[index], e);
+            new = NULL;
+        }
+        spin_unlock(&owner->lock);
+        if (new)
+            free_table(new);      // lost the race; never visible
     }
-    return (uint64_t *)(table[index] & ~0xFFFULL);
+    if (e & PAGE_SIZE_2MB)
+        return NULL;
+    return PTE_TABLE(e);
+}
+
+// Entry mapping `virt` in `pml4`: a PTE, or the PDE/PDPTE of a 2 MiB/1 GiB
+// page, with the page size in *size and the table holding the entry in
+// *table.  NULL if nothing maps it.  Lockless: call inside a walk section.
+static uint64_t *walk(uint64_t *pml4, uint64_t virt, uint64_t *size, uint64_t **table) {
+    uint64_t e = pte_read(&pml4[PML4_INDEX(virt)]);
+    if (!(e & PAGE_PRESENT)) return NULL;
+    uint64_t *pdpt_t = PTE_TABLE(e);
+    e = pte_read(&pdpt_t[PDPT_INDEX(virt)]);
+    if (!(e & PAGE_PRESENT)) return NULL;
+    if (e & PAGE_SIZE_2MB) {
+        *size = 1ULL << 30;
+        *table = pdpt_t;
+        return &pdpt_t[PDPT_INDEX(virt)];
+    }
+    uint64_t *pd_t = PTE_TABLE(e);
+    e = pte_read(&pd_t[PD_INDEX(virt)]);
+    if (!(e & PAGE_PRESENT)) return NULL;
+    if (e & PAGE_SIZE_2MB) {
+        *size = 1ULL << 21;
+        *table = pd_t;
+        return &pd_t[PD_INDEX(virt)];
+    }
+    uint64_t *pt_t = PTE_TABLE(e);
+    if (!(pte_read(&pt_t[PT_INDEX(virt)]) & PAGE_PRESENT)) return NULL;
+    *size = PAGE_SIZE;
+    *table = pt_t;
+    return &pt_t[PT_INDEX(virt)];
+}
+
+// Unlink the page table `pt_t` under `virt` if it is still empty.  Returns
+// it for retiring once the caller's TLB flush is done, or NULL if a mapper
+// got there first.
+static uint64_t *unlink_table(vm_space_t *owner, uint64_t virt, uint64_t *pt_t) {
+    uint64_t *unlinked = NULL;
+    spin_lock(&owner->lock);
+    uint64_t e = pte_read(&owner->pml4[PML4_INDEX(virt)]);
+    if (e & PAGE_PRESENT) {
+        uint64_t *pdpt_t = PTE_TABLE(e);
+        e = pte_read(&pdpt_t[PDPT_INDEX(virt)]);
+        if ((e & PAGE_PRESENT) && !(e & PAGE_SIZE_2MB)) {
+            uint64_t *pde = &PTE_TABLE(e)[PD_INDEX(virt)];
+            e = pte_read(pde);
+            if ((e & PAGE_PRESENT) && !(e & PAGE_SIZE_2MB) && PTE_TABLE(e) == pt_t) {
+                page_t *pg = ptl_lock(pt_t);
+                if (pg && !pg->refcount && !pt_dead(pg)) {
+                    pte_write(pde, 0);
+                    page_set_flag(pg, PG_PTDEAD);
+                    unlinked = pt_t;
+                }
+                ptl_unlock(pg);
+            }
+        }
+    }
+    spin_unlock(&owner->lock);
+    return unlinked;
 }
 
 // Map (virt->phys) using huge or normal page, NUMA-aware
 void paging_map_adv(uint64_t virt, uint64_t phys, uint64_t flags, uint32_t order, int numa_node) {
-    PAGING_LOCK();
-    uint64_t pml4_i = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virt >> 30) & 0x1FF;
-    uint64_t pd_i   = (virt >> 21) & 0x1FF;
-    uint64_t pt_i   = (virt >> 12) & 0x1FF;
+    if (slot_is_boot(PML4_INDEX(virt)))
+        return;
+    vm_space_t *owner = table_owner(virt);
+    int huge = order >= 9 || (flags & PAGE_HUGE_2MB);
+    uint64_t val = huge ? (phys & ~0x1FFFFFULL) | (flags & ~PAGE_HUGE_2MB) |
+                          PAGE_PRESENT | PAGE_WRITABLE | PAGE_SIZE_2MB
+                        : (phys & ~0xFFFULL) | flags | PAGE_PRESENT;
+    uint64_t old = 0, *dead = NULL;
+
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    for (;;) {
+        walk_begin(pc);
+        uint64_t *pdpt_t = descend(owner, owner->pml4, PML4_INDEX(virt), numa_node);
+        uint64_t *pd_t = pdpt_t ? descend(owner, pdpt_t, PDPT_INDEX(virt), numa_node) : NULL;
+        if (!pd_t)
+            break;                // failed allocation, nothing mapped
+        if (huge) {
+            // A page table this replaces goes, with whatever it mapped.
+            uint64_t *pde = &pd_t[PD_INDEX(virt)];
+            spin_lock(&owner->lock);
+            old = pte_read(pde);
+            if ((old & PAGE_PRESENT) && !(old & PAGE_SIZE_2MB)) {
+                dead = PTE_TABLE(old);
+                page_t *pg = ptl_lock(dead);
+                if (pg)
+                    page_set_flag(pg, PG_PTDEAD);
+                ptl_unlock(pg);
+            }
+            pte_write(pde, val);
+            spin_unlock(&owner->lock);
+            break;
+        }
+        uint64_t *pt_t = descend(owner, pd_t, PD_INDEX(virt), numa_node);
+        if (!pt_t)
+            break;
+        page_t *pg = ptl_lock(pt_t);
+        if (pt_dead(pg)) {
+            ptl_unlock(pg);
+            walk_end(pc);
+            continue;
+        }
+        uint64_t *pte = &pt_t[PT_INDEX(virt)];
+        old = pte_read(pte);
+        pte_write(pte, val);
+        if (pg && !old)
+            pg->refcount++;
+        ptl_unlock(pg);
+        break;
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
 
-    uint64_t *pdpt_t = get_or_create(current_pml4, pml4_i, PAGE_USER, numa_node);
-    if (!pdpt_t) goto out;
-    uint64_t *pd_t = get_or_create(pdpt_t, pdpt_i, PAGE_USER, numa_node);
-    if (!pd_t) goto out;
+    if (old & PAGE_PRESENT)
+        flush_page(virt, (huge || (old & PAGE_SIZE_2MB)) ? 1ULL << 21 : PAGE_SIZE);
+    if (dead) {
+        tlb_batch_flush();
+        pt_retire(dead);
+    }
+}
 
-    if (order >= 9 || (flags & PAGE_HUGE_2MB)) {
-        pd_t[pd_i] = (phys & ~0x1FFFFFULL) | (flags & ~PAGE_HUGE_2MB) |
-                     PAGE_PRESENT | PAGE_WRITABLE | PAGE_SIZE_2MB;
-        goto done;
+uint64_t paging_map_pages(uint64_t virt, uint64_t *frames, uint64_t n,
+                          uint64_t flags, int numa_node) {
+    if (!n || slot_is_boot(PML4_INDEX(virt)))
+        return 0;
+    vm_space_t *owner = table_owner(virt);
+    uint64_t mapped = 0, i = 0;
+
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    while (i < n) {
+        uint64_t va = virt + i * PAGE_SIZE;
+        uint64_t run = 512 - PT_INDEX(va);  // to the end of this page table
+        if (run > n - i)
+            run = n - i;
+        walk_begin(pc);
+        uint64_t *pdpt_t = descend(owner, owner->pml4, PML4_INDEX(va), numa_node);
+        uint64_t *pd_t = pdpt_t ? descend(owner, pdpt_t, PDPT_INDEX(va), numa_node) : NULL;
+        uint64_t *pt_t = pd_t ? descend(owner, pd_t, PD_INDEX(va), numa_node) : NULL;
+        if (!pt_t) {
+            // Out of memory or a large page; either way nothing fits here.
+            walk_end(pc);
+            i += run;
+            continue;
+        }
+        page_t *pg = ptl_lock(pt_t);
+        if (pt_dead(pg)) {
+            ptl_unlock(pg);
+            walk_end(pc);
+            continue;
+        }
+        // Entries were empty, so no TLB holds them: nothing to flush.
+        for (uint64_t k = 0; k < run; ++k, ++i) {
+            uint64_t *pte = &pt_t[PT_INDEX(va) + k];
+            if (!frames[i] || pte_read(pte))
+                continue;                   // mapped, or a swap entry
+            pte_write(pte, (frames[i] & ~0xFFFULL) | flags | PAGE_PRESENT);
+            frames[i] = 0;
+            mapped++;
+            if (pg)
+                pg->refcount++;
+        }
+        ptl_unlock(pg);
+        walk_end(pc);
     }
+    paging_irq_restore(rf);
+    return mapped;
+}
 
-    uint64_t *pt_t = get_or_create(pd_t, pd_i, PAGE_USER, numa_node);
-    if (!pt_t) goto out;
-    pt_t[pt_i] = (phys & ~0xFFFULL) | flags | PAGE_PRESENT;
-    goto done;
+// ----------- Range operations -----------
+// One pass over [virt, virt+len): each iteration handles the largest unit
+// the position allows (a 1 GiB or 2 MiB leaf, a whole page table, or the
+// run of 4 KiB entries to the end of a page table), walking from the root
+// once per unit instead of once per page.  Changes to large pages or
+// table links retry the iteration, so every decision is made on what the
+// tables hold now.
 
-out:
-    // failed allocation, nothing mapped
-done:
-    
-    PAGING_UNLOCK();
+enum { RANGE_MAP, RANGE_PROTECT, RANGE_UNMAP, RANGE_UNMAP_LAZY };
+
+#define SIZE_1GB (1ULL << 30)
+#define SIZE_2MB (1ULL << 21)
+#define RANGE_DEAD_MAX 16       // unlinked tables held for one flush
+
+static inline int is_leaf(uint64_t e) {
+    return (e & PAGE_PRESENT) && (e & PAGE_SIZE_2MB);
 }
 
-void paging_unmap_adv(uint64_t virt) {
-    PAGING_LOCK();
-    uint64_t pml4_i = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virt >> 30) & 0x1FF;
-    uint64_t pd_i   = (virt >> 21) & 0x1FF;
-    uint64_t pt_i   = (virt >> 12) & 0x1FF;
+// Replace the large leaf at *e (level 3: 1 GiB, 2: 2 MiB) by a table of
+// the next size down mapping the same memory with the same flags.  The
+// translations do not change, so nothing needs flushing.
+static int split_leaf(vm_space_t *owner, uint64_t *e, int level, int numa_node) {
+    uint64_t *t = alloc_table(numa_node);
+    if (!t)
+        return -1;
+    spin_lock(&owner->lock);
+    uint64_t v = pte_read(e);
+    if (is_leaf(v)) {
+        uint64_t step = level == 3 ? SIZE_2MB : PAGE_SIZE;
+        uint64_t base = v & PTE_ADDR_MASK & ~(step * 512 - 1);
+        uint64_t fl = v & ~PTE_ADDR_MASK;
+        if (level == 2)
+            fl &= ~PAGE_SIZE_2MB;         // bit 7 is PAT in a PTE
+        for (uint64_t i = 0; i < 512; ++i)
+            t[i] = (base + i * step) | fl;
+        page_t *pg = phys_to_page((uint64_t)(uintptr_t)t);
+        if (pg && level == 2)
+            pg->refcount = 512;
+        pte_write(e, (uint64_t)(uintptr_t)t | PAGE_USER | PAGE_PRESENT | PAGE_WRITABLE);
+        t = NULL;
+    }
+    spin_unlock(&owner->lock);
+    if (t)
+        free_table(t);                    // split or cleared meanwhile
+    return 0;
+}
+
+// New value for an entry changed by PROTECT: its frame (and size) with
+// the new flags.
+static inline uint64_t reprotect(uint64_t old, uint64_t flags) {
+    return (old & (PTE_ADDR_MASK | PAGE_SIZE_2MB)) | flags | PAGE_PRESENT;
+}
+
+// Set or change the large leaf at *e covering `size` bytes, flushing the
+// old translation if `flush`.  A page table it replaces is handed back in
+// *dead, to retire after the walk.  Returns 0, or 1 if *e holds a table
+// the caller did not allow to go and must look again.
+static int set_leaf(vm_space_t *owner, uint64_t *e, uint64_t val, uint64_t va, uint64_t size,
+                    int allow_table, int flush, uint64_t **dead) {
+    spin_lock(&owner->lock);
+    uint64_t old = pte_read(e);
+    if ((old & PAGE_PRESENT) && !(old & PAGE_SIZE_2MB)) {
+        if (!allow_table) {
+            spin_unlock(&owner->lock);
+            return 1;
+        }
+        *dead = PTE_TABLE(old);
+        page_t *pg = ptl_lock(*dead);
+        if (pg)
+            page_set_flag(pg, PG_PTDEAD);
+        ptl_unlock(pg);
+    }
+    pte_write(e, val);
+    spin_unlock(&owner->lock);
+    if ((old & PAGE_PRESENT) && flush)
+        flush_page(va, size);
+    return 0;
+}
+
+// Retire tables unlinked by a range operation, once the flush covering
+// them has gone out.  Returns 0, the new count.
+static int retire_tables(uint64_t **tables, int n) {
+    tlb_batch_flush();
+    while (n)
+        pt_retire(tables[--n]);
+    return 0;
+}
+
+static int range_op(int op, uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags,
+                    int numa_node) {
+    if (!len || ((virt | len) & (PAGE_SIZE - 1)) || virt + len < virt)
+        return -1;
+    uint64_t va = virt, end = virt + len, *dead_tables[RANGE_DEAD_MAX];
+    int ret = 0, ndead = 0;
+    int unmap = op == RANGE_UNMAP || op == RANGE_UNMAP_LAZY, flush = op != RANGE_UNMAP_LAZY;
+
+    tlb_batch_begin();
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    while (va < end && !ret) {
+        uint64_t pa = phys + (va - virt), left = end - va, *dead = NULL;
+        if (slot_is_boot(PML4_INDEX(va))) {
+            va = next_entry(va, 39);
+            continue;
+        }
+        vm_space_t *owner = table_owner(va);
+        walk_begin(pc);
+
+        // PML4 -> PDPT
+        uint64_t *pdpt_t;
+        if (op == RANGE_MAP) {
+            pdpt_t = descend(owner, owner->pml4, PML4_INDEX(va), numa_node);
+            if (!pdpt_t) {
+                ret = -1;
+                goto next;
+            }
+        } else {
+            uint64_t e = pte_read(&owner->pml4[PML4_INDEX(va)]);
+            if (!(e & PAGE_PRESENT)) {
+                va = next_entry(va, 39);
+                goto next;
+            }
+            pdpt_t = PTE_TABLE(e);
+        }
+
+        // PDPT entry: a 1 GiB leaf, or the PD below.
+        uint64_t *e3 = &pdpt_t[PDPT_INDEX(va)];
+        uint64_t v3 = pte_read(e3);
+        int fits_1g = !(va & (SIZE_1GB - 1)) && left >= SIZE_1GB;
+        if (op == RANGE_MAP && fits_1g && gbpages && !(pa & (SIZE_1GB - 1)) &&
+            (!(v3 & PAGE_PRESENT) || is_leaf(v3))) {
+            // A PD already there keeps the range in 2 MiB leaves.
+            if (!set_leaf(owner, e3, pa | flags | PAGE_PRESENT | PAGE_SIZE_2MB, va, SIZE_1GB, 0, 1, &dead))
+                va += SIZE_1GB;
+            goto next;
+        }
+        if (is_leaf(v3)) {
+            if (op != RANGE_MAP && fits_1g) {
+                if (!set_leaf(owner, e3, unmap ? 0 : reprotect(v3, flags), va,
+                              SIZE_1GB, 0, flush, &dead))
+                    va += SIZE_1GB;
+            } else if (split_leaf(owner, e3, 3, numa_node) < 0) {
+                ret = -1;
+            }
+            goto next;
+        }
+        uint64_t *pd_t;
+        if (op == RANGE_MAP) {
+            pd_t = descend(owner, pdpt_t, PDPT_INDEX(va), numa_node);
+            if (!pd_t) {
+                ret = is_leaf(pte_read(e3)) ? 0 : -1;   // a leaf appeared: look again
+                goto next;
+            }
+        } else {
+            if (!(v3 & PAGE_PRESENT)) {
+                va = next_entry(va, 30);
+                goto next;
+            }
+            pd_t = PTE_TABLE(v3);
+        }
 
-    if (!(current_pml4[pml4_i] & PAGE_PRESENT)) goto out;
-    uint64_t *pdpt_t = (uint64_t *)(current_pml4[pml4_i] & ~0xFFFULL);
-    if (!(pdpt_t[pdpt_i] & PAGE_PRESENT)) goto out;
-    uint64_t *pd_t = (uint64_t *)(pdpt_t[pdpt_i] & ~0xFFFULL);
-    if (!(pd_t[pd_i] & PAGE_PRESENT)) goto out;
+        // PD entry: a 2 MiB leaf, or the page table below.
+        uint64_t *e2 = &pd_t[PD_INDEX(va)];
+        uint64_t v2 = pte_read(e2);
+        int fits_2m = !(va & (SIZE_2MB - 1)) && left >= SIZE_2MB;
+        if (op == RANGE_MAP && fits_2m && !(pa & (SIZE_2MB - 1))) {
+            set_leaf(owner, e2, pa | flags | PAGE_PRESENT | PAGE_SIZE_2MB, va, SIZE_2MB, 1, 1, &dead);
+            va += SIZE_2MB;
+            goto next;
+        }
+        if (is_leaf(v2)) {
+            if (op != RANGE_MAP && fits_2m) {
+                if (!set_leaf(owner, e2, unmap ? 0 : reprotect(v2, flags), va,
+                              SIZE_2MB, 0, flush, &dead))
+                    va += SIZE_2MB;
+            } else if (split_leaf(owner, e2, 2, numa_node) < 0) {
+                ret = -1;
+            }
+            goto next;
+        }
+        if (op == RANGE_UNMAP && fits_2m && (v2 & PAGE_PRESENT)) {
+            // The whole page table goes at once.
+            set_leaf(owner, e2, 0, va, SIZE_2MB, 1, 1, &dead);
+            va += SIZE_2MB;
+            goto next;
+        }
+        uint64_t *pt_t;
+        if (op == RANGE_MAP) {
+            pt_t = descend(owner, pd_t, PD_INDEX(va), numa_node);
+            if (!pt_t) {
+                ret = is_leaf(pte_read(e2)) ? 0 : -1;
+                goto next;
+            }
+        } else {
+            if (!(v2 & PAGE_PRESENT)) {
+                va = next_entry(va, 21);
+                goto next;
+            }
+            pt_t = PTE_TABLE(v2);
+        }
 
-    if (pd_t[pd_i] & PAGE_SIZE_2MB) {
-        pd_t[pd_i] = 0;
-        goto done;
+        // The 4 KiB entries from here to the end of the table or range.
+        {
+            page_t *pg = ptl_lock(pt_t);
+            if (pt_dead(pg)) {
+                ptl_unlock(pg);
+                goto next;
+            }
+            uint64_t n = 512 - PT_INDEX(va), first = va;
+            if (n > left / PAGE_SIZE)
+                n = left / PAGE_SIZE;
+            uint64_t *pte = &pt_t[PT_INDEX(va)];
+            for (uint64_t k = 0; k < n; ++k, pa += PAGE_SIZE, va += PAGE_SIZE) {
+                uint64_t old = pte_read(&pte[k]);
+                if (op == RANGE_MAP) {
+                    pte_write(&pte[k], (pa & PTE_ADDR_MASK) | flags | PAGE_PRESENT);
+                    if (pg && !old)
+                        pg->refcount++;
+                } else if (old & PAGE_PRESENT) {
+                    pte_write(&pte[k], unmap ? 0 : reprotect(old, flags));
+                    if (pg && unmap)
+                        pg->refcount--;
+                }
+                if ((old & PAGE_PRESENT) && flush)
+                    flush_page(va, PAGE_SIZE);
+            }
+            int empty = op == RANGE_UNMAP && pg && !pg->refcount;
+            ptl_unlock(pg);
+            if (empty)
+                dead = unlink_table(owner, first, pt_t);
+        }
+next:
+        walk_end(pc);
+        if (dead)
+            dead_tables[ndead++] = dead;
+        if (ndead == RANGE_DEAD_MAX)
+            ndead = retire_tables(dead_tables, ndead);
     }
+    if (ndead)
+        retire_tables(dead_tables, ndead);
+    paging_irq_restore(rf);
+    tlb_batch_end();
+    return ret;
+}
+
+int paging_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags, int numa_node) {
+    if (phys & (PAGE_SIZE - 1))
+        return -1;
+    return range_op(RANGE_MAP, virt, phys, len, flags & ~PAGE_SIZE_2MB, numa_node);
+}
 
-    uint64_t *pt_t = (uint64_t *)(pd_t[pd_i] & ~0xFFFULL);
-    pt_t[pt_i] = 0;
+int paging_protect_range(uint64_t virt, uint64_t len, uint64_t flags) {
+    return range_op(RANGE_PROTECT, virt, 0, len, flags & ~PAGE_SIZE_2MB, current_cpu_node());
+}
+
+int paging_unmap_range(uint64_t virt, uint64_t len) {
+    return range_op(RANGE_UNMAP, virt, 0, len, 0, current_cpu_node());
+}
 
-done:
-out:
-    PAGING_UNLOCK();
+int paging_unmap_range_lazy(uint64_t virt, uint64_t len) {
+    return range_op(RANGE_UNMAP_LAZY, virt, 0, len, 0, current_cpu_node());
+}
+
+void paging_unmap_adv(uint64_t virt) {
+    if (slot_is_boot(PML4_INDEX(virt)))
+        return;
+    vm_space_t *owner = table_owner(virt);
+    uint64_t old = 0, size = PAGE_SIZE, *dead = NULL;
+
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    for (;;) {
+        walk_begin(pc);
+        uint64_t *table;
+        uint64_t *entry = walk(owner->pml4, virt, &size, &table);
+        if (!entry)
+            break;
+        if (size != PAGE_SIZE) {
+            spin_lock(&owner->lock);
+            old = pte_read(entry);
+            int leaf = (old & PAGE_PRESENT) && (old & PAGE_SIZE_2MB);
+            if (leaf)
+                pte_write(entry, 0);
+            spin_unlock(&owner->lock);
+            if (leaf)
+                break;
+            old = 0;              // replaced under us; look again
+            walk_end(pc);
+            continue;
+        }
+        page_t *pg = ptl_lock(table);
+        if (pt_dead(pg)) {
+            ptl_unlock(pg);
+            walk_end(pc);
+            continue;
+        }
+        old = pte_read(entry);
+        int empty = 0;
+        if (old & PAGE_PRESENT) {
+            pte_write(entry, 0);
+            empty = pg && !--pg->refcount;
+        }
+        ptl_unlock(pg);
+        // Dropping the table is left to the one who emptied it; the walk
+        // section stays open so the table cannot be freed under it.
+        if (empty)
+            dead = unlink_table(owner, virt, table);
+        break;
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
+
+    // One invalidation covers the leaf and, with it, the paging-structure
+    // caches that may still hold the unlinked table.
+    if (old & PAGE_PRESENT)
+        flush_page(virt, size);
+    if (dead) {
+        tlb_batch_flush();
+        pt_retire(dead);
+    }
 }
 
 uint64_t paging_virt_to_phys_adv(uint64_t virt) {
-    PAGING_LOCK();
-    uint64_t pml4_i = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virt >> 30) & 0x1FF;
-    uint64_t pd_i   = (virt >> 21) & 0x1FF;
-    uint64_t pt_i   = (virt >> 12) & 0x1FF;
-
-  
-  if (!(current_pml4[pml4_i] & PAGE_PRESENT)) { PAGING_UNLOCK(); return 0; }
-    uint64_t *pdpt_t = (uint64_t *)(current_pml4[pml4_i] & ~0xFFFULL);
-  if (!(pdpt_t[pdpt_i] & PAGE_PRESENT)) { PAGING_UNLOCK(); return 0; }
-    uint64_t *pd_t = (uint64_t *)(pdpt_t[pdpt_i] & ~0xFFFULL);
-    if (!(pd_t[pd_i] & PAGE_PRESENT)) { PAGING_UNLOCK(); return 0; }
-
-    if (pd_t[pd_i] & PAGE_SIZE_2MB) {
-        uint64_t phys = (pd_t[pd_i] & ~0x1FFFFFULL) | (virt & 0x1FFFFFULL);
-        PAGING_UNLOCK();
-        return phys;
-    }
-
-    uint64_t *pt_t = (uint64_t *)(pd_t[pd_i] & ~0xFFFULL);
-    if (!(pt_t[pt_i] & PAGE_PRESENT)) { PAGING_UNLOCK(); return 0; }
-    uint64_t phys = (pt_t[pt_i] & ~0xFFFULL) | (virt & 0xFFFULL);
-    PAGING_UNLOCK();
+    uint64_t phys = 0;
+    paging_lookup_adv(virt, &phys, NULL);
     return phys;
 }
 
 /* Lookup mapping for virt: returns 1 if mapped and provides phys+flags. */
 int paging_lookup_adv(uint64_t virt, uint64_t *phys, uint64_t *flags) {
-    int ret = 0;
-    PAGING_LOCK();
-    uint64_t pml4_i = (virt >> 39) & 0x1FF;
-    uint64_t pdpt_i = (virt >> 30) & 0x1FF;
-    uint64_t pd_i   = (virt >> 21) & 0x1FF;
-    uint64_t pt_i   = (virt >> 12) & 0x1FF;
-
-    if (!(current_pml4[pml4_i] & PAGE_PRESENT)) goto out;
-    uint64_t *pdpt_t = (uint64_t *)(current_pml4[pml4_i] & ~0xFFFULL);
-    if (!(pdpt_t[pdpt_i] & PAGE_PRESENT)) goto out;
-    uint64_t *pd_t = (uint64_t *)(pdpt_t[pdpt_i] & ~0xFFFULL);
-    if (!(pd_t[pd_i] & PAGE_PRESENT)) goto out;
-
-    if (pd_t[pd_i] & PAGE_SIZE_2MB) {
-        if (phys) *phys = (pd_t[pd_i] & ~0x1FFFFFULL) | (virt & 0x1FFFFFULL);
-        if (flags) *flags = pd_t[pd_i];
-        ret = 1;
-        goto out;
-    }
-
-    uint64_t *pt_t = (uint64_t *)(pd_t[pd_i] & ~0xFFFULL);
-    if (!(pt_t[pt_i] & PAGE_PRESENT)) goto out;
-    if (phys) *phys = (pt_t[pt_i] & ~0xFFFULL) | (virt & 0xFFFULL);
-    if (flags) *flags = pt_t[pt_i];
-    ret = 1;
-
-out:
-    PAGING_UNLOCK();
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    walk_begin(pc);
+    uint64_t size, *table;
+    uint64_t *entry = walk(table_owner(virt)->pml4, virt, &size, &table);
+    uint64_t e = entry ? pte_read(entry) : 0;
+    walk_end(pc);
+    paging_irq_restore(rf);
+    // The entry may have been cleared since the walk found it.
+    if (!(e & PAGE_PRESENT))
+        return 0;
+    if (phys) *phys = (e & PTE_ADDR_MASK & ~(size - 1)) | (virt & (size - 1));
+    if (flags) *flags = e;
+    return 1;
+}
+
+int paging_range_private(uint64_t start, uint64_t len) {
+    if (!len || start + len < start || start + len > ((uint64_t)KERNEL_SLOT_FIRST << 39))
+        return 0;
+    for (uint64_t slot = PML4_INDEX(start); slot <= PML4_INDEX(start + len - 1); ++slot)
+        if (slot_is_shared(slot))
+            return 0;
+    return 1;
+}
+
+// Lowest address in [va, end) whose leaf in `vs` is present or, with
+// `swapped`, holds a swap entry (only 4 KiB entries do), with the entry in
+// *ent and the page size in *sz; `end` if none.
+static uint64_t next_leaf(vm_space_t *vs, uint64_t va, uint64_t end, int swapped,
+                          uint64_t *ent, uint64_t *sz) {
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    walk_begin(pc);
+    uint64_t e = 0;
+    *sz = PAGE_SIZE;
+    va &= ~(PAGE_SIZE - 1);
+    while (va < end) {
+        e = pte_read(&vs->pml4[PML4_INDEX(va)]);
+        if (!(e & PAGE_PRESENT)) {
+            va = next_entry(va, 39);
+            continue;
+        }
+        e = pte_read(&PTE_TABLE(e)[PDPT_INDEX(va)]);
+        if (!(e & PAGE_PRESENT)) {
+            va = next_entry(va, 30);
+            continue;
+        }
+        if (e & PAGE_SIZE_2MB) {
+            *sz = 1ULL << 30;
+            if (!swapped)
+                break;
+            va = next_entry(va, 30);
+            continue;
+        }
+        e = pte_read(&PTE_TABLE(e)[PD_INDEX(va)]);
+        if (!(e & PAGE_PRESENT)) {
+            va = next_entry(va, 21);
+            continue;
+        }
+        if (e & PAGE_SIZE_2MB) {
+            *sz = 1ULL << 21;
+            if (!swapped)
+                break;
+            va = next_entry(va, 21);
+            continue;
+        }
+        e = pte_read(&PTE_TABLE(e)[PT_INDEX(va)]);
+        *sz = PAGE_SIZE;
+        if (swapped ? e && !(e & PAGE_PRESENT) : (e & PAGE_PRESENT))
+            break;
+        va += PAGE_SIZE;
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
+    *ent = e;
+    return va < end ? va : end;
+}
+
+uint64_t paging_next_mapped(vm_space_t *vs, uint64_t va, uint64_t end,
+                            uint64_t *phys, uint64_t *size) {
+    uint64_t e, sz;
+    va = next_leaf(vs, va, end, 0, &e, &sz);
+    if (va >= end)
+        return end;
+    if (phys) *phys = (e & PTE_ADDR_MASK & ~(sz - 1)) | (va & (sz - 1));
+    if (size) *size = sz;
+    return va;
+}
+
+uint64_t paging_next_swap(vm_space_t *vs, uint64_t va, uint64_t end, uint64_t *entry) {
+    uint64_t e, sz;
+    va = next_leaf(vs, va, end, 1, &e, &sz);
+    if (va < end && entry)
+        *entry = e;
+    return va;
+}
+
+// The 4 KiB entry for `va` in `vs`, with the page table holding it in
+// *table, or NULL if no page table covers `va`.  Lockless: call inside a
+// walk section.
+static uint64_t *pte_slot(vm_space_t *vs, uint64_t va, uint64_t **table) {
+    uint64_t e = pte_read(&vs->pml4[PML4_INDEX(va)]);
+    if (!(e & PAGE_PRESENT))
+        return NULL;
+    e = pte_read(&PTE_TABLE(e)[PDPT_INDEX(va)]);
+    if (!(e & PAGE_PRESENT) || (e & PAGE_SIZE_2MB))
+        return NULL;
+    e = pte_read(&PTE_TABLE(e)[PD_INDEX(va)]);
+    if (!(e & PAGE_PRESENT) || (e & PAGE_SIZE_2MB))
+        return NULL;
+    *table = PTE_TABLE(e);
+    return &(*table)[PT_INDEX(va)];
+}
+
+int paging_clear_young(vm_space_t *vs, uint64_t va) {
+    if (slot_is_shared(PML4_INDEX(va)))
+        return -1;
+    int ret = -1;
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    walk_begin(pc);
+    uint64_t *table, *pte = pte_slot(vs, va, &table);
+    if (pte) {
+        // The lock keeps swap entries, whose bits are not flags, out of it.
+        page_t *pg = ptl_lock(table);
+        if (pte_read(pte) & PAGE_PRESENT)
+            ret = (__atomic_fetch_and(pte, ~PAGE_ACCESSED, __ATOMIC_ACQ_REL) & PAGE_ACCESSED) != 0;
+        ptl_unlock(pg);
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
+    return ret;
+}
+
+// Clear the present bit of the entry at `va` if it maps `phys` (and, with
+// `cold`, has not been accessed), queueing its flush.
+static int take_page(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t *old, int cold) {
+    if (slot_is_shared(PML4_INDEX(va)))
+        return -1;
+    int ret = -1;
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    walk_begin(pc);
+    uint64_t *table, *pte = pte_slot(vs, va, &table);
+    if (pte) {
+        page_t *pg = ptl_lock(table);
+        uint64_t e = pte_read(pte);
+        // The CPU may set the accessed bit meanwhile; then the page stays.
+        if ((e & PAGE_PRESENT) && !(cold && (e & PAGE_ACCESSED)) && (e & PTE_ADDR_MASK) == phys &&
+            __atomic_compare_exchange_n(pte, &e, e & ~PAGE_PRESENT, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            *old = e;
+            ret = 0;
+        }
+        ptl_unlock(pg);
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
+    if (!ret)
+        tlb_flush(vs, va, PAGE_SIZE);
     return ret;
 }
 
-// Allocate a new PML4 for a task, cloning the kernel's higher-half mappings.
+int paging_swap_out(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t *old) {
+    return take_page(vs, va, phys, old, 1);
+}
+
+int paging_page_take(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t *old) {
+    return take_page(vs, va, phys, old, 0);
+}
+
+int paging_swap_set(vm_space_t *vs, uint64_t va, uint64_t expect, uint64_t val) {
+    if (!expect || (expect & PAGE_PRESENT) || slot_is_shared(PML4_INDEX(va)))
+        return -1;
+    int ret = -1, empty = 0;
+    uint64_t *dead = NULL;
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    walk_begin(pc);
+    uint64_t *table, *pte = pte_slot(vs, va, &table);
+    if (pte) {
+        page_t *pg = ptl_lock(table);
+        if (pte_read(pte) == expect) {
+            pte_write(pte, val);
+            empty = !val && pg && !--pg->refcount;
+            ret = 0;
+        }
+        ptl_unlock(pg);
+        if (empty)
+            dead = unlink_table(vs, va, table);
+    }
+    walk_end(pc);
+    paging_irq_restore(rf);
+    if (dead) {
+        // Nothing cached the entry, but the table may sit in the
+        // paging-structure caches.
+        tlb_flush(vs, va, PAGE_SIZE);
+        tlb_batch_flush();
+        pt_retire(dead);
+    }
+    return ret;
+}
+
+int64_t paging_copy_range(vm_space_t *dst, vm_space_t *src, uint64_t start, uint64_t end,
+                          int cow, int numa_node) {
+    int64_t copied = 0;
+    uint64_t va = start & ~(PAGE_SIZE - 1);
+
+    tlb_batch_begin();
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    while (va < end) {
+        walk_begin(pc);
+        uint64_t e = pte_read(&src->pml4[PML4_INDEX(va)]);
+        if (!(e & PAGE_PRESENT)) {
+            va = next_entry(va, 39);
+            walk_end(pc);
+            continue;
+        }
+        e = pte_read(&PTE_TABLE(e)[PDPT_INDEX(va)]);
+        if (!(e & PAGE_PRESENT) || (e & PAGE_SIZE_2MB)) {
+            va = next_entry(va, 30);      // user mappings are 4 KiB pages
+            walk_end(pc);
+            continue;
+        }
+        e = pte_read(&PTE_TABLE(e)[PD_INDEX(va)]);
+        if (!(e & PAGE_PRESENT) || (e & PAGE_SIZE_2MB)) {
+            va = next_entry(va, 21);
+            walk_end(pc);
+            continue;
+        }
+        uint64_t *spt = PTE_TABLE(e);
+        uint64_t *pdpt_t = descend(dst, dst->pml4, PML4_INDEX(va), numa_node);
+        uint64_t *pd_t = pdpt_t ? descend(dst, pdpt_t, PDPT_INDEX(va), numa_node) : NULL;
+        uint64_t *dpt = pd_t ? descend(dst, pd_t, PD_INDEX(va), numa_node) : NULL;
+        if (!dpt) {
+            walk_end(pc);
+            copied = -1;
+            break;
+        }
+
+        uint64_t n = 512 - PT_INDEX(va), first = va;
+        if (n > (end - va + PAGE_SIZE - 1) / PAGE_SIZE)
+            n = (end - va + PAGE_SIZE - 1) / PAGE_SIZE;
+        page_t *sp = ptl_lock(spt);
+        if (pt_dead(sp)) {
+            ptl_unlock(sp);
+            walk_end(pc);
+            continue;
+        }
+        // `dst` runs nowhere yet, so its table needs no lock of its own.
+        page_t *dp = phys_to_page((uint64_t)(uintptr_t)dpt);
+        int dropped_write = 0;
+        for (uint64_t k = PT_INDEX(va); k < PT_INDEX(va) + n; ++k) {
+            uint64_t pte = pte_read(&spt[k]);
+            if (!(pte & PAGE_PRESENT) || (pte_read(&dpt[k]) & PAGE_PRESENT))
+                continue;
+            page_t *pg = phys_to_page(pte & PTE_ADDR_MASK);
+            if (cow) {
+                if (pte & PAGE_WRITABLE) {
+                    pte &= ~PAGE_WRITABLE;
+                    pte_write(&spt[k], pte);
+                    dropped_write = 1;
+                }
+                if (pg) {
+                    page_set_flag(pg, PG_COW);
+                    page_ref_inc(pg);
+                }
+            }
+            if (pg)
+                page_mapcount_inc(pg);
+            pte_write(&dpt[k], pte);
+            if (dp)
+                dp->refcount++;
+            copied++;
+        }
+        ptl_unlock(sp);
+        walk_end(pc);
+        // One flush per table for the pages `src` may no longer write.
+        if (dropped_write && !slot_is_shared(PML4_INDEX(first)))
+            tlb_flush(src, first, n * PAGE_SIZE);
+        va = first + n * PAGE_SIZE;
+    }
+    paging_irq_restore(rf);
+    tlb_batch_end();
+    return copied;
+}
+
+// Allocate a new PML4 for a task: the shared slots point at the kernel's
+// tables, the private ones start empty.
 uint64_t *paging_new_context(void) {
     uint64_t *pml4 = alloc_table(current_cpu_node());
     if (!pml4)
         return NULL;
-    /* The kernel is currently identity-mapped in the lower half of the
-       address space.  Copy the entire bootstrap PML4 so new contexts
-       retain mappings for kernel code, data, and stacks. */
-    memcpy(pml4, kernel_pml4, 512 * sizeof(uint64_t));
+    for (uint64_t i = 0; i < 512; ++i)
+        if (slot_is_shared(i))
+            pml4[i] = kernel_pml4[i];
     return pml4;
 }
 
-// Switch to a new page table and update the active pointer. Reloading CR3
-// implicitly flushes the TLB, so we avoid per-page shootdowns.
-void paging_switch(uint64_t *new_pml4) {
-    if (!new_pml4)
-        new_pml4 = kernel_pml4;
-    current_pml4 = new_pml4;
-    asm volatile("mov %0, %%cr3" :: "r"(new_pml4) : "memory");
-}
-
-// Expose the kernel's bootstrap PML4 for threads that run in kernel space.
+// Expose the kernel PML4 for threads that run in kernel space.
 uint64_t *paging_kernel_pml4(void) {
     return kernel_pml4;
 }
 
+#ifdef KERNEL_BUILD
+static void enable_pcid(void) {
+    uint32_t eax, ebx, ecx, edx, max;
+    cpuid(0, 0, &max, &ebx, &ecx, &edx);
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (!(ecx & (1u << 17)))
+        return;
+    if (max >= 7) {
+        cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+        invpcid_supported = (ebx >> 10) & 1;
+    }
+    // CR3[11:0] is zero here: kernel_pml4 was just loaded with PCID 0.
+    uint64_t cr4;
+    __asm__ volatile("mov %%cr4,%0" : "=r"(cr4));
+    __asm__ volatile("mov %0,%%cr4" :: "r"(cr4 | CR4_PCIDE) : "memory");
+    pcid_supported = pcid_on = 1;
+}
+
+static void detect_gbpages(void) {
+    uint32_t eax, ebx, ecx, edx, max;
+    cpuid(0x80000000, 0, &max, &ebx, &ecx, &edx);
+    if (max < 0x80000001)
+        return;
+    cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+    gbpages = (edx >> 26) & 1;
+}
+#else
+static void enable_pcid(void) {}
+// Host tables are never loaded, so every leaf size can be exercised.
+static void detect_gbpages(void) { gbpages = 1; }
+#endif
+
+void paging_init(void) {
+    uint64_t *boot = PTE_TABLE(read_cr3());
+
+    // Take over the firmware's entries.  Whatever else was mapped through
+    // kernel_pml4 before now (nothing, in the boot order) is kept.
+    for (uint64_t i = 0; boot && i < 512; ++i) {
+        if (!(boot[i] & PAGE_PRESENT) || (kernel_pml4[i] & PAGE_PRESENT))
+            continue;
+        kernel_pml4[i] = boot[i];
+        if (i < KERNEL_SLOT_FIRST)
+            boot_slots[i / 64] |= 1ULL << (i % 64);
+    }
+    // Give every kernel-half slot a PDPT up front (1 MiB), so its PML4
+    // entries never change and spaces copied earlier see later mappings.
+    for (uint64_t i = KERNEL_SLOT_FIRST; i < 512; ++i) {
+        if (kernel_pml4[i] & PAGE_PRESENT)
+            continue;
+        uint64_t *pdpt_t = alloc_table(current_cpu_node());
+        if (!pdpt_t)
+            return;
+        kernel_pml4[i] = (uint64_t)pdpt_t | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+
+    for (int cpu = 0; cpu < PAGING_MAX_CPUS; ++cpu)
+        paging_cpu[cpu].cur_slot = -1;
+    uint64_t rf = paging_irq_save();
+    write_cr3((uint64_t)kernel_pml4);
+    this_paging_cpu()->cur = &kernel_space;
+    kernel_space.cpumask = cpus_active = 1ULL << paging_cpu_index();
+    enable_pcid();
+    detect_gbpages();
+    paging_live = 1;
+    paging_irq_restore(rf);
+    kprintf("[paging] kernel page tables live, pcid=%d invpcid=%d\n",
+            pcid_supported, invpcid_supported);
+}
+
+int paging_is_live(void) {
+    return paging_live;
+}
+
+vm_space_t *paging_kernel_space(void) {
+    return &kernel_space;
+}
+
+vm_space_t *paging_current_space(void) {
+    vm_space_t *vs = this_paging_cpu()->cur;
+    return vs ? vs : &kernel_space;
+}
+
+vm_space_t *paging_space_create(void) {
+    if (!paging_live)
+        return NULL;
+    vm_space_t *vs = kalloc(sizeof(*vs));
+    if (!vs)
+        return NULL;
+    vs->pml4 = paging_new_context();
+    if (!vs->pml4) {
+        kfree(vs);
+        return NULL;
+    }
+    vs->id = __atomic_fetch_add(&next_space_id, 1, __ATOMIC_RELAXED);
+    vs->tlb_gen = 0;
+    vs->cpumask = 0;
+    vs->refs = 1;
+    vs->lock = 0;
+    vs->vmas.root = NULL;
+    vs->vmas.count = 0;
+    vs->mmap_lock = 0;
+    vs->ring3 = 0;
+    vs->next = NULL;
+    uint64_t rf = paging_irq_save();
+    spin_lock(&spaces_lock);
+    vs->prev = spaces_tail;
+    if (spaces_tail)
+        spaces_tail->next = vs;
+    else
+        spaces_head = vs;
+    spaces_tail = vs;
+    spin_unlock(&spaces_lock);
+    paging_irq_restore(rf);
+    return vs;
+}
 
+void paging_space_get(vm_space_t *vs) {
+    if (vs && vs != &kernel_space)
+        __atomic_fetch_add(&vs->refs, 1, __ATOMIC_RELAXED);
+}
+
+vm_space_t *paging_space_next(vm_space_t *prev) {
+    uint64_t rf = paging_irq_save();
+    spin_lock(&spaces_lock);
+    // `prev` is still listed: the caller's reference keeps it.
+    vm_space_t *vs = prev ? prev->next : spaces_head;
+    for (; vs; vs = vs->next) {
+        uint32_t refs = __atomic_load_n(&vs->refs, __ATOMIC_RELAXED);
+        while (refs && !__atomic_compare_exchange_n(&vs->refs, &refs, refs + 1, 1,
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            ;
+        if (refs)
+            break;
+    }
+    spin_unlock(&spaces_lock);
+    paging_irq_restore(rf);
+    paging_space_put(prev);
+    return vs;
+}
+
+static void free_tables(uint64_t *table, int level) {
+    if (level > 1)
+        for (int i = 0; i < 512; ++i)
+            if ((table[i] & PAGE_PRESENT) && !(table[i] & PAGE_SIZE_2MB))
+                free_tables(PTE_TABLE(table[i]), level - 1);
+    free_table(table);
+}
+
+void paging_space_put(vm_space_t *vs) {
+    if (!vs || vs == &kernel_space)
+        return;
+    if (__atomic_sub_fetch(&vs->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+
+    // No CPU has it loaded: the last reference belongs to a thread that
+    // is no longer running.  This CPU's PCID for it is retired now; other
+    // CPUs' go stale and are flushed before reuse, since ids never repeat.
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    for (int i = 0; i < PCID_SLOTS; ++i) {
+        if (pc->slot_id[i] != vs->id)
+            continue;
+        if (invpcid_supported)
+            invpcid(1, (uint64_t)i + 1, 0);
+        pc->slot_id[i] = 0;
+    }
+    spin_lock(&spaces_lock);
+    if (vs->prev)
+        vs->prev->next = vs->next;
+    else
+        spaces_head = vs->next;
+    if (vs->next)
+        vs->next->prev = vs->prev;
+    else
+        spaces_tail = vs->prev;
+    spin_unlock(&spaces_lock);
+    paging_irq_restore(rf);
+
+    vm_exit_mmap(vs);
+    for (uint64_t i = 0; i < KERNEL_SLOT_FIRST; ++i)
+        if (!slot_is_shared(i) && (vs->pml4[i] & PAGE_PRESENT))
+            free_tables(PTE_TABLE(vs->pml4[i]), 3);
+    free_table(vs->pml4);
+    kfree(vs);
+    paging_reclaim_tables();
+}
+
+void paging_space_switch(vm_space_t *vs) {
+    if (!paging_live)
+        return;
+    if (!vs)
+        vs = &kernel_space;
+    uint64_t rf = paging_irq_save();
+    paging_cpu_t *pc = this_paging_cpu();
+    if (pc->cur == vs) {
+        paging_irq_restore(rf);
+        return;
+    }
+
+    // Join the space's CPU mask before reading its generation; a flusher
+    // bumps the generation before reading the mask (see tlb.c).
+    uint64_t bit = 1ULL << paging_cpu_index();
+    vm_space_t *prev = pc->cur;
+    __atomic_or_fetch(&vs->cpumask, bit, __ATOMIC_SEQ_CST);
+    if (!(cpus_active & bit))
+        __atomic_or_fetch(&cpus_active, bit, __ATOMIC_SEQ_CST);
+    uint64_t gen = __atomic_load_n(&vs->tlb_gen, __ATOMIC_SEQ_CST);
+
+    uint64_t cr3 = (uint64_t)vs->pml4;
+    if (pcid_on) {
+        if (pc->cur_slot >= 0)
+            pc->slot_gen[pc->cur_slot] = pc->cur_gen;
+        int slot = -1;
+        for (int i = 0; i < PCID_SLOTS; ++i)
+            if (pc->slot_id[i] == vs->id)
+                slot = i;
+        if (slot >= 0 && pc->slot_gen[slot] == gen) {
+            cr3 |= CR3_NOFLUSH;
+        } else if (slot < 0) {
+            slot = (int)(pc->victim++ % PCID_SLOTS);
+            pc->slot_id[slot] = vs->id;
+        }
+        pc->cur_slot = slot;
+        cr3 |= (uint64_t)slot + 1;
+    }
+    pc->cur = vs;
+    pc->cur_gen = gen;
+    pc->switches++;
+    if (!(cr3 & CR3_NOFLUSH))
+        pc->flushes++;
+    write_cr3(cr3);
+    // Flushes of the outgoing space no longer need this CPU: with PCID its
+    // entries stay tagged, and the slot's generation is checked on reload.
+    if (prev)
+        __atomic_and_fetch(&prev->cpumask, ~bit, __ATOMIC_SEQ_CST);
+    paging_irq_restore(rf);
+}
+
+int paging_pcid_supported(void) {
+    return pcid_supported;
+}
+
+int paging_invpcid_supported(void) {
+    return invpcid_supported;
+}
+
+int paging_pcid_use(int on) {
+    int was = pcid_on;
+    uint64_t rf = paging_irq_save();
+    on = on && pcid_supported;
+    if (on != was) {
+        // Forget every PCID assignment: each space flushes on its next
+        // load, so nothing cached under the other mode is trusted.
+        paging_cpu_t *pc = this_paging_cpu();
+        memset(pc->slot_id, 0, sizeof(pc->slot_id));
+        pc->cur_slot = -1;
+        pcid_on = on;
+        // Reload the current space under the new scheme.
+        vm_space_t *vs = pc->cur;
+        pc->cur = NULL;
+        paging_space_switch(vs);
+    }
+    paging_irq_restore(rf);
+    return was;
+}
+
+void paging_switch_stats(uint64_t *switches, uint64_t *flushes) {
+    paging_cpu_t *pc = this_paging_cpu();
+    if (switches) *switches = pc->switches;
+    if (flushes) *flushes = pc->flushes;
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <stdint.h>
 #include "pmm_buddy.h"
+#include "vma.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -16,6 +17,7 @@ extern "C" {
 #define PAGE_USER           0x004ULL
 #define PAGE_WRITE_THROUGH  0x008ULL
 #define PAGE_CACHE_DISABLE  0x010ULL
+#define PAGE_ACCESSED       0x020ULL
 #define PAGE_NO_EXEC        (1ULL << 63)
 
 // Extended paging flags
@@ -27,9 +29,37 @@ extern "C" {
 // Map a virtual address to a physical one on a preferred NUMA node.
 void paging_map_adv(uint64_t virt, uint64_t phys, uint64_t flags, uint32_t order, int numa_node);
 void paging_unmap_adv(uint64_t virt);
+/* Map frames[i] at virt + i * PAGE_SIZE for every i < n whose frame is
+ * non-zero and whose entry is still empty (neither a page nor a swap
+ * entry), walking each page table once.
+ * Frames mapped are zeroed in `frames`, so those left are the caller's to
+ * free.  Returns how many were mapped. */
+uint64_t paging_map_pages(uint64_t virt, uint64_t *frames, uint64_t n,
+                          uint64_t flags, int numa_node);
+
+/* Range operations: one walk from the root per page table or large page
+ * instead of one per 4 KiB page, with the TLB invalidations of the whole
+ * call sent as one batch.  Addresses and lengths are page aligned.
+ *
+ * paging_map_range maps [virt, virt+len) to [phys, phys+len), replacing
+ * what was there, with 1 GiB leaves (when the CPU has them) and 2 MiB
+ * leaves wherever both addresses are aligned and the range covers one.
+ * paging_protect_range gives every page mapped in the range `flags`;
+ * paging_unmap_range unmaps them, dropping whole page tables at once.  A
+ * large page the range covers only partly is split first.  0, or -1 when
+ * out of memory (the range then partly done). */
+int paging_map_range(uint64_t virt, uint64_t phys, uint64_t len, uint64_t flags, int numa_node);
+int paging_protect_range(uint64_t virt, uint64_t len, uint64_t flags);
+int paging_unmap_range(uint64_t virt, uint64_t len);
+/* paging_unmap_range without the invalidations: the old translations may
+ * linger in TLBs, and emptied page tables stay linked, until the caller
+ * flushes the range (tlb_flush).  Until then the addresses must not be
+ * reused nor the frames freed.  For callers that gather many unmaps into
+ * one flush. */
+int paging_unmap_range_lazy(uint64_t virt, uint64_t len);
 uint64_t paging_virt_to_phys_adv(uint64_t virt);
 
-void paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id);
+int paging_handle_fault(uint64_t err, uint64_t addr, int cpu_id);
 
 /* Debug helper: retrieve mapping info for a virtual address.
  * Returns 1 if mapped and fills phys and flags (raw PTE/PDE).
@@ -38,9 +68,122 @@ int paging_lookup_adv(uint64_t virt, uint64_t *phys, uint64_t *flags);
 
 /* Context management */
 uint64_t *paging_new_context(void);
-void paging_switch(uint64_t *new_pml4);
 uint64_t *paging_kernel_pml4(void);
 
+/* An address space: a PML4 whose kernel half (and the firmware's identity
+ * map) is shared with every other space, and whose remaining lower-half
+ * slots are private.  `id` is never reused and tags the space in the
+ * per-CPU PCID slots; `tlb_gen` counts changes that CPUs holding stale
+ * translations under the space's PCID must flush before using it again.
+ * `cpumask` has a bit per CPU that has the space loaded, the CPUs a TLB
+ * shootdown must reach.  `lock` guards its upper-level entries; those of
+ * each last-level table are under that table's own lock (page_t.ptl).
+ * `vmas` are its mmap areas, under `mmap_lock` (kernel/VM/mmap.c).
+ * `prev`/`next` link every space but the kernel's (paging_space_next). */
+typedef struct vm_space {
+    uint64_t *pml4;
+    uint64_t  id;
+    uint64_t  tlb_gen;
+    uint64_t  cpumask;
+    uint32_t  refs;
+    volatile int lock;
+    vma_tree_t   vmas;
+    volatile int mmap_lock;
+    int       ring3;      // its threads run in ring 3: VMAs map PAGE_USER
+    struct vm_space *prev, *next;
+} vm_space_t;
+
+/* Adopt the firmware's page tables into the kernel PML4, preallocate the
+ * kernel half, enable PCID when CPUID reports it and load the result.
+ * Needs the buddy allocator; until it runs the switch calls do nothing. */
+void paging_init(void);
+/* Whether paging_init has loaded the kernel tables. */
+int paging_is_live(void);
+
+vm_space_t *paging_kernel_space(void);
+vm_space_t *paging_current_space(void);
+/* New space with a reference for the caller; NULL when out of memory. */
+vm_space_t *paging_space_create(void);
+void paging_space_get(vm_space_t *vs);
+/* Spaces other than the kernel's, oldest first: the one after `prev`
+ * (the first if NULL) with a reference taken, dropping the reference on
+ * `prev`.  NULL past the last.  Spaces on their way out are skipped. */
+vm_space_t *paging_space_next(vm_space_t *prev);
+/* Drop a reference; the last one frees the private page tables (not the
+ * frames they map, which belong to whoever mapped them). */
+void paging_space_put(vm_space_t *vs);
+/* Load `vs` on this CPU.  With PCID the TLB entries of the outgoing space
+ * survive, and those of `vs` are reused unless its tlb_gen moved. */
+void paging_space_switch(vm_space_t *vs);
+
+/* PCID/INVPCID as detected, and whether switches use PCID (on when
+ * supported).  Turning it off makes every switch flush, for comparison. */
+int paging_pcid_supported(void);
+int paging_invpcid_supported(void);
+int paging_pcid_use(int on);
+/* Local half of a TLB shootdown (kernel/VM/tlb.c): apply a request to this
+ * CPU, or drop everything it caches.  CPUs that ever loaded a space. */
+struct tlb_req;
+void paging_flush_local(const struct tlb_req *req);
+void paging_flush_local_all(void);
+uint64_t paging_cpus_active(void);
+
+/* Free the page tables emptied by unmaps once no lockless walk can still
+ * be inside them.  Unmapping calls it; callers that want the frames back
+ * now (tests, reclaim) may call it again. */
+void paging_reclaim_tables(void);
+/* Whether unmapped tables are still waiting to be freed; kswapd keeps
+ * calling paging_reclaim_tables from the timer until they are not. */
+int paging_tables_retired(void);
+
+/* Whether [start, start+len) lies in private slots of the lower half,
+ * where a space may map pages of its own. */
+int paging_range_private(uint64_t start, uint64_t len);
+
+/* Lowest address in [va, end) with a page mapped in `vs`, which need not
+ * be loaded, with the frame in *phys and the page size in *size; `end` if
+ * none.  Skips unpopulated tables whole. */
+uint64_t paging_next_mapped(vm_space_t *vs, uint64_t va, uint64_t end,
+                            uint64_t *phys, uint64_t *size);
+
+/* Swap entries: a 4 KiB entry that is not present but non-zero belongs to
+ * whoever wrote it (kernel/VM/zswap.c) and says where the page went.  The
+ * mapping calls leave such entries alone, and count them towards keeping
+ * their page table, so the owner clears them before the range is
+ * unmapped; paging_unmap_range, which drops whole tables, must not meet
+ * any.  Only private slots of the lower half hold them.
+ *
+ * paging_next_swap is paging_next_mapped for swap entries.
+ * paging_clear_young clears the accessed bit of the page at `va` in `vs`
+ * and returns whether it was set, or -1 if no page is mapped there.
+ * paging_swap_out takes the page at `va` away if it still maps `phys`
+ * and has not been accessed: the entry loses its present bit, the old
+ * value going to *old, and a flush is queued (tlb.h); the caller sends it
+ * before trusting that nothing writes the frame any more.
+ * paging_page_take does the same whether or not the page was accessed
+ * (kernel/VM/ksm.c, to compare a page nothing can write meanwhile).
+ * paging_swap_set replaces the non-present entry `expect` at `va` with
+ * `val`: a swap entry, the page back, or 0 to clear it.  Both return 0,
+ * or -1 if the entry was not as expected. */
+uint64_t paging_next_swap(vm_space_t *vs, uint64_t va, uint64_t end, uint64_t *entry);
+int paging_clear_young(vm_space_t *vs, uint64_t va);
+int paging_swap_out(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t *old);
+int paging_page_take(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t *old);
+int paging_swap_set(vm_space_t *vs, uint64_t va, uint64_t expect, uint64_t val);
+
+/* Copy the 4 KiB mappings of [start, end) in `src` to the same addresses
+ * in `dst`, a space not yet running, in one walk per page table.  Each
+ * copied frame gains a map count.  With `cow` it also gains a reference
+ * and PG_COW, and loses write access on both sides, with the flushes for
+ * `src` sent as one batch; the first write then faults and copies.  Slots
+ * of `dst` already mapped are left alone.  Returns pages copied, or -1
+ * when page tables for `dst` ran out. */
+int64_t paging_copy_range(vm_space_t *dst, vm_space_t *src, uint64_t start, uint64_t end,
+                          int cow, int numa_node);
+
+/* CR3 loads on this CPU, and how many of them flushed the TLB. */
+void paging_switch_stats(uint64_t *switches, uint64_t *flushes);
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,6 +3,7 @@
 #include "pmm.h"
 #include "pmm_buddy.h"
 #include "numa.h"
+#include "memblock.h"
 
 #define PROT_EXEC  0x1
 #define PROT_WRITE 0x2
@@ -28,6 +29,7 @@ static void protect_kernel(void) {
 }
 
 void pmm_init(const bootinfo_t *bootinfo) {
+    memblock_init(bootinfo);
     numa_init(bootinfo);
     buddy_init(bootinfo);
     protect_kernel();
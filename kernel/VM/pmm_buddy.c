@@ -1,5 +1,8 @@
 #include "pmm_buddy.h"
 #include "numa.h"
+#include "memblock.h"
+#include "shrinker.h"
+#include "page.h"
 #include <stdint.h>
 #include <stddef.h>
 #include "../../user/libc/libc.h"
@@ -24,6 +27,14 @@ static inline void spin_unlock(spinlock_t *l) {
     __sync_lock_release(l);
 }
 
+#ifdef BUDDY_LOCK_STATS
+static inline uint64_t buddy_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+#endif
+
 // =====================
 //  Buddy Allocator Structures
 // =====================
@@ -32,26 +43,40 @@ typedef struct buddy_block {
     struct buddy_block *next;
 } buddy_block_t;
 
+// Block state lives in the page frame database: the head page of a free
+// block carries PG_BUDDY and its order, so merging checks one descriptor.
 typedef struct {
     buddy_block_t *free_list[PMM_BUDDY_ORDERS];
-    uint8_t      *bitmap;      // 1 bit per minimal block
+    uint64_t      nr_free[PMM_BUDDY_ORDERS];
+    page_t       *pages;       // descriptor of the zone's first frame
     uint64_t      base, length;
     uint32_t      frames, max_order;
     spinlock_t    lock;
     uint64_t      free_frames;
+#ifdef BUDDY_LOCK_STATS
+    uint64_t      lock_t0, lock_acquires, lock_hold_cycles, lock_max_hold;
+#endif
 } buddy_zone_t;
 
 static buddy_zone_t zones[MAX_NUMA_ZONES];
 static int zone_count = 0;
 
-// =====================
-//  Utility Bit Operations
-// =====================
-
-#define BITMAP_SIZE(frames) (((frames)+7)/8)
-#define BIT_SET(bm,bit)   ((bm)[(bit)>>3] |= (1<<((bit)&7)))
-#define BIT_CLEAR(bm,bit) ((bm)[(bit)>>3] &= ~(1<<((bit)&7)))
-#define BIT_TEST(bm,bit)  (((bm)[(bit)>>3] >> ((bit)&7)) & 1)
+static inline void zone_lock(buddy_zone_t *z) {
+    spin_lock(&z->lock);
+#ifdef BUDDY_LOCK_STATS
+    z->lock_t0 = buddy_rdtsc();
+    z->lock_acquires++;
+#endif
+}
+static inline void zone_unlock(buddy_zone_t *z) {
+#ifdef BUDDY_LOCK_STATS
+    uint64_t held = buddy_rdtsc() - z->lock_t0;
+    z->lock_hold_cycles += held;
+    if (held > z->lock_max_hold)
+        z->lock_max_hold = held;
+#endif
+    spin_unlock(&z->lock);
+}
 
 // =====================
 //  Helper: find the order for a size
@@ -85,7 +110,34 @@ static uint32_t addr_to_frame(const buddy_zone_t *z, uint64_t addr) {
     return (addr - z->base) / PAGE_SIZE;
 }
 static uint64_t frame_to_addr(const buddy_zone_t *z, uint32_t frame) {
-    return z->base + (frame * PAGE_SIZE);
+    return z->base + ((uint64_t)frame * PAGE_SIZE);
+}
+static page_t *frame_page(const buddy_zone_t *z, uint32_t frame) {
+    return &z->pages[frame];
+}
+
+// Put a block on a free list and mark its head.
+static void free_list_push(buddy_zone_t *z, uint32_t frame, uint32_t order) {
+    buddy_block_t *blk = (buddy_block_t*)frame_to_addr(z, frame);
+    page_t *pg = frame_page(z, frame);
+    pg->order = (uint8_t)order;
+    page_set_flag(pg, PG_BUDDY);
+    blk->next = z->free_list[order];
+    z->free_list[order] = blk;
+    z->nr_free[order]++;
+}
+
+// Unlink a free block from its list.
+static void free_list_remove(buddy_zone_t *z, uint32_t frame, uint32_t order) {
+    buddy_block_t **prev = &z->free_list[order];
+    buddy_block_t *target = (buddy_block_t*)frame_to_addr(z, frame);
+    while (*prev && *prev != target)
+        prev = &(*prev)->next;
+    if (*prev) {
+        *prev = target->next;
+        z->nr_free[order]--;
+    }
+    page_clear_flag(frame_page(z, frame), PG_BUDDY);
 }
 
 // =====================
@@ -98,15 +150,12 @@ static void split_block(buddy_zone_t *z, uint32_t order) {
         if (z->free_list[o]) {
             buddy_block_t *block = z->free_list[o];
             z->free_list[o] = block->next;
+            z->nr_free[o]--;
 
             uint32_t block_frame = addr_to_frame(z, (uint64_t)block);
             uint32_t split_frame = block_frame + (1U << (o-1));
-            buddy_block_t *buddy = (buddy_block_t*)frame_to_addr(z, split_frame);
-
-            block->next = NULL;
-            buddy->next = NULL;
-            z->free_list[o-1] = block;
-            block->next = buddy;
+            free_list_push(z, split_frame, o-1);
+            free_list_push(z, block_frame, o-1);
 
             return;
         }
@@ -114,7 +163,7 @@ static void split_block(buddy_zone_t *z, uint32_t order) {
 }
 
 // Allocates a block of order N (2^N pages), NUMA-aware, with fallback.
-void *buddy_alloc(uint32_t order, int preferred_node, int strict) {
+void *buddy_try_alloc(uint32_t order, int preferred_node, int strict) {
     if (zone_count == 0)
         return NULL;
     if (preferred_node < 0 || preferred_node >= zone_count)
@@ -123,7 +172,7 @@ void *buddy_alloc(uint32_t order, int preferred_node, int strict) {
         int node = (preferred_node + tries) % zone_count;
         buddy_zone_t *z = &zones[node];
 
-        spin_lock(&z->lock);
+        zone_lock(z);
         for (uint32_t o=order; o<=z->max_order; ++o) {
             if (z->free_list[o]) {
                 // Split down if necessary
@@ -134,67 +183,103 @@ void *buddy_alloc(uint32_t order, int preferred_node, int strict) {
                 buddy_block_t *block = z->free_list[order];
                 if (!block) break; // Defensive (should not happen)
                 z->free_list[order] = block->next;
+                z->nr_free[order]--;
 
-                uint32_t f = addr_to_frame(z, (uint64_t)block);
-                for (uint32_t i = 0; i < (1U << order); ++i)
-                    BIT_SET(z->bitmap, f+i);
+                page_t *pg = frame_page(z, addr_to_frame(z, (uint64_t)block));
+                page_clear_flag(pg, PG_BUDDY);
+                page_set_flag(pg, PG_HEAD);
+                pg->order = (uint8_t)order;
                 z->free_frames -= (1U << order);
 
-                spin_unlock(&z->lock);
+                zone_unlock(z);
                 return block;
             }
         }
-        spin_unlock(&z->lock);
+        zone_unlock(z);
         if (strict) break;
     }
     return NULL; // No memory!
 }
 
+#define BUDDY_RECLAIM_RETRIES 3
+
+// On failure, ask the registered shrinkers for memory and retry while they
+// keep making progress.
+void *buddy_alloc(uint32_t order, int preferred_node, int strict) {
+    void *p = buddy_try_alloc(order, preferred_node, strict);
+    for (int i = 0; !p && i < BUDDY_RECLAIM_RETRIES; ++i) {
+        if (!shrink_memory(1ULL << order))
+            break;
+        p = buddy_try_alloc(order, preferred_node, strict);
+    }
+    if (p)
+        reclaim_note_free(buddy_free_frames_total());
+    return p;
+}
+
 // Merge freed block with buddy if possible
 static void try_merge(buddy_zone_t *z, uint32_t frame, uint32_t order) {
-    if (order >= z->max_order) {
-        // Top level, can't merge
-        buddy_block_t *blk = (buddy_block_t*)frame_to_addr(z, frame);
-        blk->next = z->free_list[order];
-        z->free_list[order] = blk;
-        return;
+    while (order < z->max_order) {
+        uint32_t buddy_frame = frame ^ (1U << order);
+        // A zone need not be a power of two in size; the buddy of a tail
+        // block can lie past its end.
+        if (buddy_frame + (1U << order) > z->frames)
+            break;
+        page_t *bp = frame_page(z, buddy_frame);
+        if (!page_test_flag(bp, PG_BUDDY) || bp->order != order)
+            break;
+        free_list_remove(z, buddy_frame, order);
+        // Merge upward
+        frame &= buddy_frame;
+        order++;
     }
-    uint32_t buddy_frame = frame ^ (1U << order);
-    int buddy_free = 1;
-    for (uint32_t i=0; i<(1U<<order); ++i)
-        if (BIT_TEST(z->bitmap, buddy_frame+i)) { buddy_free = 0; break; }
-    if (buddy_free) {
-        // Remove buddy from list
-        buddy_block_t **prev = &z->free_list[order];
-        while (*prev) {
-            if ((uint64_t)*prev == frame_to_addr(z, buddy_frame)) {
-                *prev = (*prev)->next;
-                break;
-            }
-            prev = &(*prev)->next;
+    free_list_push(z, frame, order);
+}
+
+// The buddy at each level lies above the block and, being aligned to its
+// own size, is free only as a single block of exactly that order.
+int buddy_try_grow(void *addr, uint32_t order, uint32_t new_order) {
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)addr);
+    if (!pg || pg->node >= zone_count || new_order <= order)
+        return -1;
+    buddy_zone_t *z = &zones[pg->node];
+    if (new_order > z->max_order)
+        return -1;
+    uint32_t f = addr_to_frame(z, (uint64_t)(uintptr_t)addr);
+    if ((f & ((1U << new_order) - 1)) || f + (1U << new_order) > z->frames)
+        return -1;
+    zone_lock(z);
+    for (uint32_t o = order; o < new_order; ++o) {
+        page_t *bp = frame_page(z, f + (1U << o));
+        if (!page_test_flag(bp, PG_BUDDY) || bp->order != o) {
+            zone_unlock(z);
+            return -1;
         }
-        // Merge upward
-        uint32_t merged_frame = frame & buddy_frame;
-        try_merge(z, merged_frame, order+1);
-    } else {
-        // Just insert this block
-        buddy_block_t *blk = (buddy_block_t*)frame_to_addr(z, frame);
-        blk->next = z->free_list[order];
-        z->free_list[order] = blk;
     }
+    for (uint32_t o = order; o < new_order; ++o)
+        free_list_remove(z, f + (1U << o), o);
+    pg->order = (uint8_t)new_order;
+    z->free_frames -= (1U << new_order) - (1U << order);
+    zone_unlock(z);
+    return 0;
 }
 
+// The frame records its zone, so a caller's guess at `node` (often the
+// current CPU's) cannot send a block to the wrong free lists.
 void buddy_free(void *addr, uint32_t order, int node) {
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)addr);
+    if (pg)
+        node = pg->node;
     if (node < 0 || node >= zone_count)
         return;
     buddy_zone_t *z = &zones[node];
-    spin_lock(&z->lock);
+    zone_lock(z);
     uint32_t f = addr_to_frame(z, (uint64_t)addr);
     for (uint32_t i=0; i<(1U<<order); ++i)
-        BIT_CLEAR(z->bitmap, f+i);
+        page_reset(frame_page(z, f+i));
     z->free_frames += (1U<<order);
     try_merge(z, f, order);
-    spin_unlock(&z->lock);
+    zone_unlock(z);
 }
 
 // Migration: move page from one NUMA node to another.
@@ -223,6 +308,41 @@ uint64_t buddy_zone_base(int node) {
 
 // ========== Debug / Info ==========
 
+int buddy_zone_count(void) {
+    return zone_count;
+}
+
+int buddy_zone_report(int node, meminfo_zone_t *out) {
+    if (node < 0 || node >= zone_count || !out)
+        return -1;
+    buddy_zone_t *z = &zones[node];
+    memset(out, 0, sizeof(*out));
+    zone_lock(z);
+    out->base = z->base;
+    out->frames = z->frames;
+    out->free_frames = z->free_frames;
+    out->node = (uint32_t)node;
+    out->max_order = z->max_order;
+    for (uint32_t o = 0; o < PMM_BUDDY_ORDERS && o < MEMINFO_ORDERS; ++o)
+        out->free_blocks[o] = z->nr_free[o];
+#ifdef BUDDY_LOCK_STATS
+    out->lock_acquires = z->lock_acquires;
+    out->lock_hold_cycles = z->lock_hold_cycles;
+    out->lock_max_hold = z->lock_max_hold;
+#endif
+    zone_unlock(z);
+
+    // Free pages in blocks smaller than order j cannot serve an order-j
+    // request (Gorman's unusable free space index).
+    uint64_t small = 0;
+    for (uint32_t j = 0; j < MEMINFO_ORDERS; ++j) {
+        out->unusable[j] = out->free_frames
+            ? (uint16_t)(small * 1000 / out->free_frames) : 1000;
+        small += out->free_blocks[j] << j;
+    }
+    return 0;
+}
+
 void buddy_debug_print(void) {
     serial_puts("[buddy] Zone summary:\n");
     for (int n=0; n<zone_count; n++) {
@@ -238,15 +358,58 @@ void buddy_debug_print(void) {
 }
 
 // ========== Initialization ==========
+
+// Give a page-aligned free range to whichever zone covers it, as the
+// largest naturally aligned blocks that fit.
+static void buddy_add_range(uint64_t base, uint64_t size, void *ctx) {
+    (void)ctx;
+    uint64_t end = base + size;
+    for (int n = 0; n < zone_count; n++) {
+        buddy_zone_t *z = &zones[n];
+        if (!z->frames || !z->pages)
+            continue;
+        uint64_t lo = base > z->base ? base : z->base;
+        uint64_t hi = end < z->base + z->length ? end : z->base + z->length;
+        if (hi <= lo)
+            continue;
+        uint32_t frame = addr_to_frame(z, lo);
+        uint32_t last = addr_to_frame(z, hi);
+        for (uint32_t f = frame; f < last; ++f)
+            page_clear_flag(frame_page(z, f), PG_RESERVED);
+        while (frame < last) {
+            uint32_t remaining = last - frame;
+            uint32_t o = z->max_order;
+            while ((1U << o) > remaining) o--;
+            while (frame & ((1U << o) - 1)) o--;
+            free_list_push(z, frame, o);
+            z->free_frames += (1U << o);
+            frame += (1U << o);
+        }
+    }
+}
+
+/*
+ * Zones span their whole NUMA node, holes included.  The page frame
+ * database covering all of RAM is carved from memblock with every frame
+ * PG_RESERVED, and only the ranges memblock reports as free are released
+ * into the free lists, so firmware holes and boot reservations are never
+ * handed out.
+ */
 void buddy_init(const bootinfo_t *bootinfo) {
     (void)bootinfo;
     zone_count = numa_node_count();
+    if (page_db_init(memblock_start(), memblock_end()) < 0) {
+        serial_puts("[buddy] no memory for page frame database\n");
+        zone_count = 0;
+        return;
+    }
     for (int n=0; n<zone_count; n++) {
         const numa_region_t *r = numa_node_region(n);
         buddy_zone_t *z = &zones[n];
 
-        uint64_t base = r->base;
-        uint64_t length = r->length;
+        uint64_t base = (r->base + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t end = (r->base + r->length) & ~(uint64_t)(PAGE_SIZE - 1);
+        uint64_t length = end > base ? end - base : 0;
 
         // Avoid reserving low memory used by firmware/IO (e.g., VGA at 0xB0000)
         if (base < 0x100000) {
@@ -263,10 +426,18 @@ void buddy_init(const bootinfo_t *bootinfo) {
         z->base = base;
         z->length = length;
         z->frames = (z->length / PAGE_SIZE);
+        z->pages = NULL;
+        z->lock = 0;
+        z->free_frames = 0;
+        for (uint32_t o = 0; o < PMM_BUDDY_ORDERS; ++o) {
+            z->free_list[o] = NULL;
+            z->nr_free[o] = 0;
+        }
+#ifdef BUDDY_LOCK_STATS
+        z->lock_acquires = z->lock_hold_cycles = z->lock_max_hold = 0;
+#endif
         if (z->frames == 0)
             continue;
-        z->lock = 0;
-        z->free_frames = z->frames;
 
         // Determine the maximum order that fits entirely inside this zone.
         uint32_t max_order = PMM_BUDDY_MAX_ORDER;
@@ -274,25 +445,17 @@ void buddy_init(const bootinfo_t *bootinfo) {
             max_order--;
         z->max_order = max_order;
 
-        size_t bm_bytes = BITMAP_SIZE(z->frames);
-        z->bitmap = calloc(bm_bytes, 1);
-
-        // Clear all free lists
-        for (uint32_t o = 0; o <= z->max_order; ++o)
-            z->free_list[o] = NULL;
-
-        // Partition the zone into power-of-two blocks, largest first
-        uint32_t frame = 0;
-        while (frame < z->frames) {
-            uint32_t remaining = z->frames - frame;
-            uint32_t o = z->max_order;
-            while ((1U << o) > remaining) o--;
-            while (frame & ((1U << o) - 1)) o--;
-            buddy_block_t *blk = (buddy_block_t*)frame_to_addr(z, frame);
-            blk->next = z->free_list[o];
-            z->free_list[o] = blk;
-            frame += (1U << o);
+        page_t *first = phys_to_page(z->base);
+        page_t *last = phys_to_page(z->base + z->length - PAGE_SIZE);
+        if (!first || !last) {
+            serial_puts("[buddy] zone outside page frame database\n");
+            z->frames = 0;
+            continue;
         }
+        z->pages = first;
+        for (uint32_t f = 0; f < z->frames; ++f)
+            first[f].node = (uint8_t)n;
     }
-}
 
+    memblock_free_all(buddy_add_range, NULL);
+}
@@ -9,6 +9,7 @@
 #pragma once
 #include <stdint.h>
 #include "../../boot/include/bootinfo.h"
+#include "../../include/meminfo.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -36,6 +37,15 @@ void buddy_init(const bootinfo_t *bootinfo);
 // Will fallback to any node if preferred node is full, unless `strict` is true.
 void *buddy_alloc(uint32_t order, int preferred_node, int strict);
 
+// Like `buddy_alloc`, but fails instead of running the shrinkers.  For
+// allocators that may already be inside one of their own shrinker paths.
+void *buddy_try_alloc(uint32_t order, int preferred_node, int strict);
+
+// Grow an allocated block from `order` to `new_order` in place by claiming
+// the free buddies above it.  Returns 0 on success, -1 if the block is not
+// the lower half at every level or a buddy is not wholly free.
+int buddy_try_grow(void *addr, uint32_t order, uint32_t new_order);
+
 // Free a block of 2^order * PAGE_SIZE previously allocated from `buddy_alloc`.
 void buddy_free(void *addr, uint32_t order, int node);
 
@@ -49,6 +59,15 @@ uint64_t buddy_free_frames_total(void);
 uint64_t buddy_free_frames_node(int node);
 uint64_t buddy_zone_base(int node);
 
+/** Number of zones the allocator manages. */
+int buddy_zone_count(void);
+
+/**
+ * Snapshot free blocks per order, the unusable free space index and lock
+ * statistics for one zone.  Returns 0 on success, -1 for a bad node.
+ */
+int buddy_zone_report(int node, meminfo_zone_t *out);
+
 void buddy_debug_print(void);
 
 #ifdef __cplusplus
@@ -0,0 +1,159 @@
+/*
+ * Shrinker registry and kswapd
+ * ----------------------------
+ * A priority-sorted singly linked list of shrinkers.  Reclaim is
+ * serialised by a try-lock: a second reclaimer (another CPU, or a shrinker
+ * whose scan allocates) backs off instead of spinning, and the failed
+ * allocation simply stays failed.
+ */
+#include "shrinker.h"
+#include "pmm_buddy.h"
+#include <stddef.h>
+
+#ifdef KERNEL_BUILD
+#include "../Task/thread.h"
+#include "paging_adv.h"
+
+static thread_wait_t kswapd_wait;
+static inline void kswapd_wake(void) { thread_wake(&kswapd_wait); }
+#else
+static inline void kswapd_wake(void) {}
+#endif
+
+static shrinker_t *shrinkers;
+static volatile int registry_lock;
+static volatile int reclaim_active;
+static volatile int kswapd_wanted;
+
+static uint64_t wmark_low = RECLAIM_WMARK_MIN;
+static uint64_t wmark_high = 2 * RECLAIM_WMARK_MIN;
+static uint64_t stat_sync, stat_kswapd, stat_reclaimed;
+
+static inline void registry_acquire(void) {
+    while (__sync_lock_test_and_set(&registry_lock, 1))
+        while (registry_lock) __asm__ volatile("pause");
+}
+static inline void registry_release(void) {
+    __sync_lock_release(&registry_lock);
+}
+
+void register_shrinker(shrinker_t *s) {
+    if (!s || !s->scan)
+        return;
+    registry_acquire();
+    for (shrinker_t *it = shrinkers; it; it = it->next) {
+        if (it == s) {
+            registry_release();
+            return;
+        }
+    }
+    shrinker_t **pp = &shrinkers;
+    while (*pp && (*pp)->priority <= s->priority)
+        pp = &(*pp)->next;
+    s->next = *pp;
+    *pp = s;
+    registry_release();
+}
+
+void unregister_shrinker(shrinker_t *s) {
+    registry_acquire();
+    for (shrinker_t **pp = &shrinkers; *pp; pp = &(*pp)->next) {
+        if (*pp == s) {
+            *pp = s->next;
+            s->next = NULL;
+            break;
+        }
+    }
+    registry_release();
+}
+
+static uint64_t do_shrink(uint64_t nr_pages) {
+    if (__sync_lock_test_and_set(&reclaim_active, 1))
+        return 0;
+    uint64_t freed = 0;
+    registry_acquire();
+    for (shrinker_t *s = shrinkers; s && freed < nr_pages; s = s->next) {
+        if (s->count && s->count(s) == 0)
+            continue;
+        freed += s->scan(s, nr_pages - freed);
+    }
+    registry_release();
+    __sync_lock_release(&reclaim_active);
+    __atomic_fetch_add(&stat_reclaimed, freed, __ATOMIC_RELAXED);
+    return freed;
+}
+
+uint64_t shrink_memory(uint64_t nr_pages) {
+    __atomic_fetch_add(&stat_sync, 1, __ATOMIC_RELAXED);
+    return do_shrink(nr_pages);
+}
+
+uint64_t shrinker_reclaimable(void) {
+    uint64_t total = 0;
+    registry_acquire();
+    for (shrinker_t *s = shrinkers; s; s = s->next)
+        if (s->count)
+            total += s->count(s);
+    registry_release();
+    return total;
+}
+
+void reclaim_init(void) {
+    // Keep roughly 1/256th of memory free, as Linux's min_free_kbytes does.
+    uint64_t low = buddy_free_frames_total() / 256;
+    if (low < RECLAIM_WMARK_MIN)
+        low = RECLAIM_WMARK_MIN;
+    wmark_low = low;
+    wmark_high = 2 * low;
+}
+
+int reclaim_under_pressure(void) {
+    return buddy_free_frames_total() < wmark_high;
+}
+
+void reclaim_note_free(uint64_t free_pages) {
+    if (free_pages < wmark_low && !kswapd_wanted) {
+        kswapd_wanted = 1;
+        kswapd_wake();
+    }
+}
+
+void reclaim_get_stats(reclaim_stats_t *out) {
+    if (!out)
+        return;
+    out->sync_runs = __atomic_load_n(&stat_sync, __ATOMIC_RELAXED);
+    out->kswapd_runs = __atomic_load_n(&stat_kswapd, __ATOMIC_RELAXED);
+    out->pages_reclaimed = __atomic_load_n(&stat_reclaimed, __ATOMIC_RELAXED);
+    out->wmark_low = wmark_low;
+    out->wmark_high = wmark_high;
+}
+
+#ifdef KERNEL_BUILD
+// Background reclaim: once woken below the low watermark, shrink until
+// the high watermark is met so allocations rarely hit the sync path.
+// The timer also wakes it to free retired page tables.
+static void kswapd_main(void) {
+    for (;;) {
+        thread_wait(&kswapd_wait);
+        kswapd_wanted = 0;
+        paging_reclaim_tables();
+        uint64_t free = buddy_free_frames_total();
+        if (free < wmark_high) {
+            __atomic_fetch_add(&stat_kswapd, 1, __ATOMIC_RELAXED);
+            do_shrink(wmark_high - free);
+        }
+    }
+}
+
+void kswapd_start(void) {
+    thread_create_with_priority(kswapd_main, MIN_PRIORITY + 1);
+}
+
+void kswapd_tick(void) {
+    if (paging_tables_retired())
+        kswapd_wake();
+}
+#else
+void kswapd_start(void) {}
+void kswapd_tick(void) {}
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Memory Pressure Reclaim
+ * -----------------------
+ * Subsystems that cache physical memory (heap quarantines, magazines,
+ * pre-zeroed pools, buffer caches) register a shrinker.  When the buddy
+ * allocator fails, or a background kswapd thread sees free memory below
+ * the low watermark, shrinkers are asked to give pages back in priority
+ * order until enough has been reclaimed.
+ */
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Lower priorities are asked first: cheap, cold caches before hot ones.
+#define SHRINKER_PRIO_CHEAP    0
+#define SHRINKER_PRIO_DEFAULT  16
+#define SHRINKER_PRIO_COSTLY   32
+
+#define RECLAIM_WMARK_MIN      64    // floor for the low watermark, pages
+
+typedef struct shrinker {
+    const char *name;
+    /** Pages this cache could release right now.  Must not allocate. */
+    uint64_t (*count)(struct shrinker *s);
+    /** Try to release `nr_pages`; return the number actually freed. */
+    uint64_t (*scan)(struct shrinker *s, uint64_t nr_pages);
+    int priority;
+    struct shrinker *next;          // registry link, owned by shrinker.c
+} shrinker_t;
+
+typedef struct {
+    uint64_t sync_runs;         // reclaim triggered by a failed allocation
+    uint64_t kswapd_runs;       // reclaim triggered by the low watermark
+    uint64_t pages_reclaimed;
+    uint64_t wmark_low, wmark_high;
+} reclaim_stats_t;
+
+/** Add `s` to the registry.  Registering an already registered shrinker is a no-op. */
+void register_shrinker(shrinker_t *s);
+void unregister_shrinker(shrinker_t *s);
+
+/**
+ * Ask registered shrinkers, lowest priority first, to free `nr_pages`.
+ * Returns pages freed.  Returns 0 without scanning if a reclaim is
+ * already running, so a shrinker that allocates cannot recurse.
+ */
+uint64_t shrink_memory(uint64_t nr_pages);
+
+/** Sum of count() over every registered shrinker. */
+uint64_t shrinker_reclaimable(void);
+
+/**
+ * Derive the watermarks from the memory currently free in the buddy
+ * allocator.  Call after pmm_init.
+ */
+void reclaim_init(void);
+
+/** Nonzero while free memory is below the high watermark. */
+int reclaim_under_pressure(void);
+
+/** Called by the buddy allocator with the free page count after an allocation. */
+void reclaim_note_free(uint64_t free_pages);
+
+/**
+ * Spawn the low-priority kswapd thread, which sleeps until
+ * reclaim_note_free sees free memory below the low watermark.  No-op in
+ * host builds.
+ */
+void kswapd_start(void);
+
+/**
+ * Timer tick hook: wake kswapd while page tables wait to be freed, so the
+ * last ones unmapped do not wait for another unmap.  No-op in host builds.
+ */
+void kswapd_tick(void);
+
+void reclaim_get_stats(reclaim_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
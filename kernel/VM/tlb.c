@@ -0,0 +1,225 @@
+// TLB shootdown.  A CPU that changes page table entries gathers the
+// ranges in its batch, flushes them locally and posts one request to the
+// queue of every other CPU that has the space loaded, with one IPI each,
+// then waits until they have run it.  While waiting it serves its own
+// queue, so two CPUs shooting at each other with interrupts off both
+// make progress.
+#include "tlb.h"
+#include <string.h>
+#include "../arch/CPU/smp.h"
+#include "../arch/APIC/lapic.h"
+
+#define TLB_MAX_CPUS   32
+#define TLB_QUEUE_REQS 4
+
+// Requests posted to one CPU.  If they do not fit, `overflow` makes the
+// CPU flush everything instead.  `posted`/`done` count requests so a
+// sender can wait for its own.
+typedef struct {
+    volatile int lock;
+    uint32_t     nr;
+    int          overflow;
+    uint64_t     posted;
+    uint64_t     done;
+    tlb_req_t    q[TLB_QUEUE_REQS];
+} __attribute__((aligned(64))) tlb_queue_t;
+
+// Flushes gathered by one CPU between tlb_batch_begin/end.
+typedef struct {
+    uint32_t  depth;
+    int       used;
+    tlb_req_t req;
+} tlb_batch_t;
+
+static tlb_queue_t tlb_queue[TLB_MAX_CPUS];
+static tlb_batch_t tlb_batch[TLB_MAX_CPUS];
+static tlb_stats_t tlb_stats;
+
+#ifdef KERNEL_BUILD
+static inline uint64_t tlb_irq_save(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    return rf;
+}
+
+static inline void tlb_irq_restore(uint64_t rf) {
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+static inline void tlb_relax(void) {
+    __asm__ volatile("pause");
+}
+#else
+// Host builds: threads stand in for CPUs and poll for shootdowns.  They
+// may outnumber the host's CPUs, so waiting yields rather than spins.
+#include <sched.h>
+static inline uint64_t tlb_irq_save(void) { return 0; }
+static inline void tlb_irq_restore(uint64_t rf) { (void)rf; }
+static inline void tlb_relax(void) { sched_yield(); }
+#endif
+
+static inline uint32_t tlb_cpu(void) {
+    uint32_t cpu = smp_cpu_index();
+    return cpu < TLB_MAX_CPUS ? cpu : 0;
+}
+
+static void tlb_queue_lock(tlb_queue_t *tq) {
+    while (__sync_lock_test_and_set(&tq->lock, 1))
+        tlb_relax();
+}
+
+static void tlb_queue_unlock(tlb_queue_t *tq) {
+    __sync_lock_release(&tq->lock);
+}
+
+// Run whatever is queued for this CPU.  IRQs are off.
+static void tlb_serve(uint32_t cpu) {
+    tlb_queue_t *tq = &tlb_queue[cpu];
+    tlb_req_t reqs[TLB_QUEUE_REQS];
+    if (__atomic_load_n(&tq->done, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&tq->posted, __ATOMIC_ACQUIRE))
+        return;
+
+    tlb_queue_lock(tq);
+    uint32_t nr = tq->nr;
+    int overflow = tq->overflow;
+    uint64_t posted = tq->posted;
+    memcpy(reqs, tq->q, nr * sizeof(reqs[0]));
+    tq->nr = 0;
+    tq->overflow = 0;
+    tlb_queue_unlock(tq);
+
+    if (overflow)
+        paging_flush_local_all();
+    else
+        for (uint32_t i = 0; i < nr; ++i)
+            paging_flush_local(&reqs[i]);
+    __atomic_store_n(&tq->done, posted, __ATOMIC_RELEASE);
+}
+
+static uint64_t tlb_post(uint32_t cpu, const tlb_req_t *req) {
+    tlb_queue_t *tq = &tlb_queue[cpu];
+    tlb_queue_lock(tq);
+    if (tq->nr < TLB_QUEUE_REQS)
+        tq->q[tq->nr++] = *req;
+    else
+        tq->overflow = 1;
+    uint64_t ticket = ++tq->posted;
+    tlb_queue_unlock(tq);
+    return ticket;
+}
+
+// Send the batch of this CPU.  IRQs are off.
+static void tlb_commit(uint32_t self, tlb_batch_t *b) {
+    tlb_req_t *req = &b->req;
+    uint64_t pages = 0;
+    for (uint32_t i = 0; i < req->nr; ++i)
+        pages += (req->r[i].end - req->r[i].start) / PAGE_SIZE;
+    if (pages > TLB_FLUSH_CEILING)
+        req->full = 1;
+
+    // Bump the generation before reading who has the space loaded; a CPU
+    // loading it sets its bit before reading the generation, so it either
+    // sees the new one or is in the mask.
+    uint64_t targets;
+    if (req->vs) {
+        req->gen = __atomic_add_fetch(&req->vs->tlb_gen, 1, __ATOMIC_SEQ_CST);
+        targets = __atomic_load_n(&req->vs->cpumask, __ATOMIC_SEQ_CST);
+    } else {
+        targets = paging_cpus_active();
+    }
+    targets &= ~(1ULL << self);
+
+    paging_flush_local(req);
+
+    uint64_t tickets[TLB_MAX_CPUS];
+    uint32_t sent = 0;
+    for (uint32_t cpu = 0; cpu < TLB_MAX_CPUS; ++cpu) {
+        if (!(targets >> cpu & 1))
+            continue;
+        tickets[cpu] = tlb_post(cpu, req);
+        lapic_send_ipi((uint8_t)smp_index_to_apic(cpu), TLB_SHOOTDOWN_VECTOR);
+        sent++;
+    }
+    for (uint32_t cpu = 0; cpu < TLB_MAX_CPUS; ++cpu) {
+        if (!(targets >> cpu & 1))
+            continue;
+        while (__atomic_load_n(&tlb_queue[cpu].done, __ATOMIC_ACQUIRE) < tickets[cpu]) {
+            tlb_serve(self);
+            tlb_relax();
+        }
+    }
+
+    uint32_t online = smp_cpu_count();
+    __atomic_fetch_add(&tlb_stats.batches, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tlb_stats.ranges, req->nr, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tlb_stats.full_flushes, (uint64_t)req->full, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&tlb_stats.ipis, sent, __ATOMIC_RELAXED);
+    if (online > sent + 1)
+        __atomic_fetch_add(&tlb_stats.cpus_skipped, online - sent - 1, __ATOMIC_RELAXED);
+
+    b->used = 0;
+    req->nr = 0;
+    req->full = 0;
+}
+
+void tlb_flush(vm_space_t *vs, uint64_t start, uint64_t len) {
+    uint64_t rf = tlb_irq_save();
+    uint32_t self = tlb_cpu();
+    tlb_batch_t *b = &tlb_batch[self];
+    tlb_req_t *req = &b->req;
+    uint64_t end = start + len;
+
+    if (b->used && req->vs != vs)
+        tlb_commit(self, b);
+    b->used = 1;
+    req->vs = vs;
+    if (req->nr && req->r[req->nr - 1].end == start)
+        req->r[req->nr - 1].end = end;
+    else if (req->nr < TLB_BATCH_RANGES)
+        req->r[req->nr++] = (tlb_range_t){ start, end };
+    else
+        req->full = 1;
+
+    if (!b->depth)
+        tlb_commit(self, b);
+    tlb_irq_restore(rf);
+}
+
+void tlb_batch_begin(void) {
+    uint64_t rf = tlb_irq_save();
+    tlb_batch[tlb_cpu()].depth++;
+    tlb_irq_restore(rf);
+}
+
+void tlb_batch_end(void) {
+    uint64_t rf = tlb_irq_save();
+    uint32_t self = tlb_cpu();
+    tlb_batch_t *b = &tlb_batch[self];
+    if (b->depth && !--b->depth && b->used)
+        tlb_commit(self, b);
+    tlb_irq_restore(rf);
+}
+
+void tlb_batch_flush(void) {
+    uint64_t rf = tlb_irq_save();
+    uint32_t self = tlb_cpu();
+    tlb_batch_t *b = &tlb_batch[self];
+    if (b->used)
+        tlb_commit(self, b);
+    tlb_irq_restore(rf);
+}
+
+void tlb_shootdown_handler(void) {
+    tlb_serve(tlb_cpu());
+}
+
+void tlb_get_stats(tlb_stats_t *out) {
+    if (!out)
+        return;
+    out->batches = __atomic_load_n(&tlb_stats.batches, __ATOMIC_RELAXED);
+    out->ranges = __atomic_load_n(&tlb_stats.ranges, __ATOMIC_RELAXED);
+    out->full_flushes = __atomic_load_n(&tlb_stats.full_flushes, __ATOMIC_RELAXED);
+    out->ipis = __atomic_load_n(&tlb_stats.ipis, __ATOMIC_RELAXED);
+    out->cpus_skipped = __atomic_load_n(&tlb_stats.cpus_skipped, __ATOMIC_RELAXED);
+}
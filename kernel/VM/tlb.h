@@ -0,0 +1,62 @@
+#pragma once
+#include <stdint.h>
+#include "paging_adv.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* IPI vector of the shootdown handler; isr_stub.asm installs isr_tlb_stub
+ * at the same number. */
+#define TLB_SHOOTDOWN_VECTOR 0xF2
+/* A flush of more pages than this reloads CR3 instead of one invlpg per
+ * page; refilling the TLB is cheaper than that many invalidations. */
+#define TLB_FLUSH_CEILING    33
+/* Ranges one request carries; a batch with more becomes a full flush. */
+#define TLB_BATCH_RANGES     8
+
+typedef struct { uint64_t start, end; } tlb_range_t;
+
+/* One batch of invalidations for a space (NULL: the shared kernel half and
+ * identity map, cached under every PCID).  `gen` is the space's tlb_gen
+ * after the batch: a CPU already at gen-1 need only drop the ranges, one
+ * further behind reloads CR3. */
+typedef struct tlb_req {
+    vm_space_t  *vs;
+    uint64_t     gen;
+    uint32_t     nr;
+    int          full;
+    tlb_range_t  r[TLB_BATCH_RANGES];
+} tlb_req_t;
+
+/* Invalidate [start, start+len) in `vs` after its page table entries
+ * changed, here and on every CPU that has `vs` loaded.  CPUs that do not
+ * (lazy TLB) are skipped: the tlb_gen bump makes them flush when they next
+ * load it.  Inside a batch the flush is deferred to tlb_batch_end(). */
+void tlb_flush(vm_space_t *vs, uint64_t start, uint64_t len);
+
+/* Gather the flushes of the calling CPU until the matching end, then send
+ * them as one request: one IPI per target CPU for the whole batch.  The
+ * old translations stay usable until then.  Batches nest. */
+void tlb_batch_begin(void);
+void tlb_batch_end(void);
+/* Send what the batch has gathered so far without leaving it: needed
+ * before freeing a page table the deferred flushes may still reach. */
+void tlb_batch_flush(void);
+
+/* IPI handler: run the requests queued for this CPU. */
+void tlb_shootdown_handler(void);
+
+typedef struct {
+    uint64_t batches;        /* requests sent */
+    uint64_t ranges;         /* ranges in them */
+    uint64_t full_flushes;   /* requests past TLB_FLUSH_CEILING */
+    uint64_t ipis;           /* shootdown IPIs sent */
+    uint64_t cpus_skipped;   /* online CPUs left alone as lazy */
+} tlb_stats_t;
+
+void tlb_get_stats(tlb_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,769 @@
+#include "vm_selftest.h"
+
+#ifdef CONFIG_VM_SELFTEST
+#include "paging_adv.h"
+#include "pmm.h"
+#include "cow.h"
+#include "zeropool.h"
+#include "numa.h"
+#include "pmm_buddy.h"
+#include "shrinker.h"
+#include "meminfo.h"
+#include "nitroheap/nitroheap.h"
+#include "tlb.h"
+#include "mmap.h"
+#include "vmalloc.h"
+#include "zswap.h"
+#include "ksm.h"
+#include "../../include/mman.h"
+#include "../../user/libc/libc.h"
+#include <printf.h>
+
+// Scratch window nothing else maps; tests clean up after themselves.
+#define VMTEST_BASE  0x0000600000000000ULL
+
+// Demand-fault latency with the pre-zeroed pool full versus drained.
+static void vmtest_fault_latency(void) {
+    const uint64_t pages = 128;
+    uint64_t f0, c0, f1, c1;
+
+    const int anon = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+
+    zeropool_refill(current_cpu_node());
+    vm_mmap(VMTEST_BASE, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, anon);
+    paging_fault_stats(&f0, &c0);
+    for (uint64_t i = 0; i < pages; ++i)
+        paging_handle_fault(2, VMTEST_BASE + i * PAGE_SIZE, 0);
+    paging_fault_stats(&f1, &c1);
+    uint64_t pooled = (c1 - c0) / (f1 - f0 ? f1 - f0 : 1);
+    vm_munmap(VMTEST_BASE, pages * PAGE_SIZE);
+
+    zeropool_drain(current_cpu_node(), ~0ULL);
+    vm_mmap(VMTEST_BASE, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, anon);
+    paging_fault_stats(&f0, &c0);
+    for (uint64_t i = 0; i < pages; ++i)
+        paging_handle_fault(2, VMTEST_BASE + i * PAGE_SIZE, 0);
+    paging_fault_stats(&f1, &c1);
+    uint64_t sync = (c1 - c0) / (f1 - f0 ? f1 - f0 : 1);
+    vm_munmap(VMTEST_BASE, pages * PAGE_SIZE);
+    zeropool_refill(current_cpu_node());
+
+    kprintf("[vmtest] fault latency pooled=%llu sync=%llu cycles/fault\n",
+            (unsigned long long)pooled, (unsigned long long)sync);
+}
+
+// Exhaust physical memory with the shrinkable caches full; allocation must
+// keep succeeding past the free count while shrinkers give pages back.
+static void vmtest_reclaim(void) {
+    zeropool_refill(current_cpu_node());
+    uint64_t free0 = buddy_free_frames_total();
+    uint64_t cached = shrinker_reclaimable();
+    reclaim_stats_t st0, st1;
+    reclaim_get_stats(&st0);
+
+    // Chain the frames through their first word so the test needs no memory.
+    void *head = NULL;
+    uint64_t n = 0;
+    void *p;
+    while ((p = alloc_page())) {
+        *(void **)p = head;
+        head = p;
+        n++;
+    }
+    reclaim_get_stats(&st1);
+    while (head) {
+        void *next = *(void **)head;
+        free_page(head);
+        head = next;
+    }
+    zeropool_refill(current_cpu_node());
+
+    kprintf("[vmtest] reclaim free=%llu cached=%llu filled=%llu reclaimed=%llu\n",
+            (unsigned long long)free0, (unsigned long long)cached,
+            (unsigned long long)n,
+            (unsigned long long)(st1.pages_reclaimed - st0.pages_reclaimed));
+    kprintf("[vmtest] reclaim %s\n", n > free0 ? "ok" : "FAILED");
+}
+
+// Every node's zone hands out only its own frames, and NitroHeap's
+// NH_NUMA_LOCAL blocks land on the calling CPU's node.
+static void vmtest_numa(void) {
+    int nodes = numa_node_count();
+    int ok = 1;
+    for (int n = 0; n < nodes; ++n) {
+        void *p = buddy_try_alloc(0, n, 1);
+        if (!p)
+            continue;
+        ok &= numa_addr_node((uint64_t)(uintptr_t)p) == n;
+        buddy_free(p, 0, n);
+    }
+#ifdef CONFIG_NITRO_HEAP
+    void *obj = nitro_kmalloc_flags(128, 8, NH_NUMA_LOCAL);
+    ok &= obj && numa_addr_node((uint64_t)(uintptr_t)obj) == current_cpu_node();
+    nitro_kfree(obj);
+#endif
+    kprintf("[vmtest] numa nodes=%d cpu node=%d %s\n", nodes, current_cpu_node(),
+            ok ? "ok" : "FAILED");
+}
+
+static inline uint64_t vmtest_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define ASPACE_PAGES   32
+#define ASPACE_ROUNDS  2000
+
+// Cycles per switch between two spaces, each touching its working set
+// after it is loaded, so the figure includes refilling a flushed TLB.
+static uint64_t vmtest_switch_cost(vm_space_t *vs[2], uint64_t *flushes) {
+    volatile uint64_t sink = 0;
+    uint64_t f0, f1;
+    paging_switch_stats(NULL, &f0);
+    uint64_t t0 = vmtest_rdtsc();
+    for (int r = 0; r < ASPACE_ROUNDS; ++r)
+        for (int s = 0; s < 2; ++s) {
+            paging_space_switch(vs[s]);
+            for (uint64_t i = 0; i < ASPACE_PAGES; ++i)
+                sink += *(volatile uint64_t *)(VMTEST_BASE + i * PAGE_SIZE);
+        }
+    uint64_t cycles = vmtest_rdtsc() - t0;
+    paging_switch_stats(NULL, &f1);
+    *flushes = f1 - f0;
+    (void)sink;
+    return cycles / (2 * ASPACE_ROUNDS);
+}
+
+// Two spaces map the same private address to different frames: each sees
+// its own, the kernel's space sees neither.  Then the cost of switching
+// between them with and without PCID.
+static void vmtest_address_spaces(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *vs[2] = { paging_space_create(), paging_space_create() };
+    int ok = vs[0] && vs[1];
+    for (int s = 0; ok && s < 2; ++s) {
+        paging_space_switch(vs[s]);
+        for (uint64_t i = 0; i < ASPACE_PAGES; ++i) {
+            uint64_t *frame = alloc_page();
+            if (!frame) {
+                ok = 0;
+                break;
+            }
+            frame[0] = 0xA5A5000000000000ULL | ((uint64_t)s << 32) | i;
+            paging_map_adv(VMTEST_BASE + i * PAGE_SIZE, (uint64_t)(uintptr_t)frame,
+                           PAGE_WRITABLE, 0, current_cpu_node());
+        }
+    }
+    for (int s = 0; ok && s < 2; ++s) {
+        paging_space_switch(vs[s]);
+        for (uint64_t i = 0; i < ASPACE_PAGES; ++i)
+            ok &= *(volatile uint64_t *)(VMTEST_BASE + i * PAGE_SIZE) ==
+                  (0xA5A5000000000000ULL | ((uint64_t)s << 32) | i);
+    }
+    paging_space_switch(home);
+    ok &= paging_virt_to_phys_adv(VMTEST_BASE) == 0;
+    kprintf("[vmtest] aspace isolation %s\n", ok ? "ok" : "FAILED");
+
+    if (ok) {
+        uint64_t fl_pcid = 0, fl_flush = 0, pcid = 0;
+        int was = paging_pcid_use(0);
+        uint64_t flush = vmtest_switch_cost(vs, &fl_flush);
+        if (paging_pcid_supported()) {
+            paging_pcid_use(1);
+            pcid = vmtest_switch_cost(vs, &fl_pcid);
+        }
+        paging_pcid_use(was);
+        paging_space_switch(home);
+        if (paging_pcid_supported())
+            kprintf("[vmtest] aspace switch pcid=%llu flush=%llu cycles, %llu vs %llu flushes (invpcid=%d)\n",
+                    (unsigned long long)pcid, (unsigned long long)flush,
+                    (unsigned long long)fl_pcid, (unsigned long long)fl_flush,
+                    paging_invpcid_supported());
+        else
+            kprintf("[vmtest] aspace switch flush=%llu cycles, no PCID\n",
+                    (unsigned long long)flush);
+    }
+
+    for (int s = 0; s < 2; ++s) {
+        if (!vs[s])
+            continue;
+        paging_space_switch(vs[s]);
+        for (uint64_t i = 0; i < ASPACE_PAGES; ++i) {
+            uint64_t phys = paging_virt_to_phys_adv(VMTEST_BASE + i * PAGE_SIZE);
+            if (!phys)
+                continue;
+            paging_unmap_adv(VMTEST_BASE + i * PAGE_SIZE);
+            free_page((void *)(uintptr_t)phys);
+        }
+        paging_space_switch(home);
+        paging_space_put(vs[s]);
+    }
+}
+
+#define SHOOT_PAGES  64
+#define SHOOT_SMALL  4
+
+static int vmtest_stale(uint64_t first, uint64_t last, uint64_t tag) {
+    int stale = 0;
+    for (uint64_t i = first; i < last; ++i)
+        stale += *(volatile uint64_t *)(VMTEST_BASE + i * PAGE_SIZE) != (tag << 32 | i);
+    return stale;
+}
+
+// A writer remaps pages whose old translations the reader has cached,
+// first a few (invalidated page by page) then the rest (a full flush),
+// each as one batch.  Reads after each batch must see the new frames.
+// Only CPUs with the space loaded are sent an IPI.
+static void vmtest_shootdown(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *vs = paging_space_create();
+    uint64_t *frames[2][SHOOT_PAGES];
+    int ok = vs != NULL, stale = 0;
+    for (int k = 0; k < 2; ++k)
+        for (uint64_t i = 0; i < SHOOT_PAGES; ++i) {
+            frames[k][i] = alloc_page();
+            ok &= frames[k][i] != NULL;
+            if (frames[k][i])
+                frames[k][i][0] = (uint64_t)k << 32 | i;
+        }
+
+    tlb_stats_t t0, t1;
+    tlb_get_stats(&t0);
+    if (ok) {
+        paging_space_switch(vs);
+        for (uint64_t i = 0; i < SHOOT_PAGES; ++i)
+            paging_map_adv(VMTEST_BASE + i * PAGE_SIZE, (uint64_t)(uintptr_t)frames[0][i],
+                           PAGE_WRITABLE, 0, current_cpu_node());
+        stale += vmtest_stale(0, SHOOT_PAGES, 0);
+
+        tlb_batch_begin();
+        for (uint64_t i = 0; i < SHOOT_SMALL; ++i)
+            paging_map_adv(VMTEST_BASE + i * PAGE_SIZE, (uint64_t)(uintptr_t)frames[1][i],
+                           PAGE_WRITABLE, 0, current_cpu_node());
+        tlb_batch_end();
+        stale += vmtest_stale(0, SHOOT_SMALL, 1) + vmtest_stale(SHOOT_SMALL, SHOOT_PAGES, 0);
+
+        tlb_batch_begin();
+        for (uint64_t i = SHOOT_SMALL; i < SHOOT_PAGES; ++i)
+            paging_map_adv(VMTEST_BASE + i * PAGE_SIZE, (uint64_t)(uintptr_t)frames[1][i],
+                           PAGE_WRITABLE, 0, current_cpu_node());
+        tlb_batch_end();
+        stale += vmtest_stale(0, SHOOT_PAGES, 1);
+
+        tlb_batch_begin();
+        for (uint64_t i = 0; i < SHOOT_PAGES; ++i)
+            paging_unmap_adv(VMTEST_BASE + i * PAGE_SIZE);
+        tlb_batch_end();
+        paging_space_switch(home);
+    }
+    tlb_get_stats(&t1);
+    ok &= !stale && t1.batches - t0.batches == 3 && t1.full_flushes - t0.full_flushes == 2;
+    kprintf("[vmtest] shootdown batches=%llu full=%llu ipis=%llu lazy=%llu stale=%d %s\n",
+            (unsigned long long)(t1.batches - t0.batches),
+            (unsigned long long)(t1.full_flushes - t0.full_flushes),
+            (unsigned long long)(t1.ipis - t0.ipis),
+            (unsigned long long)(t1.cpus_skipped - t0.cpus_skipped),
+            stale, ok ? "ok" : "FAILED");
+
+    for (int k = 0; k < 2; ++k)
+        for (uint64_t i = 0; i < SHOOT_PAGES; ++i)
+            if (frames[k][i])
+                free_page(frames[k][i]);
+    paging_space_put(vs);
+}
+
+// Plain accesses, no stac/clac: the threads that map memory here run in
+// ring 0, so their pages must not be user pages (SMAP would fault).
+static void vmtest_poke(uint64_t va, uint64_t val) {
+    *(volatile uint64_t *)va = val;
+}
+
+static uint64_t vmtest_peek(uint64_t va) {
+    return *(volatile uint64_t *)va;
+}
+
+#define PF_WRITE_KERN  0x2      // not present, write, supervisor
+#define PF_PROT_WRITE  0x3      // present, write, supervisor
+
+// mmap/mprotect/munmap in a fresh space: VMAs split and merge back, the
+// fault handler honours protections and holes, unmapped and exited frames
+// go back to the allocator, and a shared mapping keeps one object across
+// a split.  The shared page is first touched directly, through #PF, and
+// nothing is wrapped in stac/clac.
+static void vmtest_mmap(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *vs = paging_space_create();
+    if (!vs) {
+        kprintf("[vmtest] mmap FAILED (no space)\n");
+        return;
+    }
+    paging_space_switch(vs);
+    vma_tree_t *t = &vs->vmas;
+    const int anon = MAP_PRIVATE | MAP_ANONYMOUS;
+    int ok = 1;
+
+    uint64_t a = vm_mmap(0, 16 * PAGE_SIZE, PROT_READ | PROT_WRITE, anon);
+    ok &= a >= MMAP_FLOOR && a != MMAP_ERR && t->count == 1;
+    for (uint64_t i = 0; ok && i < 16; ++i) {
+        ok &= paging_handle_fault(PF_WRITE_KERN, a + i * PAGE_SIZE, 0) == 0;
+        vmtest_poke(a + i * PAGE_SIZE, 0xC0DE0000 | i);
+    }
+
+    // A ring-0 space maps no user pages, so the kernel may touch them
+    // without stac, on first use through #PF as well.
+    uint64_t pte = 0;
+    paging_lookup_adv(a, NULL, &pte);
+    ok &= !(pte & PAGE_USER) && !vs->ring3;
+    uint64_t plain = vm_mmap(0, PAGE_SIZE, PROT_READ | PROT_WRITE, anon);
+    ok &= plain != MMAP_ERR;
+    if (ok) {
+        *(volatile uint64_t *)plain = 0xA11CE;
+        ok &= *(volatile uint64_t *)plain == 0xA11CE && vm_munmap(plain, PAGE_SIZE) == 0;
+    }
+
+    // Read-only in the middle: three VMAs, writes there refused.
+    ok &= vm_mprotect(a + 4 * PAGE_SIZE, 4 * PAGE_SIZE, PROT_READ) == 0 && t->count == 3;
+    pte = 0;
+    paging_lookup_adv(a + 5 * PAGE_SIZE, NULL, &pte);
+    ok &= !(pte & PAGE_WRITABLE);
+    ok &= paging_handle_fault(PF_PROT_WRITE, a + 5 * PAGE_SIZE, 0) == -1;
+    ok &= vmtest_peek(a + 5 * PAGE_SIZE) == (0xC0DE0000 | 5);
+    ok &= vm_mprotect(a + 4 * PAGE_SIZE, 4 * PAGE_SIZE, PROT_READ | PROT_WRITE) == 0 && t->count == 1;
+    ok &= vm_mprotect(a + 15 * PAGE_SIZE, 2 * PAGE_SIZE, PROT_READ) == -1;    // runs past the end
+
+    // A hole: its frames freed, faults in it and past the end refused.
+    uint64_t hole = paging_virt_to_phys_adv(a + 8 * PAGE_SIZE);
+    ok &= vm_munmap(a + 8 * PAGE_SIZE, 2 * PAGE_SIZE) == 0 && t->count == 2;
+    ok &= cow_refcount(hole) == 0 && paging_virt_to_phys_adv(a + 8 * PAGE_SIZE) == 0;
+    ok &= paging_handle_fault(PF_WRITE_KERN, a + 8 * PAGE_SIZE, 0) == -1;
+    ok &= paging_handle_fault(PF_WRITE_KERN, a + 16 * PAGE_SIZE, 0) == -1;
+    ok &= vmtest_peek(a + 10 * PAGE_SIZE) == (0xC0DE0000 | 10);
+
+    // The next mapping fills the hole, the lowest fit.
+    uint64_t b = vm_mmap(0, 2 * PAGE_SIZE, PROT_READ, anon);
+    ok &= b == a + 8 * PAGE_SIZE && t->count == 3;
+
+    // Shared: both halves of a split keep the object and its page order.
+    uint64_t sh = vm_mmap(0, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS);
+    ok &= sh != MMAP_ERR;
+    if (ok) {
+        vmtest_poke(sh + PAGE_SIZE, 0x5EED);
+        vm_object_t *obj = vma_find(t, sh)->obj;
+        ok &= vm_mprotect(sh, PAGE_SIZE, PROT_READ) == 0;
+        vma_t *hi = vma_find(t, sh + PAGE_SIZE);
+        ok &= hi->obj == obj && hi->pgoff == 1 && vma_find(t, sh)->obj == obj;
+        ok &= paging_virt_to_phys_adv(sh + PAGE_SIZE) == obj->frames[1];
+        ok &= vm_mprotect(sh, PAGE_SIZE, PROT_READ | PROT_WRITE) == 0 && vma_find(t, sh)->end == sh + 2 * PAGE_SIZE;
+    }
+
+    uint64_t kept = paging_virt_to_phys_adv(a);
+    paging_space_switch(home);
+    paging_space_put(vs);
+    ok &= cow_refcount(kept) == 0;
+    kprintf("[vmtest] mmap semantics %s\n", ok ? "ok" : "FAILED");
+}
+
+#define SWEEP_PAGES  4096     // 16 MiB
+
+// One write per page over a fresh 16 MiB mapping, each miss a real #PF;
+// `advice` is applied first, inside the timed region.  Returns cycles per
+// page, with the traps taken in *faults; 0 if anything went wrong.
+static uint64_t vmtest_sweep(int advice, uint64_t *faults) {
+    const uint64_t len = SWEEP_PAGES * PAGE_SIZE;
+    zeropool_refill(current_cpu_node());
+    uint64_t a = vm_mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    if (a == MMAP_ERR)
+        return 0;
+    uint64_t f0, f1;
+    paging_fault_stats(&f0, NULL);
+    uint64_t t0 = vmtest_rdtsc();
+    int ok = vm_madvise(a, len, advice) == 0;
+    for (uint64_t i = 0; i < SWEEP_PAGES; ++i)
+        vmtest_poke(a + i * PAGE_SIZE, i);
+    uint64_t t1 = vmtest_rdtsc();
+    paging_fault_stats(&f1, NULL);
+    for (uint64_t i = 0; i < SWEEP_PAGES; i += 511)
+        ok &= vmtest_peek(a + i * PAGE_SIZE) == i;
+    vm_munmap(a, len);
+    *faults = f1 - f0;
+    return ok ? (t1 - t0) / SWEEP_PAGES : 0;
+}
+
+// Sequential touches one page per fault (MADV_RANDOM), with adaptive
+// fault-around, and prefaulted in one call.
+static void vmtest_fault_around(void) {
+    uint64_t single_f, around_f, populate_f;
+    uint64_t single = vmtest_sweep(MADV_RANDOM, &single_f);
+    uint64_t around = vmtest_sweep(MADV_NORMAL, &around_f);
+    uint64_t populate = vmtest_sweep(MADV_POPULATE_WRITE, &populate_f);
+    int ok = single && around && populate && single_f >= SWEEP_PAGES &&
+             around_f * 16 < single_f && populate_f == 0;
+    kprintf("[vmtest] sweep 16M single faults=%llu cyc/page=%llu, around faults=%llu cyc/page=%llu, "
+            "populate faults=%llu cyc/page=%llu %s\n",
+            (unsigned long long)single_f, (unsigned long long)single,
+            (unsigned long long)around_f, (unsigned long long)around,
+            (unsigned long long)populate_f, (unsigned long long)populate,
+            ok ? "ok" : "FAILED");
+}
+
+#define FORK_PAGES   512      // 2 MiB of agent state set up once
+#define FORK_DIRTY   16       // pages a derived agent writes
+#define FORK_ROUNDS  8
+
+// Build a fresh space holding the template's state the way a load does:
+// map, fault in, copy every page.
+static vm_space_t *vmtest_load_copy(vm_space_t *tmpl, uint64_t a, uint64_t len) {
+    vm_space_t *vs = paging_space_create();
+    if (!vs)
+        return NULL;
+    paging_space_switch(vs);
+    if (vm_mmap(a, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED) != a ||
+        vm_madvise(a, len, MADV_POPULATE_WRITE) < 0)
+        return vs;
+    for (uint64_t va = a; va < a + len; va += PAGE_SIZE) {
+        uint64_t src = 0;
+        paging_next_mapped(tmpl, va, va + PAGE_SIZE, &src, NULL);
+        memcpy((void *)paging_virt_to_phys_adv(va), (void *)src, PAGE_SIZE);
+    }
+    return vs;
+}
+
+// Spawning from a template space: a fork shares its pages copy-on-write
+// and copies only what the child then writes, against rebuilding the
+// state from scratch.  Also checks that the sides stop seeing each
+// other's writes, that the last sharer reuses its page in place, and
+// that the frames of a dropped child go back.
+static void vmtest_fork(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *tmpl = paging_space_create();
+    if (!tmpl) {
+        kprintf("[vmtest] fork FAILED (no space)\n");
+        return;
+    }
+    paging_space_switch(tmpl);
+    const uint64_t len = FORK_PAGES * PAGE_SIZE;
+    uint64_t a = vm_mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    int ok = a != MMAP_ERR && vm_madvise(a, len, MADV_POPULATE_WRITE) == 0;
+    for (uint64_t i = 0; ok && i < FORK_PAGES; ++i)
+        vmtest_poke(a + i * PAGE_SIZE, 0xF0C00000 | i);
+    uint64_t first = paging_virt_to_phys_adv(a);
+
+    uint64_t fork_cyc = 0, load_cyc = 0, copied = 0;
+    for (int r = 0; ok && r < FORK_ROUNDS; ++r) {
+        uint64_t t0 = vmtest_rdtsc();
+        vm_space_t *child = vm_fork(tmpl);
+        ok &= child != NULL;
+        if (!ok)
+            break;
+        paging_space_switch(child);
+        for (uint64_t i = 0; i < FORK_DIRTY; ++i)
+            vmtest_poke(a + i * PAGE_SIZE, 0xC41D0000 | i);
+        uint64_t t1 = vmtest_rdtsc();
+        for (uint64_t i = 0; i < FORK_PAGES; i += 37)
+            ok &= vmtest_peek(a + i * PAGE_SIZE) == ((i < FORK_DIRTY ? 0xC41D0000 : 0xF0C00000) | i);
+        copied += paging_virt_to_phys_adv(a) != first;
+        paging_space_switch(tmpl);
+        ok &= vmtest_peek(a) == 0xF0C00000 && cow_refcount(first) == 2;
+        paging_space_switch(home);
+        paging_space_put(child);
+        ok &= cow_refcount(first) == 1;
+
+        uint64_t t2 = vmtest_rdtsc();
+        vm_space_t *copy = vmtest_load_copy(tmpl, a, len);
+        ok &= copy != NULL;
+        if (!ok)
+            break;
+        for (uint64_t i = 0; i < FORK_DIRTY; ++i)
+            vmtest_poke(a + i * PAGE_SIZE, 0xC41D0000 | i);
+        uint64_t t3 = vmtest_rdtsc();
+        ok &= vmtest_peek(a + (FORK_PAGES - 1) * PAGE_SIZE) == (0xF0C00000 | (FORK_PAGES - 1));
+        paging_space_switch(home);
+        paging_space_put(copy);
+        paging_space_switch(tmpl);
+
+        fork_cyc += t1 - t0;
+        load_cyc += t3 - t2;
+    }
+
+    // The parent writing after a fork copies, and its old frame stays
+    // with the child until the child goes.
+    vm_space_t *child = ok ? vm_fork(tmpl) : NULL;
+    ok &= child != NULL;
+    if (ok) {
+        vmtest_poke(a, 0xBEEF);
+        ok &= paging_virt_to_phys_adv(a) != first && cow_refcount(first) == 1;
+        paging_space_switch(child);
+        ok &= vmtest_peek(a) == 0xF0C00000;
+        paging_space_switch(tmpl);
+        paging_space_put(child);
+        ok &= cow_refcount(first) == 0;
+        // Sole owner again: the write reuses the page.
+        uint64_t last = paging_virt_to_phys_adv(a + PAGE_SIZE);
+        vmtest_poke(a + PAGE_SIZE, 0xBEEF);
+        ok &= paging_virt_to_phys_adv(a + PAGE_SIZE) == last && cow_refcount(last) == 1;
+    }
+    paging_space_switch(home);
+    paging_space_put(tmpl);
+
+    kprintf("[vmtest] fork 2M template fork=%llu load=%llu cycles %s\n",
+            (unsigned long long)(fork_cyc / FORK_ROUNDS), (unsigned long long)(load_cyc / FORK_ROUNDS),
+            ok && copied == FORK_ROUNDS && fork_cyc < load_cyc ? "ok" : "FAILED");
+}
+
+#define VMALLOC_TEST_PAGES  16384    // 64 MiB
+
+// vmalloc with no free block larger than a page: take every free frame,
+// give back every other one, then map 64 MiB from what is left.  Also
+// checks the guard page, that a freed area stays reserved and unmapped
+// until the purge, and that a purge gives everything back.  Guests too
+// small to hold 64 MiB beside the frames kept back skip it.
+static void vmtest_vmalloc(void) {
+    if (buddy_free_frames_total() < 2 * VMALLOC_TEST_PAGES) {
+        kprintf("[vmtest] vmalloc 64M fragmented skipped (%llu frames free)\n",
+                (unsigned long long)buddy_free_frames_total());
+        return;
+    }
+    int node = current_cpu_node();
+    void *held = NULL, *spare = NULL, *p;
+    uint64_t n = 0;
+    while ((p = buddy_try_alloc(0, node, 0))) {
+        if (n++ & 1) {
+            *(void **)p = held;
+            held = p;
+        } else {
+            *(void **)p = spare;
+            spare = p;
+        }
+    }
+    while (spare) {
+        p = *(void **)spare;
+        buddy_free(spare, 0, numa_addr_node((uint64_t)(uintptr_t)spare));
+        spare = p;
+    }
+    void *big = buddy_try_alloc(9, node, 0);
+    int ok = big == NULL;
+    if (big)
+        buddy_free(big, 9, numa_addr_node((uint64_t)(uintptr_t)big));
+
+    vmalloc_stats_t st0, st1;
+    vmalloc_get_stats(&st0);
+    uint64_t len = VMALLOC_TEST_PAGES * PAGE_SIZE, breaks = 0;
+    uint64_t t0 = vmtest_rdtsc();
+    uint8_t *a = vmalloc(len);
+    uint64_t cyc = vmtest_rdtsc() - t0;
+    ok &= a != NULL && is_vmalloc_addr(a);
+    for (uint64_t i = 0; ok && i < VMALLOC_TEST_PAGES; ++i) {
+        *(volatile uint64_t *)(a + i * PAGE_SIZE) = 0x7A110C00000000ULL | i;
+        *(volatile uint64_t *)(a + i * PAGE_SIZE + PAGE_SIZE - 8) = ~i;
+    }
+    for (uint64_t i = 0; ok && i < VMALLOC_TEST_PAGES; ++i) {
+        ok &= *(volatile uint64_t *)(a + i * PAGE_SIZE) == (0x7A110C00000000ULL | i) &&
+              *(volatile uint64_t *)(a + i * PAGE_SIZE + PAGE_SIZE - 8) == ~i;
+        if (i && paging_virt_to_phys_adv((uint64_t)(uintptr_t)(a + i * PAGE_SIZE)) !=
+                 paging_virt_to_phys_adv((uint64_t)(uintptr_t)(a + (i - 1) * PAGE_SIZE)) + PAGE_SIZE)
+            breaks++;
+    }
+    if (a) {
+        ok &= paging_virt_to_phys_adv((uint64_t)(uintptr_t)(a + len)) == 0;
+        vmalloc_get_stats(&st1);
+        ok &= st1.areas == st0.areas + 1 && st1.pages == st0.pages + VMALLOC_TEST_PAGES;
+        vfree(a);                       // past VMALLOC_LAZY_MAX: purged at once
+        vmalloc_get_stats(&st1);
+        ok &= st1.areas == st0.areas && st1.lazy_pages == 0 && st1.purges > st0.purges;
+    }
+
+    // Below the threshold a freed area is unmapped but parked.
+    uint8_t *b = vmalloc(256 * PAGE_SIZE);
+    ok &= b != NULL;
+    if (b) {
+        b[0] = 1;
+        vfree(b);
+        vmalloc_get_stats(&st1);
+        ok &= st1.lazy_pages == 256 && paging_virt_to_phys_adv((uint64_t)(uintptr_t)b) == 0;
+        uint8_t *c = vmalloc(PAGE_SIZE);
+        ok &= c != NULL && (c < b || c > b + 256 * PAGE_SIZE);
+        vfree(c);
+        vmalloc_purge();
+        vmalloc_get_stats(&st0);
+        ok &= st0.lazy_pages == 0 && st0.purges > st1.purges;
+    }
+
+    while (held) {
+        p = *(void **)held;
+        buddy_free(held, 0, numa_addr_node((uint64_t)(uintptr_t)held));
+        held = p;
+    }
+    kprintf("[vmtest] vmalloc 64M fragmented breaks=%llu cyc/page=%llu %s\n",
+            (unsigned long long)breaks, (unsigned long long)(cyc / VMALLOC_TEST_PAGES),
+            ok && breaks ? "ok" : "FAILED");
+}
+
+// Map half again as much private memory as is free and fill it: faults
+// keep succeeding only because reclaim compresses the pages written
+// earlier.  Pages hold two words, sparse like an idle agent's heap, and
+// every fourth is only read, so stays zero.  All of it must read back,
+// and tearing the space down must leave the pool as it was.
+static void vmtest_zswap(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *vs = paging_space_create();
+    if (!vs) {
+        kprintf("[vmtest] zswap FAILED (no space)\n");
+        return;
+    }
+    paging_space_switch(vs);
+    meminfo_zswap_t z0, z1, z2;
+    zswap_get_stats(&z0);
+    uint64_t pages = buddy_free_frames_total() * 3 / 2;
+    uint64_t a = vm_mmap(0, pages * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS);
+    int ok = a != MMAP_ERR;
+    for (uint64_t i = 0; ok && i < pages; ++i) {
+        uint64_t va = a + i * PAGE_SIZE;
+        if (i % 4 == 3) {
+            ok &= vmtest_peek(va) == 0;
+        } else {
+            vmtest_poke(va, i);
+            vmtest_poke(va + PAGE_SIZE / 2, ~i);
+        }
+    }
+    for (uint64_t i = 0; ok && i < pages; ++i) {
+        uint64_t va = a + i * PAGE_SIZE;
+        if (i % 4 == 3)
+            ok &= vmtest_peek(va) == 0;
+        else
+            ok &= vmtest_peek(va) == i && vmtest_peek(va + PAGE_SIZE / 2) == ~i;
+    }
+    zswap_get_stats(&z1);
+    ok &= z1.stores > z0.stores && z1.loads > z0.loads && z1.same_filled > z0.same_filled;
+
+    paging_space_switch(home);
+    paging_space_put(vs);
+    zswap_get_stats(&z2);
+    ok &= z2.stored_pages == z0.stored_pages && z2.pool_pages == z0.pool_pages;
+
+    uint64_t stored = z1.stored_pages - z0.stored_pages, pool = z1.pool_pages - z0.pool_pages;
+    uint64_t ratio = pool ? stored * 10 / pool : 0;
+    uint64_t loads = z1.loads - z0.loads;
+    kprintf("[vmtest] zswap oversubscribed pages=%llu stored=%llu ratio=%llu.%llu "
+            "load=%llu cycles %s\n",
+            (unsigned long long)pages, (unsigned long long)stored,
+            (unsigned long long)(ratio / 10), (unsigned long long)(ratio % 10),
+            (unsigned long long)(loads ? (z1.load_cycles - z0.load_cycles) / loads : 0),
+            ok ? "ok" : "FAILED");
+}
+
+#define KSM_AGENTS  8
+#define KSM_PAGES   64
+
+// What page `i` of agent `id` holds: every fourth page is only read, so
+// stays zero, page 0 differs per agent and the rest match across agents.
+static uint64_t ksm_word(int id, uint64_t i) {
+    return i == 0 ? 0xA6E40000 | (uint64_t)id : 0x5A3E0000 | i;
+}
+
+static int ksm_check(int id) {
+    int ok = 1;
+    for (uint64_t i = 0; i < KSM_PAGES; ++i) {
+        uint64_t va = VMTEST_BASE + i * PAGE_SIZE;
+        if (i % 4 == 3)
+            ok &= vmtest_peek(va) == 0 && vmtest_peek(va + PAGE_SIZE / 2) == 0;
+        else
+            ok &= vmtest_peek(va) == ksm_word(id, i) && vmtest_peek(va + PAGE_SIZE / 2) == ~i;
+    }
+    return ok;
+}
+
+// Eight agents loaded from the same image into their own spaces: after a
+// few passes every page they hold in common is a single frame, and the
+// contents read back unchanged.  A write to a merged page copies it out
+// for that agent alone, and once the agents are gone the merged frames
+// go back too.
+static void vmtest_ksm(void) {
+    vm_space_t *home = paging_current_space();
+    vm_space_t *agents[KSM_AGENTS] = {0};
+    const uint64_t len = KSM_PAGES * PAGE_SIZE;
+    meminfo_ksm_t k0, k1, k2, k3;
+    ksm_get_stats(&k0);
+    uint64_t anon0 = vm_anon_pages();
+    int ok = 1;
+    for (int id = 0; ok && id < KSM_AGENTS; ++id) {
+        agents[id] = paging_space_create();
+        ok &= agents[id] != NULL;
+        if (!ok)
+            break;
+        paging_space_switch(agents[id]);
+        ok &= vm_mmap(VMTEST_BASE, len, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED) == VMTEST_BASE;
+        for (uint64_t i = 0; ok && i < KSM_PAGES; ++i) {
+            uint64_t va = VMTEST_BASE + i * PAGE_SIZE;
+            if (i % 4 == 3) {
+                ok &= vmtest_peek(va) == 0;
+            } else {
+                vmtest_poke(va, ksm_word(id, i));
+                vmtest_poke(va + PAGE_SIZE / 2, ~i);
+            }
+        }
+    }
+    paging_space_switch(home);
+
+    // The first pass only records checksums; two more merge everything.
+    uint64_t free0 = buddy_free_frames_total();
+    for (int r = 0; ok && r < 8; ++r) {
+        ksm_scan(~0ULL);
+        ksm_get_stats(&k1);
+        if (k1.full_scans >= k0.full_scans + 3)
+            break;
+    }
+    uint64_t saved = k1.saved - k0.saved;
+    // Per agent: 16 zero pages and 47 pattern pages merge, page 0 not.
+    ok &= saved >= KSM_AGENTS * (KSM_PAGES - 1) - 48 && buddy_free_frames_total() > free0;
+    for (int id = 0; ok && id < KSM_AGENTS; ++id) {
+        paging_space_switch(agents[id]);
+        ok &= ksm_check(id);
+    }
+
+    // Agent 0 writes a merged page: it gets its own copy.
+    if (ok) {
+        paging_space_switch(agents[0]);
+        uint64_t va = VMTEST_BASE + PAGE_SIZE, shared = paging_virt_to_phys_adv(va);
+        vmtest_poke(va, 0xD1D);
+        ok &= vmtest_peek(va) == 0xD1D && paging_virt_to_phys_adv(va) != shared;
+        vmtest_poke(va, ksm_word(0, 1));
+        paging_space_switch(agents[1]);
+        ok &= paging_virt_to_phys_adv(va) == shared && ksm_check(1);
+        ksm_get_stats(&k2);
+        ok &= k2.saved == k1.saved - 1;
+        paging_space_switch(agents[0]);
+        ok &= ksm_check(0);
+    }
+    paging_space_switch(home);
+    for (int id = 0; id < KSM_AGENTS; ++id)
+        paging_space_put(agents[id]);
+    ksm_scan(~0ULL);
+    ksm_get_stats(&k3);
+    ok &= k3.merged_pages == k0.merged_pages && vm_anon_pages() == anon0;
+
+    kprintf("[vmtest] ksm %d agents pages=%llu saved=%llu %s\n", KSM_AGENTS,
+            (unsigned long long)(KSM_AGENTS * KSM_PAGES), (unsigned long long)saved,
+            ok ? "ok" : "FAILED");
+}
+
+void vm_selftest_run(void) {
+    kprintf("[vmtest] begin\n");
+    vmtest_fault_latency();
+    vmtest_reclaim();
+    vmtest_numa();
+    vmtest_address_spaces();
+    vmtest_shootdown();
+    vmtest_mmap();
+    vmtest_fault_around();
+    vmtest_fork();
+    vmtest_vmalloc();
+    vmtest_zswap();
+    vmtest_ksm();
+    meminfo_dump();
+    kprintf("[vmtest] done\n");
+}
+#else
+void vm_selftest_run(void) {}
+#endif
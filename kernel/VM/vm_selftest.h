@@ -0,0 +1,17 @@
+// Boot-time VM self-tests and micro-benchmarks.
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Run the VM self-tests when the kernel is built with CONFIG_VM_SELFTEST
+ * (`make EXTRA_CFLAGS=-DCONFIG_VM_SELFTEST`).  Results are printed with a
+ * "[vmtest]" prefix for tests/integration/test_qemu.py.  No-op otherwise.
+ */
+void vm_selftest_run(void);
+
+#ifdef __cplusplus
+}
+#endif
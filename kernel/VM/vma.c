@@ -0,0 +1,403 @@
+#include "vma.h"
+#include <stddef.h>
+#include <string.h>
+#include "heap.h"
+#include "page.h"
+
+static inline uint64_t max_u64(uint64_t a, uint64_t b) {
+    return a > b ? a : b;
+}
+
+// Recompute `n`'s summary from its children.  Nodes are ordered by start
+// and never overlap, so the left subtree's highest end belongs to the VMA
+// just before `n` and the right subtree's lowest start to the one after.
+static void vma_pull(vma_t *n) {
+    uint64_t gap = 0;
+    n->lo = n->start;
+    n->hi = n->end;
+    if (n->left) {
+        n->lo = n->left->lo;
+        gap = max_u64(n->left->gap, n->start - n->left->hi);
+    }
+    if (n->right) {
+        n->hi = n->right->hi;
+        gap = max_u64(gap, max_u64(n->right->gap, n->right->lo - n->end));
+    }
+    n->gap = gap;
+}
+
+static void vma_propagate(vma_t *n) {
+    for (; n; n = n->parent)
+        vma_pull(n);
+}
+
+// Rotations keep the set of nodes under the rotated pair, so only the
+// pair's summaries change.
+static void rotate_left(vma_tree_t *t, vma_t *x) {
+    vma_t *y = x->right;
+    x->right = y->left;
+    if (y->left)
+        y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        t->root = y;
+    else if (x == x->parent->left)
+        x->parent->left = y;
+    else
+        x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+    vma_pull(x);
+    vma_pull(y);
+}
+
+static void rotate_right(vma_tree_t *t, vma_t *x) {
+    vma_t *y = x->left;
+    x->left = y->right;
+    if (y->right)
+        y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent)
+        t->root = y;
+    else if (x == x->parent->right)
+        x->parent->right = y;
+    else
+        x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+    vma_pull(x);
+    vma_pull(y);
+}
+
+static inline int is_red(const vma_t *n) {
+    return n && n->red;
+}
+
+void vma_insert(vma_tree_t *t, vma_t *v) {
+    vma_t *p = NULL, **link = &t->root;
+    while (*link) {
+        p = *link;
+        link = v->start < p->start ? &p->left : &p->right;
+    }
+    v->parent = p;
+    v->left = v->right = NULL;
+    v->red = 1;
+    *link = v;
+    vma_propagate(v);
+    t->count++;
+
+    while (is_red(v->parent)) {
+        vma_t *gp = v->parent->parent;
+        if (v->parent == gp->left) {
+            vma_t *uncle = gp->right;
+            if (is_red(uncle)) {
+                v->parent->red = 0;
+                uncle->red = 0;
+                gp->red = 1;
+                v = gp;
+                continue;
+            }
+            if (v == v->parent->right) {
+                v = v->parent;
+                rotate_left(t, v);
+            }
+            v->parent->red = 0;
+            gp->red = 1;
+            rotate_right(t, gp);
+        } else {
+            vma_t *uncle = gp->left;
+            if (is_red(uncle)) {
+                v->parent->red = 0;
+                uncle->red = 0;
+                gp->red = 1;
+                v = gp;
+                continue;
+            }
+            if (v == v->parent->left) {
+                v = v->parent;
+                rotate_right(t, v);
+            }
+            v->parent->red = 0;
+            gp->red = 1;
+            rotate_left(t, gp);
+        }
+    }
+    t->root->red = 0;
+}
+
+static void transplant(vma_tree_t *t, vma_t *u, vma_t *v) {
+    if (!u->parent)
+        t->root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v)
+        v->parent = u->parent;
+}
+
+// Restore the black height after a black node left from under `parent`
+// on the side of `x` (which may be NULL).
+static void remove_fixup(vma_tree_t *t, vma_t *x, vma_t *parent) {
+    while (x != t->root && !is_red(x)) {
+        if (x == parent->left) {
+            vma_t *w = parent->right;
+            if (w->red) {
+                w->red = 0;
+                parent->red = 1;
+                rotate_left(t, parent);
+                w = parent->right;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->right)) {
+                w->left->red = 0;
+                w->red = 1;
+                rotate_right(t, w);
+                w = parent->right;
+            }
+            w->red = parent->red;
+            parent->red = 0;
+            w->right->red = 0;
+            rotate_left(t, parent);
+        } else {
+            vma_t *w = parent->left;
+            if (w->red) {
+                w->red = 0;
+                parent->red = 1;
+                rotate_right(t, parent);
+                w = parent->left;
+            }
+            if (!is_red(w->left) && !is_red(w->right)) {
+                w->red = 1;
+                x = parent;
+                parent = x->parent;
+                continue;
+            }
+            if (!is_red(w->left)) {
+                w->right->red = 0;
+                w->red = 1;
+                rotate_left(t, w);
+                w = parent->left;
+            }
+            w->red = parent->red;
+            parent->red = 0;
+            w->left->red = 0;
+            rotate_right(t, parent);
+        }
+        x = t->root;
+    }
+    if (x)
+        x->red = 0;
+}
+
+void vma_remove(vma_tree_t *t, vma_t *z) {
+    vma_t *x, *parent;
+    int removed_red = z->red;
+
+    if (!z->left) {
+        x = z->right;
+        parent = z->parent;
+        transplant(t, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        parent = z->parent;
+        transplant(t, z, z->left);
+    } else {
+        // The successor takes z's place.
+        vma_t *y = z->right;
+        while (y->left)
+            y = y->left;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            parent = y;
+        } else {
+            parent = y->parent;
+            transplant(t, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        transplant(t, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    // Every node whose subtree changed is on the path up from `parent`.
+    vma_propagate(parent);
+    t->count--;
+    if (!removed_red)
+        remove_fixup(t, x, parent);
+    z->parent = z->left = z->right = NULL;
+}
+
+void vma_update(vma_tree_t *t, vma_t *v) {
+    (void)t;
+    vma_propagate(v);
+}
+
+vma_t *vma_find(const vma_tree_t *t, uint64_t addr) {
+    vma_t *n = t->root;
+    while (n) {
+        if (addr < n->start)
+            n = n->left;
+        else if (addr >= n->end)
+            n = n->right;
+        else
+            return n;
+    }
+    return NULL;
+}
+
+vma_t *vma_find_after(const vma_tree_t *t, uint64_t addr) {
+    vma_t *n = t->root, *best = NULL;
+    while (n) {
+        if (n->end > addr) {
+            best = n;
+            n = n->left;
+        } else {
+            n = n->right;
+        }
+    }
+    return best;
+}
+
+vma_t *vma_first(const vma_tree_t *t) {
+    vma_t *n = t->root;
+    while (n && n->left)
+        n = n->left;
+    return n;
+}
+
+vma_t *vma_next(const vma_t *v) {
+    if (v->right) {
+        v = v->right;
+        while (v->left)
+            v = v->left;
+        return (vma_t *)v;
+    }
+    while (v->parent && v == v->parent->right)
+        v = v->parent;
+    return v->parent;
+}
+
+vma_t *vma_prev(const vma_t *v) {
+    if (v->left) {
+        v = v->left;
+        while (v->right)
+            v = v->right;
+        return (vma_t *)v;
+    }
+    while (v->parent && v == v->parent->left)
+        v = v->parent;
+    return v->parent;
+}
+
+// Whether [a, b) clipped to [lo, hi) holds `len` bytes; its start in *out.
+static int gap_fits(uint64_t a, uint64_t b, uint64_t lo, uint64_t hi,
+                    uint64_t len, uint64_t *out) {
+    if (a < lo)
+        a = lo;
+    if (b > hi)
+        b = hi;
+    if (a >= b || b - a < len)
+        return 0;
+    *out = a;
+    return 1;
+}
+
+// In-order walk over the holes of subtree `n`; *prev is the end of the VMA
+// visited last.  A subtree whose holes are all too small, or all below
+// `lo`, is passed over whole: only the hole leading into it is tried.
+static int gap_walk(const vma_t *n, uint64_t *prev, uint64_t lo, uint64_t hi,
+                    uint64_t len, uint64_t *out) {
+    if (!n || *prev >= hi)
+        return 0;
+    if (n->gap < len || n->hi <= lo) {
+        if (gap_fits(*prev, n->lo, lo, hi, len, out))
+            return 1;
+        *prev = n->hi;
+        return 0;
+    }
+    if (gap_walk(n->left, prev, lo, hi, len, out))
+        return 1;
+    if (gap_fits(*prev, n->start, lo, hi, len, out))
+        return 1;
+    *prev = n->end;
+    return gap_walk(n->right, prev, lo, hi, len, out);
+}
+
+uint64_t vma_gap_find(const vma_tree_t *t, uint64_t lo, uint64_t hi, uint64_t len) {
+    uint64_t prev = lo, out;
+    if (!len || lo >= hi)
+        return VMA_NO_GAP;
+    if (gap_walk(t->root, &prev, lo, hi, len, &out))
+        return out;
+    if (gap_fits(prev, hi, lo, hi, len, &out))
+        return out;
+    return VMA_NO_GAP;
+}
+
+vma_t *vma_alloc(void) {
+    vma_t *v = kalloc(sizeof(*v));
+    if (v)
+        memset(v, 0, sizeof(*v));
+    return v;
+}
+
+void vma_free(vma_t *v) {
+    if (!v)
+        return;
+    if (v->obj)
+        vm_object_put(v->obj);
+    kfree(v);
+}
+
+vma_t *vma_split(vma_tree_t *t, vma_t *v, uint64_t addr) {
+    vma_t *n = vma_alloc();
+    if (!n)
+        return NULL;
+    n->start = addr;
+    n->end = v->end;
+    n->prot = v->prot;
+    n->flags = v->flags;
+    n->obj = v->obj;
+    n->pgoff = v->pgoff + (addr - v->start) / PAGE_SIZE;
+    if (n->obj)
+        vm_object_get(n->obj);
+    v->end = addr;
+    vma_update(t, v);
+    vma_insert(t, n);
+    return n;
+}
+
+static int vma_mergeable(const vma_t *a, const vma_t *b) {
+    if (a->end != b->start || a->prot != b->prot || a->flags != b->flags || a->obj != b->obj)
+        return 0;
+    return !a->obj || a->pgoff + (a->end - a->start) / PAGE_SIZE == b->pgoff;
+}
+
+vma_t *vma_merge(vma_tree_t *t, vma_t *v) {
+    vma_t *prev = vma_prev(v);
+    if (prev && vma_mergeable(prev, v)) {
+        uint64_t end = v->end;
+        vma_remove(t, v);
+        vma_free(v);
+        prev->end = end;
+        vma_update(t, prev);
+        v = prev;
+    }
+    vma_t *next = vma_next(v);
+    if (next && vma_mergeable(v, next)) {
+        uint64_t end = next->end;
+        vma_remove(t, next);
+        vma_free(next);
+        v->end = end;
+        vma_update(t, v);
+    }
+    return v;
+}
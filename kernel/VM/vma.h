@@ -0,0 +1,100 @@
+/*
+ * Virtual Memory Areas
+ * --------------------
+ * Each address space keeps the ranges it has mapped as VMAs in a red-black
+ * tree ordered by start address.  Every node also carries the lowest start,
+ * the highest end and the largest hole between two VMAs of its subtree, so
+ * finding the lowest free range of a given size skips whole subtrees
+ * instead of walking the list.
+ *
+ * The tree does no locking; the owner (vm_space_t.mmap_lock) serializes
+ * changes and lookups.
+ */
+#pragma once
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* vma_t.prot, the same bits as PROT_* in include/mman.h */
+#define VMA_READ    0x1
+#define VMA_WRITE   0x2
+#define VMA_EXEC    0x4
+
+/* vma_t.flags */
+#define VMA_SHARED  0x1     /* pages belong to `obj`, not to the mapping */
+#define VMA_SEQ     0x2     /* MADV_SEQUENTIAL: always fault around fully */
+#define VMA_RAND    0x4     /* MADV_RANDOM: never fault around */
+
+#define VMA_NO_GAP  (~0ULL)
+
+struct vm_object;
+
+typedef struct vma {
+    uint64_t start, end;            /* [start, end), page aligned */
+    uint32_t prot;                  /* VMA_READ | VMA_WRITE | VMA_EXEC */
+    uint32_t flags;                 /* VMA_SHARED */
+    struct vm_object *obj;          /* backing of a shared mapping */
+    uint64_t pgoff;                 /* page of `obj` at `start` */
+    uint64_t fault_next;            /* where a sequential fault lands next */
+    uint32_t fault_window;          /* pages the last fault mapped */
+
+    struct vma *parent, *left, *right;
+    int      red;
+    uint64_t lo, hi;                /* lowest start, highest end below */
+    uint64_t gap;                   /* largest hole between VMAs below */
+} vma_t;
+
+typedef struct vma_tree {
+    vma_t   *root;
+    uint64_t count;
+} vma_tree_t;
+
+/** VMA containing `addr`, or NULL. */
+vma_t *vma_find(const vma_tree_t *t, uint64_t addr);
+/** First VMA ending above `addr` (containing it or after it), or NULL. */
+vma_t *vma_find_after(const vma_tree_t *t, uint64_t addr);
+vma_t *vma_first(const vma_tree_t *t);
+vma_t *vma_next(const vma_t *v);
+vma_t *vma_prev(const vma_t *v);
+
+/** Link `v`; it must not overlap any VMA in the tree. */
+void vma_insert(vma_tree_t *t, vma_t *v);
+/** Unlink `v` without freeing it. */
+void vma_remove(vma_tree_t *t, vma_t *v);
+/** Refresh the tree after moving `v`'s start or end without reordering. */
+void vma_update(vma_tree_t *t, vma_t *v);
+
+/**
+ * Lowest address of a free range of `len` bytes inside [lo, hi), or
+ * VMA_NO_GAP.
+ */
+uint64_t vma_gap_find(const vma_tree_t *t, uint64_t lo, uint64_t hi, uint64_t len);
+
+/** Zeroed node, or NULL when out of memory. */
+vma_t *vma_alloc(void);
+/** Free an unlinked node and its reference to `obj`. */
+void vma_free(vma_t *v);
+
+/**
+ * Cut `v` at `addr` (page aligned, strictly inside it).  `v` keeps the
+ * lower part; the upper part is returned as a new VMA, or NULL when out of
+ * memory, leaving `v` as it was.
+ */
+vma_t *vma_split(vma_tree_t *t, vma_t *v, uint64_t addr);
+
+/**
+ * Fold `v` into its neighbours where they touch it with the same
+ * protection and backing.  Returns the VMA that now covers `v`'s range.
+ */
+vma_t *vma_merge(vma_tree_t *t, vma_t *v);
+
+/* References to shared backing, taken by split and dropped by vma_free;
+ * kernel/VM/mmap.c owns the objects. */
+void vm_object_get(struct vm_object *obj);
+void vm_object_put(struct vm_object *obj);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,229 @@
+#include "vmalloc.h"
+#include "vma.h"
+#include "paging_adv.h"
+#include "pmm_buddy.h"
+#include "page.h"
+#include "numa.h"
+#include "tlb.h"
+#include <printf.h>
+
+// vma_t.flags of an area freed but not yet purged.
+#define AREA_LAZY  0x100
+
+// Frames gathered per paging_map_pages call; its walk covers them all.
+#define MAP_BATCH  128
+
+// Areas, live and parked, ordered by address; the lock also covers the
+// parked frames and the counters.  Frames are allocated and mapped
+// outside it, the area's addresses being reserved by then.
+static vma_tree_t areas;
+static volatile int vmalloc_lock;
+static page_t  *lazy_frames;          // chained through page_t.private
+static uint64_t live_areas, live_pages, lazy_pages, purges;
+
+// Interrupts stay off while held: a purge waits for a TLB shootdown, so a
+// CPU spinning here serves shootdowns meanwhile.
+static uint64_t vmalloc_lock_irq(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    while (__sync_lock_test_and_set(&vmalloc_lock, 1)) {
+        tlb_shootdown_handler();
+        __asm__ volatile("pause");
+    }
+    return rf;
+}
+
+static void vmalloc_unlock_irq(uint64_t rf) {
+    __sync_lock_release(&vmalloc_lock);
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+// One invalidation for everything parked (past the flush ceiling, a CR3
+// reload on every CPU), then the parked frames and addresses go back.
+static void purge_locked(void) {
+    if (!lazy_pages)
+        return;
+    uint64_t lo = VMALLOC_END, hi = VMALLOC_START;
+    for (vma_t *v = vma_first(&areas); v; v = vma_next(v)) {
+        if (!(v->flags & AREA_LAZY))
+            continue;
+        if (v->start < lo)
+            lo = v->start;
+        if (v->end > hi)
+            hi = v->end;
+    }
+    tlb_flush(NULL, lo, hi - lo);
+    tlb_batch_flush();                  // sent even inside a caller's batch
+
+    for (vma_t *v = vma_first(&areas), *next; v; v = next) {
+        next = vma_next(v);
+        if (v->flags & AREA_LAZY) {
+            vma_remove(&areas, v);
+            vma_free(v);
+        }
+    }
+    while (lazy_frames) {
+        page_t *pg = lazy_frames;
+        lazy_frames = pg->private;
+        pg->private = NULL;
+        uint64_t phys = page_to_phys(pg);
+        buddy_free((void *)(uintptr_t)phys, 0, numa_addr_node(phys));
+    }
+    lazy_pages = 0;
+    purges++;
+}
+
+void vmalloc_purge(void) {
+    uint64_t rf = vmalloc_lock_irq();
+    purge_locked();
+    vmalloc_unlock_irq(rf);
+}
+
+// Park area `v`, already marked AREA_LAZY: unmap it without a flush and
+// queue its frames for the next purge.
+static void area_release(vma_t *v, uint64_t live) {
+    page_t *chain = NULL, *tail = NULL;
+    uint64_t n = 0, va = v->start, phys;
+    vm_space_t *ks = paging_kernel_space();
+    while ((va = paging_next_mapped(ks, va, v->end, &phys, NULL)) < v->end) {
+        page_t *pg = phys_to_page(phys);
+        if (pg) {
+            pg->private = chain;
+            chain = pg;
+            if (!tail)
+                tail = pg;
+            n++;
+        }
+        va += PAGE_SIZE;
+    }
+    paging_unmap_range_lazy(v->start, v->end - v->start);
+
+    uint64_t rf = vmalloc_lock_irq();
+    if (tail) {
+        tail->private = lazy_frames;
+        lazy_frames = chain;
+    }
+    lazy_pages += n;
+    if (live) {
+        live_areas--;
+        live_pages -= n;
+    }
+    if (lazy_pages >= VMALLOC_LAZY_MAX)
+        purge_locked();
+    vmalloc_unlock_irq(rf);
+}
+
+// Reserve `len` bytes of the window, purging parked areas if it is full.
+static vma_t *area_reserve(uint64_t len) {
+    vma_t *v = vma_alloc();
+    if (!v)
+        return NULL;
+    uint64_t rf = vmalloc_lock_irq();
+    uint64_t va = vma_gap_find(&areas, VMALLOC_START, VMALLOC_END, len);
+    if (va == VMA_NO_GAP && lazy_pages) {
+        purge_locked();
+        va = vma_gap_find(&areas, VMALLOC_START, VMALLOC_END, len);
+    }
+    if (va != VMA_NO_GAP) {
+        v->start = va;
+        v->end = va + len;
+        vma_insert(&areas, v);
+    }
+    vmalloc_unlock_irq(rf);
+    if (va == VMA_NO_GAP) {
+        vma_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+static void *frame_alloc(int node) {
+    void *p = buddy_alloc(0, node, 0);
+    if (!p && __atomic_load_n(&lazy_pages, __ATOMIC_RELAXED)) {
+        vmalloc_purge();
+        p = buddy_alloc(0, node, 0);
+    }
+    if (p) {
+        page_t *pg = phys_to_page((uint64_t)(uintptr_t)p);
+        if (pg)
+            pg->owner = PAGE_OWNER_KERNEL;
+    }
+    return p;
+}
+
+static void *vmalloc_flags(size_t size, uint64_t flags) {
+    uint64_t npages = ((uint64_t)size + PAGE_SIZE - 1) / PAGE_SIZE;
+    // Before paging_init the kernel tables are not the ones loaded.
+    if (!size || !paging_is_live() || npages >= (VMALLOC_END - VMALLOC_START) / PAGE_SIZE)
+        return NULL;
+    vma_t *v = area_reserve((npages + 1) * PAGE_SIZE);     // and the guard page
+    if (!v)
+        return NULL;
+
+    int node = current_cpu_node();
+    uint64_t frames[MAP_BATCH];
+    for (uint64_t done = 0; done < npages;) {
+        uint64_t n = npages - done < MAP_BATCH ? npages - done : MAP_BATCH, got = 0;
+        while (got < n && (frames[got] = (uint64_t)(uintptr_t)frame_alloc(node)))
+            got++;
+        // Frames paging_map_pages could not place are left in `frames`.
+        uint64_t mapped = got ? paging_map_pages(v->start + done * PAGE_SIZE, frames, got, flags, node) : 0;
+        for (uint64_t k = 0; k < got; ++k)
+            if (frames[k])
+                buddy_free((void *)(uintptr_t)frames[k], 0, numa_addr_node(frames[k]));
+        done += mapped;
+        if (got < n || mapped < got) {
+            kprintf("[vmalloc] %llu pages: out of memory after %llu\n",
+                    (unsigned long long)npages, (unsigned long long)done);
+            uint64_t rf = vmalloc_lock_irq();
+            v->flags |= AREA_LAZY;
+            vmalloc_unlock_irq(rf);
+            area_release(v, 0);
+            return NULL;
+        }
+    }
+
+    uint64_t rf = vmalloc_lock_irq();
+    live_areas++;
+    live_pages += npages;
+    vmalloc_unlock_irq(rf);
+    return (void *)(uintptr_t)v->start;
+}
+
+void *vmalloc(size_t size) {
+    return vmalloc_flags(size, PAGE_PRESENT | PAGE_WRITABLE | PAGE_NO_EXEC);
+}
+
+void *vmalloc_exec(size_t size) {
+    return vmalloc_flags(size, PAGE_PRESENT | PAGE_WRITABLE);
+}
+
+void vfree(void *addr) {
+    if (!addr)
+        return;
+    uint64_t rf = vmalloc_lock_irq();
+    vma_t *v = vma_find(&areas, (uint64_t)(uintptr_t)addr);
+    int ok = v && v->start == (uint64_t)(uintptr_t)addr && !(v->flags & AREA_LAZY);
+    if (ok)
+        v->flags |= AREA_LAZY;          // a second vfree now fails here
+    vmalloc_unlock_irq(rf);
+    if (!ok) {
+        kprintf("[vmalloc] vfree of %p: not an area\n", addr);
+        return;
+    }
+    area_release(v, 1);
+}
+
+int is_vmalloc_addr(const void *addr) {
+    uint64_t a = (uint64_t)(uintptr_t)addr;
+    return a >= VMALLOC_START && a < VMALLOC_END;
+}
+
+void vmalloc_get_stats(vmalloc_stats_t *out) {
+    uint64_t rf = vmalloc_lock_irq();
+    out->areas = live_areas;
+    out->pages = live_pages;
+    out->lazy_pages = lazy_pages;
+    out->purges = purges;
+    vmalloc_unlock_irq(rf);
+}
@@ -0,0 +1,55 @@
+/*
+ * vmalloc
+ * -------
+ * Virtually contiguous kernel memory built from single frames, for large
+ * buffers that need not be physically contiguous and so keep working when
+ * fragmentation has left the buddy allocator without large blocks.  Areas
+ * sit in a window of the kernel half, each followed by an unmapped guard
+ * page, and are kept in a VMA tree (vma.h) whose hole summaries find the
+ * lowest free range without walking every area.
+ *
+ * Freeing is lazy: vfree unmaps without a TLB flush and parks the area.
+ * Once VMALLOC_LAZY_MAX pages are parked, or an allocation runs short of
+ * addresses or frames, one flush covers them all; only then are their
+ * frames and addresses handed out again.
+ */
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define VMALLOC_START     0xFFFFA00000000000ULL
+#define VMALLOC_END       0xFFFFA10000000000ULL     /* 1 TiB */
+#define VMALLOC_LAZY_MAX  8192                      /* parked pages (32 MiB) before a purge */
+
+typedef struct {
+    uint64_t areas;         /* live allocations */
+    uint64_t pages;         /* frames they map */
+    uint64_t lazy_pages;    /* freed, waiting for the purge */
+    uint64_t purges;        /* flushes that released parked areas */
+} vmalloc_stats_t;
+
+/** `size` bytes (rounded up to pages), readable and writable, not
+ *  executable and not zeroed; NULL when out of addresses or frames. */
+void *vmalloc(size_t size);
+
+/** vmalloc for code: the pages are executable too. */
+void *vmalloc_exec(size_t size);
+
+/** Free an area from vmalloc or vmalloc_exec.  NULL is ignored. */
+void vfree(void *addr);
+
+/** Whether `addr` lies in the vmalloc window. */
+int is_vmalloc_addr(const void *addr);
+
+/** Flush and release every parked area now. */
+void vmalloc_purge(void);
+
+void vmalloc_get_stats(vmalloc_stats_t *out);
+
+#ifdef __cplusplus
+}
+#endif
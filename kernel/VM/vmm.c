@@ -51,16 +51,9 @@ static uint64_t *get_or_create(uint64_t *table, uint64_t index, uint64_t flags,
 }
 
 uint64_t *vmm_create_pml4(void) {
-    int node = current_cpu_node();
-    uint64_t *new_pml4 = alloc_table(node);
-    if (!new_pml4) return NULL;
-    uint64_t *kernel_pml4 = paging_kernel_pml4();
-    /* Copy the full kernel PML4 so new threads inherit both lower and
-       higher-half mappings.  The kernel currently runs in the lower
-       half, so omitting those entries leaves new contexts without code
-       or stack mappings, leading to early triple faults. */
-    memcpy(new_pml4, kernel_pml4, 512 * sizeof(uint64_t));
-    return new_pml4;
+    /* Shared slots (kernel half, firmware identity map) point at the
+       kernel's tables; the rest of the lower half starts empty. */
+    return paging_new_context();
 }
 
 void vmm_map_page(uint64_t *pml4, uint64_t virt, uint64_t phys, uint64_t flags, uint32_t order, int node) {
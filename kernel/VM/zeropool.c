@@ -0,0 +1,257 @@
+/*
+ * Pre-zeroed page pool
+ * --------------------
+ * Zeroing a 4KiB frame inside the page-fault handler costs roughly a
+ * microsecond and evicts a page worth of useful cache lines.  A low
+ * priority thread per NUMA node keeps a small stack of frames that were
+ * zeroed ahead of time with non-temporal stores, so the fault path only
+ * pops a pointer.  The thread sleeps until a pop leaves fewer than
+ * ZEROPOOL_LOW pages.  When the pool runs dry callers fall back to buddy_alloc
+ * plus synchronous zeroing.
+ */
+#include "zeropool.h"
+#include "pmm_buddy.h"
+#include "numa.h"
+#include "shrinker.h"
+#include "../../include/cpuid.h"
+#include <string.h>
+
+#ifdef KERNEL_BUILD
+#include "../Task/thread.h"
+#endif
+
+typedef struct zp_page {
+    struct zp_page *next;
+} zp_page_t;
+
+typedef struct {
+    zp_page_t    *head;
+    uint32_t      count;
+    volatile int  lock;
+#ifdef KERNEL_BUILD
+    thread_wait_t worker;       // the node's zeroing thread
+#endif
+} zp_node_t;
+
+static zp_node_t zp_nodes[MAX_NUMA_ZONES];
+static int zp_have_erms = -1;
+static int zp_next_worker;
+
+static uint64_t zp_hits, zp_misses, zp_refilled;
+
+#ifdef KERNEL_BUILD
+static inline uint64_t zp_irq_save(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    return rf;
+}
+static inline void zp_irq_restore(uint64_t rf) {
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+static inline void zp_wake(zp_node_t *n) {
+    thread_wake(&n->worker);
+}
+#else
+static inline uint64_t zp_irq_save(void) { return 0; }
+static inline void zp_irq_restore(uint64_t rf) { (void)rf; }
+static inline void zp_wake(zp_node_t *n) { (void)n; }
+#endif
+
+// The fault handler pops from the pool, so the lock is taken with
+// interrupts disabled to avoid deadlocking against the zeroing thread.
+static inline uint64_t zp_lock(zp_node_t *n) {
+    uint64_t rf = zp_irq_save();
+    while (__sync_lock_test_and_set(&n->lock, 1))
+        while (n->lock) __asm__ volatile("pause");
+    return rf;
+}
+static inline void zp_unlock(zp_node_t *n, uint64_t rf) {
+    __sync_lock_release(&n->lock);
+    zp_irq_restore(rf);
+}
+
+static int zp_erms(void) {
+    if (zp_have_erms < 0) {
+        uint32_t eax, ebx, ecx, edx;
+        cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+        zp_have_erms = 0;
+        if (eax >= 7) {
+            cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+            zp_have_erms = (ebx >> 9) & 1;
+        }
+    }
+    return zp_have_erms;
+}
+
+void zero_range_nt(void *dst, size_t len) {
+    uint64_t *p = (uint64_t *)dst;
+    uint64_t *end = (uint64_t *)((uint8_t *)dst + len);
+    uint64_t zero = 0;
+    while (p < end) {
+        __asm__ volatile(
+            "movnti %1, 0(%0)\n\t"
+            "movnti %1, 8(%0)\n\t"
+            "movnti %1, 16(%0)\n\t"
+            "movnti %1, 24(%0)\n\t"
+            :: "r"(p), "r"(zero) : "memory");
+        p += 4;
+    }
+    // Non-temporal stores are weakly ordered; publish before handing out.
+    __asm__ volatile("sfence" ::: "memory");
+}
+
+void zero_range_sync(void *dst, size_t len) {
+    if (zp_erms()) {
+        void *d = dst;
+        size_t n = len;
+        __asm__ volatile("rep stosb"
+                         : "+D"(d), "+c"(n)
+                         : "a"(0)
+                         : "memory");
+        return;
+    }
+    memset(dst, 0, len);
+}
+
+static uint64_t zp_shrink_count(shrinker_t *s) {
+    (void)s;
+    uint64_t total = 0;
+    for (int i = 0; i < MAX_NUMA_ZONES; ++i)
+        total += __atomic_load_n(&zp_nodes[i].count, __ATOMIC_RELAXED);
+    return total;
+}
+
+static uint64_t zp_shrink_scan(shrinker_t *s, uint64_t nr_pages) {
+    (void)s;
+    uint64_t freed = 0;
+    for (int i = 0; i < MAX_NUMA_ZONES && freed < nr_pages; ++i)
+        freed += zeropool_drain(i, nr_pages - freed);
+    return freed;
+}
+
+// Pre-zeroed pages are the cheapest memory to give back.
+static shrinker_t zp_shrinker = {
+    .name = "zeropool",
+    .count = zp_shrink_count,
+    .scan = zp_shrink_scan,
+    .priority = SHRINKER_PRIO_CHEAP,
+};
+
+void zeropool_init(void) {
+    memset(zp_nodes, 0, sizeof(zp_nodes));
+    zp_hits = zp_misses = zp_refilled = 0;
+    zp_next_worker = 0;
+    zp_erms();
+    register_shrinker(&zp_shrinker);
+}
+
+int zeropool_refill(int node) {
+    if (node < 0 || node >= MAX_NUMA_ZONES)
+        return 0;
+    zp_node_t *n = &zp_nodes[node];
+    int added = 0;
+    while (__atomic_load_n(&n->count, __ATOMIC_RELAXED) < ZEROPOOL_TARGET) {
+        // Never compete with real allocations for the last free pages; the
+        // pool's own shrinker would just hand the page straight back.
+        if (reclaim_under_pressure())
+            break;
+        zp_page_t *pg = buddy_alloc(0, node, 1);
+        if (!pg)
+            break;
+        // Zero outside the lock; only the link word is written under it.
+        zero_range_nt(pg, PAGE_SIZE);
+        uint64_t rf = zp_lock(n);
+        pg->next = n->head;
+        n->head = pg;
+        n->count++;
+        zp_unlock(n, rf);
+        added++;
+    }
+    __atomic_fetch_add(&zp_refilled, (uint64_t)added, __ATOMIC_RELAXED);
+    return added;
+}
+
+void *alloc_zeroed_page_node(int node) {
+    if (node >= 0 && node < MAX_NUMA_ZONES) {
+        zp_node_t *n = &zp_nodes[node];
+        uint64_t rf = zp_lock(n);
+        zp_page_t *pg = n->head;
+        if (pg) {
+            n->head = pg->next;
+            n->count--;
+        }
+        int low = n->count < ZEROPOOL_LOW;
+        zp_unlock(n, rf);
+        if (low)
+            zp_wake(n);
+        if (pg) {
+            pg->next = NULL;        // the only dirty word
+            __atomic_fetch_add(&zp_hits, 1, __ATOMIC_RELAXED);
+            return pg;
+        }
+    }
+    void *page = buddy_alloc(0, node, 0);
+    if (!page)
+        return NULL;
+    zero_range_sync(page, PAGE_SIZE);
+    __atomic_fetch_add(&zp_misses, 1, __ATOMIC_RELAXED);
+    return page;
+}
+
+void *alloc_zeroed_page(void) {
+    return alloc_zeroed_page_node(current_cpu_node());
+}
+
+uint64_t zeropool_drain(int node, uint64_t max_pages) {
+    if (node < 0 || node >= MAX_NUMA_ZONES)
+        return 0;
+    zp_node_t *n = &zp_nodes[node];
+    uint64_t released = 0;
+    while (released < max_pages) {
+        uint64_t rf = zp_lock(n);
+        zp_page_t *pg = n->head;
+        if (pg) {
+            n->head = pg->next;
+            n->count--;
+        }
+        zp_unlock(n, rf);
+        if (!pg)
+            break;
+        buddy_free(pg, 0, node);
+        released++;
+    }
+    return released;
+}
+
+void zeropool_get_stats(zeropool_stats_t *out) {
+    if (!out)
+        return;
+    out->hits = __atomic_load_n(&zp_hits, __ATOMIC_RELAXED);
+    out->misses = __atomic_load_n(&zp_misses, __ATOMIC_RELAXED);
+    out->refilled = __atomic_load_n(&zp_refilled, __ATOMIC_RELAXED);
+    out->pooled = 0;
+    for (int i = 0; i < MAX_NUMA_ZONES; ++i)
+        out->pooled += __atomic_load_n(&zp_nodes[i].count, __ATOMIC_RELAXED);
+}
+
+#ifdef KERNEL_BUILD
+static void zeropool_worker(void) {
+    int node = __atomic_fetch_add(&zp_next_worker, 1, __ATOMIC_RELAXED);
+    for (;;) {
+        thread_wait(&zp_nodes[node].worker);
+        zeropool_refill(node);
+    }
+}
+
+void zeropool_start(void) {
+    int nodes = numa_node_count();
+    if (nodes > MAX_NUMA_ZONES)
+        nodes = MAX_NUMA_ZONES;
+    for (int i = 0; i < nodes; ++i) {
+        zeropool_refill(i);
+        thread_create_with_priority(zeropool_worker, MIN_PRIORITY + 1);
+    }
+}
+#else
+void zeropool_start(void) {}
+#endif
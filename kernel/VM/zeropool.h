@@ -0,0 +1,67 @@
+// Background pre-zeroed page pool.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Pages kept zeroed per NUMA node, and the level that wakes the refill.
+#define ZEROPOOL_TARGET   256
+#define ZEROPOOL_LOW      64
+
+typedef struct {
+    uint64_t hits;         // alloc_zeroed_page served from the pool
+    uint64_t misses;       // pool empty, zeroed synchronously
+    uint64_t refilled;     // pages zeroed by the background thread
+    uint64_t pooled;       // pages currently sitting in the pool
+} zeropool_stats_t;
+
+/**
+ * Reset the per-node pools.  Call once the buddy allocator is online.
+ */
+void zeropool_init(void);
+
+/**
+ * Spawn one low-priority zeroing thread per NUMA node, woken when its
+ * pool drops below ZEROPOOL_LOW.
+ */
+void zeropool_start(void);
+
+/**
+ * Top up a node's pool to ZEROPOOL_TARGET.  Returns pages added.
+ * The zeroing threads call this when woken; tests may call it directly.
+ */
+int zeropool_refill(int node);
+
+/**
+ * Allocate one zero-filled 4KiB frame, preferring the pre-zeroed pool and
+ * falling back to buddy_alloc plus synchronous zeroing.
+ */
+void *alloc_zeroed_page(void);
+void *alloc_zeroed_page_node(int node);
+
+/**
+ * Return pooled pages to the buddy allocator.  Returns pages released.
+ */
+uint64_t zeropool_drain(int node, uint64_t max_pages);
+
+void zeropool_get_stats(zeropool_stats_t *out);
+
+/**
+ * Zero memory with non-temporal stores so the lines are not pulled into
+ * the cache.  Used for memory nobody will touch soon (pool refill, dead
+ * thread stacks).  `len` must be a multiple of 32 bytes.
+ */
+void zero_range_nt(void *dst, size_t len);
+
+/**
+ * Zero memory that is about to be used, with `rep stosb` when the CPU
+ * advertises ERMS.
+ */
+void zero_range_sync(void *dst, size_t len);
+
+#ifdef __cplusplus
+}
+#endif
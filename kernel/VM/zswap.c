@@ -0,0 +1,421 @@
+#include "zswap.h"
+#include "mmap.h"
+#include "shrinker.h"
+#include "pmm_buddy.h"
+#include "page.h"
+#include "numa.h"
+#include "tlb.h"
+#include "cow.h"
+#include "zeropool.h"
+#include "../klib/lz4.h"
+#include "../../user/libc/libc.h"
+#include <printf.h>
+
+// Swap entries: the chunk's physical address with ZSWAP_PTE, a software
+// bit no present entry uses, so an entry that merely lost its present
+// bit never reads as one; chunk 0 stands for a page of zeroes.  Chunks
+// are 64-byte aligned and the low bits, present included, stay clear.
+#define ZSWAP_PTE    (1ULL << 58)
+#define CHUNK_SHIFT  6
+#define CHUNK_SIZE   (1u << CHUNK_SHIFT)
+#define CHUNK_MASK   ((uint64_t)CHUNK_SIZE - 1)
+
+// What the MMU reads in a present entry: flags, address, NX; and bit 9,
+// which paging_adv uses for 1 GiB leaves.
+#define PTE_HW_BITS  (0x000FFFFFFFFFF000ULL | 0x3FFULL | PAGE_NO_EXEC)
+_Static_assert(!(ZSWAP_PTE & PTE_HW_BITS), "ZSWAP_PTE overlaps page table flags");
+#define NR_CLASSES   (ZSWAP_MAX_STORED / CHUNK_SIZE)    // chunks of 64..2048 bytes
+
+// A stored page: its compressed length, then the LZ4 block.
+#define CHUNK_HDR    sizeof(uint16_t)
+
+#define ZSWAP_BATCH     16      // pages unmapped per TLB flush
+#define ZSWAP_SCAN_MAX  1024    // pages examined per hold of a space's lock
+
+static inline int is_zswap_entry(uint64_t e) {
+    return (e & (ZSWAP_PTE | CHUNK_MASK)) == ZSWAP_PTE;
+}
+
+static inline uint64_t entry_chunk(uint64_t e) {
+    return e & ~(ZSWAP_PTE | CHUNK_MASK);
+}
+
+static inline uint64_t zswap_rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static meminfo_zswap_t stats;       // updated atomically
+
+#define STAT_ADD(field, n)  __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n)  __atomic_fetch_sub(&stats.field, (n), __ATOMIC_RELAXED)
+
+// ----------- Pool -----------
+// Each pool page holds chunks of one class.  Its descriptor keeps the
+// bookkeeping: `refcount` chunks in use, `zs_free` the index+1 of the
+// first free chunk (0: full), and, while it has a free chunk, links in its
+// class's partial list through `private` (next) and `zs_prev`.  A
+// free chunk's first 16 bits hold the index+1 of the next one.
+
+static page_t *partial[NR_CLASSES];
+static volatile int pool_lock;
+
+static uint64_t pool_lock_irq(void) {
+    uint64_t rf;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(rf) :: "memory");
+    while (__sync_lock_test_and_set(&pool_lock, 1))
+        __asm__ volatile("pause");
+    return rf;
+}
+
+static void pool_unlock_irq(uint64_t rf) {
+    __sync_lock_release(&pool_lock);
+    __asm__ volatile("push %0; popfq" :: "r"(rf) : "memory");
+}
+
+static inline unsigned class_of(size_t stored) {
+    return (unsigned)((stored + CHUNK_SIZE - 1) / CHUNK_SIZE) - 1;
+}
+
+static inline uint32_t class_size(unsigned cls) {
+    return (cls + 1) * CHUNK_SIZE;
+}
+
+static void partial_push(unsigned cls, page_t *pg) {
+    pg->zs_prev = NULL;
+    pg->private = partial[cls];
+    if (partial[cls])
+        partial[cls]->zs_prev = pg;
+    partial[cls] = pg;
+}
+
+static void partial_remove(unsigned cls, page_t *pg) {
+    page_t *next = pg->private, *prev = pg->zs_prev;
+    if (prev)
+        prev->private = next;
+    else
+        partial[cls] = next;
+    if (next)
+        next->zs_prev = prev;
+    pg->private = pg->zs_prev = NULL;
+}
+
+// A fresh pool page for `cls`, its chunks all on its free list.  Never
+// reclaims: the scanner allocates from inside a shrinker.
+static page_t *pool_grow(unsigned cls) {
+    void *p = buddy_try_alloc(0, current_cpu_node(), 0);
+    if (!p)
+        return NULL;
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)p);
+    if (!pg) {
+        buddy_free(p, 0, numa_addr_node((uint64_t)(uintptr_t)p));
+        return NULL;
+    }
+    uint32_t size = class_size(cls), n = PAGE_SIZE / size;
+    for (uint32_t i = 0; i < n; ++i)
+        *(uint16_t *)((uint8_t *)p + i * size) = (uint16_t)(i + 1 < n ? i + 2 : 0);
+    pg->owner = PAGE_OWNER_KERNEL;
+    pg->refcount = 0;
+    pg->zs_free = 1;
+    STAT_ADD(pool_pages, 1);
+    return pg;
+}
+
+// Address of a free chunk of `cls`, or 0 when out of memory.
+static uint64_t chunk_alloc(unsigned cls) {
+    uint64_t rf = pool_lock_irq();
+    page_t *pg = partial[cls];
+    if (!pg) {
+        pool_unlock_irq(rf);
+        page_t *fresh = pool_grow(cls);
+        if (!fresh)
+            return 0;
+        rf = pool_lock_irq();
+        partial_push(cls, fresh);
+        pg = partial[cls];
+    }
+    uint64_t chunk = page_to_phys(pg) + (uint64_t)(pg->zs_free - 1) * class_size(cls);
+    pg->zs_free = *(uint16_t *)(uintptr_t)chunk;
+    pg->refcount++;
+    if (!pg->zs_free)
+        partial_remove(cls, pg);
+    pool_unlock_irq(rf);
+    return chunk;
+}
+
+// Free the chunk at `chunk`, and its pool page with the last one.
+static void chunk_free(uint64_t chunk) {
+    uint64_t base = chunk & ~((uint64_t)PAGE_SIZE - 1);
+    page_t *pg = phys_to_page(base);
+    uint16_t *hdr = (uint16_t *)(uintptr_t)chunk;
+    unsigned cls = class_of(CHUNK_HDR + *hdr);
+    uint32_t idx = (uint32_t)((chunk - base) / class_size(cls));
+
+    uint64_t rf = pool_lock_irq();
+    if (!pg->zs_free)
+        partial_push(cls, pg);
+    *hdr = (uint16_t)pg->zs_free;
+    pg->zs_free = idx + 1;
+    int empty = !--pg->refcount;
+    if (empty)
+        partial_remove(cls, pg);
+    pool_unlock_irq(rf);
+    if (empty) {
+        STAT_SUB(pool_pages, 1);
+        buddy_free((void *)(uintptr_t)base, 0, numa_addr_node(base));
+    }
+}
+
+// Forget the page behind entry `e`, which no page table holds any more.
+static void entry_drop(uint64_t e) {
+    uint64_t chunk = entry_chunk(e);
+    if (chunk) {
+        STAT_SUB(compressed_bytes, *(uint16_t *)(uintptr_t)chunk);
+        chunk_free(chunk);
+    } else {
+        STAT_SUB(same_filled, 1);
+    }
+    STAT_SUB(stored_pages, 1);
+}
+
+// ----------- Storing -----------
+// The scan state, the compressor's table and output are the scanner's,
+// serialised by scan_lock.
+
+typedef struct {
+    uint64_t va, phys, old;     // `old`: the entry before it lost its present bit
+} victim_t;
+
+static volatile int scan_lock;
+static lz4_work_t scan_work;
+static uint8_t scan_buf[ZSWAP_MAX_STORED - CHUNK_HDR];
+static uint64_t scan_id, scan_va;   // clock hand: space id and address to look at next
+
+static int page_is_zero(const void *page) {
+    const uint64_t *w = page;
+    for (size_t i = 0; i < PAGE_SIZE / sizeof(*w); ++i)
+        if (w[i])
+            return 0;
+    return 1;
+}
+
+// Swap entry holding a copy of `page`, or 0 if it does not compress
+// enough or the pool cannot grow.
+static uint64_t store_page(const void *page) {
+    STAT_ADD(stores, 1);
+    if (page_is_zero(page)) {
+        STAT_ADD(same_filled, 1);
+        STAT_ADD(stored_pages, 1);
+        return ZSWAP_PTE;
+    }
+    size_t clen = lz4_compress(page, PAGE_SIZE, scan_buf, sizeof(scan_buf), &scan_work);
+    uint64_t chunk = clen ? chunk_alloc(class_of(CHUNK_HDR + clen)) : 0;
+    if (!chunk) {
+        STAT_ADD(rejected, 1);
+        return 0;
+    }
+    *(uint16_t *)(uintptr_t)chunk = (uint16_t)clen;
+    memcpy((uint8_t *)(uintptr_t)chunk + CHUNK_HDR, scan_buf, clen);
+    STAT_ADD(compressed_bytes, clen);
+    STAT_ADD(stored_pages, 1);
+    return chunk | ZSWAP_PTE;
+}
+
+// Compress the pages of `batch`, unmapped by paging_swap_out, and free
+// their frames; those that do not compress are mapped back.  Returns the
+// frames freed.
+static uint64_t store_batch(vm_space_t *vs, victim_t *batch, unsigned n) {
+    // Until the flush lands, a CPU may still write through a stale entry.
+    tlb_batch_flush();
+    uint64_t freed = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        victim_t *c = &batch[i];
+        uint64_t gone = c->old & ~PAGE_PRESENT;
+        uint64_t e = store_page((void *)(uintptr_t)c->phys);
+        if (!e) {
+            // Accessed again as far as the scanner cares: it is skipped
+            // next pass instead of compressed again at once.
+            paging_swap_set(vs, c->va, gone, c->old | PAGE_ACCESSED);
+            continue;
+        }
+        paging_swap_set(vs, c->va, gone, e);
+        vm_frame_release(c->phys, 0);
+        freed++;
+    }
+    return freed;
+}
+
+// Whether the page at `va`, mapping `phys`, goes: an anonymous 4 KiB page
+// mapped only here, not accessed since the last pass.  The accessed bit
+// is cleared on the way, which gives a busy page another pass.
+static int scan_candidate(vm_space_t *vs, uint64_t va, uint64_t phys, uint64_t size,
+                          uint64_t *old) {
+    page_t *pg = phys_to_page(phys);
+    return size == PAGE_SIZE && pg && pg->owner == PAGE_OWNER_USER &&
+           page_ref_count(pg) == 1 && pg->mapcount == 1 && !page_test_flag(pg, PG_COW) &&
+           paging_clear_young(vs, va) == 0 && paging_swap_out(vs, va, phys, old) == 0;
+}
+
+// Scan the private mappings of `vs` from the clock hand for up to
+// ZSWAP_SCAN_MAX pages, adding frames freed to *freed, until it reaches
+// `want`.  Returns 1 once the space is done (or busy), 0 if the hand
+// stopped inside it.
+static int scan_space(vm_space_t *vs, uint64_t want, uint64_t *freed) {
+    uint64_t rf;
+    if (!vm_mm_trylock(vs, &rf))
+        return 1;
+    victim_t batch[ZSWAP_BATCH];
+    unsigned n = 0;
+    uint64_t seen = 0;
+    int done = 1;
+    tlb_batch_begin();
+    for (vma_t *v = vma_find_after(&vs->vmas, scan_va); v && done; v = vma_next(v)) {
+        if (v->flags & VMA_SHARED)
+            continue;
+        uint64_t va = scan_va > v->start ? scan_va : v->start, phys, size;
+        while ((va = paging_next_mapped(vs, va, v->end, &phys, &size)) < v->end) {
+            if (++seen > ZSWAP_SCAN_MAX || *freed + n >= want) {
+                done = 0;
+                break;
+            }
+            if (scan_candidate(vs, va, phys, size, &batch[n].old)) {
+                batch[n].va = va;
+                batch[n].phys = phys;
+                if (++n == ZSWAP_BATCH) {
+                    *freed += store_batch(vs, batch, n);
+                    n = 0;
+                }
+            }
+            va += size;
+        }
+        scan_va = va;
+    }
+    if (n)
+        *freed += store_batch(vs, batch, n);
+    tlb_batch_end();
+    vm_mm_unlock(vs, rf);
+    return done;
+}
+
+uint64_t zswap_reclaim(uint64_t nr_pages) {
+    if (__sync_lock_test_and_set(&scan_lock, 1))
+        return 0;
+    uint64_t freed = 0;
+    int wraps = 0;
+    vm_space_t *vs = NULL;
+    // Spaces are visited in id order from the hand.  Three ends of the
+    // list make at least two full passes: the first may only clear
+    // accessed bits.
+    while (freed < nr_pages && wraps < 3) {
+        vs = paging_space_next(vs);
+        if (!vs) {
+            wraps++;
+            scan_id = 0;
+            scan_va = 0;
+            continue;
+        }
+        if (vs->id < scan_id)
+            continue;
+        if (vs->id > scan_id) {
+            scan_id = vs->id;
+            scan_va = 0;
+        }
+        while (!scan_space(vs, nr_pages, &freed) && freed < nr_pages)
+            ;
+        if (freed < nr_pages) {
+            scan_id = vs->id + 1;
+            scan_va = 0;
+        }
+    }
+    paging_space_put(vs);
+    __sync_lock_release(&scan_lock);
+    return freed;
+}
+
+// ----------- Loading -----------
+
+int zswap_fault(vm_space_t *vs, vma_t *v, uint64_t va) {
+    uint64_t e;
+    if ((v->flags & VMA_SHARED) || paging_next_swap(vs, va, va + PAGE_SIZE, &e) != va ||
+        !is_zswap_entry(e))
+        return 1;
+    uint64_t t0 = zswap_rdtsc();
+    uint64_t chunk = entry_chunk(e);
+    void *frame = chunk ? buddy_alloc(0, current_cpu_node(), 0) : alloc_zeroed_page();
+    if (!frame)
+        return -1;
+    if (chunk) {
+        uint16_t clen = *(uint16_t *)(uintptr_t)chunk;
+        if (lz4_decompress((uint8_t *)(uintptr_t)chunk + CHUNK_HDR, clen, frame, PAGE_SIZE) != PAGE_SIZE) {
+            kprintf("[zswap] corrupt entry %llx at %llx\n", (unsigned long long)e,
+                    (unsigned long long)va);
+            buddy_free(frame, 0, numa_addr_node((uint64_t)(uintptr_t)frame));
+            return -1;
+        }
+    }
+    uint64_t phys = (uint64_t)(uintptr_t)frame;
+    vm_frame_claim(phys, 0);
+    // Marked accessed, or the next pass would take it straight back.
+    if (paging_swap_set(vs, va, e, phys | vm_prot_flags(vs, v->prot) | PAGE_ACCESSED) < 0) {
+        vm_frame_release(phys, 0);      // not ours after all
+        return 1;
+    }
+    entry_drop(e);
+    STAT_ADD(loads, 1);
+    STAT_ADD(load_cycles, zswap_rdtsc() - t0);
+    return 0;
+}
+
+int zswap_load_range(vm_space_t *vs, vma_t *v, uint64_t start, uint64_t end) {
+    uint64_t va = start;
+    while ((va = paging_next_swap(vs, va, end, NULL)) < end) {
+        if (zswap_fault(vs, v, va) < 0)
+            return -1;
+        va += PAGE_SIZE;
+    }
+    return 0;
+}
+
+void zswap_zap(vm_space_t *vs, uint64_t start, uint64_t end) {
+    uint64_t va = start, e;
+    while ((va = paging_next_swap(vs, va, end, &e)) < end) {
+        if (is_zswap_entry(e) && paging_swap_set(vs, va, e, 0) == 0)
+            entry_drop(e);
+        va += PAGE_SIZE;
+    }
+}
+
+void zswap_get_stats(meminfo_zswap_t *out) {
+    out->stored_pages = __atomic_load_n(&stats.stored_pages, __ATOMIC_RELAXED);
+    out->same_filled = __atomic_load_n(&stats.same_filled, __ATOMIC_RELAXED);
+    out->compressed_bytes = __atomic_load_n(&stats.compressed_bytes, __ATOMIC_RELAXED);
+    out->pool_pages = __atomic_load_n(&stats.pool_pages, __ATOMIC_RELAXED);
+    out->stores = __atomic_load_n(&stats.stores, __ATOMIC_RELAXED);
+    out->rejected = __atomic_load_n(&stats.rejected, __ATOMIC_RELAXED);
+    out->loads = __atomic_load_n(&stats.loads, __ATOMIC_RELAXED);
+    out->load_cycles = __atomic_load_n(&stats.load_cycles, __ATOMIC_RELAXED);
+}
+
+// ----------- Shrinker -----------
+
+static uint64_t zswap_count(shrinker_t *s) {
+    (void)s;
+    return vm_anon_pages();
+}
+
+static uint64_t zswap_scan(shrinker_t *s, uint64_t nr_pages) {
+    (void)s;
+    return zswap_reclaim(nr_pages);
+}
+
+static shrinker_t zswap_shrinker = {
+    .name = "zswap",
+    .count = zswap_count,
+    .scan = zswap_scan,
+    .priority = SHRINKER_PRIO_COSTLY,
+};
+
+void zswap_init(void) {
+    register_shrinker(&zswap_shrinker);
+}
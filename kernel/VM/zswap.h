@@ -0,0 +1,53 @@
+// Compressed in-memory swap for anonymous pages.
+#pragma once
+#include <stdint.h>
+#include "paging_adv.h"
+#include "../../include/meminfo.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * There is no swap device: under memory pressure the zswap shrinker picks
+ * cold private anonymous pages, compresses them with LZ4 into a pool of
+ * size-classed chunks carved from single frames, and leaves a swap entry
+ * (paging_adv.h) in place of the page.  The next touch faults and
+ * decompresses it into a fresh frame.  Zero-filled pages keep no data at
+ * all, and pages that do not shrink to ZSWAP_MAX_STORED stay resident.
+ *
+ * Pages are cold once their accessed bit stayed clear for a whole pass of
+ * the scanner, which clears it as it goes (second chance).  The scanner
+ * visits every space in turn and skips those whose mmap lock is taken.
+ */
+
+#define ZSWAP_MAX_STORED  2048      // bytes a page must compress to, header included
+
+/** Register the shrinker.  Call after reclaim_init. */
+void zswap_init(void);
+
+/**
+ * Compress up to `nr_pages` cold pages; returns the frames freed.  Returns
+ * 0 at once if another scan is running.  The shrinker calls it.
+ */
+uint64_t zswap_reclaim(uint64_t nr_pages);
+
+/**
+ * Bring back the page at `va` in `vs`, inside `v`, if a swap entry holds
+ * it.  Call under the mmap lock.  Returns 1 if `va` has no swap entry, 0
+ * once the page is mapped again, -1 when out of memory.
+ */
+int zswap_fault(vm_space_t *vs, vma_t *v, uint64_t va);
+
+/** zswap_fault for every swap entry in [start, end) of `v`. */
+int zswap_load_range(vm_space_t *vs, vma_t *v, uint64_t start, uint64_t end);
+
+/** Drop the swap entries of [start, end) in `vs` and their data.  Call
+ *  under the mmap lock, or on a space nothing runs in any more. */
+void zswap_zap(vm_space_t *vs, uint64_t start, uint64_t end);
+
+void zswap_get_stats(meminfo_zswap_t *out);
+
+#ifdef __cplusplus
+}
+#endif
@@ -5,7 +5,9 @@
 
 #include "elf.h"
 #include "agent_loader.h"
+#include "Task/thread.h"
 #include "VM/heap.h"
+#include "VM/vmalloc.h"
 #include "drivers/IO/serial.h"
 
 // Some tree headers provide these; define minimally if missing.
@@ -55,8 +57,8 @@ static __attribute__((unused)) void safe_dump_window(const uint8_t* load_base, u
 /*
  * Very small allocator shim: try a page-aligned kalloc first.  Early in boot
  * the full kernel heap may not be available which previously caused agent
- * loading to fail outright.  If kalloc() returns NULL, fall back to a tiny
- * static arena so we can still bootstrap built-in agents.
+ * loading to fail outright.  If kalloc() returns NULL, try vmalloc, then fall
+ * back to a tiny static arena so we can still bootstrap built-in agents.
  */
 static void* kalloc_aligned_or_arena(size_t bytes, size_t align) {
     size_t need = bytes;
@@ -64,6 +66,10 @@ static void* kalloc_aligned_or_arena(size_t bytes, size_t align) {
 
     // Primary attempt: use the real kernel allocator.
     uint8_t* raw = (uint8_t*)kalloc(need + align);
+    // An image too big for one free run of frames still loads once paging
+    // is up: vmalloc maps it from single pages, page aligned already.
+    if (!raw && align <= PAGE_SIZE)
+        raw = (uint8_t*)vmalloc_exec(need);
     if (!raw) {
         // Fallback arena: single static buffer used only when the heap is not
         // yet ready.  This is intentionally small but sufficient for early
@@ -281,6 +287,17 @@ static int elf_map_and_spawn(const void *img, size_t sz, const char *path, int p
         rc = __agent_loader_spawn_fn(path ? path : "(elf)", (void *)runtime_entry, prio);
         serial_printf("[loader] register_and_spawn rc=%d\n", rc);
     }
+
+    // The executable segments bound where the agent may SYS_SPAWN into.
+    uint64_t x_lo = UINT64_MAX, x_hi = 0;
+    for (uint16_t i = 0; i < eh->e_phnum; ++i) {
+        if (ph[i].p_type != PT_LOAD || !(ph[i].p_flags & PF_X)) continue;
+        x_lo = MIN(x_lo, ph[i].p_vaddr - lo);
+        x_hi = MAX(x_hi, ph[i].p_vaddr - lo + ph[i].p_memsz);
+    }
+    if (rc > 0 && x_lo < x_hi)
+        thread_set_text(rc, (uint64_t)(uintptr_t)load_base + x_lo,
+                        (uint64_t)(uintptr_t)load_base + x_hi);
     return rc;
 }
 
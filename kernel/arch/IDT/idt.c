@@ -56,6 +56,9 @@ static void idt_populate_all(void) {
                     ist  = IST_DF;
 #endif
                     break;
+                case 14: /* #PF: CR2 must be read before anything can fault again */
+                    type = IDT_INTERRUPT_GATE;
+                    break;
                 default:
                     type = IDT_TRAP_GATE;
                     break;
@@ -1,4 +1,8 @@
 #include "arch/IDT/isr.h"
+#include "VM/paging_adv.h"
+#include "arch/CPU/smp.h"
+#include "Task/thread.h"
+#include "VM/shrinker.h"
 #ifndef kprintf
 #include "../../klib/stdio.h"
 #define kprintf printf
@@ -13,6 +17,8 @@ void arm_init_watchdog(unsigned t) { init_watchdog = t; }
 void isr_timer_handler(const void *hw_frame) {
     (void)hw_frame;
     if (++ticks % 100 == 0) kprintf("[timer] %u ticks\n", ticks);
+    thread_timer_tick();
+    kswapd_tick();
 
     if (init_watchdog) {
         if (--init_watchdog == 0) {
@@ -21,3 +27,13 @@ void isr_timer_handler(const void *hw_frame) {
         }
     }
 }
+
+void isr_page_fault_handler(uint64_t err, uint64_t addr, const void *hw_frame) {
+    if (paging_handle_fault(err, addr, (int)smp_cpu_index()) == 0)
+        return;
+    const uint64_t *frame = hw_frame;
+    kprintf("[pf] unresolved fault addr=%llx err=%llx rip=%llx\n",
+            (unsigned long long)addr, (unsigned long long)err,
+            (unsigned long long)frame[0]);
+    for (;;) __asm__ volatile("cli; hlt");
+}
@@ -1,5 +1,8 @@
 #pragma once
+#include <stdint.h>
 void isr_timer_handler(const void *hw_frame);
+/* #PF: resolve through paging_handle_fault, or report and halt. */
+void isr_page_fault_handler(uint64_t err, uint64_t addr, const void *hw_frame);
 /* Arm or disarm the tiny init watchdog.
  * Pass number of timer ticks before panic; 0 disarms.
  */
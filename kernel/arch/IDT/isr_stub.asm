@@ -6,11 +6,15 @@ global isr_ud_stub
 global isr_timer_stub
 global isr_i2c_stub
 global isr_syscall_stub
+global isr_tlb_stub
+global isr_pf_stub
 
 extern lapic_eoi
 extern isr_timer_handler   ; void isr_timer_handler(const void *hw_frame)
 extern isr_i2c_handler     ; void isr_i2c_handler(const void *hw_frame)
 extern isr_syscall_handler ; uint64_t isr_syscall_handler(uint64_t *regs)
+extern tlb_shootdown_handler ; void tlb_shootdown_handler(void)
+extern isr_page_fault_handler ; void isr_page_fault_handler(uint64_t err, uint64_t addr, const void *hw_frame)
 
 section .text
 
@@ -76,10 +80,8 @@ isr_i2c_stub:
     pop rax
     iretq
 
-; Syscall stub for int 0x80
-; Saves general purpose registers, passes pointer to saved regs
-; to C handler, stores return value in saved RAX slot
-isr_syscall_stub:
+; TLB shootdown IPI (TLB_SHOOTDOWN_VECTOR in kernel/VM/tlb.h)
+isr_tlb_stub:
     push rax
     push rcx
     push rdx
@@ -90,11 +92,41 @@ isr_syscall_stub:
     push r10
     push r11
 
-    mov rdi, rsp            ; rdi = pointer to saved regs
-    call isr_syscall_handler
+    call tlb_shootdown_handler
+
+    call lapic_eoi
+
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rax
+    iretq
+
+; Page fault.  The CPU pushes an error code below the frame; the C handler
+; gets it with CR2 and either resolves the fault or halts.
+isr_pf_stub:
+    push rax
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push r8
+    push r9
+    push r10
+    push r11
+    sub  rsp, 8                ; keep the call 16-byte aligned
 
-    mov [rsp + 8*8], rax    ; place return value into saved rax
+    mov  rdi, [rsp + 10*8]     ; rdi = error code
+    mov  rsi, cr2              ; rsi = faulting address
+    lea  rdx, [rsp + 11*8]     ; rdx = &HW frame
+    call isr_page_fault_handler
 
+    add  rsp, 8
     pop r11
     pop r10
     pop r9
@@ -104,18 +136,56 @@ isr_syscall_stub:
     pop rdx
     pop rcx
     pop rax
+    add  rsp, 8                ; drop the error code
+    iretq
+
+; Syscall stub for int 0x80
+; Saves general purpose registers in syscall_regs_t order (rax at the
+; lowest address), passes a pointer to them to the C handler and stores
+; the return value in the saved RAX slot
+isr_syscall_stub:
+    push r11
+    push r10
+    push r9
+    push r8
+    push rdi
+    push rsi
+    push rdx
+    push rcx
+    push rax
+
+    mov rdi, rsp            ; rdi = pointer to saved regs
+    call isr_syscall_handler
+
+    mov [rsp], rax          ; place return value into saved rax
+
+    pop rax
+    pop rcx
+    pop rdx
+    pop rsi
+    pop rdi
+    pop r8
+    pop r9
+    pop r10
+    pop r11
     iretq
 
 section .rodata
 align 8
 isr_stub_table:
 %define I2C_VEC 42
+%define TLB_VEC 0xF2
+%define PF_VEC 14
 %assign i 0
 %rep 256
 %if i = 32
     dq isr_timer_stub
 %elif i = I2C_VEC
     dq isr_i2c_stub
+%elif i = TLB_VEC
+    dq isr_tlb_stub
+%elif i = PF_VEC
+    dq isr_pf_stub
 %elif i = 0x80
     dq isr_syscall_stub
 %else
@@ -21,6 +21,11 @@
 #define PT_LOAD     1
 #define PT_DYNAMIC  2
 
+/* p_flags */
+#define PF_X        0x1
+#define PF_W        0x2
+#define PF_R        0x4
+
 /* dynamic tags */
 #define DT_NULL     0
 #define DT_SYMTAB   6
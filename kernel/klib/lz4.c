@@ -0,0 +1,140 @@
+#include "lz4.h"
+#include <string.h>
+
+#define MINMATCH      4
+#define LASTLITERALS  5     // the block ends in at least this many literals
+#define MFLIMIT       12    // no match starts closer than this to the end
+#define SKIP_TRIGGER  6     // misses before the scan starts skipping ahead
+
+static inline uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+// A length past the token's nibble: runs of 255, then the remainder.
+static uint8_t *put_len(uint8_t *op, size_t n) {
+    for (; n >= 255; n -= 255)
+        *op++ = 255;
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// One sequence: literals [lit, lit+nlit), then a match of `mlen` bytes at
+// `off` back (none when mlen is 0, for the last sequence).  NULL if it
+// does not fit before `oend`.
+static uint8_t *put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+                        size_t off, size_t mlen) {
+    size_t need = 1 + nlit + nlit / 255 + 1 + (mlen ? 2 + mlen / 255 + 1 : 0);
+    if (need > (size_t)(oend - op))
+        return NULL;
+    uint8_t *token = op++;
+    *token = (uint8_t)((nlit < 15 ? nlit : 15) << 4);
+    if (nlit >= 15)
+        op = put_len(op, nlit - 15);
+    memcpy(op, lit, nlit);
+    op += nlit;
+    if (!mlen)
+        return op;
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    mlen -= MINMATCH;
+    *token |= (uint8_t)(mlen < 15 ? mlen : 15);
+    if (mlen >= 15)
+        op = put_len(op, mlen - 15);
+    return op;
+}
+
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap, lz4_work_t *work) {
+    const uint8_t *base = src, *ip = base, *anchor = base, *iend = base + len;
+    uint8_t *op = dst, *oend = op + cap;
+    if (len > LZ4_MAX_INPUT)
+        return 0;
+
+    if (len > MFLIMIT) {
+        const uint8_t *mflimit = iend - MFLIMIT, *matchlimit = iend - LASTLITERALS;
+        memset(work->table, 0, sizeof(work->table));
+        unsigned misses = 1 << SKIP_TRIGGER;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip), h = hash4(seq);
+            const uint8_t *ref = base + work->table[h];
+            work->table[h] = (uint16_t)(ip - base);
+            if (ref >= ip || read32(ref) != seq) {
+                // Incompressible stretches are crossed in growing steps.
+                ip += misses++ >> SKIP_TRIGGER;
+                continue;
+            }
+            misses = 1 << SKIP_TRIGGER;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + MINMATCH, *r = ref + MINMATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+            op = put_seq(op, oend, anchor, (size_t)(ip - anchor), (size_t)(ip - ref),
+                         (size_t)(m - ip));
+            if (!op)
+                return 0;
+            ip = anchor = m;
+            if (ip < mflimit)
+                work->table[hash4(read32(ip - 2))] = (uint16_t)(ip - 2 - base);
+        }
+    }
+    op = put_seq(op, oend, anchor, (size_t)(iend - anchor), 0, 0);
+    return op ? (size_t)(op - (uint8_t *)dst) : 0;
+}
+
+// Read a length extension into *n; 0 if the input ends first.
+static int get_len(const uint8_t **ip, const uint8_t *iend, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip >= iend)
+            return 0;
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 1;
+}
+
+long lz4_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *ip = src, *iend = ip + len;
+    uint8_t *op = dst, *oend = op + cap;
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == 15 && !get_len(&ip, iend, &nlit))
+            return -1;
+        if (nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+            return -1;
+        memcpy(op, ip, nlit);
+        op += nlit;
+        ip += nlit;
+        if (ip == iend)
+            break;                  // the last sequence has no match
+
+        if (iend - ip < 2)
+            return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (!off || off > (size_t)(op - (uint8_t *)dst))
+            return -1;
+        size_t mlen = token & 15;
+        if (mlen == 15 && !get_len(&ip, iend, &mlen))
+            return -1;
+        mlen += MINMATCH;
+        if (mlen > (size_t)(oend - op))
+            return -1;
+        // Byte by byte: the match may overlap what it is producing.
+        const uint8_t *ref = op - off;
+        while (mlen--)
+            *op++ = *ref++;
+    }
+    return (long)(op - (uint8_t *)dst);
+}
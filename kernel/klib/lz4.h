@@ -0,0 +1,25 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// LZ4 block format (no frame header), compatible with the reference
+// decoder.  The compressor is the greedy single-probe matcher of LZ4's
+// fast mode; inputs are limited to 64 KiB so table positions fit 16 bits.
+
+#define LZ4_MAX_INPUT  65535
+#define LZ4_HASH_LOG   12
+
+// Match table for lz4_compress.  8 KiB, too big for a kernel stack: keep
+// one per compressing context.
+typedef struct {
+    uint16_t table[1 << LZ4_HASH_LOG];
+} lz4_work_t;
+
+// Compress `len` bytes of `src` into at most `cap` bytes of `dst`.
+// Returns the compressed size, or 0 if it does not fit (or len is too big).
+size_t lz4_compress(const void *src, size_t len, void *dst, size_t cap, lz4_work_t *work);
+
+// Decompress `len` bytes of `src` into at most `cap` bytes of `dst`.
+// Returns the decompressed size, or -1 if the input is malformed or would
+// overflow `dst`; never reads or writes outside the buffers.
+long lz4_decompress(const void *src, size_t len, void *dst, size_t cap);
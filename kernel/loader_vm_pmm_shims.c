@@ -30,24 +30,17 @@ static inline uint64_t prot_to_flags(int prot) {
 }
 
 int vmm_map(void* va, uintptr_t pa, int prot) {
-    paging_map_adv((uint64_t)va, pa, prot_to_flags(prot), 0, current_cpu_node());
-    return 0;
+    return paging_map_range((uint64_t)va, pa, PAGE_SIZE, prot_to_flags(prot), current_cpu_node());
 }
 
 // Change page protections on a VA range
 void vmm_prot(void* va, size_t size, int prot) {
-    uint64_t flags = prot_to_flags(prot);
-    for (size_t off = 0; off < size; off += PAGE_SIZE) {
-        uint64_t phys = paging_virt_to_phys_adv((uint64_t)va + off);
-        if (phys)
-            paging_map_adv((uint64_t)va + off, phys, flags, 0, current_cpu_node());
-    }
+    paging_protect_range((uint64_t)va, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), prot_to_flags(prot));
 }
 
 // Unmap a VA range
 void vmm_unmap(void* va, size_t size) {
-    for (size_t off = 0; off < size; off += PAGE_SIZE)
-        paging_unmap_adv((uint64_t)va + off);
+    paging_unmap_range((uint64_t)va, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
 }
 
 // Check that VA is mapped with execute permission (best-effort)
@@ -21,10 +21,16 @@
 #include "arch_x86_64/gdt_tss.h"
 #include "VM/numa.h"
 #include "VM/pmm_buddy.h"
+#include "VM/memblock.h"
 #include "VM/pmm.h"
 #include "VM/vmm.h"
 #include "VM/heap.h"
 #include "VM/paging_adv.h"
+#include "VM/zeropool.h"
+#include "VM/shrinker.h"
+#include "VM/zswap.h"
+#include "VM/ksm.h"
+#include "VM/vm_selftest.h"
 #include "arch/APIC/lapic.h"
 #include "arch/CPU/irq.h"
 #include "uaccess.h"
@@ -79,24 +85,17 @@ static void print_framebuffer(const bootinfo_t *b) { (void)b; }
 static void print_mmap(const bootinfo_t *b) { (void)b; }
 extern void thread_yield(void);
 
+/* 2 MiB leaves where the load addresses allow, 4 KiB pages elsewhere. */
 static void setup_high_half_vm(const bootinfo_t *b) {
-    uint64_t phys = b->kernel_load_base;
-    uint64_t size = b->kernel_load_size;
-    for (uint64_t off = 0; off < size; off += 0x200000ULL) {
-        paging_map_adv(KERNEL_BASE + off, phys + off,
-                       PAGE_PRESENT | PAGE_WRITABLE, 9,
-                       current_cpu_node());
-    }
+    uint64_t size = (b->kernel_load_size + 0x1FFFFFULL) & ~0x1FFFFFULL;
+    paging_map_range(KERNEL_BASE, b->kernel_load_base & ~0xFFFULL, size,
+                     PAGE_PRESENT | PAGE_WRITABLE, current_cpu_node());
 
     uint64_t va = NOSM_BASE;
     for (uint32_t i = 0; i < b->module_count; ++i) {
-        uint64_t mphys = (uint64_t)b->modules[i].base;
+        uint64_t mphys = (uint64_t)b->modules[i].base & ~0xFFFULL;
         uint64_t msize = (b->modules[i].size + 0x1FFFFFULL) & ~0x1FFFFFULL;
-        for (uint64_t off = 0; off < msize; off += 0x200000ULL) {
-            paging_map_adv(va + off, mphys + off,
-                           PAGE_PRESENT | PAGE_WRITABLE, 9,
-                           current_cpu_node());
-        }
+        paging_map_range(va, mphys, msize, PAGE_PRESENT | PAGE_WRITABLE, current_cpu_node());
         va += msize;
     }
 }
@@ -227,14 +226,25 @@ void n2_main(bootinfo_t *bootinfo) {
     print_framebuffer(bootinfo);
     print_mmap(bootinfo);
 
-    numa_init(bootinfo);
-    buddy_init(bootinfo);
     vmm_init();
     pmm_init(bootinfo);
+    kprintf("[N2] memory: %llu MiB usable, %llu pages free\n",
+            (unsigned long long)(memblock_phys_mem_size() >> 20),
+            (unsigned long long)buddy_free_frames_total());
     kheap_parse_bootarg(bootinfo->cmdline);
     kheap_init();
-
+    zeropool_init();
+    zeropool_start();
+    reclaim_init();
+    zswap_init();
+    ksm_init();
+    kswapd_start();
+    ksm_start();
+    kheap_start();
+
+    paging_init();
     setup_high_half_vm(bootinfo);
+    vm_selftest_run();
 
     hal_init();
 
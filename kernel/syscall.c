@@ -3,6 +3,13 @@
 #include "klib/string.h"
 #include "drivers/IO/tty.h"
 #include "syscall.h"
+#include "VM/meminfo.h"
+#include "../include/nitroheap_sys.h"
+#include "../include/nitroheap_stats.h"
+#include "uaccess.h"
+#include "VM/mmap.h"
+#include "VM/paging_adv.h"
+#include "Task/thread.h"
 
 #define SYS_CLOCK_GETTIME 7
 #define SYS_OPEN  8
@@ -11,6 +18,13 @@
 #define SYS_CLOSE 11
 #define SYS_LSEEK 12
 #define SYS_RENAME 13
+#define SYS_MEMINFO 14
+#define SYS_HEAPCTL 15
+#define SYS_MMAP     16
+#define SYS_MUNMAP   17
+#define SYS_MPROTECT 18
+#define SYS_MADVISE  19
+#define SYS_SPAWN    20
 
 #define MAX_SYSCALLS 64
 #define MAX_DEVICES 8
@@ -93,6 +107,13 @@ static long sys_close_handler(syscall_regs_t *regs);
 static long sys_clock_gettime_handler(syscall_regs_t *regs);
 static long sys_lseek_handler(syscall_regs_t *regs);
 static long sys_rename_handler(syscall_regs_t *regs);
+static long sys_meminfo_handler(syscall_regs_t *regs);
+static long sys_heapctl_handler(syscall_regs_t *regs);
+static long sys_mmap_handler(syscall_regs_t *regs);
+static long sys_munmap_handler(syscall_regs_t *regs);
+static long sys_mprotect_handler(syscall_regs_t *regs);
+static long sys_madvise_handler(syscall_regs_t *regs);
+static long sys_spawn_handler(syscall_regs_t *regs);
 
 void devfs_init(void) {
     dev_count = 0;
@@ -105,6 +126,13 @@ void devfs_init(void) {
     n2_syscall_register(SYS_CLOCK_GETTIME, sys_clock_gettime_handler);
     n2_syscall_register(SYS_LSEEK, sys_lseek_handler);
     n2_syscall_register(SYS_RENAME, sys_rename_handler);
+    n2_syscall_register(SYS_MEMINFO, sys_meminfo_handler);
+    n2_syscall_register(SYS_HEAPCTL, sys_heapctl_handler);
+    n2_syscall_register(SYS_MMAP, sys_mmap_handler);
+    n2_syscall_register(SYS_MUNMAP, sys_munmap_handler);
+    n2_syscall_register(SYS_MPROTECT, sys_mprotect_handler);
+    n2_syscall_register(SYS_MADVISE, sys_madvise_handler);
+    n2_syscall_register(SYS_SPAWN, sys_spawn_handler);
 }
 
 static long sys_open(const char *path) {
@@ -178,9 +206,125 @@ static long sys_rename_handler(syscall_regs_t *regs) {
     return -1;
 }
 
+// rdi = meminfo_t buffer, rsi = its size; fails rather than truncating so
+// callers built against an older layout notice.
+static long sys_meminfo_handler(syscall_regs_t *regs) {
+    static meminfo_t snap;              // too large for the kernel stack
+    static volatile int snap_lock;
+    void *dst = (void *)regs->rdi;
+    if ((size_t)regs->rsi < sizeof(snap))
+        return -1;
+    while (__sync_lock_test_and_set(&snap_lock, 1))
+        __asm__ volatile("pause");
+    meminfo_fill(&snap);
+    long rc = copy_to_user(dst, &snap, sizeof(snap)) ? -1 : 0;
+    __sync_lock_release(&snap_lock);
+    return rc;
+}
+
+// rdi = nh_heapctl_op, rsi = its argument block, rdx = the block's size.
+// Only the statistics, tunable and profiler ops are exposed.  Results are
+// built in a kernel buffer and copied out whole, so the heap never sees a
+// user address.  The buffer caps a profile report at 16 KiB.
+static long sys_heapctl_handler(syscall_regs_t *regs) {
+    static uint8_t out[16 * 1024];
+    static volatile int out_lock;
+    union {
+        nh_heapctl_get_stats_args       stats;
+        nh_heapctl_get_class_stats_args classes;
+        nh_heapctl_get_tunables_args    get;
+        nh_heap_tunables                set;
+        nh_heapctl_prof_set_args        prof;
+        nh_heapctl_prof_dump_args       dump;
+    } args;
+    nh_heapctl_op op = (nh_heapctl_op)regs->rdi;
+    size_t len = (size_t)regs->rdx;
+    if (len > sizeof(args) || copy_from_user(&args, (const void *)regs->rsi, len))
+        return -1;
+
+    void **buf;
+    size_t *buf_len;
+    size_t need;
+    switch (op) {
+    case NH_HEAPCTL_GET_STATS:
+        buf = &args.stats.user_buf;
+        buf_len = &args.stats.user_buf_len;
+        need = sizeof(args.stats);
+        break;
+    case NH_HEAPCTL_GET_CLASS_STATS:
+        buf = &args.classes.user_buf;
+        buf_len = &args.classes.user_buf_len;
+        need = sizeof(args.classes);
+        break;
+    case NH_HEAPCTL_GET_TUNABLES:
+        buf = &args.get.user_buf;
+        buf_len = &args.get.user_buf_len;
+        need = sizeof(args.get);
+        break;
+    case NH_HEAPCTL_PROF_DUMP:
+        buf = &args.dump.user_buf;
+        buf_len = &args.dump.user_buf_len;
+        need = sizeof(args.dump);
+        break;
+    case NH_HEAPCTL_SET_TUNABLES:
+    case NH_HEAPCTL_PROF_SET:
+        return sys_heapctl(op, &args, len);
+    default:
+        return -1;
+    }
+    if (len < need)
+        return -1;
+    void *dst = *buf;
+    if (*buf_len > sizeof(out))
+        *buf_len = sizeof(out);
+    *buf = out;
+
+    while (__sync_lock_test_and_set(&out_lock, 1))
+        __asm__ volatile("pause");
+    memset(out, 0, *buf_len);
+    long rc = sys_heapctl(op, &args, len);
+    if (rc >= 0 && copy_to_user(dst, out, *buf_len))
+        rc = -1;
+    __sync_lock_release(&out_lock);
+    return rc;
+}
+
+// rdi = address hint, rsi = length, rdx = PROT_*, r10 = MAP_* (the fourth
+// argument register, as rcx is taken by syscall-style callers).  Only
+// anonymous memory; returns the address or -1.
+static long sys_mmap_handler(syscall_regs_t *regs) {
+    return (long)vm_mmap(regs->rdi, regs->rsi, (int)regs->rdx, (int)regs->r10);
+}
+
+// rdi = address, rsi = length.
+static long sys_munmap_handler(syscall_regs_t *regs) {
+    return vm_munmap(regs->rdi, regs->rsi);
+}
+
+// rdi = address, rsi = length, rdx = PROT_*.
+static long sys_mprotect_handler(syscall_regs_t *regs) {
+    return vm_mprotect(regs->rdi, regs->rsi, (int)regs->rdx);
+}
+
+// rdi = address, rsi = length, rdx = MADV_*.
+static long sys_madvise_handler(syscall_regs_t *regs) {
+    return vm_madvise(regs->rdi, regs->rsi, (int)regs->rdx);
+}
+
+// rdi = entry, rsi = priority.  The caller is the template: the new thread
+// starts at `entry` in a copy-on-write copy of its address space, so
+// whatever the caller set up there needs no loading again.  The entry
+// must be in the caller's own text and the priority is capped at its
+// own.  Returns the thread id or -1.
+static long sys_spawn_handler(syscall_regs_t *regs) {
+    thread_t *t = task_spawn(thread_current(), (void (*)(void))regs->rdi, (int)regs->rsi);
+    return t ? t->id : -1;
+}
+
 long isr_syscall_handler(syscall_regs_t *regs) {
     if (regs->rax >= MAX_SYSCALLS)
         return -1;
     syscall_fn_t fn = syscall_table[regs->rax];
     return fn ? fn(regs) : -1;
 }
+
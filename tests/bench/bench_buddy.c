@@ -0,0 +1,169 @@
+/*
+ * Buddy allocator benchmark
+ * -------------------------
+ * Drives the real pmm_buddy.c over a static host region with three traces
+ * and reports allocation/free latency per order, zone lock hold times and
+ * the unusable free space index left behind.  Built with BUDDY_LOCK_STATS;
+ * run with `make -C tests bench`.
+ *
+ *   uniform  random orders 0-4, random frees, ~50% occupancy
+ *   bursty   order-0 bursts allocated and released together
+ *   mixed    long-lived allocations pinned between short-lived churn
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../boot/include/bootinfo.h"
+
+#define REGION_PAGES  16384               // 64MiB
+#define SLOTS         4096
+#define BENCH_ORDERS  5
+#define OPS           400000
+
+static uint8_t region[REGION_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+typedef struct {
+    void    *p;
+    uint32_t order;
+} slot_t;
+
+typedef struct {
+    uint64_t n, cycles, max;
+} lat_t;
+
+static slot_t slots[SLOTS];
+static lat_t alloc_lat[BENCH_ORDERS], free_lat[BENCH_ORDERS];
+static uint64_t failures;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rnd(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static void account(lat_t *l, uint64_t c) {
+    l->n++;
+    l->cycles += c;
+    if (c > l->max)
+        l->max = c;
+}
+
+static void do_alloc(slot_t *s, uint32_t order) {
+    uint64_t t = rdtsc();
+    void *p = buddy_alloc(order, 0, 0);
+    account(&alloc_lat[order], rdtsc() - t);
+    if (!p) {
+        failures++;
+        return;
+    }
+    s->p = p;
+    s->order = order;
+}
+
+static void do_free(slot_t *s) {
+    if (!s->p)
+        return;
+    uint64_t t = rdtsc();
+    buddy_free(s->p, s->order, 0);
+    account(&free_lat[s->order], rdtsc() - t);
+    s->p = NULL;
+}
+
+static void reset(void) {
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    pmm_init(&bi);
+    memset(slots, 0, sizeof(slots));
+    memset(alloc_lat, 0, sizeof(alloc_lat));
+    memset(free_lat, 0, sizeof(free_lat));
+    failures = 0;
+}
+
+static void trace_uniform(void) {
+    for (int i = 0; i < OPS; ++i) {
+        slot_t *s = &slots[rnd() % SLOTS];
+        if (s->p)
+            do_free(s);
+        else
+            do_alloc(s, (uint32_t)(rnd() % BENCH_ORDERS));
+    }
+}
+
+static void trace_bursty(void) {
+    for (int done = 0; done < OPS; ) {
+        int burst = 64 + (int)(rnd() % 1024);
+        for (int i = 0; i < burst; ++i)
+            do_alloc(&slots[i], 0);
+        for (int i = 0; i < burst; ++i)
+            do_free(&slots[i]);
+        done += 2 * burst;
+    }
+}
+
+static void trace_mixed(void) {
+    // Every eighth slot is long-lived: allocated once and never freed until
+    // the end, scattering pinned blocks across the zone.
+    for (int i = 0; i < OPS; ++i) {
+        uint32_t idx = (uint32_t)(rnd() % SLOTS);
+        slot_t *s = &slots[idx];
+        if (s->p && idx % 8 != 0)
+            do_free(s);
+        else if (!s->p)
+            do_alloc(s, (uint32_t)(rnd() % 3));
+    }
+}
+
+static void report(const char *name) {
+    meminfo_zone_t z;
+    buddy_zone_report(0, &z);
+    printf("== %s ==\n", name);
+    printf("order  allocs  avg-cyc  max-cyc   frees  avg-cyc  max-cyc\n");
+    for (int o = 0; o < BENCH_ORDERS; ++o) {
+        const lat_t *a = &alloc_lat[o], *f = &free_lat[o];
+        printf("%5d %7llu %8llu %8llu %7llu %8llu %8llu\n", o,
+               (unsigned long long)a->n,
+               (unsigned long long)(a->n ? a->cycles / a->n : 0),
+               (unsigned long long)a->max,
+               (unsigned long long)f->n,
+               (unsigned long long)(f->n ? f->cycles / f->n : 0),
+               (unsigned long long)f->max);
+    }
+    printf("lock: %llu acquires, avg hold %llu cyc, max hold %llu cyc\n",
+           (unsigned long long)z.lock_acquires,
+           (unsigned long long)(z.lock_acquires ? z.lock_hold_cycles / z.lock_acquires : 0),
+           (unsigned long long)z.lock_max_hold);
+    printf("free %llu/%llu frames, %llu failed allocs\n",
+           (unsigned long long)z.free_frames, (unsigned long long)z.frames,
+           (unsigned long long)failures);
+    printf("unusable index (permille) by order:");
+    for (uint32_t o = 0; o <= 10 && o <= z.max_order; ++o)
+        printf(" %u", (unsigned)z.unusable[o]);
+    printf("\n\n");
+}
+
+static void run(const char *name, void (*trace)(void)) {
+    reset();
+    trace();
+    report(name);
+}
+
+int main(void) {
+    run("uniform", trace_uniform);
+    run("bursty", trace_bursty);
+    run("mixed", trace_mixed);
+    return 0;
+}
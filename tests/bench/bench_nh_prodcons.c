@@ -0,0 +1,107 @@
+/*
+ * NitroHeap producer/consumer benchmark
+ * -------------------------------------
+ * Pairs of threads, each standing in for a CPU: the producer allocates
+ * buffers and hands them over a ring to its consumer, which frees them, as
+ * a network thread hands packets to a filesystem thread.  Every object is
+ * therefore freed on a CPU that never allocates it, so throughput rests on
+ * full magazines travelling from consumers to producers through the depot.
+ * Run with `make -C tests bench`.
+ */
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+
+static __thread uint32_t cpu_index;
+uint32_t smp_cpu_index(void) { return cpu_index; }
+uint32_t smp_cpu_id(void) { return cpu_index; }
+uint32_t smp_cpu_count(void) { return 16; }
+
+extern int buddy_allocs;
+
+#define MAX_PAIRS 8
+#define ITEMS     500000
+#define RING      1024
+
+typedef struct {
+    _Atomic(uint32_t) head __attribute__((aligned(64)));
+    _Atomic(uint32_t) tail __attribute__((aligned(64)));
+    void*             slots[RING];
+    uint32_t          cpu;
+} pipe_t;
+
+static pipe_t pipes[MAX_PAIRS];
+
+// Sizes a network stack would ask for: headers, small packets, MTU buffers.
+static const uint32_t sizes[] = { 64, 256, 1500, 2048 };
+
+static void* producer(void* arg) {
+    pipe_t* p = arg;
+    cpu_index = p->cpu;
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        uint32_t size = sizes[i & 3];
+        uint64_t* buf = nitro_kmalloc(size, 8);
+        assert(buf);
+        buf[0] = (uintptr_t)buf ^ size;
+        uint32_t t = atomic_load_explicit(&p->tail, memory_order_relaxed);
+        while (t - atomic_load_explicit(&p->head, memory_order_acquire) == RING)
+            sched_yield();
+        p->slots[t % RING] = buf;
+        atomic_store_explicit(&p->tail, t + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void* consumer(void* arg) {
+    pipe_t* p = arg;
+    cpu_index = p->cpu + 1;
+    for (uint32_t i = 0; i < ITEMS; ++i) {
+        uint32_t h = atomic_load_explicit(&p->head, memory_order_relaxed);
+        while (atomic_load_explicit(&p->tail, memory_order_acquire) == h)
+            sched_yield();
+        uint64_t* buf = p->slots[h % RING];
+        atomic_store_explicit(&p->head, h + 1, memory_order_release);
+        assert(buf[0] == ((uintptr_t)buf ^ sizes[i & 3]));
+        nitro_kfree(buf);
+    }
+    return NULL;
+}
+
+static double run(int pairs) {
+    pthread_t t[2 * MAX_PAIRS];
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (int i = 0; i < pairs; ++i) {
+        atomic_store(&pipes[i].head, 0);
+        atomic_store(&pipes[i].tail, 0);
+        pipes[i].cpu = (uint32_t)(2 * i);
+        assert(pthread_create(&t[2 * i], NULL, producer, &pipes[i]) == 0);
+        assert(pthread_create(&t[2 * i + 1], NULL, consumer, &pipes[i]) == 0);
+    }
+    for (int i = 0; i < 2 * pairs; ++i)
+        pthread_join(t[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    return (double)(b.tv_sec - a.tv_sec) + (double)(b.tv_nsec - a.tv_nsec) / 1e9;
+}
+
+int main(void) {
+    nitroheap_init();
+    for (int pairs = 1; pairs <= MAX_PAIRS; pairs *= 2) {
+        double secs = run(pairs);
+        printf("nh prodcons %d pair%s: %6.2f M objects/s, %6.1f ns/object\n",
+               pairs, pairs > 1 ? "s" : " ", (double)pairs * ITEMS / secs / 1e6,
+               secs * 1e9 / ((double)pairs * ITEMS));
+    }
+    for (uint32_t cpu = 0; cpu < 2 * MAX_PAIRS; ++cpu) {
+        cpu_index = cpu;
+        nitro_kheap_trim();
+    }
+    assert(buddy_allocs == 0);
+    return 0;
+}
@@ -1,24 +1,52 @@
 #include <stdlib.h>
 #include <stdint.h>
+#include "../kernel/VM/page.h"
 
 int buddy_allocs = 0;
+uint64_t buddy_pages = 0;   // pages currently handed out
 
 void* buddy_alloc(uint32_t order, int preferred_node, int strict) {
     (void)preferred_node;
     (void)strict;
     size_t bytes = ((size_t)1 << order) * 4096;
     void* p = NULL;
-    if (posix_memalign(&p, 4096, bytes) != 0)
+    // Buddy blocks are naturally aligned to their size.
+    if (posix_memalign(&p, bytes, bytes) != 0)
         p = NULL;
-    if (p) buddy_allocs++;
+    if (p) {
+        __atomic_fetch_add(&buddy_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&buddy_pages, (uint64_t)1 << order, __ATOMIC_RELAXED);
+    }
     return p;
 }
 
-void buddy_free(void* addr, uint32_t order, int node) {
+void* buddy_try_alloc(uint32_t order, int preferred_node, int strict) {
+    return buddy_alloc(order, preferred_node, strict);
+}
+
+// malloc'd blocks have no free neighbours to claim.
+int buddy_try_grow(void* addr, uint32_t order, uint32_t new_order) {
+    (void)addr;
     (void)order;
+    (void)new_order;
+    return -1;
+}
+
+void buddy_free(void* addr, uint32_t order, int node) {
     (void)node;
     if (addr) {
-        buddy_allocs--;
+        __atomic_fetch_sub(&buddy_allocs, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&buddy_pages, (uint64_t)1 << order, __ATOMIC_RELAXED);
         free(addr);
     }
 }
+
+// malloc-backed frames never run short, so reclaim never looks pressured.
+uint64_t buddy_free_frames_total(void) {
+    return UINT64_MAX / 2;
+}
+
+// Frames come from malloc, outside any page frame database.
+page_t  *page_db;
+uint64_t page_db_base_pfn;
+uint64_t page_db_count;
@@ -4,8 +4,13 @@ import shutil
 import pytest
 
 
-def run_qemu():
-    subprocess.run(["make"], check=True)
+def run_qemu(cflags=None, memory="512M", extra_args=None, timeout=10):
+    if cflags:
+        # Objects do not depend on the flags, so rebuild from scratch.
+        subprocess.run(["make", "clean"], check=True)
+        subprocess.run(["make", "EXTRA_CFLAGS=" + " ".join(cflags)], check=True)
+    else:
+        subprocess.run(["make"], check=True)
     try:
         result = subprocess.run(
             [
@@ -19,7 +24,7 @@ def run_qemu():
                 "-drive",
                 "file=fs.img,format=raw",
                 "-m",
-                "512M",
+                memory,
                 "-netdev",
                 "user,id=n0",
                 "-device",
@@ -36,19 +41,31 @@ def run_qemu():
                 "none",
                 "-no-reboot",
                 "-no-shutdown",
-            ],
+            ]
+            + (extra_args or []),
             stdout=subprocess.PIPE,
             stderr=subprocess.STDOUT,
-            timeout=10,
+            timeout=timeout,
             text=True,
         )
         out = result.stdout
     except subprocess.TimeoutExpired as e:
-        out = (e.stdout or b"").decode()
+        out = e.stdout or ""
+        if isinstance(out, bytes):
+            out = out.decode(errors="replace")
     return out
 
 
-@pytest.mark.skipif(shutil.which("qemu-system-x86_64") is None, reason="qemu-system-x86_64 not installed")
+def run_vm_selftest(**kwargs):
+    return run_qemu(cflags=["-DCONFIG_VM_SELFTEST"], **kwargs)
+
+
+requires_qemu = pytest.mark.skipif(
+    shutil.which("qemu-system-x86_64") is None, reason="qemu-system-x86_64 not installed"
+)
+
+
+@requires_qemu
 def test_boot_sequence():
     out = run_qemu()
     sequence = ["[nboot]", "[O2]", "[N2]", "[regx]", "[init]", "[login]"]
@@ -59,5 +76,107 @@ def test_boot_sequence():
         last = idx
 
 
+@requires_qemu
+@pytest.mark.parametrize("memory", ["64M", "512M", "4G", "16G"])
+def test_boot_memory_sizes(memory):
+    out = run_qemu(memory=memory, timeout=20)
+    assert "[N2] memory:" in out
+    assert "[login]" in out
+
+
+@requires_qemu
+def test_vm_fault_latency():
+    out = run_vm_selftest()
+    assert "[vmtest] fault latency pooled=" in out
+    assert "[vmtest] done" in out
+
+
+@requires_qemu
+def test_vm_reclaim_under_pressure():
+    out = run_vm_selftest(memory="128M")
+    assert "[vmtest] reclaim ok" in out
+
+
+@requires_qemu
+def test_vm_meminfo_report():
+    out = run_vm_selftest()
+    assert "[meminfo] node 0" in out
+    assert "order  0:" in out
+
+
+@requires_qemu
+def test_vm_address_space_isolation():
+    out = run_vm_selftest()
+    assert "[paging] kernel page tables live" in out
+    assert "[vmtest] aspace isolation ok" in out
+    assert "[vmtest] aspace switch" in out
+
+
+@requires_qemu
+def test_vm_tlb_shootdown_smp():
+    out = run_vm_selftest(extra_args=["-smp", "4"])
+    assert "[vmtest] shootdown" in out
+    line = next(l for l in out.splitlines() if "[vmtest] shootdown" in l)
+    assert line.endswith("stale=0 ok")
+
+
+@requires_qemu
+def test_vm_mmap_semantics():
+    out = run_vm_selftest()
+    assert "[vmtest] mmap semantics ok" in out
+    assert "[pf] unresolved" not in out
+
+
+@requires_qemu
+def test_vm_fault_around_sweep():
+    out = run_vm_selftest()
+    line = next(l for l in out.splitlines() if "[vmtest] sweep 16M" in l)
+    assert line.endswith(" ok")
+
+
+@requires_qemu
+def test_vm_fork_template():
+    out = run_vm_selftest()
+    line = next(l for l in out.splitlines() if "[vmtest] fork 2M template" in l)
+    assert line.endswith(" ok")
+
+
+@requires_qemu
+def test_vm_vmalloc_fragmented():
+    out = run_vm_selftest()
+    line = next(l for l in out.splitlines() if "[vmtest] vmalloc 64M fragmented" in l)
+    assert line.endswith(" ok")
+
+
+@requires_qemu
+def test_vm_zswap_oversubscribed():
+    # 64 MiB guest: the test maps half again as much as is free, so most
+    # of it lives compressed.  The vmalloc test skips itself at this size.
+    out = run_vm_selftest(memory="64M", timeout=60)
+    line = next(l for l in out.splitlines() if "[vmtest] zswap oversubscribed" in l)
+    assert line.endswith(" ok")
+
+
+@requires_qemu
+def test_vm_ksm_agents():
+    out = run_vm_selftest()
+    line = next(l for l in out.splitlines() if "[vmtest] ksm 8 agents" in l)
+    assert line.endswith(" ok")
+
+
+@requires_qemu
+def test_vm_numa_nodes():
+    numa = [
+        "-smp", "2",
+        "-object", "memory-backend-ram,id=m0,size=256M",
+        "-object", "memory-backend-ram,id=m1,size=256M",
+        "-numa", "node,nodeid=0,cpus=0,memdev=m0",
+        "-numa", "node,nodeid=1,cpus=1,memdev=m1",
+    ]
+    out = run_qemu(cflags=["-DCONFIG_VM_SELFTEST", "-DCONFIG_NITRO_HEAP"], extra_args=numa)
+    assert "[vmtest] numa nodes=2 cpu node=0 ok" in out
+    assert "[meminfo] node 1" in out
+
+
 if __name__ == "__main__":
     run_qemu()
@@ -35,6 +35,11 @@ void* hptr(nh_handle_t h) {
     return resp.ptr;
 }
 
+int hunpin(nh_handle_t h) {
+    nh_hunpin_req req = { .handle = h };
+    return sys_nh_hunpin(&req);
+}
+
 int hfree(nh_handle_t h) {
     nh_hfree_req req = { .handle = h };
     return sys_nh_hfree(&req);
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 
 void context_switch(uint64_t *prev, uint64_t next) { (void)prev; (void)next; }
 void regx_main(void) {}
@@ -19,6 +20,9 @@ int api_regx_load(const char *name, const char *arg, uint32_t *out) { (void)name
 void api_yield(void) {}
 int regx_verify_launch_key(const char *key) { (void)key; return 0; }
 
-uint64_t *paging_kernel_pml4(void) { return NULL; }
-void paging_switch(uint64_t *new_pml4) { (void)new_pml4; }
-uint64_t *paging_new_context(void) { return NULL; }
+struct vm_space *paging_kernel_space(void) { return NULL; }
+struct vm_space *paging_space_create(void) { return NULL; }
+void paging_space_put(struct vm_space *vs) { (void)vs; }
+void paging_space_switch(struct vm_space *vs) { (void)vs; }
+struct vm_space *vm_fork(struct vm_space *src) { static char space; (void)src; return (struct vm_space *)&space; }
+void zero_range_nt(void *dst, size_t len) { memset(dst, 0, len); }
@@ -0,0 +1,83 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../kernel/klib/lz4.h"
+
+#define PAGE  4096
+
+static lz4_work_t work;
+static uint8_t in[LZ4_MAX_INPUT], out[LZ4_MAX_INPUT + LZ4_MAX_INPUT / 255 + 16],
+               back[LZ4_MAX_INPUT];
+
+static uint32_t rng = 12345;
+static uint32_t next_rand(void) {
+    rng = rng * 1103515245u + 12345u;
+    return rng >> 8;
+}
+
+// Round trip `len` bytes of `in`; returns the compressed size.
+static size_t round_trip(size_t len) {
+    size_t c = lz4_compress(in, len, out, sizeof(out), &work);
+    assert(c > 0);
+    memset(back, 0xAA, sizeof(back));
+    assert(lz4_decompress(out, c, back, len) == (long)len);
+    assert(memcmp(in, back, len) == 0);
+    return c;
+}
+
+int main(void) {
+    // A zeroed page shrinks to a few bytes.
+    memset(in, 0, PAGE);
+    assert(round_trip(PAGE) < 32);
+
+    // Mostly empty page with a few words, as an idle agent's heap looks.
+    for (int i = 0; i < PAGE; i += 512)
+        memcpy(in + i, &i, sizeof(i));
+    assert(round_trip(PAGE) < 256);
+
+    // Text-like data with repeats at every distance.
+    const char *words[] = { "agent ", "login ", "nosfs ", "mapping ", "page ", "fault " };
+    for (size_t i = 0; i < sizeof(in);) {
+        const char *w = words[next_rand() % 6];
+        size_t n = strlen(w);
+        if (i + n > sizeof(in))
+            n = sizeof(in) - i;
+        memcpy(in + i, w, n);
+        i += n;
+    }
+    assert(round_trip(PAGE) < PAGE / 2);
+    assert(round_trip(sizeof(in)) < sizeof(in) / 2);
+
+    // Random bytes do not compress, and do not fit a page-sized output.
+    for (int i = 0; i < PAGE; ++i)
+        in[i] = (uint8_t)next_rand();
+    round_trip(PAGE);
+    assert(lz4_compress(in, PAGE, out, PAGE, &work) == 0);
+
+    // Every short length, including those with no room for a match.
+    for (size_t len = 0; len < 64; ++len) {
+        for (size_t i = 0; i < len; ++i)
+            in[i] = (uint8_t)(i % 3);
+        size_t c = lz4_compress(in, len, out, sizeof(out), &work);
+        assert(c > 0 && lz4_decompress(out, c, back, len) == (long)len);
+        assert(memcmp(in, back, len) == 0);
+    }
+
+    // Malformed input fails instead of overrunning: truncated streams, an
+    // offset before the start, and output larger than the buffer.
+    memset(in, 'x', PAGE);
+    size_t c = lz4_compress(in, PAGE, out, sizeof(out), &work);
+    for (size_t cut = 1; cut < c; ++cut)
+        assert(lz4_decompress(out, cut, back, PAGE) != PAGE);
+    assert(lz4_decompress(out, c, back, PAGE - 1) == -1);
+    const uint8_t bad_off[] = { 0x10, 'a', 0x05, 0x00, 0x00 };
+    assert(lz4_decompress(bad_off, sizeof(bad_off), back, PAGE) == -1);
+    const uint8_t zero_off[] = { 0x10, 'a', 0x00, 0x00 };
+    assert(lz4_decompress(zero_off, sizeof(zero_off), back, PAGE) == -1);
+    assert(lz4_compress(in, LZ4_MAX_INPUT + 1, out, sizeof(out), &work) == 0);
+
+    printf("lz4 tests passed\n");
+    return 0;
+}
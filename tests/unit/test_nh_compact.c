@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../include/nitroheap_shim.h"
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+#include "../../include/nitroheap_sys.h"
+#include "../../include/nitroheap_stats.h"
+
+// Each thread is its own CPU, as in test_nh_stress.
+static __thread uint32_t cpu_index;
+uint32_t smp_cpu_index(void) { return cpu_index; }
+uint32_t smp_cpu_id(void) { return cpu_index; }
+uint32_t smp_cpu_count(void) { return 16; }
+
+#define READERS  3
+#define OWNED    128          // handles per reader
+#define SIZE     256
+#define WORDS    (SIZE / sizeof(uint64_t))
+#define ROUNDS   100
+#define FILLER   1536
+
+static nh_handle_t owned[READERS][OWNED];
+static atomic_int running;
+static _Atomic(uint64_t) pins_taken;
+
+static uint64_t rnd(uint64_t* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+static void fill(uint64_t* p, uint64_t v) {
+    for (size_t w = 0; w < WORDS; ++w)
+        p[w] = v + w;
+}
+
+static void check(const uint64_t* p, uint64_t v) {
+    for (size_t w = 0; w < WORDS; ++w)
+        assert(p[w] == v + w);
+}
+
+// Pin one of this reader's handles, check it holds what was last written
+// and write the next value through the pointer while compaction runs.
+// A second pin must see the same pointer.
+static void* reader(void* arg) {
+    uint32_t id = (uint32_t)(uintptr_t)arg;
+    cpu_index = id + 1;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL * (id + 1), last[OWNED];
+    for (int i = 0; i < OWNED; ++i)
+        last[i] = (uint64_t)id << 32 | (uint64_t)i << 16;
+    while (atomic_load(&running)) {
+        uint32_t i = (uint32_t)(rnd(&seed) % OWNED);
+        nh_handle_t h = owned[id][i];
+        uint64_t* p = hptr(h);
+        assert(p);
+        check(p, last[i]);
+        last[i] += WORDS;
+        fill(p, last[i]);
+        assert(hptr(h) == p);
+        check(p, last[i]);
+        assert(hunpin(h) == 0 && hunpin(h) == 0);
+        atomic_fetch_add(&pins_taken, 1);
+    }
+    for (int i = 0; i < OWNED; ++i) {
+        uint64_t* p = hptr(owned[id][i]);
+        check(p, last[i]);
+        assert(hfree(owned[id][i]) == 0);
+    }
+    return NULL;
+}
+
+// Lay the readers' handles out between filler handles, then free the
+// filler: the slabs left are sparse, and compaction empties them.
+static void setup(nh_handle_t* filler) {
+    int f = 0;
+    for (int i = 0; i < OWNED; ++i)
+        for (int r = 0; r < READERS; ++r) {
+            owned[r][i] = halloc(SIZE, NH_PRESET_BALANCED);
+            assert(owned[r][i]);
+            uint64_t* p = hptr(owned[r][i]);
+            fill(p, (uint64_t)r << 32 | (uint64_t)i << 16);
+            assert(hunpin(owned[r][i]) == 0);
+            for (int k = 0; k < FILLER / (OWNED * READERS); ++k) {
+                filler[f] = halloc(SIZE, NH_PRESET_BALANCED);
+                assert(filler[f]);
+                f++;
+            }
+        }
+    for (int i = 0; i < f; ++i)
+        assert(hfree(filler[i]) == 0);
+    nitro_kheap_harvest();
+    nitro_kheap_harvest();
+    nitro_kheap_trim();
+}
+
+// hunpin calls the movable partition saw without a pin to drop.
+static uint64_t stale_unpins(void) {
+    for (uint16_t id = 0; nitro_partition_get(id); ++id) {
+        nh_part_stats_summary s;
+        nh_heapctl_get_stats_args a = { .part_id = id, .user_buf = &s, .user_buf_len = sizeof(s) };
+        assert(sys_heapctl(NH_HEAPCTL_GET_STATS, &a, sizeof(a)) == 0);
+        if (!strcmp(s.name, "movable"))
+            return s.stale_unpins;
+    }
+    return 0;
+}
+
+int main(void) {
+    static nh_handle_t filler[FILLER];
+    cpu_index = 0;
+    nitroheap_init();
+
+    // Every round compacts a freshly fragmented heap while the readers
+    // pin and write the handles being moved.
+    uint64_t moved = 0, raced = 0;
+    for (int round = 0; round < ROUNDS; ++round) {
+        setup(filler);
+        uint64_t pins0 = atomic_load(&pins_taken);
+        atomic_store(&running, 1);
+        pthread_t t[READERS];
+        for (uintptr_t r = 0; r < READERS; ++r)
+            assert(pthread_create(&t[r], NULL, reader, (void*)r) == 0);
+        while (atomic_load(&pins_taken) < pins0 + READERS)
+            ;
+        uint64_t m = nitro_kheap_compact();
+        raced += m && atomic_load(&pins_taken) > pins0 + READERS;
+        moved += m;
+        atomic_store(&running, 0);
+        for (int r = 0; r < READERS; ++r)
+            pthread_join(t[r], NULL);
+    }
+
+    assert(moved > 0 && raced > 0);
+    // Every unpin matched a pin; one more, or one after hfree, is counted.
+    assert(stale_unpins() == 0);
+    nh_handle_t h = halloc(SIZE, NH_PRESET_BALANCED);
+    assert(h && hptr(h) && hunpin(h) == 0);
+    assert(hunpin(h) == -1 && stale_unpins() == 1);
+    assert(hfree(h) == 0 && hunpin(h) == -1 && stale_unpins() == 2);
+    printf("nh compact tests passed (moved %llu, pins %llu)\n", (unsigned long long)moved,
+           (unsigned long long)atomic_load(&pins_taken));
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/numa.h"
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+#include "../../include/nitroheap_sys.h"
+#include "../../include/nitroheap_stats.h"
+#include "../../boot/include/bootinfo.h"
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+void smp_stub_set_cpu_index(uint32_t idx);
+
+#define NODE_PAGES 2048
+
+static uint8_t region[2 * NODE_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+// Firmware tables for two nodes, one per half of `region`, with APIC 0 on
+// node 0 and APIC 1 on node 1.
+struct sdt {
+    char     signature[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem[6 + 8 + 4 + 4 + 4];
+} __attribute__((packed));
+
+static struct {
+    char     signature[8];
+    uint8_t  checksum;
+    char     oemid[6];
+    uint8_t  revision;
+    uint32_t rsdt_addr;
+    uint32_t length;
+    uint64_t xsdt_addr;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+} __attribute__((packed)) rsdp;
+
+static struct {
+    struct sdt hdr;
+    uint64_t   entry;
+} __attribute__((packed)) xsdt;
+
+static struct {
+    struct sdt hdr;
+    uint8_t    reserved[12];
+    struct { uint8_t type, len, domain_lo, apic; uint32_t flags; uint8_t eid, domain_hi[3];
+             uint32_t clock; } __attribute__((packed)) cpu[2];
+    struct { uint8_t type, len; uint32_t domain; uint16_t r0; uint64_t base, size;
+             uint32_t r1, flags; uint64_t r2; } __attribute__((packed)) mem[2];
+} __attribute__((packed)) srat;
+
+static uint8_t checksum(const void* p, size_t len) {
+    uint8_t sum = 0;
+    for (size_t i = 0; i < len; ++i)
+        sum += ((const uint8_t*)p)[i];
+    return (uint8_t)-sum;
+}
+
+static void build_acpi(void) {
+    memcpy(srat.hdr.signature, "SRAT", 4);
+    srat.hdr.length = sizeof(srat);
+    for (int n = 0; n < 2; ++n) {
+        srat.cpu[n].type = 0;
+        srat.cpu[n].len = sizeof(srat.cpu[n]);
+        srat.cpu[n].domain_lo = (uint8_t)(7 + n);   // domains need not be 0-based
+        srat.cpu[n].apic = (uint8_t)n;
+        srat.cpu[n].flags = 1;
+        srat.mem[n].type = 1;
+        srat.mem[n].len = sizeof(srat.mem[n]);
+        srat.mem[n].domain = (uint32_t)(7 + n);
+        srat.mem[n].base = (uint64_t)(uintptr_t)region + (uint64_t)n * NODE_PAGES * PAGE_SIZE;
+        srat.mem[n].size = (uint64_t)NODE_PAGES * PAGE_SIZE;
+        srat.mem[n].flags = 1;
+    }
+    srat.hdr.checksum = checksum(&srat, sizeof(srat));
+
+    memcpy(xsdt.hdr.signature, "XSDT", 4);
+    xsdt.hdr.length = sizeof(xsdt);
+    xsdt.entry = (uint64_t)(uintptr_t)&srat;
+    xsdt.hdr.checksum = checksum(&xsdt, sizeof(xsdt));
+
+    memcpy(rsdp.signature, "RSD PTR ", 8);
+    rsdp.revision = 2;
+    rsdp.length = sizeof(rsdp);
+    rsdp.xsdt_addr = (uint64_t)(uintptr_t)&xsdt;
+    rsdp.checksum = checksum(&rsdp, 20);
+}
+
+static int node_of(void* p) {
+    return numa_addr_node((uint64_t)(uintptr_t)p);
+}
+
+static void test_numa_local(void) {
+    for (uint32_t cpu = 0; cpu < 2; ++cpu) {
+        smp_stub_set_cpu_index(cpu);
+        assert(current_cpu_node() == (int)cpu);
+        void* small = nitro_kmalloc_flags(64, 8, NH_NUMA_LOCAL);
+        void* big = nitro_kmalloc_flags(64 * PAGE_SIZE, 8, NH_NUMA_LOCAL);
+        nh_alloc_req req = { .size = 200, .flags = NH_PRESET_BALANCED };
+        nh_alloc_resp resp;
+        assert(sys_nh_alloc(&req, &resp) == 0);
+        assert(small && big);
+        assert(node_of(small) == (int)cpu);
+        assert(node_of(big) == (int)cpu);
+        assert(node_of(resp.ptr) == (int)cpu);
+        nitro_kfree(small);
+        nitro_kfree(resp.ptr);
+
+        // A large block goes back to the node it came from.
+        uint64_t before = buddy_free_frames_node((int)cpu);
+        nitro_kfree(big);
+        nitro_kheap_trim();
+        assert(buddy_free_frames_node((int)cpu) > before);
+    }
+    smp_stub_set_cpu_index(0);
+}
+
+static void test_low_latency(void) {
+    static void* held[4096];
+    assert(nitro_kheap_reserve(128, 8, 32) == 0);
+
+    // The reserve serves allocations without touching buddy and fails
+    // fast once it is spent.
+    uint64_t free0 = buddy_free_frames_total();
+    size_t n = 0;
+    while ((held[n] = nitro_kmalloc_flags(128, 8, NH_LOW_LATENCY)))
+        n++;
+    assert(n >= 32);
+    assert(buddy_free_frames_total() == free0);
+
+    // The reclaimer tops it back up.
+    nitro_kheap_reclaim();
+    assert(buddy_free_frames_total() < free0);
+    size_t more = n;
+    while ((held[more] = nitro_kmalloc_flags(128, 8, NH_LOW_LATENCY)))
+        more++;
+    assert(more >= n + 32);
+    while (more)
+        nitro_kfree(held[--more]);
+
+    // A class asked for without a reserve gets one for next time.
+    void* first = nitro_kmalloc_flags(1024, 8, NH_LOW_LATENCY);
+    assert(first);
+    nitro_kfree(first);
+    nitro_kheap_reclaim();
+    free0 = buddy_free_frames_total();
+    for (n = 0; n < 32; ++n)
+        assert((held[n] = nitro_kmalloc_flags(1024, 8, NH_LOW_LATENCY)));
+    assert(buddy_free_frames_total() == free0);
+    while (n)
+        nitro_kfree(held[--n]);
+
+    // Trim leaves the reserve alone.
+    nitro_kheap_harvest();
+    nitro_kheap_trim();
+    assert(nitro_kmalloc_flags(128, 8, NH_LOW_LATENCY));
+}
+
+static uint64_t committed(const char* name) {
+    for (uint16_t id = 0; nitro_partition_get(id); ++id) {
+        nh_part_stats_summary s;
+        nh_heapctl_get_stats_args a = { .part_id = id, .user_buf = &s, .user_buf_len = sizeof(s) };
+        assert(sys_heapctl(NH_HEAPCTL_GET_STATS, &a, sizeof(a)) == 0);
+        if (!strcmp(s.name, name))
+            return s.bytes_committed;
+    }
+    return 0;
+}
+
+static void* handle_ptr(uint64_t h) {
+    nh_hptr_req req = { .handle = h };
+    nh_alloc_resp resp;
+    assert(sys_nh_hptr(&req, &resp) == 0);
+    return resp.ptr;
+}
+
+static void handle_unpin(uint64_t h) {
+    nh_hunpin_req req = { .handle = h };
+    assert(sys_nh_hunpin(&req) == 0);
+}
+
+static void test_movable(void) {
+    enum { N = 512, SIZE = 256 };
+    static uint64_t handles[N];
+    for (int i = 0; i < N; ++i) {
+        nh_halloc_req req = { .size = SIZE, .flags = NH_MOVABLE };
+        nh_halloc_resp resp;
+        assert(sys_nh_halloc(&req, &resp) == 0);
+        handles[i] = resp.handle;
+        memset(handle_ptr(handles[i]), (uint8_t)i, SIZE);
+        handle_unpin(handles[i]);
+    }
+    // Keep one in four, spread over every slab.
+    for (int i = 0; i < N; ++i)
+        if (i % 4) {
+            nh_hfree_req req = { .handle = handles[i] };
+            assert(sys_nh_hfree(&req) == 0);
+        }
+    nitro_kheap_harvest();
+    nitro_kheap_harvest();
+    nitro_kheap_trim();
+    uint64_t sparse = committed("movable");
+    assert(sparse > 0);
+
+    // Handle 0 stays pinned through the compaction and must not move.
+    static void* before[N];
+    for (int i = 0; i < N; i += 4) {
+        before[i] = handle_ptr(handles[i]);
+        if (i)
+            handle_unpin(handles[i]);
+    }
+    uint64_t moved = nitro_kheap_compact();
+    assert(moved > 0);
+    assert(handle_ptr(handles[0]) == before[0]);
+    nitro_kheap_trim();
+    assert(committed("movable") <= sparse / 2);
+    for (int i = 0; i < N; i += 4) {
+        uint8_t* p = handle_ptr(handles[i]);
+        moved -= p != before[i];
+        for (int b = 0; b < SIZE; ++b)
+            assert(p[b] == (uint8_t)i);
+        nh_hfree_req req = { .handle = handles[i] };
+        assert(sys_nh_hfree(&req) == 0);
+    }
+    assert(moved == 0);
+}
+
+static void test_ephemeral(void) {
+    // Blocks are bumped out of one arena back to back...
+    char* a = nitro_kmalloc_flags(48, 8, NH_EPHEMERAL);
+    char* b = nitro_kmalloc_flags(48, 8, NH_EPHEMERAL);
+    assert(a && b && b > a && b - a < 128);
+    nitro_kfree(a);
+    nitro_kfree(b);
+    // ...and an arena with nothing live starts over.
+    char* c = nitro_kmalloc_flags(48, 8, NH_EPHEMERAL);
+    assert(c == a);
+    nitro_kfree(c);
+
+    // Arenas filled up and then emptied go back to buddy whole.
+    static void* held[256];
+    uint64_t free0 = buddy_free_frames_total();
+    for (int i = 0; i < 256; ++i) {
+        held[i] = nitro_kmalloc_flags(1000, 8, NH_EPHEMERAL);
+        assert(held[i]);
+        memset(held[i], i, 1000);
+    }
+    assert(buddy_free_frames_total() < free0);
+    for (int i = 0; i < 256; ++i)
+        nitro_kfree(held[i]);
+    assert(buddy_free_frames_total() == free0);
+
+    // Requests too big for an arena fall back to the slabs.
+    void* big = nitro_kmalloc_flags(32 * 1024, 8, NH_EPHEMERAL);
+    assert(big);
+    nitro_kfree(big);
+}
+
+int main(void) {
+    build_acpi();
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    bi.acpi_rsdp = (uint64_t)(uintptr_t)&rsdp;
+    smp_stub_set_cpu_index(0);
+    pmm_init(&bi);
+    assert(numa_node_count() == 2);
+    assert(numa_node_region(1)->base == srat.mem[1].base);
+    assert(buddy_zone_count() == 2);
+
+    nitroheap_init();
+    test_numa_local();
+    test_low_latency();
+    test_movable();
+    test_ephemeral();
+    return 0;
+}
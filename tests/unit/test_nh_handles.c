@@ -7,6 +7,69 @@
 
 void smp_stub_set_cpu_index(uint32_t idx);
 
+#define LIVE   5000
+#define CYCLES 2000000
+
+static nh_handle_t live[LIVE];
+
+static uint32_t slot_of(nh_handle_t h) {
+    return (uint32_t)h;
+}
+
+// A freed handle stays dead once its slot has a new owner.
+static void test_stale(void) {
+    nh_handle_t a = halloc(32, NH_PRESET_BALANCED);
+    assert(a && hfree(a) == 0);
+    assert(hptr(a) == NULL);
+    assert(hfree(a) == -1);
+
+    nh_handle_t b = halloc(32, NH_PRESET_BALANCED);
+    assert(slot_of(b) == slot_of(a) && b != a);
+    memset(hptr(b), 0x11, 32);
+    assert(hptr(a) == NULL);
+    assert(hfree(a) == -1);
+    assert(hptr(b) != NULL);
+    assert(hfree(b) == 0);
+
+    // Garbage handles are rejected rather than indexing past the table.
+    assert(hptr(0) == NULL);
+    assert(hptr(0xffffffffffffffffull) == NULL);
+    assert(hfree(0x12345678ull << 32) == -1);
+}
+
+// Far more handles than one leaf holds, recycled millions of times: the
+// table stays as large as the live set and every handle keeps its bytes.
+static void test_churn(void) {
+    uint32_t top = 0;
+    for (uint32_t i = 0; i < LIVE; ++i) {
+        live[i] = halloc(16, NH_PRESET_BALANCED);
+        assert(live[i]);
+        memcpy(hptr(live[i]), &i, sizeof(i));
+        if (slot_of(live[i]) > top)
+            top = slot_of(live[i]);
+    }
+    uint32_t seed = 1;
+    for (uint32_t n = 0; n < CYCLES; ++n) {
+        seed = seed * 1103515245u + 12345u;
+        uint32_t i = (seed >> 8) % LIVE;
+        nh_handle_t old = live[i];
+        assert(hfree(old) == 0);
+        live[i] = halloc(16, NH_PRESET_BALANCED);
+        assert(live[i] && live[i] != old);
+        assert(slot_of(live[i]) <= top);
+        assert(hptr(old) == NULL);
+        memcpy(hptr(live[i]), &i, sizeof(i));
+    }
+    nitro_kheap_harvest();
+    nitro_kheap_compact();
+    for (uint32_t i = 0; i < LIVE; ++i) {
+        uint32_t v;
+        memcpy(&v, hptr(live[i]), sizeof(v));
+        assert(v == i);
+        assert(hfree(live[i]) == 0);
+    }
+}
+
 int main(void) {
     smp_stub_set_cpu_index(0);
     nitroheap_init();
@@ -18,6 +81,9 @@ int main(void) {
     memset(p, 0x5A, 64);
     assert(hfree(h) == 0);
 
+    test_stale();
+    test_churn();
+
     printf("nh handle tests passed\n");
     return 0;
 }
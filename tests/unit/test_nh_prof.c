@@ -0,0 +1,136 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../include/nitroheap_sys.h"
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+
+void smp_stub_set_cpu_index(uint32_t idx);
+
+#define RATE    4096
+#define LEAKS   2000
+#define OBJ     1000
+
+static void* leaked[LEAKS];
+static char report[64 * 1024];
+
+// Both sites sit in their own functions so the report can be matched to
+// them by return address.
+static __attribute__((noinline)) void leak_site(void) {
+    for (int i = 0; i < LEAKS; ++i)
+        leaked[i] = nitro_kmalloc(OBJ, 8);
+}
+
+static __attribute__((noinline)) void churn_site(void) {
+    for (int i = 0; i < 4 * LEAKS; ++i)
+        nitro_kfree(nitro_kmalloc(OBJ, 8));
+}
+
+static int prof_set(uint64_t rate) {
+    nh_heapctl_prof_set_args a = { .sample_bytes = rate };
+    return sys_heapctl(NH_HEAPCTL_PROF_SET, &a, sizeof(a));
+}
+
+static int prof_dump(char* buf, size_t len) {
+    nh_heapctl_prof_dump_args a = { .user_buf = buf, .user_buf_len = len };
+    return sys_heapctl(NH_HEAPCTL_PROF_DUMP, &a, sizeof(a));
+}
+
+int main(void);
+
+// A function is taken to end at the next of this file's functions above
+// it, or 512 bytes in, whichever comes first.
+static int in_func(uint64_t pc, void (*fn)(void)) {
+    const uintptr_t others[] = { (uintptr_t)leak_site, (uintptr_t)churn_site,
+                                 (uintptr_t)prof_set, (uintptr_t)main };
+    uintptr_t lo = (uintptr_t)fn, hi = lo + 512;
+    for (size_t i = 0; i < sizeof(others) / sizeof(others[0]); ++i)
+        if (others[i] > lo && others[i] < hi)
+            hi = others[i];
+    return pc > lo && pc < hi;
+}
+
+typedef struct {
+    uint64_t objs, bytes, lines;
+} site_total;
+
+// Parse "objs: bytes [objs: bytes] @ pc pc ..." lines and sum the ones whose
+// stack passes through `fn`.
+static site_total site(const char* text, void (*fn)(void)) {
+    site_total t = {0};
+    const char* line = strchr(text, '\n') + 1;
+    for (; *line && *line != '#'; line = strchr(line, '\n') + 1) {
+        char* end;
+        uint64_t objs = strtoull(line, &end, 10);
+        assert(*end == ':');
+        uint64_t bytes = strtoull(end + 1, &end, 10);
+        const char* at = strchr(line, '@');
+        const char* eol = strchr(line, '\n');
+        assert(at && eol && at < eol);
+        for (const char* p = at + 1; p < eol; p = end) {
+            uint64_t pc = strtoull(p, &end, 16);
+            if (in_func(pc, fn)) {
+                t.objs += objs;
+                t.bytes += bytes;
+                t.lines++;
+                break;
+            }
+        }
+    }
+    return t;
+}
+
+int main(void) {
+    smp_stub_set_cpu_index(0);
+    nitroheap_init();
+
+    // Off by default: nothing is recorded.
+    leak_site();
+    assert(prof_dump(report, sizeof(report)) > 0);
+    assert(!strncmp(report, "heap profile: 0: 0 [0: 0] @ heap_v2/0\n", 38));
+    for (int i = 0; i < LEAKS; ++i)
+        nitro_kfree(leaked[i]);
+
+    assert(prof_set(NH_PROF_RATE_MAX + 1) == -1);
+    assert(prof_set(RATE) == 0);
+    leak_site();
+    churn_site();
+    int len = prof_dump(report, sizeof(report));
+    assert(len > 0 && (size_t)len < sizeof(report));
+    assert(!strncmp(report, "heap profile: ", 14));
+    assert(strstr(report, "] @ heap_v2/4096\n"));
+
+    // Each 1000-byte block is sampled with probability 1 - e^(-1000/4096),
+    // so about 430 of the 2000 leaked, folded into one line since every
+    // stack is the same.
+    site_total leak = site(report, leak_site);
+    printf("nitroheap profile: %llu leaked samples, %llu bytes\n",
+           (unsigned long long)leak.objs, (unsigned long long)leak.bytes);
+    assert(leak.lines == 1);
+    assert(leak.objs > 330 && leak.objs < 540);
+    assert(leak.bytes == leak.objs * OBJ);
+    // Everything churn_site allocated was freed again.
+    assert(site(report, churn_site).objs == 0);
+
+    // Freeing the leak clears its samples; a short buffer still learns the
+    // length it needs.
+    for (int i = 0; i < LEAKS; ++i)
+        nitro_kfree(leaked[i]);
+    char tiny[8];
+    len = prof_dump(tiny, sizeof(tiny));
+    assert(len > (int)sizeof(tiny) && tiny[sizeof(tiny) - 1] == '\0');
+    assert(prof_dump(report, sizeof(report)) == len);
+    assert(site(report, leak_site).objs == 0);
+
+    // Stopping drops whatever is live.
+    leak_site();
+    assert(prof_set(0) == 0);
+    prof_dump(report, sizeof(report));
+    assert(!strncmp(report, "heap profile: 0: 0", 18));
+    for (int i = 0; i < LEAKS; ++i)
+        nitro_kfree(leaked[i]);
+
+    printf("nitroheap profiler tests passed\n");
+    return 0;
+}
@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+#include "../../boot/include/bootinfo.h"
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+void smp_stub_set_cpu_index(uint32_t idx);
+
+#define GROW_TO (1u << 20)
+
+static uint8_t region[4096 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+// Grow a buffer one byte at a time, as an appending writer would, and count
+// the reallocations that had to move it.
+static unsigned grow(void) {
+    uint8_t* p = NULL;
+    unsigned copies = 0;
+    for (size_t n = 1; n <= GROW_TO; ++n) {
+        uint8_t* q = nitro_krealloc(p, n, 8);
+        assert(q);
+        copies += p && q != p;
+        q[n - 1] = (uint8_t)n;
+        p = q;
+    }
+    for (size_t i = 0; i < GROW_TO; ++i)
+        assert(p[i] == (uint8_t)(i + 1));
+    nitro_kfree(p);
+    return copies;
+}
+
+int main(void) {
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    smp_stub_set_cpu_index(0);
+    pmm_init(&bi);
+    nitroheap_init();
+
+    // Only crossing a size class moves the buffer; once it outgrows the
+    // slabs, its block takes over the free buddies above it.
+    unsigned copies = grow();
+    printf("nitroheap grow to %u bytes: %u copies\n", GROW_TO, copies);
+    assert(copies <= 48);
+
+    // Shrinking never moves, and neither does growing back.
+    uint8_t* p = nitro_kmalloc(3 * PAGE_SIZE, 8);
+    assert(p);
+    memset(p, 0x5a, 3 * PAGE_SIZE);
+    assert(nitro_krealloc(p, PAGE_SIZE, 8) == p);
+    assert(nitro_krealloc(p, 3 * PAGE_SIZE, 8) == p);
+
+    // Two buffers growing side by side get in each other's way; the copies
+    // keep their contents.
+    uint8_t* q = nitro_kmalloc(PAGE_SIZE, 8);
+    assert(q);
+    memset(q, 0xa5, PAGE_SIZE);
+    for (size_t n = 4; n <= 64; ++n) {
+        p = nitro_krealloc(p, n * PAGE_SIZE, 8);
+        q = nitro_krealloc(q, (n - 2) * PAGE_SIZE, 8);
+        assert(p && q);
+    }
+    for (size_t i = 0; i < PAGE_SIZE; ++i)
+        assert(p[i] == 0x5a && q[i] == 0xa5);
+    nitro_kfree(p);
+    nitro_kfree(q);
+
+    printf("nitroheap realloc tests passed\n");
+    return 0;
+}
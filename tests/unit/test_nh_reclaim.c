@@ -0,0 +1,69 @@
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+
+void smp_stub_set_cpu_index(uint32_t idx);
+extern uint64_t buddy_pages;
+
+#define TOTAL     (100u << 20)
+#define MAX_OBJS  (TOTAL / 256)
+
+static void* objs[MAX_OBJS];
+static const uint32_t sizes[] = { 256, 1024, 2048, 4096 };
+
+// Frees reach the slabs through quarantine, magazines and depot; run the
+// reclaimer twice so depot magazines count as unused for a whole interval.
+static void settle(void) {
+    nitro_kheap_harvest();
+    nitro_kheap_harvest();
+    nitro_kheap_reclaim();
+    nitro_kheap_reclaim();
+}
+
+int main(void) {
+    smp_stub_set_cpu_index(0);
+    nitroheap_init();
+
+    size_t n = 0;
+    for (size_t bytes = 0; bytes < TOTAL; n++) {
+        uint32_t size = sizes[n & 3];
+        objs[n] = nitro_kmalloc(size, 8);
+        assert(objs[n]);
+        memset(objs[n], 0xa5, size);
+        bytes += size;
+    }
+    uint64_t peak = buddy_pages;
+    assert(peak >= TOTAL / 4096);
+
+    // Freeing returns nothing to buddy on the free path itself...
+    for (size_t i = 0; i < n; ++i)
+        nitro_kfree(objs[i]);
+    nitro_kheap_harvest();
+    nitro_kheap_harvest();
+    assert(buddy_pages > peak / 2);
+
+    // ...the reclaimer does, down to its low watermark plus per-class
+    // reserves and this CPU's magazines.
+    nitro_kheap_reclaim();
+    nitro_kheap_reclaim();
+    assert(buddy_pages < peak / 50);
+
+    // Keep one object in sixteen: every slab stays partly live until the
+    // sparse ones are drained, and then their pages come back too.
+    for (size_t i = 0; i < MAX_OBJS / 4; ++i)
+        objs[i] = nitro_kmalloc(512, 8);
+    peak = buddy_pages;
+    for (size_t i = 0; i < MAX_OBJS / 4; ++i)
+        if (i % 16)
+            nitro_kfree(objs[i]);
+    settle();
+    assert(buddy_pages > peak / 2);
+    for (size_t i = 0; i < MAX_OBJS / 4; i += 16)
+        nitro_kfree(objs[i]);
+    settle();
+    assert(buddy_pages < peak / 20);
+
+    nitro_kheap_trim();
+    return 0;
+}
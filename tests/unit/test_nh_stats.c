@@ -9,6 +9,114 @@
 
 void smp_stub_set_cpu_index(uint32_t idx);
 
+static nh_class_stats classes[NH_MAX_SIZE_CLASSES];
+
+static nh_class_stats* class_stats(uint16_t cpu, uint32_t size) {
+    nh_heapctl_get_class_stats_args a = { .cpu = cpu, .user_buf = classes,
+                                          .user_buf_len = sizeof(classes) };
+    int n = sys_heapctl(NH_HEAPCTL_GET_CLASS_STATS, &a, sizeof(a));
+    assert(n > 0);
+    for (int c = 0; c < n; ++c)
+        if (classes[c].size >= size)
+            return &classes[c];
+    assert(!"no class");
+    return NULL;
+}
+
+static nh_heap_tunables tunables(void) {
+    nh_heap_tunables t;
+    nh_heapctl_get_tunables_args a = { .user_buf = &t, .user_buf_len = sizeof(t) };
+    assert(sys_heapctl(NH_HEAPCTL_GET_TUNABLES, &a, sizeof(a)) == 0);
+    return t;
+}
+
+// Hits, refills, drains, quarantine and bytes in use for one class.
+static void test_class_stats(void) {
+    enum { N = 600 };
+    static void* objs[N];
+    nh_class_stats before = *class_stats(NH_STATS_ALL_CPUS, 200);
+    for (int i = 0; i < N; ++i)
+        assert((objs[i] = mallocx(200, NH_PRESET_BALANCED)));
+    nh_class_stats* cs = class_stats(NH_STATS_ALL_CPUS, 200);
+    assert(cs->size >= 200 && cs->mag_size > 0);
+    assert(cs->bytes_inuse >= before.bytes_inuse + N * 200);
+    assert(cs->refills > before.refills);
+    assert(cs->fast_hits > before.fast_hits);
+    assert(cs->fast_hits + cs->refills >= before.fast_hits + N);
+
+    for (int i = 0; i < N; ++i)
+        dallocx(objs[i], 0);
+    cs = class_stats(NH_STATS_ALL_CPUS, 200);
+    assert(cs->bytes_inuse == before.bytes_inuse);
+    assert(cs->quarantined > 0);
+    nitro_kheap_harvest();
+    nitro_kheap_harvest();
+    cs = class_stats(NH_STATS_ALL_CPUS, 200);
+    assert(cs->quarantined == 0);
+    assert(cs->drains > before.drains);
+
+    // Everything happened on CPU 0.
+    assert(class_stats(1, 200)->fast_hits == 0);
+    assert(class_stats(0, 200)->fast_hits == cs->fast_hits);
+    nh_heapctl_get_class_stats_args bad = { .cpu = NH_MAX_CPUS, .user_buf = classes,
+                                            .user_buf_len = sizeof(classes) };
+    assert(sys_heapctl(NH_HEAPCTL_GET_CLASS_STATS, &bad, sizeof(bad)) == -1);
+}
+
+static void test_per_cpu(void) {
+    static union {
+        nh_part_stats_blob blob;
+        uint8_t            raw[sizeof(nh_part_stats_blob) + 4 * sizeof(nh_part_stats_cpu)];
+    } buf;
+    nh_heapctl_get_stats_args a = { .part_id = 0, .include_per_cpu = 1,
+                                    .user_buf = &buf, .user_buf_len = sizeof(buf) };
+    assert(sys_heapctl(NH_HEAPCTL_GET_STATS, &a, sizeof(a)) == 0);
+    assert(buf.blob.n_cpus == 2);
+    const nh_part_stats_cpu* pc = (const nh_part_stats_cpu*)(&buf.blob + 1);
+    assert(pc[0].cpu_id == 0 && pc[1].cpu_id == 1);
+    assert(pc[0].allocs == buf.blob.summary.allocs);
+    assert(pc[0].mag_hits > 0 && pc[0].mag_misses > 0);
+    assert(pc[0].mag_hits + pc[0].mag_misses <= pc[0].allocs);
+    assert(pc[0].harvests > 0);
+    assert(pc[1].frees >= 1);          // the cross-CPU free above
+
+    a.user_buf_len = sizeof(nh_part_stats_blob);
+    assert(sys_heapctl(NH_HEAPCTL_GET_STATS, &a, sizeof(a)) == -1);
+}
+
+static void test_tunables(void) {
+    nh_heap_tunables t = tunables();
+    assert(t.mag_bytes && t.mag_rounds && t.quarantine_limit);
+    assert(t.reclaim_low < t.reclaim_high);
+
+    // Magazines for small objects are capped by mag_rounds.
+    nh_heap_tunables set = { .mag_rounds = 8 };
+    assert(sys_heapctl(NH_HEAPCTL_SET_TUNABLES, &set, sizeof(set)) == 0);
+    assert(class_stats(NH_STATS_ALL_CPUS, 16)->mag_size == 8);
+    nh_heap_tunables now = tunables();
+    assert(now.mag_rounds == 8 && now.mag_bytes == t.mag_bytes);
+
+    // A quarantine limit of one harvests on every local free.
+    set = (nh_heap_tunables){ .quarantine_limit = 1 };
+    assert(sys_heapctl(NH_HEAPCTL_SET_TUNABLES, &set, sizeof(set)) == 0);
+    void* p = mallocx(64, NH_PRESET_BALANCED);
+    dallocx(p, 0);
+    nh_part_stats_summary s;
+    nh_heapctl_get_stats_args a = { .part_id = 0, .user_buf = &s, .user_buf_len = sizeof(s) };
+    assert(sys_heapctl(NH_HEAPCTL_GET_STATS, &a, sizeof(a)) == 0);
+    assert(s.quarantine_backlog <= 1);
+
+    // Inconsistent settings are refused and change nothing.
+    set = (nh_heap_tunables){ .reclaim_low = t.reclaim_high };
+    assert(sys_heapctl(NH_HEAPCTL_SET_TUNABLES, &set, sizeof(set)) == -1);
+    set = (nh_heap_tunables){ .mag_rounds = NH_MAG_ROUNDS_MAX + 1 };
+    assert(sys_heapctl(NH_HEAPCTL_SET_TUNABLES, &set, sizeof(set)) == -1);
+    assert(tunables().reclaim_low == t.reclaim_low);
+
+    assert(sys_heapctl(NH_HEAPCTL_SET_TUNABLES, &t, sizeof(t)) == 0);
+    assert(class_stats(NH_STATS_ALL_CPUS, 16)->mag_size > 8);
+}
+
 int main(void) {
     smp_stub_set_cpu_index(0);
     nitroheap_init();
@@ -44,10 +152,10 @@ int main(void) {
     assert(stats.remote_free_backlog == 0);
 
     void* hold32 = mallocx(32, NH_PRESET_BALANCED);
-    void* x = mallocx(32, NH_PRESET_BALANCED);
+    void* x = mallocx(200000, NH_PRESET_BALANCED);
     assert(hold32 && x);
     smp_stub_set_cpu_index(1);
-    dallocx(x, 0); // cross-CPU free
+    dallocx(x, 0); // cross-CPU free; only large blocks go back home
     smp_stub_set_cpu_index(0);
     ret = sys_heapctl(NH_HEAPCTL_GET_STATS, &args, sizeof(args));
     assert(ret == 0);
@@ -57,6 +165,10 @@ int main(void) {
     dallocx(hold32, 0);
     dallocx(hold64, 0);
 
+    test_class_stats();
+    test_per_cpu();
+    test_tunables();
+
     printf("nh stats tests passed\n");
     return 0;
 }
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+
+// Each thread is its own CPU, so per-CPU state is only ever touched by one
+// thread, as it is by one CPU with interrupts off in the kernel.
+static __thread uint32_t cpu_index;
+uint32_t smp_cpu_index(void) { return cpu_index; }
+uint32_t smp_cpu_id(void) { return cpu_index; }
+uint32_t smp_cpu_count(void) { return 16; }
+
+extern int buddy_allocs;
+
+#define MAX_THREADS 16
+#define LIVE        256
+#define ITERS       200000
+#define SHARED      64
+
+// Objects parked here are freed by whichever thread swaps them out, so a
+// good share of frees are cross-CPU.
+static _Atomic(uintptr_t) shared[SHARED];
+
+typedef struct {
+    uint32_t cpu;
+    uint64_t seed;
+} worker_arg_t;
+
+static uint64_t rnd(uint64_t* s) {
+    *s ^= *s << 13;
+    *s ^= *s >> 7;
+    *s ^= *s << 17;
+    return *s;
+}
+
+// Stamp the object with its address and size and fill the rest, so a block
+// handed out twice or overwritten after free is caught when it is freed.
+static void stamp(uint8_t* p, uint32_t size) {
+    uint64_t tag = (uintptr_t)p ^ 0x5a5aa5a5f00dULL;
+    memcpy(p, &tag, 8);
+    memcpy(p + 8, &size, 4);
+    memset(p + 12, (uint8_t)((uintptr_t)p >> 4), size - 12);
+}
+
+static void check_and_free(uint8_t* p) {
+    uint64_t tag;
+    uint32_t size;
+    memcpy(&tag, p, 8);
+    memcpy(&size, p + 8, 4);
+    assert(tag == ((uintptr_t)p ^ 0x5a5aa5a5f00dULL));
+    for (uint32_t i = 12; i < size; ++i)
+        assert(p[i] == (uint8_t)((uintptr_t)p >> 4));
+    nitro_kfree(p);
+}
+
+static void* alloc_stamped(uint64_t* seed) {
+    uint64_t r = rnd(seed);
+    // Mostly small objects, with the odd medium one to cross slab orders.
+    uint32_t size = (r & 15) ? 16 + (uint32_t)(r >> 8) % 1024
+                             : 4096 + (uint32_t)(r >> 8) % 16384;
+    uint8_t* p = nitro_kmalloc(size, 8);
+    assert(p);
+    stamp(p, size);
+    return p;
+}
+
+static void* worker(void* arg) {
+    worker_arg_t* w = arg;
+    cpu_index = w->cpu;
+    uint64_t seed = w->seed;
+    void* live[LIVE] = {0};
+    for (int i = 0; i < ITERS; ++i) {
+        uint64_t r = rnd(&seed);
+        void** slot = &live[r % LIVE];
+        if (!*slot) {
+            *slot = alloc_stamped(&seed);
+        } else if ((r >> 32) % 8 == 0) {
+            uintptr_t old = atomic_exchange(&shared[(r >> 40) % SHARED], (uintptr_t)*slot);
+            *slot = NULL;
+            if (old)
+                check_and_free((uint8_t*)old);
+        } else {
+            check_and_free(*slot);
+            *slot = NULL;
+        }
+    }
+    for (int i = 0; i < LIVE; ++i)
+        if (live[i])
+            check_and_free(live[i]);
+    return NULL;
+}
+
+static double run(int threads) {
+    pthread_t t[MAX_THREADS];
+    worker_arg_t args[MAX_THREADS];
+    struct timespec a, b;
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    for (int i = 0; i < threads; ++i) {
+        args[i].cpu = (uint32_t)i;
+        args[i].seed = 0x9e3779b97f4a7c15ULL * (uint64_t)(i + 1);
+        assert(pthread_create(&t[i], NULL, worker, &args[i]) == 0);
+    }
+    for (int i = 0; i < threads; ++i)
+        pthread_join(t[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    for (int i = 0; i < SHARED; ++i) {
+        uintptr_t p = atomic_exchange(&shared[i], 0);
+        if (p)
+            check_and_free((uint8_t*)p);
+    }
+    return (double)(b.tv_sec - a.tv_sec) + (double)(b.tv_nsec - a.tv_nsec) / 1e9;
+}
+
+int main(void) {
+    nitroheap_init();
+    for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+        double secs = run(threads);
+        printf("nh stress %2d threads: %6.1f Mops/s\n", threads,
+               (double)threads * ITERS / secs / 1e6);
+    }
+    // Nothing leaked and nothing was lost: once every CPU has trimmed, all
+    // slabs, caches and large blocks are back with buddy.
+    for (uint32_t cpu = 0; cpu < MAX_THREADS; ++cpu) {
+        cpu_index = cpu;
+        nitro_kheap_trim();
+    }
+    assert(buddy_allocs == 0);
+    return 0;
+}
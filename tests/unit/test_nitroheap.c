@@ -2,11 +2,57 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
 #include "../../kernel/VM/nitroheap/nitroheap.h"
 
 extern int buddy_allocs;
+extern uint64_t buddy_pages;
 void smp_stub_set_cpu_index(uint32_t idx);
 
+#define BENCH_ITERS 200000
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// Steady-state malloc/free pairs per size: after warm-up both hit the
+// per-CPU magazine, with a harvest every NH_HARVEST_BATCH frees.
+static void bench(void) {
+    for (size_t sz = 16; sz <= 4096; sz <<= 1) {
+        void* warm = nitro_kmalloc(sz, 8);
+        nitro_kfree(warm);
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < BENCH_ITERS; ++i) {
+            void* p = nitro_kmalloc(sz, 8);
+            *(volatile char*)p = 1;
+            nitro_kfree(p);
+        }
+        uint64_t dt = now_ns() - t0;
+        printf("nitroheap %4zu B: %3llu ns/op\n", sz,
+               (unsigned long long)(dt / (2ull * BENCH_ITERS)));
+    }
+}
+
+// Pages held per live object for the small sizes that dominate kernel
+// allocations.
+#define FOOTPRINT_OBJS 65536
+static void footprint(void) {
+    static void* objs[FOOTPRINT_OBJS];
+    for (size_t sz = 16; sz <= 64; sz += 16) {
+        uint64_t before = buddy_pages;
+        for (int i = 0; i < FOOTPRINT_OBJS; ++i)
+            objs[i] = nitro_kmalloc(sz, 8);
+        uint64_t bytes = (buddy_pages - before) * 4096;
+        printf("nitroheap %4zu B: %3llu bytes/object\n", sz,
+               (unsigned long long)(bytes / FOOTPRINT_OBJS));
+        for (int i = 0; i < FOOTPRINT_OBJS; ++i)
+            nitro_kfree(objs[i]);
+        nitro_kheap_trim();
+    }
+}
+
 int main(void) {
     smp_stub_set_cpu_index(0);
     nitroheap_init();
@@ -23,42 +69,79 @@ int main(void) {
     // Per-CPU magazine behavior
     void* hold = nitro_kmalloc(32, 8); // keep span alive
     void* a = nitro_kmalloc(32, 8);
-    nitro_kfree(a); // stays in CPU 0 magazine
+    nitro_kfree(a); // quarantined on CPU 0
     smp_stub_set_cpu_index(1);
     void* b = nitro_kmalloc(32, 8); // different CPU should not reuse
     assert(b != a);
     nitro_kfree(b);
     smp_stub_set_cpu_index(0);
+    nitro_kheap_harvest();          // a reaches CPU 0's magazine
     void* c = nitro_kmalloc(32, 8); // original CPU reuses
     assert(c == a);
     nitro_kfree(c);
     nitro_kfree(hold);
 
-    // Cross-CPU free should return to home CPU
+    // A small object carries no record of its allocating CPU, so a
+    // cross-CPU free is reused by the CPU that freed it.
+    smp_stub_set_cpu_index(1);
+    nitro_kheap_harvest();              // settle the frees above first
+    smp_stub_set_cpu_index(0);
+    nitro_kheap_harvest();
     void* hold2 = nitro_kmalloc(32, 8); // keep span alive
     void* x = nitro_kmalloc(32, 8);     // allocate on CPU 0
     smp_stub_set_cpu_index(1);
     nitro_kfree(x);                     // free on CPU 1
-    smp_stub_set_cpu_index(0);
-    void* y = nitro_kmalloc(32, 8);     // CPU 0 should reclaim
+    nitro_kheap_harvest();
+    void* y = nitro_kmalloc(32, 8);     // CPU 1 reuses it
     assert(y == x);
     nitro_kfree(y);
+    smp_stub_set_cpu_index(0);
     nitro_kfree(hold2);
 
-    // Test large allocation caching and realloc path
+    // Test large allocation caching and realloc path.  Empty spans stay
+    // cached until trim, so count buddy allocations relative to here.
+    int base = buddy_allocs;
     void* p = nitro_kmalloc(150000, 8); // larger than any size class
     assert(p);
-    assert(buddy_allocs == 1);
-    nitro_kfree(p);
-    assert(buddy_allocs == 1);
+    assert(buddy_allocs == base + 1);
+    smp_stub_set_cpu_index(1);
+    nitro_kfree(p);                     // large blocks go back home
+    smp_stub_set_cpu_index(0);
+    nitro_kheap_harvest();              // pick up the remote free
+    assert(buddy_allocs == base + 1);
     void* q = nitro_kmalloc(150000, 8);
     assert(q == p);
-    assert(buddy_allocs == 1);
+    assert(buddy_allocs == base + 1);
     nitro_kfree(q);
-    assert(buddy_allocs == 1);
+    assert(buddy_allocs == base + 1);
 
+    // Trim only reaches the calling CPU's caches, so run it on both.
+    smp_stub_set_cpu_index(1);
+    nitro_kheap_trim();
+    smp_stub_set_cpu_index(0);
     nitro_kheap_trim();
     assert(buddy_allocs == 0);
+
+    // Partitions never share slabs: a block freed in one is not handed out
+    // by the other, even for the same size class.
+    struct nh_partition* iso = nitro_partition_create("isolated");
+    assert(iso && nitro_partition_get(1) == iso);
+    void* d = nitro_kmalloc(48, 8);
+    nitro_kfree(d);
+    nitro_kheap_harvest();
+    void* e = nitro_pkmalloc(iso, 48, 8);
+    assert(e && e != d);
+    void* f = nitro_kmalloc(48, 8);
+    assert(f == d);
+    nitro_kfree(e);
+    nitro_kfree(f);
+    nitro_kheap_trim();
+    assert(buddy_allocs == 1);          // the partition object itself
+
+    bench();
+    nitro_kheap_trim();
+    footprint();
+    assert(buddy_allocs == 1);
     printf("nitroheap unit tests passed\n");
     return 0;
 }
@@ -0,0 +1,107 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/page.h"
+#include "../../boot/include/bootinfo.h"
+
+#define THREADS 8
+#define ITERS   200000
+
+static uint8_t region[256 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static page_t *shared;
+static int last_ref_seen;
+
+static void *inc_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ITERS; ++i)
+        page_ref_inc(shared);
+    return NULL;
+}
+
+static void *dec_worker(void *arg) {
+    (void)arg;
+    for (int i = 0; i < ITERS; ++i)
+        if (page_ref_dec_and_test(shared))
+            __atomic_fetch_add(&last_ref_seen, 1, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+// Each thread flips a bit of its own, above the PG_* ones, and leaves it
+// set if its index is even.
+static void *flag_worker(void *arg) {
+    uint32_t bit = 1u << (16 + (uintptr_t)arg);
+    for (int i = 0; i < ITERS; ++i) {
+        page_set_flag(shared, bit);
+        page_clear_flag(shared, bit);
+    }
+    if (!((uintptr_t)arg & 1))
+        page_set_flag(shared, bit);
+    return NULL;
+}
+
+static void run(void *(*fn)(void *)) {
+    pthread_t t[THREADS];
+    for (uintptr_t i = 0; i < THREADS; ++i)
+        assert(pthread_create(&t[i], NULL, fn, (void *)i) == 0);
+    for (int i = 0; i < THREADS; ++i)
+        pthread_join(t[i], NULL);
+}
+
+int main(void) {
+    bootinfo_memory_t mmap[2] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = 128 * PAGE_SIZE, .type = 7 },
+        { .addr = (uint64_t)(uintptr_t)region + 192 * PAGE_SIZE, .len = 64 * PAGE_SIZE, .type = 7 },
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 2;
+    pmm_init(&bi);
+
+    // Every frame in the span has a descriptor; the hole stays reserved.
+    assert(page_db_count == 256);
+    assert(phys_to_page((uint64_t)(uintptr_t)region) == &page_db[0]);
+    assert(page_to_phys(&page_db[5]) == (uint64_t)(uintptr_t)region + 5 * PAGE_SIZE);
+    assert(phys_to_page((uint64_t)(uintptr_t)region + 256 * PAGE_SIZE) == NULL);
+    assert(page_test_flag(phys_to_page((uint64_t)(uintptr_t)region + 150 * PAGE_SIZE),
+                          PG_RESERVED));
+
+    // Allocation flips the buddy marker to an allocated head; free undoes it
+    // and clears owner state.
+    void *p = alloc_page();
+    page_t *pg = phys_to_page((uint64_t)(uintptr_t)p);
+    assert(pg && !page_test_flag(pg, PG_BUDDY) && page_test_flag(pg, PG_HEAD));
+    assert(pg->order == 0);
+    pg->owner = PAGE_OWNER_KERNEL;
+    page_ref_inc(pg);
+    free_page(p);
+    assert(pg->owner == PAGE_OWNER_NONE && page_ref_count(pg) == 0);
+    assert(!page_test_flag(pg, PG_HEAD));
+
+    // Refcounts no longer saturate at 16 bits, and concurrent updates are
+    // not lost.
+    shared = phys_to_page((uint64_t)(uintptr_t)alloc_page());
+    run(inc_worker);
+    assert(page_ref_count(shared) == (uint32_t)THREADS * ITERS);
+    run(dec_worker);
+    assert(page_ref_count(shared) == 0);
+    assert(last_ref_seen == 1);
+
+    // Dropping below zero saturates instead of wrapping.
+    assert(!page_ref_dec_and_test(shared));
+    assert(page_ref_count(shared) == 0);
+
+    // Concurrent flag updates on one descriptor do not clobber each other.
+    page_set_flag(shared, PG_SLAB);
+    uint32_t want = __atomic_load_n(&shared->flags, __ATOMIC_ACQUIRE);
+    run(flag_worker);
+    for (int i = 0; i < THREADS; i += 2)
+        want |= 1u << (16 + i);
+    assert(__atomic_load_n(&shared->flags, __ATOMIC_ACQUIRE) == want);
+    page_set_flag(shared, PG_COW);
+    page_clear_flag(shared, PG_COW);
+    assert(page_test_flag(shared, PG_SLAB) && !page_test_flag(shared, PG_COW));
+
+    return 0;
+}
@@ -0,0 +1,201 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/paging_adv.h"
+#include "../../kernel/VM/tlb.h"
+#include "../../boot/include/bootinfo.h"
+
+#define WORKERS 4
+#define READERS 2
+#define ROUNDS  40
+// 4 page tables' worth of pages, owned round-robin: every thread maps into
+// every table, and the last one out of a table frees it.
+#define NPAGES  2048
+#define BASE    0x0000008000000000ULL
+
+// The page tables live in `region`, handed to the real buddy allocator as
+// physical memory; mapped "frames" are never touched, so their addresses
+// are just numbers that say who mapped them.  Each thread is its own CPU,
+// and polls for shootdowns where a CPU would take the IPI.
+static __thread uint32_t cpu_index;
+uint32_t smp_cpu_index(void) { return cpu_index; }
+uint32_t smp_cpu_id(void) { return cpu_index; }
+uint32_t smp_cpu_count(void) { return 1 + WORKERS + READERS; }
+uint32_t smp_index_to_apic(uint32_t cpu) { return cpu; }
+
+static atomic_uint ipis;
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) {
+    (void)apic_id;
+    assert(vector == TLB_SHOOTDOWN_VECTOR);
+    atomic_fetch_add(&ipis, 1);
+}
+
+void* kmalloc(size_t sz, size_t align) { (void)align; return malloc(sz); }
+void kfree(void* p) { free(p); }
+// No VMAs here: paging_space_put has no mmap frames to release.
+void vm_exit_mmap(vm_space_t* vs) { assert(!vs->vmas.root); }
+
+static uint8_t region[8192 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static vm_space_t* space;
+static atomic_int finished;
+static atomic_ulong torn;
+
+static uint64_t frame(uint32_t owner, uint32_t idx, uint32_t round) {
+    return ((uint64_t)round << 32 | (uint64_t)idx << 8 | owner) << 12;
+}
+
+// Leave the space and keep serving shootdowns until everyone is done: a
+// flusher may have picked this CPU before it left.
+static void drain(void) {
+    paging_space_switch(paging_kernel_space());
+    atomic_fetch_add(&finished, 1);
+    while (atomic_load(&finished) < WORKERS + READERS) {
+        tlb_shootdown_handler();
+        sched_yield();
+    }
+}
+
+static void* worker(void* arg) {
+    cpu_index = (uint32_t)(uintptr_t)arg;
+    uint32_t me = cpu_index - 1;
+    paging_space_switch(space);
+    for (uint32_t round = 0; round < ROUNDS; ++round) {
+        for (uint32_t i = me; i < NPAGES; i += WORKERS) {
+            paging_map_adv(BASE + (uint64_t)i * PAGE_SIZE, frame(me, i, round),
+                           PAGE_WRITABLE | PAGE_USER, 0, 0);
+            tlb_shootdown_handler();
+        }
+        for (uint32_t i = me; i < NPAGES; i += WORKERS) {
+            uint64_t phys = 0;
+            assert(paging_lookup_adv(BASE + (uint64_t)i * PAGE_SIZE, &phys, NULL));
+            assert(phys == frame(me, i, round));
+        }
+        // Half the rounds unmap in a batch, so tables are emptied with
+        // their flushes still pending.
+        if (round & 1)
+            tlb_batch_begin();
+        for (uint32_t i = me; i < NPAGES; i += WORKERS) {
+            paging_unmap_adv(BASE + (uint64_t)i * PAGE_SIZE);
+            tlb_shootdown_handler();
+        }
+        if (round & 1)
+            tlb_batch_end();
+    }
+    drain();
+    return NULL;
+}
+
+// Lockless lookups racing the mappers: a page reads as unmapped or as
+// mapped by its owner, never anything else.
+static void* reader(void* arg) {
+    cpu_index = (uint32_t)(uintptr_t)arg;
+    paging_space_switch(space);
+    while (atomic_load(&finished) < WORKERS) {
+        for (uint32_t i = 0; i < NPAGES; ++i) {
+            uint64_t phys;
+            if (!paging_lookup_adv(BASE + (uint64_t)i * PAGE_SIZE, &phys, NULL))
+                continue;
+            uint64_t f = phys >> 12;
+            if ((f & 0xFF) != i % WORKERS || ((f >> 8) & 0xFFFFFF) != i)
+                atomic_fetch_add(&torn, 1);
+        }
+        tlb_shootdown_handler();
+        sched_yield();
+    }
+    drain();
+    return NULL;
+}
+
+static void test_single(void) {
+    uint64_t va = BASE + 0x40000000ULL;
+    uint64_t phys, flags;
+    paging_map_adv(va, 0x1234000, PAGE_WRITABLE, 0, 0);
+    assert(paging_lookup_adv(va + 0x10, &phys, &flags));
+    assert(phys == 0x1234010 && (flags & PAGE_WRITABLE));
+    assert(paging_virt_to_phys_adv(va) == 0x1234000);
+    paging_unmap_adv(va);
+    assert(!paging_lookup_adv(va, &phys, NULL));
+
+    // A 2 MiB page over a table of 4 KiB ones replaces the table.
+    paging_map_adv(va, 0x5000, 0, 0, 0);
+    paging_map_adv(va, 0x40000000ULL, PAGE_HUGE_2MB, 9, 0);
+    assert(paging_virt_to_phys_adv(va + 0x12345) == 0x40012345ULL);
+    paging_unmap_adv(va + 0x1000);
+    assert(!paging_lookup_adv(va, &phys, NULL));
+}
+
+// Batched mapping across a page table boundary: taken slots and zero
+// frames are skipped, the frames not used are handed back.
+static void test_map_pages(void) {
+    uint64_t va = BASE + 0x80000000ULL + 500 * PAGE_SIZE;   // 12 pages, then a new table
+    uint64_t frames[40], phys;
+    for (int i = 0; i < 40; ++i)
+        frames[i] = 0x7000000ULL + (uint64_t)i * PAGE_SIZE;
+    frames[3] = 0;
+    paging_map_adv(va + 20 * PAGE_SIZE, 0x9000, PAGE_WRITABLE, 0, 0);
+    assert(paging_map_pages(va, frames, 40, PAGE_WRITABLE, 0) == 38);
+    for (int i = 0; i < 40; ++i) {
+        int mapped = paging_lookup_adv(va + (uint64_t)i * PAGE_SIZE, &phys, NULL);
+        if (i == 3)
+            assert(!mapped);
+        else if (i == 20)
+            assert(mapped && phys == 0x9000 && frames[i] == 0x7000000ULL + 20 * PAGE_SIZE);
+        else
+            assert(mapped && phys == 0x7000000ULL + (uint64_t)i * PAGE_SIZE && !frames[i]);
+    }
+    for (int i = 0; i < 40; ++i)
+        paging_unmap_adv(va + (uint64_t)i * PAGE_SIZE);
+    assert(!paging_lookup_adv(va + 20 * PAGE_SIZE, &phys, NULL));
+}
+
+int main(void) {
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    pmm_init(&bi);
+    paging_init();
+
+    uint64_t base = buddy_free_frames_total();
+    space = paging_space_create();
+    assert(space);
+    paging_space_switch(space);
+    test_single();
+    test_map_pages();
+    paging_space_switch(paging_kernel_space());
+
+    pthread_t th[WORKERS + READERS];
+    for (uintptr_t t = 0; t < WORKERS + READERS; ++t)
+        pthread_create(&th[t], NULL, t < WORKERS ? worker : reader, (void*)(t + 1));
+    for (int t = 0; t < WORKERS + READERS; ++t)
+        pthread_join(th[t], NULL);
+    assert(atomic_load(&torn) == 0);
+
+    // Every last-level table was emptied and freed; the PML4, the PDPT and
+    // the three PDs (stress range, test_single, test_map_pages) stay until
+    // the space goes.  With no unmaps to come, the calls kswapd makes
+    // from the timer tick empty the retire list.
+    assert(paging_tables_retired());
+    for (int tick = 0; tick < 4 && paging_tables_retired(); ++tick)
+        paging_reclaim_tables();
+    assert(!paging_tables_retired());
+    assert(buddy_free_frames_total() == base - 5);
+    paging_space_put(space);
+    assert(buddy_free_frames_total() == base);
+
+    tlb_stats_t st;
+    tlb_get_stats(&st);
+    printf("paging: %d threads x %d rounds, %llu flushes, %u ipis\n",
+           WORKERS + READERS, ROUNDS, (unsigned long long)st.batches, atomic_load(&ipis));
+    printf("paging tests passed\n");
+    return 0;
+}
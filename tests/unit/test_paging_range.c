@@ -0,0 +1,269 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/paging_adv.h"
+#include "../../kernel/VM/page.h"
+#include "../../kernel/VM/tlb.h"
+#include "../../boot/include/bootinfo.h"
+
+#define SZ_2M   0x200000ULL
+#define SZ_1G   0x40000000ULL
+#define BASE    0x0000008000000000ULL
+
+// Page tables come from `region`, handed to the buddy allocator as
+// physical memory; the mapped frames are never touched, so any address
+// does.  One CPU: every batch is a local flush, counted by tlb_get_stats.
+uint32_t smp_cpu_index(void) { return 0; }
+uint32_t smp_cpu_id(void) { return 0; }
+uint32_t smp_cpu_count(void) { return 1; }
+uint32_t smp_index_to_apic(uint32_t cpu) { return cpu; }
+void lapic_send_ipi(uint8_t apic_id, uint8_t vector) { (void)apic_id; (void)vector; assert(0); }
+
+void* kmalloc(size_t sz, size_t align) { (void)align; return malloc(sz); }
+void kfree(void* p) { free(p); }
+void vm_exit_mmap(vm_space_t* vs) { assert(!vs->vmas.root); }
+
+static uint8_t region[4096 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+static uint64_t batches(void) {
+    tlb_stats_t st;
+    tlb_get_stats(&st);
+    return st.batches;
+}
+
+static uint64_t tables_in_use(uint64_t base) {
+    paging_reclaim_tables();
+    paging_reclaim_tables();
+    return base - buddy_free_frames_total();
+}
+
+static void check_range(uint64_t va, uint64_t pa, uint64_t len, uint64_t want_flags) {
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE) {
+        uint64_t phys, flags;
+        assert(paging_lookup_adv(va + off + 0x123, &phys, &flags));
+        assert(phys == pa + off + 0x123);
+        assert((flags & (PAGE_WRITABLE | PAGE_USER)) == want_flags);
+    }
+}
+
+// 2 MiB leaves where both sides line up, 4 KiB pages for the tail, and
+// the whole call flushes at most once.
+static void test_map_2m(uint64_t base) {
+    uint64_t va = BASE, pa = 0x40000000ULL, len = 3 * SZ_2M + 5 * PAGE_SIZE;
+    uint64_t used = tables_in_use(base), b = batches();
+    assert(paging_map_range(va, pa, len, PAGE_WRITABLE | PAGE_USER, 0) == 0);
+    assert(batches() == b);                     // nothing was mapped before
+    check_range(va, pa, len, PAGE_WRITABLE | PAGE_USER);
+    uint64_t flags;
+    paging_lookup_adv(va, NULL, &flags);
+    assert(flags & PAGE_SIZE_2MB);
+    paging_lookup_adv(va + 3 * SZ_2M, NULL, &flags);
+    assert(!(flags & PAGE_SIZE_2MB));
+    assert(!paging_lookup_adv(va + len, NULL, NULL));
+    // The PDPT and PD, and one page table for the tail.
+    assert(tables_in_use(base) == used + 3);
+
+    // Read-only over the lot: leaves change in place, one flush.
+    b = batches();
+    assert(paging_protect_range(va, len, PAGE_USER) == 0);
+    assert(batches() == b + 1);
+    check_range(va, pa, len, PAGE_USER);
+
+    b = batches();
+    assert(paging_unmap_range(va, len) == 0);
+    assert(batches() == b + 1);
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE)
+        assert(!paging_lookup_adv(va + off, NULL, NULL));
+    assert(tables_in_use(base) == used + 2);
+}
+
+// A physical base off 2 MiB alignment can only use 4 KiB pages.
+static void test_map_unaligned(uint64_t base) {
+    uint64_t va = BASE + 4 * SZ_2M, pa = 0x40001000ULL, len = 2 * SZ_2M;
+    uint64_t used = tables_in_use(base);
+    assert(paging_map_range(va, pa, len, PAGE_WRITABLE, 0) == 0);
+    check_range(va, pa, len, PAGE_WRITABLE);
+    uint64_t flags;
+    paging_lookup_adv(va, NULL, &flags);
+    assert(!(flags & PAGE_SIZE_2MB));
+    assert(tables_in_use(base) == used + 2);
+
+    // Unmapping a whole table's worth drops the table with it.
+    assert(paging_unmap_range(va, SZ_2M) == 0);
+    assert(tables_in_use(base) == used + 1);
+    assert(paging_lookup_adv(va + SZ_2M, NULL, NULL));
+    assert(paging_unmap_range(va + SZ_2M, SZ_2M) == 0);
+    assert(tables_in_use(base) == used);
+
+    assert(paging_map_range(va, 0x1001, PAGE_SIZE, 0, 0) == -1);
+    assert(paging_map_range(va + 0x10, 0x1000, PAGE_SIZE, 0, 0) == -1);
+}
+
+// Protecting or unmapping part of a 2 MiB leaf splits it into a table
+// mapping the same memory, and only the pages asked for change.
+static void test_split_2m(uint64_t base) {
+    uint64_t va = BASE + 8 * SZ_2M, pa = 0x80000000ULL;
+    uint64_t used = tables_in_use(base);
+    assert(paging_map_range(va, pa, SZ_2M, PAGE_WRITABLE | PAGE_USER, 0) == 0);
+    assert(tables_in_use(base) == used);
+
+    assert(paging_protect_range(va + 16 * PAGE_SIZE, 4 * PAGE_SIZE, PAGE_USER) == 0);
+    assert(tables_in_use(base) == used + 1);
+    check_range(va, pa, 16 * PAGE_SIZE, PAGE_WRITABLE | PAGE_USER);
+    check_range(va + 16 * PAGE_SIZE, pa + 16 * PAGE_SIZE, 4 * PAGE_SIZE, PAGE_USER);
+    check_range(va + 20 * PAGE_SIZE, pa + 20 * PAGE_SIZE, SZ_2M - 20 * PAGE_SIZE,
+                PAGE_WRITABLE | PAGE_USER);
+
+    assert(paging_unmap_range(va + PAGE_SIZE, 2 * PAGE_SIZE) == 0);
+    assert(paging_lookup_adv(va, NULL, NULL));
+    assert(!paging_lookup_adv(va + PAGE_SIZE, NULL, NULL));
+    assert(!paging_lookup_adv(va + 2 * PAGE_SIZE, NULL, NULL));
+    assert(paging_lookup_adv(va + 3 * PAGE_SIZE, NULL, NULL));
+
+    // Mapping a 2 MiB leaf back over the split table replaces it.
+    assert(paging_map_range(va, pa, SZ_2M, PAGE_WRITABLE, 0) == 0);
+    assert(tables_in_use(base) == used);
+    check_range(va, pa, SZ_2M, PAGE_WRITABLE);
+    assert(paging_unmap_range(va, SZ_2M) == 0);
+    assert(tables_in_use(base) == used);
+}
+
+// A 1 GiB leaf needs both sides on 1 GiB; a partial change splits it into
+// 2 MiB leaves and then, where needed, into a page table.
+static void test_1g(uint64_t base) {
+    uint64_t va = BASE + SZ_1G, pa = 2 * SZ_1G;
+    uint64_t used = tables_in_use(base);
+    assert(paging_map_range(va, pa, SZ_1G, PAGE_WRITABLE, 0) == 0);
+    assert(tables_in_use(base) == used);
+    uint64_t phys, flags;
+    assert(paging_lookup_adv(va + SZ_1G - 1, &phys, &flags));
+    assert(phys == pa + SZ_1G - 1 && (flags & PAGE_SIZE_2MB));
+
+    assert(paging_protect_range(va + SZ_2M + PAGE_SIZE, PAGE_SIZE, 0) == 0);
+    assert(tables_in_use(base) == used + 2);    // a PD and a page table
+    assert(paging_lookup_adv(va + SZ_2M + PAGE_SIZE, &phys, &flags));
+    assert(phys == pa + SZ_2M + PAGE_SIZE && !(flags & PAGE_WRITABLE));
+    check_range(va + SZ_2M + 2 * PAGE_SIZE, pa + SZ_2M + 2 * PAGE_SIZE, 16 * PAGE_SIZE,
+                PAGE_WRITABLE);
+    check_range(va + SZ_1G - SZ_2M, pa + SZ_1G - SZ_2M, SZ_2M, PAGE_WRITABLE);
+
+    // Unmapping the whole range frees the page table; the PD stays.
+    assert(paging_unmap_range(va, SZ_1G) == 0);
+    assert(!paging_lookup_adv(va, NULL, NULL));
+    assert(!paging_lookup_adv(va + SZ_2M + PAGE_SIZE, NULL, NULL));
+    assert(tables_in_use(base) == used + 1);
+
+    // Misaligned physical memory falls back to 2 MiB leaves.
+    assert(paging_map_range(va, pa + SZ_2M, SZ_1G, PAGE_WRITABLE, 0) == 0);
+    assert(tables_in_use(base) == used + 1);
+    assert(paging_virt_to_phys_adv(va + SZ_1G - 1) == pa + SZ_1G + SZ_2M - 1);
+    assert(paging_unmap_range(va, SZ_1G) == 0);
+}
+
+// Copying a space's pages for fork: the same frames on both sides, each
+// with one more mapping; copy-on-write also takes a reference, marks the
+// frame and takes write access from both, in one flush for the source.
+static void test_copy(uint64_t base) {
+    vm_space_t* src = paging_current_space();
+    vm_space_t* dst = paging_space_create();
+    assert(dst);
+    uint64_t va = BASE + 16 * SZ_2M - 2 * PAGE_SIZE;        // straddles two tables
+    uint64_t f[4];
+    for (int i = 0; i < 4; ++i) {
+        f[i] = (uint64_t)(uintptr_t)buddy_alloc(0, 0, 0);
+        page_t* pg = phys_to_page(f[i]);
+        page_ref_inc(pg);
+        page_mapcount_inc(pg);
+        assert(paging_map_range(va + i * PAGE_SIZE, f[i], PAGE_SIZE,
+                                (i == 3 ? 0 : PAGE_WRITABLE) | PAGE_USER, 0) == 0);
+    }
+
+    uint64_t b = batches();
+    assert(paging_copy_range(dst, src, va, va + 4 * PAGE_SIZE, 1, 0) == 4);
+    assert(batches() == b + 1);
+    for (int i = 0; i < 4; ++i) {
+        page_t* pg = phys_to_page(f[i]);
+        uint64_t phys, flags;
+        assert(page_ref_count(pg) == 2 && pg->mapcount == 2 && page_test_flag(pg, PG_COW));
+        assert(paging_lookup_adv(va + i * PAGE_SIZE, &phys, &flags));
+        assert(phys == f[i] && !(flags & PAGE_WRITABLE) && (flags & PAGE_USER));
+        assert(paging_next_mapped(dst, va + i * PAGE_SIZE, va + 4 * PAGE_SIZE, &phys, NULL) ==
+               va + i * PAGE_SIZE && phys == f[i]);
+    }
+    // Slots already filled in `dst` are skipped.
+    assert(paging_copy_range(dst, src, va, va + 4 * PAGE_SIZE, 1, 0) == 0);
+
+    // Shared pages keep write access and gain no reference.
+    vm_space_t* shr = paging_space_create();
+    assert(paging_protect_range(va, 4 * PAGE_SIZE, PAGE_WRITABLE | PAGE_USER) == 0);
+    b = batches();
+    assert(paging_copy_range(shr, src, va, va + 4 * PAGE_SIZE, 0, 0) == 4);
+    assert(batches() == b);
+    assert(page_ref_count(phys_to_page(f[0])) == 2 && phys_to_page(f[0])->mapcount == 3);
+
+    assert(paging_unmap_range(va, 4 * PAGE_SIZE) == 0);
+    paging_space_put(dst);
+    paging_space_put(shr);
+    for (int i = 0; i < 4; ++i) {
+        page_t* pg = phys_to_page(f[i]);
+        pg->refcount = 0;
+        pg->mapcount = 0;
+        page_clear_flag(pg, PG_COW);
+        buddy_free((void*)(uintptr_t)f[i], 0, 0);
+    }
+    tables_in_use(base);
+}
+
+// A lazy unmap clears the entries without a flush and keeps the tables;
+// the caller flushes, and an ordinary unmap later drops them.
+static void test_unmap_lazy(uint64_t base) {
+    uint64_t va = BASE + 20 * SZ_2M, pa = 0x40001000ULL, len = SZ_2M + 4 * PAGE_SIZE;
+    uint64_t used = tables_in_use(base);
+    assert(paging_map_range(va, pa, len, PAGE_WRITABLE, 0) == 0);
+    uint64_t tables = tables_in_use(base), b = batches();
+    assert(tables > used);
+    assert(paging_unmap_range_lazy(va, len) == 0);
+    assert(batches() == b);
+    for (uint64_t off = 0; off < len; off += PAGE_SIZE)
+        assert(!paging_lookup_adv(va + off, NULL, NULL));
+    assert(tables_in_use(base) == tables);
+    assert(paging_unmap_range(va, len) == 0);
+    assert(tables_in_use(base) < tables);
+}
+
+int main(void) {
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    pmm_init(&bi);
+    paging_init();
+
+    uint64_t base = buddy_free_frames_total();
+    vm_space_t* space = paging_space_create();
+    assert(space);
+    paging_space_switch(space);
+    test_map_2m(base);
+    test_map_unaligned(base);
+    test_split_2m(base);
+    test_1g(base);
+    test_copy(base);
+    test_unmap_lazy(base);
+    paging_space_switch(paging_kernel_space());
+    paging_space_put(space);
+    paging_reclaim_tables();
+    paging_reclaim_tables();
+    assert(buddy_free_frames_total() == base);
+
+    tlb_stats_t st;
+    tlb_get_stats(&st);
+    printf("paging range: %llu flushes, %llu ranges\n",
+           (unsigned long long)st.batches, (unsigned long long)st.ranges);
+    printf("paging range tests passed\n");
+    return 0;
+}
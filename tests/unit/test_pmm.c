@@ -1,14 +1,16 @@
 #include <assert.h>
 #include "../../kernel/VM/pmm.h"
 #include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/memblock.h"
 #include "../../boot/include/bootinfo.h"
 #include "../../user/libc/libc.h"
 #ifndef PAGE_SIZE
 #define PAGE_SIZE 4096
 #endif
 
+static uint8_t region[128 * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
 int main(void) {
-    static uint8_t region[128 * PAGE_SIZE];
     bootinfo_memory_t mmap[1] = {
         { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
     };
@@ -16,20 +18,86 @@ int main(void) {
     bi.mmap = mmap;
     bi.mmap_entries = 1;
     pmm_init(&bi);
-    assert(buddy_free_frames_total() == 128);
+    // The buddy bitmap is carved from the top page of the region.
+    assert(buddy_free_frames_total() == 127);
+    assert(memblock_alloc(PAGE_SIZE, PAGE_SIZE) == NULL);
 
     void *p1 = alloc_page();
     assert(p1);
-    assert(buddy_free_frames_total() == 127);
+    assert(buddy_free_frames_total() == 126);
 
     void *p2 = alloc_page();
     assert(p2);
-    assert(buddy_free_frames_total() == 126);
+    assert(buddy_free_frames_total() == 125);
 
     free_page(p1);
-    assert(buddy_free_frames_total() == 127);
+    assert(buddy_free_frames_total() == 126);
     free_page(p2);
-    assert(buddy_free_frames_total() == 128);
+    assert(buddy_free_frames_total() == 127);
+
+    // A block grows in place only over a wholly free buddy above it.
+    uint8_t *big = buddy_alloc(6, 0, 0);
+    assert(big);
+    assert(buddy_try_grow(big, 5, 6) == -1);
+    buddy_free(big + 32 * PAGE_SIZE, 5, 0);
+    assert(buddy_free_frames_total() == 127 - 32);
+    assert(buddy_try_grow(big + PAGE_SIZE, 0, 1) == -1);
+    assert(buddy_try_grow(big, 5, 6) == 0);
+    assert(buddy_free_frames_total() == 127 - 64);
+    buddy_free(big, 6, 0);
+    assert(buddy_free_frames_total() == 127);
+
+    // A firmware hole and a boot module inside the span are never handed out.
+    bootinfo_memory_t holes[3] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = 48 * PAGE_SIZE, .type = 7 },
+        { .addr = (uint64_t)(uintptr_t)region + 48 * PAGE_SIZE, .len = 16 * PAGE_SIZE, .type = 0 },
+        { .addr = (uint64_t)(uintptr_t)region + 64 * PAGE_SIZE, .len = 64 * PAGE_SIZE, .type = 7 },
+    };
+    bootinfo_t hb = {0};
+    hb.mmap = holes;
+    hb.mmap_entries = 3;
+    hb.modules[0].base = region + 8 * PAGE_SIZE;
+    hb.modules[0].size = 2 * PAGE_SIZE;
+    hb.module_count = 1;
+    pmm_init(&hb);
+    assert(buddy_free_frames_total() == 128 - 16 - 2 - 1);
+
+    uint64_t n = buddy_free_frames_total();
+    void *pages[128];
+    for (uint64_t i = 0; i < n; ++i) {
+        pages[i] = alloc_page();
+        uint8_t *p = pages[i];
+        assert(p);
+        assert(p < region + 48 * PAGE_SIZE || p >= region + 64 * PAGE_SIZE);
+        assert(p < region + 8 * PAGE_SIZE || p >= region + 10 * PAGE_SIZE);
+    }
+    assert(alloc_page() == NULL);
+    for (uint64_t i = 0; i < n; ++i)
+        free_page(pages[i]);
+    assert(buddy_free_frames_total() == n);
+
+    // The zone report accounts for every free frame, and pinning every other
+    // page leaves only order-0 blocks, so nothing larger can be served.
+    meminfo_zone_t zr;
+    assert(buddy_zone_count() == 1);
+    assert(buddy_zone_report(1, &zr) == -1);
+    assert(buddy_zone_report(0, &zr) == 0);
+    uint64_t counted = 0;
+    for (uint32_t o = 0; o < MEMINFO_ORDERS; ++o)
+        counted += zr.free_blocks[o] << o;
+    assert(counted == n && zr.free_frames == n);
+    assert(zr.unusable[0] == 0);
+    for (uint64_t i = 0; i < n; ++i)
+        pages[i] = alloc_page();
+    for (uint64_t i = 0; i < n; i += 2)
+        free_page(pages[i]);
+    assert(buddy_zone_report(0, &zr) == 0);
+    assert(zr.free_blocks[0] == (n + 1) / 2 && zr.free_blocks[1] == 0);
+    assert(zr.unusable[0] == 0 && zr.unusable[1] == 1000);
+    for (uint64_t i = 1; i < n; i += 2)
+        free_page(pages[i]);
+    assert(buddy_zone_report(0, &zr) == 0);
+    assert(zr.unusable[1] < 1000);
 
     return 0;
 }
@@ -0,0 +1,131 @@
+#include <assert.h>
+#include <stdint.h>
+#include "../../kernel/VM/pmm.h"
+#include "../../kernel/VM/pmm_buddy.h"
+#include "../../kernel/VM/shrinker.h"
+#include "../../kernel/VM/nitroheap/nitroheap.h"
+#include "../../boot/include/bootinfo.h"
+#include "../../user/libc/libc.h"
+#ifndef PAGE_SIZE
+#define PAGE_SIZE 4096
+#endif
+
+#define REGION_PAGES 512
+
+static uint8_t region[REGION_PAGES * PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static void *pages[REGION_PAGES];
+
+// A cache that hoards a few pages and gives them back when asked.
+typedef struct {
+    shrinker_t s;
+    void *held[8];
+    int nheld;
+    int scans;
+} fake_cache_t;
+
+static int scan_order[8];
+static int scan_seq;
+
+static uint64_t fake_count(shrinker_t *s) {
+    return ((fake_cache_t *)s)->nheld;
+}
+
+static uint64_t fake_scan(shrinker_t *s, uint64_t nr) {
+    fake_cache_t *c = (fake_cache_t *)s;
+    uint64_t freed = 0;
+    c->scans++;
+    scan_order[scan_seq++ & 7] = c->s.priority;
+    while (c->nheld && freed < nr) {
+        free_page(c->held[--c->nheld]);
+        freed++;
+    }
+    return freed;
+}
+
+// A shrinker that allocates while memory is exhausted must not recurse.
+static int greedy_nested_null;
+static uint64_t greedy_scan(shrinker_t *s, uint64_t nr) {
+    (void)s; (void)nr;
+    greedy_nested_null = alloc_page() == NULL;
+    return 0;
+}
+
+static fake_cache_t cold = { .s = { .name = "cold", .count = fake_count, .scan = fake_scan,
+                                    .priority = SHRINKER_PRIO_CHEAP } };
+static fake_cache_t hot = { .s = { .name = "hot", .count = fake_count, .scan = fake_scan,
+                                   .priority = SHRINKER_PRIO_COSTLY } };
+static shrinker_t greedy = { .name = "greedy", .scan = greedy_scan,
+                             .priority = SHRINKER_PRIO_DEFAULT };
+
+static uint64_t fill(void) {
+    uint64_t n = 0;
+    while (n < REGION_PAGES && (pages[n] = alloc_page()))
+        n++;
+    return n;
+}
+
+static void unfill(uint64_t n) {
+    while (n)
+        free_page(pages[--n]);
+}
+
+int main(void) {
+    bootinfo_memory_t mmap[1] = {
+        { .addr = (uint64_t)(uintptr_t)region, .len = sizeof(region), .type = 7, .reserved = 0 }
+    };
+    bootinfo_t bi = {0};
+    bi.mmap = mmap;
+    bi.mmap_entries = 1;
+    pmm_init(&bi);
+    reclaim_init();
+
+    // Registration keeps priority order whatever the call order.
+    register_shrinker(&hot.s);
+    register_shrinker(&cold.s);
+    register_shrinker(&cold.s);
+    for (int i = 0; i < 4; ++i) {
+        cold.held[cold.nheld++] = alloc_page();
+        hot.held[hot.nheld++] = alloc_page();
+    }
+    assert(shrinker_reclaimable() == 8);
+
+    // Exhausting memory drains the cold cache before the hot one, and
+    // every hoarded page ends up with a caller.
+    uint64_t free0 = buddy_free_frames_total();
+    uint64_t n = fill();
+    assert(n == free0 + 8);
+    assert(cold.nheld == 0 && hot.nheld == 0);
+    assert(scan_order[0] == SHRINKER_PRIO_CHEAP);
+    assert(scan_order[scan_seq - 1] == SHRINKER_PRIO_COSTLY);
+    assert(alloc_page() == NULL);
+
+    reclaim_stats_t st;
+    reclaim_get_stats(&st);
+    assert(st.pages_reclaimed == 8);
+    assert(st.sync_runs >= 8);
+    unfill(n);
+
+    // Reentrant reclaim backs off instead of deadlocking.
+    register_shrinker(&greedy);
+    n = fill();
+    assert(alloc_page() == NULL);
+    assert(greedy_nested_null);
+    unfill(n);
+    unregister_shrinker(&greedy);
+    unregister_shrinker(&cold.s);
+    unregister_shrinker(&hot.s);
+
+    // NitroHeap's cached large blocks go back under pressure.
+    nitroheap_init();
+    void *big = nitro_kmalloc(64 * PAGE_SIZE, 8); // above the largest class
+    assert(big);
+    nitro_kfree(big);
+    free0 = buddy_free_frames_total();
+    assert(shrinker_reclaimable() >= 64);
+    n = fill();
+    assert(n >= free0 + 64);
+    assert(shrinker_reclaimable() == 0);
+    unfill(n);
+
+    return 0;
+}
@@ -12,5 +12,36 @@ int main(void) {
     assert(sp[6] == 0x202);
     assert(sp[8] == thread_debug_get_entry_trampoline());
     assert(sp[9] == (uint64_t)dummy);
+
+    // A wake before anyone waits is kept; one for a blocked waiter makes
+    // it ready without running the scheduler.
+    thread_wait_t w = {0};
+    thread_wake(&w);
+    assert(w.pending == 1);
+    w.pending = 0;
+    w.waiter = t;
+    t->state = THREAD_BLOCKED;
+    thread_wake(&w);
+    assert(w.pending == 1 && t->state == THREAD_READY);
+    t->state = THREAD_RUNNING;
+    thread_wake(&w);
+    assert(t->state == THREAD_RUNNING);
+
+    // A sleeper becomes ready on the tick its deadline falls on, not before.
+    t->state = THREAD_BLOCKED;
+    t->wake_tick = 2;
+    thread_timer_tick();
+    assert(t->state == THREAD_BLOCKED);
+    thread_timer_tick();
+    assert(t->state == THREAD_READY);
+    t->wake_tick = 0;
+
+    // SYS_SPAWN: only into the caller's own text, never above its priority.
+    assert(thread_set_text(t->id, (uint64_t)(uintptr_t)dummy, (uint64_t)(uintptr_t)dummy + 1) == 0);
+    assert(!task_spawn(t, (void (*)(void))0x600000000000ULL, 100));   // mmap'd memory
+    assert(!task_spawn(t, (void (*)(void))main, 100));                  // other kernel code
+    thread_t *c = task_spawn(t, dummy, MAX_PRIORITY);
+    assert(c && c->priority == 100);
+    assert(c->text_lo == t->text_lo && c->text_hi == t->text_hi);
     return 0;
 }
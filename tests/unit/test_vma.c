@@ -0,0 +1,202 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../kernel/VM/vma.h"
+
+#define PAGE    4096ULL
+#define NPAGES  512
+#define BASE    0x0000100000000000ULL
+#define STEPS   20000
+
+void* kmalloc(size_t sz, size_t align) { (void)align; return malloc(sz); }
+void kfree(void* p) { free(p); }
+void vm_object_get(struct vm_object* obj) { (void)obj; }
+void vm_object_put(struct vm_object* obj) { (void)obj; }
+
+// Reference model: the protection of every page, or -1 where nothing is
+// mapped.  Merging changes the tree's shape but never this.
+static int model[NPAGES];
+static vma_tree_t tree;
+
+static uint64_t addr(int pg) { return BASE + (uint64_t)pg * PAGE; }
+
+// Checks colours, black height, parent links, order and the augmented
+// fields of the subtree at `n`; returns its black height.
+static int check_node(const vma_t* n, const vma_t* parent, uint64_t* count) {
+    if (!n)
+        return 1;
+    assert(n->parent == parent);
+    assert(n->start < n->end);
+    if (n->red)
+        assert(!(n->left && n->left->red) && !(n->right && n->right->red));
+    int lh = check_node(n->left, n, count);
+    int rh = check_node(n->right, n, count);
+    assert(lh == rh);
+    ++*count;
+
+    uint64_t lo = n->start, hi = n->end, gap = 0;
+    if (n->left) {
+        assert(n->left->hi <= n->start);
+        lo = n->left->lo;
+        gap = n->left->gap > n->start - n->left->hi ? n->left->gap : n->start - n->left->hi;
+    }
+    if (n->right) {
+        assert(n->right->lo >= n->end);
+        hi = n->right->hi;
+        if (n->right->gap > gap)
+            gap = n->right->gap;
+        if (n->right->lo - n->end > gap)
+            gap = n->right->lo - n->end;
+    }
+    assert(n->lo == lo && n->hi == hi && n->gap == gap);
+    return lh + !n->red;
+}
+
+static void check_tree(void) {
+    uint64_t count = 0;
+    assert(!tree.root || !tree.root->red);
+    check_node(tree.root, NULL, &count);
+    assert(count == tree.count);
+
+    // In-order walk matches the model page for page, and no two
+    // neighbours are left mergeable.
+    int pg = 0;
+    const vma_t* prev = NULL;
+    for (const vma_t* v = vma_first(&tree); v; prev = v, v = vma_next(v)) {
+        int first = (int)((v->start - BASE) / PAGE), last = (int)((v->end - BASE) / PAGE);
+        for (; pg < first; ++pg)
+            assert(model[pg] < 0);
+        for (; pg < last; ++pg)
+            assert(model[pg] == (int)v->prot);
+        assert(vma_prev(v) == prev);
+        if (prev)
+            assert(prev->end != v->start || prev->prot != v->prot);
+    }
+    for (; pg < NPAGES; ++pg)
+        assert(model[pg] < 0);
+}
+
+static int free_run(int first, int len) {
+    if (first + len > NPAGES)
+        return 0;
+    for (int i = first; i < first + len; ++i)
+        if (model[i] >= 0)
+            return 0;
+    return 1;
+}
+
+static void check_gap(void) {
+    int lo = rand() % NPAGES, hi = lo + rand() % (NPAGES - lo + 1);
+    int len = 1 + rand() % 16;
+    int want = -1;
+    for (int i = lo; i + len <= hi; ++i)
+        if (free_run(i, len)) {
+            want = i;
+            break;
+        }
+    uint64_t got = vma_gap_find(&tree, addr(lo), addr(hi), (uint64_t)len * PAGE);
+    if (want < 0)
+        assert(got == VMA_NO_GAP);
+    else
+        assert(got == addr(want));
+}
+
+static vma_t* random_vma(void) {
+    if (!tree.count)
+        return NULL;
+    for (;;) {
+        vma_t* v = vma_find(&tree, addr(rand() % NPAGES));
+        if (v)
+            return v;
+    }
+}
+
+static void step(void) {
+    switch (rand() % 4) {
+    case 0: {   // map a free run
+        int first = rand() % NPAGES, len = 1 + rand() % 24;
+        if (!free_run(first, len))
+            return;
+        vma_t* v = vma_alloc();
+        v->start = addr(first);
+        v->end = addr(first + len);
+        v->prot = (uint32_t)(rand() % 3);
+        vma_insert(&tree, v);
+        for (int i = first; i < first + len; ++i)
+            model[i] = (int)v->prot;
+        vma_merge(&tree, v);
+        break;
+    }
+    case 1: {   // unmap a whole VMA
+        vma_t* v = random_vma();
+        if (!v)
+            return;
+        for (uint64_t a = v->start; a < v->end; a += PAGE)
+            model[(a - BASE) / PAGE] = -1;
+        vma_remove(&tree, v);
+        vma_free(v);
+        break;
+    }
+    case 2: {   // split, reprotect one half, merge back where it matches
+        vma_t* v = random_vma();
+        if (!v || v->end - v->start < 2 * PAGE)
+            return;
+        uint64_t pages = (v->end - v->start) / PAGE;
+        uint64_t at = v->start + (1 + (uint64_t)rand() % (pages - 1)) * PAGE;
+        vma_t* hi = vma_split(&tree, v, at);
+        assert(hi && v->end == at && hi->start == at);
+        assert(vma_find(&tree, at - PAGE) == v && vma_find(&tree, at) == hi);
+        vma_t* t = rand() & 1 ? v : hi;
+        t->prot = (uint32_t)(rand() % 3);
+        for (uint64_t a = t->start; a < t->end; a += PAGE)
+            model[(a - BASE) / PAGE] = (int)t->prot;
+        vma_merge(&tree, t);
+        break;
+    }
+    default:
+        check_gap();
+        return;
+    }
+}
+
+static void test_lookup(void) {
+    vma_t* v = vma_alloc();
+    v->start = addr(10);
+    v->end = addr(20);
+    vma_insert(&tree, v);
+    assert(vma_find(&tree, addr(10)) == v);
+    assert(vma_find(&tree, addr(20) - 1) == v);
+    assert(!vma_find(&tree, addr(20)));
+    assert(vma_find_after(&tree, addr(0)) == v);
+    assert(vma_find_after(&tree, addr(15)) == v);
+    assert(!vma_find_after(&tree, addr(20)));
+    assert(vma_gap_find(&tree, addr(0), addr(30), 10 * PAGE) == addr(0));
+    assert(vma_gap_find(&tree, addr(5), addr(30), 10 * PAGE) == addr(20));
+    assert(vma_gap_find(&tree, addr(5), addr(29), 10 * PAGE) == VMA_NO_GAP);
+    vma_remove(&tree, v);
+    vma_free(v);
+    assert(!tree.root && !tree.count);
+}
+
+int main(void) {
+    srand(44);
+    for (int i = 0; i < NPAGES; ++i)
+        model[i] = -1;
+    test_lookup();
+    for (int i = 0; i < STEPS; ++i) {
+        step();
+        if (i % 16 == 0)
+            check_tree();
+    }
+    check_tree();
+    printf("vma: %llu areas after %d steps\n", (unsigned long long)tree.count, STEPS);
+    while (tree.root) {
+        vma_t* v = tree.root;
+        vma_remove(&tree, v);
+        vma_free(v);
+    }
+    printf("vma tests passed\n");
+    return 0;
+}
@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+"""Decode a NitroHeap heap profile (NH_HEAPCTL_PROF_DUMP, `heapprof` in nsh).
+
+The report is pprof's legacy heap text format, so `pprof` reads it as is.
+This tool is for when pprof is not at hand.  It symbolizes the return
+addresses against the kernel ELF, scales the sampled figures back up to
+estimated totals, and lists allocation sites by live bytes.
+
+    nhprof.py kernel.elf report.txt [--base 0x...] [--top 20] [--stacks]
+"""
+import argparse
+import bisect
+import math
+import re
+import subprocess
+import sys
+
+ENTRY = re.compile(r'^\s*(\d+):\s*(\d+)\s*\[\s*(\d+):\s*(\d+)\]\s*@(.*)$')
+HEADER = re.compile(r'^heap profile:.*@\s*heap_v2/(\d+)')
+
+# Frames inside the allocator itself; a site is the first frame past them.
+ALLOCATOR = ('nh_', 'nitro_', 'kmalloc', 'kfree', 'krealloc', 'sys_nh_', 'mallocx')
+
+
+def load_symbols(elf):
+    out = subprocess.run(['nm', '-n', '--defined-only', elf], check=True,
+                         capture_output=True, text=True).stdout
+    addrs, names = [], []
+    for line in out.splitlines():
+        parts = line.split()
+        if len(parts) == 3 and parts[1] in 'TtWw':
+            addrs.append(int(parts[0], 16))
+            names.append(parts[2])
+    return addrs, names
+
+
+def symbolize(symbols, pc):
+    addrs, names = symbols
+    i = bisect.bisect_right(addrs, pc - 1) - 1
+    # Past the end of the image, or a stray frame from outside it.
+    if i < 0 or pc - addrs[i] > 1 << 20:
+        return hex(pc)
+    return '%s+0x%x' % (names[i], pc - addrs[i])
+
+
+def parse(lines):
+    rate, entries, dropped = None, [], 0
+    for line in lines:
+        m = HEADER.match(line)
+        if m:
+            rate = int(m.group(1))
+            continue
+        if line.startswith('# dropped'):
+            dropped = int(line.split()[2])
+            continue
+        m = ENTRY.match(line)
+        if m:
+            pcs = [int(x, 16) for x in m.group(5).split()]
+            entries.append((int(m.group(1)), int(m.group(2)), pcs))
+    if rate is None:
+        sys.exit('nhprof: no "heap profile" header')
+    return rate, entries, dropped
+
+
+def unsample(objs, nbytes, rate):
+    """pprof's heap_v2 scaling: a block of size s was sampled with
+    probability 1 - exp(-s / rate)."""
+    if not objs or not rate:
+        return objs, nbytes
+    avg = nbytes / objs
+    scale = 1.0 / (1.0 - math.exp(-avg / rate))
+    return objs * scale, nbytes * scale
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    ap.add_argument('elf', help='kernel image with symbols')
+    ap.add_argument('report', nargs='?', default='-', help='profile text, default stdin')
+    ap.add_argument('--base', default='0', help='load bias subtracted from every pc')
+    ap.add_argument('--top', type=int, default=20)
+    ap.add_argument('--stacks', action='store_true', help='print whole stacks')
+    args = ap.parse_args()
+
+    text = sys.stdin if args.report == '-' else open(args.report)
+    rate, entries, dropped = parse(text)
+    symbols = load_symbols(args.elf)
+    base = int(args.base, 16)
+
+    sites = {}
+    total = 0.0
+    for objs, nbytes, pcs in entries:
+        frames = [symbolize(symbols, pc - base) for pc in pcs]
+        site = next((f for f in frames if not f.startswith(ALLOCATOR)),
+                    frames[-1] if frames else '?')
+        est_objs, est_bytes = unsample(objs, nbytes, rate)
+        total += est_bytes
+        s = sites.setdefault(site, [0.0, 0.0, frames])
+        s[0] += est_objs
+        s[1] += est_bytes
+
+    print('sampling every %d bytes; %.0f live bytes estimated' % (rate, total))
+    if dropped:
+        print('%d samples dropped: the sample table was full' % dropped)
+    ranked = sorted(sites.items(), key=lambda kv: -kv[1][1])[:args.top]
+    for site, (objs, nbytes, frames) in ranked:
+        share = 100.0 * nbytes / total if total else 0.0
+        print('%12.0f B %5.1f%% %9.0f objs  %s' % (nbytes, share, objs, site))
+        if args.stacks:
+            for f in frames:
+                print('%40s %s' % ('', f))
+
+
+if __name__ == '__main__':
+    main()
@@ -6,6 +6,9 @@
 #include "../pkg/pkg.h"
 #include "../update/update.h"
 #include "../../include/nosfs.h"
+#include "../../../include/meminfo.h"
+#include "../../../include/nitroheap_sys.h"
+#include "../../../include/nitroheap_stats.h"
 #include "../nosfs/nosfs_server.h"
 #include "../../../nosm/drivers/IO/tty.h"
 #include "../../../nosm/drivers/IO/serial.h"
@@ -422,6 +425,135 @@ static void cmd_update(ipc_queue_t *upd_q, uint32_t self_id, const char *target)
         puts_out("update failed\n");
 }
 
+// libc snprintf only handles int, so 64-bit counters are formatted here.
+static void put_u64(uint64_t v, int width) {
+    char buf[21];
+    int i = 0;
+    do {
+        buf[i++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v);
+    while (width-- > i)
+        putc_out(' ');
+    while (i)
+        putc_out(buf[--i]);
+}
+
+static void cmd_meminfo(void) {
+    static meminfo_t mi;
+    if (meminfo(&mi, sizeof(mi)) != 0) {
+        puts_out("meminfo unavailable\n");
+        return;
+    }
+    puts_out("total ");
+    put_u64(mi.total_pages, 0);
+    puts_out(" free ");
+    put_u64(mi.free_pages, 0);
+    puts_out(" reclaimable ");
+    put_u64(mi.reclaimable_pages, 0);
+    puts_out(" pages\n");
+    const meminfo_zswap_t *zs = &mi.zswap;
+    uint64_t ratio = zs->pool_pages ? zs->stored_pages * 10 / zs->pool_pages : 0;
+    puts_out("zswap ");
+    put_u64(zs->stored_pages, 0);
+    puts_out(" pages in ");
+    put_u64(zs->pool_pages, 0);
+    puts_out(" frames (");
+    put_u64(ratio / 10, 0);
+    putc_out('.');
+    put_u64(ratio % 10, 0);
+    puts_out("x), ");
+    put_u64(zs->loads, 0);
+    puts_out(" loads, ");
+    put_u64(zs->loads ? zs->load_cycles / zs->loads : 0, 0);
+    puts_out(" cycles/load\n");
+    puts_out("ksm ");
+    put_u64(mi.ksm.merged_pages, 0);
+    puts_out(" frames shared by ");
+    put_u64(mi.ksm.sharing, 0);
+    puts_out(" mappings, ");
+    put_u64(mi.ksm.saved, 0);
+    puts_out(" saved\n");
+    for (uint32_t z = 0; z < mi.zone_count; ++z) {
+        const meminfo_zone_t *zi = &mi.zones[z];
+        puts_out("node ");
+        put_u64(zi->node, 0);
+        puts_out(": ");
+        put_u64(zi->free_frames, 0);
+        puts_out(" of ");
+        put_u64(zi->frames, 0);
+        puts_out(" frames free\n  order   blocks  unusable\n");
+        for (uint32_t o = 0; o <= zi->max_order && o < MEMINFO_ORDERS; ++o) {
+            put_u64(o, 7);
+            put_u64(zi->free_blocks[o], 9);
+            put_u64(zi->unusable[o] / 10, 8);
+            putc_out('.');
+            put_u64(zi->unusable[o] % 10, 0);
+            puts_out("%\n");
+        }
+    }
+}
+
+// Kernel heap counters per size class, summed over CPUs; idle classes are
+// skipped.
+static void cmd_heapstat(void) {
+    static nh_class_stats cs[NH_MAX_SIZE_CLASSES];
+    nh_heap_tunables t;
+    nh_heapctl_get_tunables_args ta = { .user_buf = &t, .user_buf_len = sizeof(t) };
+    nh_heapctl_get_class_stats_args ca = {
+        .cpu = NH_STATS_ALL_CPUS, .user_buf = cs, .user_buf_len = sizeof(cs)
+    };
+    int n = heapctl(NH_HEAPCTL_GET_CLASS_STATS, &ca, sizeof(ca));
+    if (n < 0 || heapctl(NH_HEAPCTL_GET_TUNABLES, &ta, sizeof(ta)) != 0) {
+        puts_out("heapstat unavailable\n");
+        return;
+    }
+    puts_out("magazine ");
+    put_u64(t.mag_bytes, 0);
+    puts_out(" bytes/");
+    put_u64(t.mag_rounds, 0);
+    puts_out(" rounds, quarantine ");
+    put_u64(t.quarantine_limit, 0);
+    puts_out(", reclaim ");
+    put_u64(t.reclaim_low, 0);
+    puts_out("-");
+    put_u64(t.reclaim_high, 0);
+    puts_out(" pages\n   size  mag        hits  refills   drains  quarant     inuse\n");
+    for (int c = 0; c < n; ++c) {
+        if (!cs[c].fast_hits && !cs[c].refills && !cs[c].bytes_inuse)
+            continue;
+        put_u64(cs[c].size, 7);
+        put_u64(cs[c].mag_size, 5);
+        put_u64(cs[c].fast_hits, 12);
+        put_u64(cs[c].refills, 9);
+        put_u64(cs[c].drains, 9);
+        put_u64(cs[c].quarantined, 9);
+        put_u64(cs[c].bytes_inuse, 10);
+        putc_out('\n');
+    }
+}
+
+// `heapprof N` samples every N bytes on average, `heapprof off` stops, and
+// plain `heapprof` prints the live samples for tools/nhprof.py.
+static void cmd_heapprof(const char *arg) {
+    static char report[16 * 1024];
+    if (arg) {
+        nh_heapctl_prof_set_args a = { .sample_bytes = (uint64_t)strtol(arg, NULL, 10) };
+        if (heapctl(NH_HEAPCTL_PROF_SET, &a, sizeof(a)) != 0)
+            puts_out("heapprof: bad rate\n");
+        return;
+    }
+    nh_heapctl_prof_dump_args a = { .user_buf = report, .user_buf_len = sizeof(report) };
+    int len = heapctl(NH_HEAPCTL_PROF_DUMP, &a, sizeof(a));
+    if (len < 0) {
+        puts_out("heapprof unavailable\n");
+        return;
+    }
+    puts_out(report);
+    if ((size_t)len >= sizeof(report))
+        puts_out("# truncated\n");
+}
+
 static void cmd_help(void) {
     puts_out("Available commands:\n");
     puts_out("  ls        - list files\n");
@@ -439,6 +571,9 @@ static void cmd_help(void) {
     puts_out("  cd DIR    - change directory\n");
     puts_out("  mkdir DIR - make directory\n");
     puts_out("  pwd       - print working directory\n");
+    puts_out("  meminfo   - free blocks and fragmentation per zone, zswap, ksm\n");
+    puts_out("  heapstat  - kernel heap counters per size class\n");
+    puts_out("  heapprof [N|off] - sample kernel heap every N bytes, or dump\n");
     puts_out("  help      - show this message\n");
 }
 
@@ -493,6 +628,12 @@ void nsh_main(ipc_queue_t *fs_q, ipc_queue_t *pkg_q, ipc_queue_t *upd_q, uint32_
             cmd_pkg_list(pkg_q, self_id);
         } else if (!strcmp(argv[0], "update") && argc > 1) {
             cmd_update(upd_q, self_id, argv[1]);
+        } else if (!strcmp(argv[0], "meminfo")) {
+            cmd_meminfo();
+        } else if (!strcmp(argv[0], "heapstat")) {
+            cmd_heapstat();
+        } else if (!strcmp(argv[0], "heapprof")) {
+            cmd_heapprof(argc > 1 ? argv[1] : NULL);
         } else if (!strcmp(argv[0], "help")) {
             cmd_help();
         } else if (!strcmp(argv[0], "exit")) {
@@ -285,6 +285,13 @@ double sqrt(double x) {
 #define SYS_CLOSE 11
 #define SYS_LSEEK 12
 #define SYS_RENAME 13
+#define SYS_MEMINFO 14
+#define SYS_HEAPCTL 15
+#define SYS_MMAP 16
+#define SYS_MUNMAP 17
+#define SYS_MPROTECT 18
+#define SYS_MADVISE 19
+#define SYS_SPAWN 20
 
 static inline long syscall3(long n, long a1, long a2, long a3) {
     long ret;
@@ -295,9 +302,45 @@ static inline long syscall3(long n, long a1, long a2, long a3) {
     return ret;
 }
 
+// The fourth argument travels in r10, as with the syscall instruction.
+static inline long syscall4(long n, long a1, long a2, long a3, long a4) {
+    register long r10 __asm__("r10") = a4;
+    long ret;
+    asm volatile("int $0x80"
+                 : "=a"(ret)
+                 : "a"(n), "D"(a1), "S"(a2), "d"(a3), "r"(r10)
+                 : "memory");
+    return ret;
+}
+
 int fork(void) { return (int)syscall3(SYS_FORK, 0, 0, 0); }
 int exec(const char *path) { return (int)syscall3(SYS_EXEC, (long)path, 0, 0); }
 void *sbrk(long inc) { return (void *)syscall3(SYS_SBRK, inc, 0, 0); }
+int meminfo(struct meminfo *out, size_t size) {
+    return (int)syscall3(SYS_MEMINFO, (long)out, (long)size, 0);
+}
+int heapctl(int op, const void *args, size_t len) {
+    return (int)syscall3(SYS_HEAPCTL, op, (long)args, (long)len);
+}
+
+// Only anonymous mappings exist, so `fd` and `off` are not passed on.
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long off) {
+    (void)fd;
+    (void)off;
+    return (void *)syscall4(SYS_MMAP, (long)addr, (long)len, prot, flags);
+}
+int munmap(void *addr, size_t len) {
+    return (int)syscall3(SYS_MUNMAP, (long)addr, (long)len, 0);
+}
+int mprotect(void *addr, size_t len, int prot) {
+    return (int)syscall3(SYS_MPROTECT, (long)addr, (long)len, prot);
+}
+int madvise(void *addr, size_t len, int advice) {
+    return (int)syscall3(SYS_MADVISE, (long)addr, (long)len, advice);
+}
+int spawn(void (*entry)(void), int prio) {
+    return (int)syscall3(SYS_SPAWN, (long)entry, prio, 0);
+}
 
 // ================== THREADING: RECURSIVE MUTEX ===================
 
@@ -90,6 +90,21 @@ double     sqrt(double x);
 int   fork(void);
 int   exec(const char *path);
 void *sbrk(long inc);
+struct meminfo;
+/** Copy the kernel's physical memory report (include/meminfo.h) into `out`. */
+int   meminfo(struct meminfo *out, size_t size);
+/** Kernel heap statistics and tunables; `op` is an nh_heapctl_op (include/nitroheap_sys.h). */
+int   heapctl(int op, const void *args, size_t len);
+/** Anonymous memory mappings; PROT_* and MAP_* come from include/mman.h. */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, long off);
+int   munmap(void *addr, size_t len);
+int   mprotect(void *addr, size_t len, int prot);
+/** MADV_* hints; MADV_POPULATE_READ/WRITE map the whole range up front. */
+int   madvise(void *addr, size_t len, int advice);
+/** Start a thread at `entry` in a copy-on-write copy of the caller's
+ *  address space, the caller serving as template; its id or -1.  `entry`
+ *  must be in the caller's own code; `prio` is capped at the caller's. */
+int   spawn(void (*entry)(void), int prio);
 
 // ===================
 // SAFE MEMOPS
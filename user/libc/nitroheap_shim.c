@@ -61,7 +61,12 @@ void* hptr(nh_handle_t h) {
   nh_hptr_req req = { .handle = h };
   nh_alloc_resp resp;
   if (sys_nh_hptr(&req, &resp) != 0) return NULL;
-  return resp.ptr; // ephemeral; invalidated across epochs or relocations
+  return resp.ptr; // stays put until hunpin(h)
+}
+
+int hunpin(nh_handle_t h) {
+  nh_hunpin_req req = { .handle = h };
+  return sys_nh_hunpin(&req);
 }
 
 int hfree(nh_handle_t h) {